@@ -75,6 +75,7 @@ aa:      85.1% -- replaced with aa.gz
 
 //applet:IF_GZIP(APPLET(gzip, BB_DIR_BIN, BB_SUID_DROP))
 //kbuild:lib-$(CONFIG_GZIP) += gzip.o
+//kbuild:lib-$(CONFIG_FEATURE_HTTPPOST_GZIP) += gzip.o
 
 //usage:#define gzip_trivial_usage
 //usage:       "[-cf" IF_GUNZIP("d") IF_FEATURE_GZIP_LEVELS("123456789") "] [FILE]..."
@@ -421,6 +422,14 @@ struct globals {
 
 	/*uint32_t *crc_32_tab;*/
 	uint32_t crc;	/* shift register contents */
+
+/* Input and output callbacks for gzip_stream, stdin/stdout are used if
+ * they are NULL.
+ */
+	ssize_t (*read_fn)(void *ctx, void *buf, size_t size);
+	int (*write_fn)(void *ctx, const void *buf, size_t size);
+	void *io_ctx;
+	smallint io_error;
 };
 
 #define G1 (*(ptr_to_globals - 1))
@@ -435,7 +444,15 @@ static void flush_outbuf(void)
 	if (G1.outcnt == 0)
 		return;
 
-	xwrite(ofd, (char *) G1.outbuf, G1.outcnt);
+	if (G1.write_fn) {
+		/* Keep going on errors, file_read reports EOF from now on */
+		if (!G1.io_error
+		 && G1.write_fn(G1.io_ctx, G1.outbuf, G1.outcnt) != 0
+		) {
+			G1.io_error = 1;
+		}
+	} else
+		xwrite(ofd, (char *) G1.outbuf, G1.outcnt);
 	G1.outcnt = 0;
 }
 
@@ -516,7 +533,14 @@ static unsigned file_read(void *buf, unsigned size)
 
 	Assert(G1.insize == 0, "l_buf not empty");
 
-	len = safe_read(ifd, buf, size);
+	if (G1.io_error)
+		return 0;
+	if (G1.read_fn) {
+		len = G1.read_fn(G1.io_ctx, buf, size);
+		if (len == (unsigned)(-1))
+			G1.io_error = 1;
+	} else
+		len = safe_read(ifd, buf, size);
 	if (len == (unsigned)(-1) || len == 0)
 		return len;
 
@@ -2148,6 +2172,55 @@ IF_DESKTOP(long long) int FAST_FUNC pack_gzip(transformer_state_t *xstate UNUSED
 	return 0;
 }
 
+#if ENABLE_FEATURE_HTTPPOST_GZIP
+/* Compress everything returned by read_fn (until it returns 0) and
+ * pass the gzip stream to write_fn. Used by httppost for compressed
+ * uploads. Memory use is bounded by the gzip buffers.
+ */
+int FAST_FUNC gzip_stream(ssize_t (*read_fn)(void *ctx, void *buf, size_t size),
+		int (*write_fn)(void *ctx, const void *buf, size_t size),
+		void *ctx)
+{
+	int r;
+	char *mem;
+
+	mem = xzalloc(sizeof(struct globals) + sizeof(struct globals2));
+	SET_PTR_TO_GLOBALS(mem + sizeof(struct globals));
+
+#ifdef ENABLE_FEATURE_GZIP_LEVELS
+	/* Level 6 */
+	max_chain_length = 1 << 7;
+	good_match	 = 8;
+	max_lazy_match	 = 16;
+	nice_match	 = 128;
+#endif
+	ALLOC(uch, G1.l_buf, INBUFSIZ);
+	ALLOC(uch, G1.outbuf, OUTBUFSIZ);
+	ALLOC(ush, G1.d_buf, DIST_BUFSIZE);
+	ALLOC(uch, G1.window, 2L * WSIZE);
+	ALLOC(ush, G1.prev, 1L << BITS);
+
+	if (!global_crc32_table)
+		global_crc32_table = crc32_filltable(NULL, 0);
+
+	G1.read_fn = read_fn;
+	G1.write_fn = write_fn;
+	G1.io_ctx = ctx;
+
+	pack_gzip(NULL);
+	r = G1.io_error ? -1 : 0;
+
+	FREE(G1.l_buf);
+	FREE(G1.outbuf);
+	FREE(G1.d_buf);
+	FREE(G1.window);
+	FREE(G1.prev);
+	free(mem);
+	return r;
+}
+#endif
+
+#if ENABLE_GZIP
 #if ENABLE_FEATURE_GZIP_LONG_OPTIONS
 static const char gzip_longopts[] ALIGN1 =
 	"stdout\0"              No_argument       "c"
@@ -2241,3 +2314,4 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 	argv += optind;
 	return bbunpack(argv, pack_gzip, append_ext, "gz");
 }
+#endif /* ENABLE_GZIP */
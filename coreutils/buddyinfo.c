@@ -22,6 +22,7 @@
 //usage:       ""
 
 #include "libbb.h"
+#include "atlas_proc.h"
 
 #include <sys/sysinfo.h>
 
@@ -34,25 +35,33 @@ int buddyinfo_main(int argc UNUSED_PARAM, char **argv)
 {
 	char *lowmemChar;
 	unsigned lowmem = 0;
-	FILE *fp = xfopen_for_read("/proc/buddyinfo");
-	char aa[10];
 	char *my_mac ;
-	int i = 0;
+	char *cp;
 	int j = 0;
 	int memBlock = 4;
 	int need_reboot = 0; // don't reboot 
 	int freeMem = 0;
 	int jMax = 64; // enough
+	unsigned long long i;
 	struct sysinfo info; 
+	struct atlas_proc proc;
+	struct atlas_obuf ob;
+
+	memset(&proc, '\0', sizeof(proc));
+	memset(&ob, '\0', sizeof(ob));
+	if (atlas_proc_read(&proc, "/proc/buddyinfo") == -1)
+		bb_perror_msg_and_die("can't open '%s'", "/proc/buddyinfo");
 
 	lowmemChar =  argv[1];
 
 	if(lowmemChar) 
 		lowmem = xatou(lowmemChar);
-        fscanf(fp, "%s", aa); 
-        fscanf(fp, "%s", aa);
-        fscanf(fp, "%s", aa);
-        fscanf(fp, "%s", aa);
+
+	/* Only the first zone: "Node 0, zone DMA" followed by counts */
+	cp = atlas_proc_line(&proc);
+	if (cp == NULL)
+		cp = proc.buf;
+	atlas_proc_skip(&cp, 4);
 
         my_mac = getenv("ETHER_SCANNED");
 
@@ -63,21 +72,23 @@ int buddyinfo_main(int argc UNUSED_PARAM, char **argv)
 		 */
 		need_reboot = 1;
 	}
-        printf ("RESULT { " DBQ(id) ": " DBQ(9001) ", " DBQ(time) ": %lld",
-		(long long)time(0));
+	atlas_obuf_printf(&ob, "RESULT { " DBQ(id) ": " DBQ(9001) ", "
+		DBQ(time) ": %lld", (long long)time(0));
 	if (my_mac !=  NULL)
-		printf(", " DBQ(macaddr) ": " DBQ(%s), my_mac);
+		atlas_obuf_printf(&ob, ", " DBQ(macaddr) ": " DBQ(%s), my_mac);
 
 	/* get uptime and print it */
 	sysinfo(&info);
- 	printf (", " DBQ(uptime) ": %ld", info.uptime );
+ 	atlas_obuf_printf(&ob, ", " DBQ(uptime) ": %ld", info.uptime );
 	
-	printf(", " DBQ(buddyinfo) ": [ ");
+	atlas_obuf_str(&ob, ", " DBQ(buddyinfo) ": [ ");
         for (j=0; j < jMax; j++)  
         {
-                if (fscanf(fp, "%d", &i) != 1)
+                if (atlas_proc_dec(&cp, &i) == -1)
 			break;
-		printf("%s%d", j == 0 ? "" : ", ", i);
+		if (j != 0)
+			atlas_obuf_str(&ob, ", ");
+		atlas_obuf_ull(&ob, i);
 		freeMem += ( memBlock * i);
 		if (i > 0 && lowmem >= 4 && memBlock >= lowmem)
 		{
@@ -88,9 +99,11 @@ int buddyinfo_main(int argc UNUSED_PARAM, char **argv)
         }
 
 	/* now print it */
-	printf (" ], " DBQ(freemem) ": %d }\n" ,  freeMem);
+	atlas_obuf_printf(&ob, " ], " DBQ(freemem) ": %d }\n" ,  freeMem);
+	atlas_obuf_write(&ob, stdout);
 
-	fclose (fp);
+	atlas_obuf_free(&ob);
+	atlas_proc_free(&proc);
 
 	if(need_reboot)
 	{
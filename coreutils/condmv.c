@@ -14,19 +14,28 @@
 //kbuild:lib-$(CONFIG_CONDMV) += condmv.o
 
 //usage:#define condmv_trivial_usage
-//usage:       "[-A <string to append>][-f] FILE1 FILE2"
+//usage:       "[-A <string to append>][-f][-S][-d <state> [-k <secs>]] FILE1 FILE2"
 //usage:#define condmv_full_usage "\n\n"
 //usage:       "Rename FILE1 to FILE2 if FILE2 does not exist\n"
 //usage:     "\nOptions:"
 //usage:     "\n       -A <string>     Append <string> before renaming FILE1"
 //usage:     "\n       -f              Force. Move even if FILE2 does exist"
+//usage:     "\n       -S              FILE2 is a result store. Append FILE1 to it"
+//usage:     "\n                       and remove FILE1"
+//usage:     "\n       -d <state>      Delta encode the results in FILE1 first,"
+//usage:     "\n                       keep the last full results in <state>"
+//usage:     "\n       -k <secs>       Send unchanged results at least every <secs>"
 
 #include "libbb.h"
+#include "atlas_store.h"
+#include "atlas_delta.h"
 
 #define SAFE_PREFIX_FROM1_REL ATLAS_DATA_NEW_REL
 #define SAFE_PREFIX_FROM2_REL ATLAS_DATA_OUT_REL
 #define SAFE_PREFIX_TO1_REL ATLAS_DATA_OUT_REL
 #define SAFE_PREFIX_TO2_REL ATLAS_DATA_STORAGE_REL
+#define SAFE_PREFIX_STORE_REL ATLAS_DATA_STORE_REL
+#define SAFE_PREFIX_DELTA_REL ATLAS_STATUS_REL
 
 #define A_FLAG	(1 << 0)
 #define a_FLAG	(1 << 1)
@@ -34,20 +43,25 @@
 #define f_FLAG	(1 << 3)
 #define t_FLAG	(1 << 4)
 #define x_FLAG	(1 << 5)
+#define S_FLAG	(1 << 6)
 
 static time_t age_value;
 static int cross_filesystems, append_timestamp;
 
 static int do_dir(char *from_dir, char *to_dir);
 static int do_cprm(char *from_file, char *to_file);
+static int do_store(char *from_file, char *store_dir);
+static int do_delta(char *from_file, char *state_file, int keepalive);
 
 int condmv_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int condmv_main(int argc, char *argv[])
 {
-	int r;
-	char *opt_add, *opt_age, *from, *to, *check;
+	int r, keepalive;
+	char *opt_add, *opt_age, *opt_delta, *opt_keepalive;
+	char *from, *to, *check;
 	char *rebased_from= NULL;
 	char *rebased_to= NULL;
+	char *rebased_delta= NULL;
 	uint32_t opt;
 	struct stat sb;
 	FILE *file;
@@ -55,8 +69,11 @@ int condmv_main(int argc, char *argv[])
 
 	opt_add= NULL;
 	opt_age= NULL;
+	opt_delta= NULL;
+	opt_keepalive= NULL;
 	opt_complementary= NULL;	/* For when we are called by crond */
-	opt= getopt32(argv, "!A:a:Dftx", &opt_add, &opt_age);
+	opt= getopt32(argv, "!A:a:DftxSd:k:", &opt_add, &opt_age, &opt_delta,
+		&opt_keepalive);
 
 	if (opt == (uint32_t)-1)
 	{
@@ -85,14 +102,22 @@ int condmv_main(int argc, char *argv[])
 		fprintf(stderr, "insecure from file '%s'\n", from);
 		goto err;
 	}
-	rebased_to= rebased_validated_filename(to,
-		SAFE_PREFIX_TO1_REL);
-	if (rebased_to == NULL)
+	if (opt & S_FLAG)
+	{
+		rebased_to= rebased_validated_filename(to,
+			SAFE_PREFIX_STORE_REL);
+	}
+	else
+	{
+		rebased_to= rebased_validated_filename(to,
+			SAFE_PREFIX_TO1_REL);
+	}
+	if (rebased_to == NULL && !(opt & S_FLAG))
 	{
 		rebased_to= rebased_validated_filename(to,
 			SAFE_PREFIX_TO2_REL);
 	}
-	if (rebased_to == NULL)
+	if (rebased_to == NULL && !(opt & S_FLAG))
 	{
 		rebased_to= rebased_validated_filename(to,
 			SAFE_PREFIX_FROM1_REL);
@@ -115,6 +140,30 @@ int condmv_main(int argc, char *argv[])
 	else
 		age_value= 0;
 
+	if (opt_delta)
+	{
+		rebased_delta= rebased_validated_filename(opt_delta,
+			SAFE_PREFIX_DELTA_REL);
+		if (rebased_delta == NULL)
+		{
+			fprintf(stderr, "insecure delta file '%s'\n",
+				opt_delta);
+			goto err;
+		}
+	}
+
+	keepalive= 0;
+	if (opt_keepalive)
+	{
+		keepalive= strtol(opt_keepalive, &check, 0);
+		if (check[0] != '\0' || keepalive <= 0)
+		{
+			fprintf(stderr, "bad keepalive value '%s'\n",
+				opt_keepalive);
+			goto err;
+		}
+	}
+
 	cross_filesystems= !!(opt & x_FLAG);
 	append_timestamp= !!(opt & t_FLAG);
 
@@ -123,10 +172,11 @@ int condmv_main(int argc, char *argv[])
 		r= do_dir(rebased_from, rebased_to);
 		free(rebased_from); rebased_from= NULL;
 		free(rebased_to); rebased_to= NULL;
+		free(rebased_delta); rebased_delta= NULL;
 		return r;
 	}
 
-	if (stat(rebased_to, &sb) == 0 && !(opt & f_FLAG))
+	if (stat(rebased_to, &sb) == 0 && !(opt & (f_FLAG|S_FLAG)))
 	{
 		/* Destination exists */
 		fprintf(stderr,
@@ -135,6 +185,15 @@ int condmv_main(int argc, char *argv[])
 		goto err;
 	}
 
+	if (rebased_delta)
+	{
+		/* Failing to encode is not fatal, the results are just
+		 * moved as they are.
+		 */
+		do_delta(rebased_from, rebased_delta, keepalive);
+		free(rebased_delta); rebased_delta= NULL;
+	}
+
 	if (opt_add)
 	{
 		mytime = time(NULL);
@@ -174,6 +233,14 @@ int condmv_main(int argc, char *argv[])
 		goto err;
 	}
 
+	if (opt & S_FLAG)
+	{
+		r= do_store(rebased_from, rebased_to);
+		free(rebased_from); rebased_from= NULL;
+		free(rebased_to); rebased_to= NULL;
+		return r;
+	}
+
 	if (rename(rebased_from, rebased_to) != 0)
 	{
 		fprintf(stderr, "condmv: unable to rename '%s' to '%s': %s\n",
@@ -188,6 +255,7 @@ int condmv_main(int argc, char *argv[])
 err:
 	if (rebased_from) free(rebased_from);
 	if (rebased_to) free(rebased_to);
+	if (rebased_delta) free(rebased_delta);
 	return 1;
 }
 
@@ -398,3 +466,45 @@ static int do_cprm(char *from_file, char *to_file)
 
 	return 0;
 }
+
+static int do_store(char *from_file, char *store_dir)
+{
+	int r;
+	struct atlas_store *store;
+
+	store= atlas_store_open(store_dir, 0, 0);
+	if (store == NULL)
+	{
+		fprintf(stderr, "condmv: unable to open store '%s': %s\n",
+			store_dir, strerror(errno));
+		return 1;
+	}
+	r= atlas_store_move_file(store, from_file);
+	atlas_store_close(store);
+	if (r == -1)
+	{
+		fprintf(stderr, "condmv: unable to store '%s' in '%s': %s\n",
+			from_file, store_dir, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int do_delta(char *from_file, char *state_file, int keepalive)
+{
+	int r;
+	struct atlas_delta *delta;
+
+	delta= atlas_delta_open(state_file, keepalive);
+	r= atlas_delta_file(delta, from_file);
+	atlas_delta_close(delta);
+	if (r == -1)
+	{
+		fprintf(stderr, "condmv: unable to delta encode '%s': %s\n",
+			from_file, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * aggregate.c -- streaming summaries of round trip times
+ */
+
+#include "libbb.h"
+
+#include "aggregate.h"
+
+#define DBQ(str) "\"" #str "\""
+
+#define SUB_COUNT	(1u << AGG_SUB_BITS)
+
+static unsigned bucket(uint32_t us)
+{
+	unsigned shift;
+
+	if (us < SUB_COUNT)
+		return us;	/* Exact */
+	shift= 31 - __builtin_clz(us) - AGG_SUB_BITS;
+	return ((shift+1) << AGG_SUB_BITS) + (us >> shift) - SUB_COUNT;
+}
+
+/* Middle of a bucket, in microseconds */
+static double bucket_value(unsigned ind)
+{
+	unsigned shift;
+
+	if (ind < SUB_COUNT)
+		return ind;
+	shift= (ind >> AGG_SUB_BITS) - 1;
+	return ((double)(SUB_COUNT + (ind & (SUB_COUNT-1))) * (1u << shift)) +
+		((1u << shift) - 1) / 2.0;
+}
+
+void agg_hist_init(struct agg_hist *hist)
+{
+	memset(hist, '\0', sizeof(*hist));
+}
+
+void agg_hist_add(struct agg_hist *hist, double ms)
+{
+	uint32_t us;
+
+	if (ms < 0)
+		ms= 0;
+	us= ms*1000 >= UINT32_MAX ? UINT32_MAX : (uint32_t)(ms*1000 + 0.5);
+
+	hist->count[bucket(us)]++;
+	if (hist->n == 0 || us < hist->min)
+		hist->min= us;
+	if (hist->n == 0 || us > hist->max)
+		hist->max= us;
+	hist->n++;
+	hist->sum += ms;
+}
+
+void agg_hist_merge(struct agg_hist *to, const struct agg_hist *from)
+{
+	unsigned i;
+
+	if (from->n == 0)
+		return;
+	for (i= 0; i<AGG_NBUCKETS; i++)
+		to->count[i] += from->count[i];
+	if (to->n == 0 || from->min < to->min)
+		to->min= from->min;
+	if (to->n == 0 || from->max > to->max)
+		to->max= from->max;
+	to->n += from->n;
+	to->sum += from->sum;
+}
+
+double agg_hist_quantile(const struct agg_hist *hist, double q)
+{
+	unsigned i;
+	uint32_t rank, seen;
+	double v;
+
+	if (hist->n == 0)
+		return 0;
+	rank= q*hist->n;
+	if (rank < q*hist->n)
+		rank++;		/* Round up */
+	if (rank < 1)
+		rank= 1;
+	if (rank > hist->n)
+		rank= hist->n;
+
+	seen= 0;
+	for (i= 0; i<AGG_NBUCKETS; i++)
+	{
+		seen += hist->count[i];
+		if (seen >= rank)
+			break;
+	}
+	v= bucket_value(i);
+
+	/* The ends are known exactly */
+	if (v < hist->min)
+		v= hist->min;
+	if (v > hist->max)
+		v= hist->max;
+	return v/1000;
+}
+
+void agg_hist_report(FILE *fh, const struct agg_hist *hist)
+{
+	if (hist->n == 0)
+		return;
+	fprintf(fh, ", " DBQ(min) ":%.3f, " DBQ(avg) ":%.3f, "
+		DBQ(max) ":%.3f, " DBQ(p50) ":%.3f, " DBQ(p90) ":%.3f, "
+		DBQ(p99) ":%.3f",
+		hist->min/1000.0, hist->sum/hist->n, hist->max/1000.0,
+		agg_hist_quantile(hist, 0.5), agg_hist_quantile(hist, 0.9),
+		agg_hist_quantile(hist, 0.99));
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * aggregate.h -- streaming summaries of round trip times
+ */
+
+/* Log-linear histogram in the style of HDR histograms. Times are kept in
+ * microseconds, each power of two is split into 2^AGG_SUB_BITS buckets.
+ * Reported quantiles are within about 3% of the real value. Histograms
+ * of the same kind can be merged by adding the counts.
+ */
+#define AGG_SUB_BITS	4
+#define AGG_NBUCKETS	((32-AGG_SUB_BITS+1) << AGG_SUB_BITS)
+
+struct agg_hist
+{
+	uint32_t count[AGG_NBUCKETS];
+	uint32_t n;
+	uint32_t min;		/* In microseconds */
+	uint32_t max;
+	double sum;		/* In milliseconds */
+};
+
+void agg_hist_init(struct agg_hist *hist);
+void agg_hist_add(struct agg_hist *hist, double ms);
+void agg_hist_merge(struct agg_hist *to, const struct agg_hist *from);
+
+/* Returns the 'q' quantile in milliseconds, 0 if the histogram is empty */
+double agg_hist_quantile(const struct agg_hist *hist, double q);
+
+/* Add min, avg, max and a few percentiles (in ms) as JSON fields, each
+ * preceded by ", ". Nothing is added for an empty histogram.
+ */
+void agg_hist_report(FILE *fh, const struct agg_hist *hist);
@@ -2,16 +2,27 @@
  * Copyright (c) 2013 RIPE NCC <atlas@ripe.net>
  * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
  * condmv.c -- move a file only if the destination doesn't exist
+ *
+ * With -S the destination is a result store (see atlas_store.h) instead.
+ * The file is appended to the store on every run and then removed.
+ *
+ * With -d the results are delta encoded (see atlas_delta.h) just before
+ * they are moved or stored.
  */
 
 #include "libbb.h"
 #include "eperd.h"
+#include "atlas_store.h"
+#include "atlas_delta.h"
 
 #define SAFE_PREFIX_FROM_REL ATLAS_DATA_NEW_REL
 #define SAFE_PREFIX_TO_REL ATLAS_DATA_OUT_REL
+#define SAFE_PREFIX_STORE_REL ATLAS_DATA_STORE_REL
+#define SAFE_PREFIX_DELTA_REL ATLAS_STATUS_REL
 
 #define A_FLAG	(1 << 0)
-#define F_FLAG	(1 << 1)
+#define F_FLAG	(1 << 2)
+#define S_FLAG	(1 << 5)
 
 #define DEFAULT_INTERVAL	60
 
@@ -22,21 +33,27 @@ struct condmvstate
 	char *atlas;
 	int force;
 	int interval;
+	struct atlas_store *store;
+	struct atlas_delta *delta;
 };
 
 static void *condmv_init(int argc, char *argv[],
 	void (*done)(void *state, int error) UNUSED_PARAM)
 {
-	char *opt_add, *opt_interval, *from, *to, *check;
-	char *rebased_from, *rebased_to;
-	int interval;
+	char *opt_add, *opt_delta, *opt_interval, *opt_keepalive;
+	char *from, *to, *check;
+	char *rebased_from, *rebased_to, *rebased_delta;
+	int interval, keepalive;
 	uint32_t opt;
 	struct condmvstate *state;
 
 	opt_add= NULL;
+	opt_delta= NULL;
 	opt_interval= NULL;
+	opt_keepalive= NULL;
 	opt_complementary= NULL;	/* For when we are called by crond */
-	opt= getopt32(argv, "!A:fi:", &opt_add, &opt_interval);
+	opt= getopt32(argv, "!A:d:fi:k:S", &opt_add, &opt_delta, &opt_interval,
+		&opt_keepalive);
 	if (opt == (uint32_t)-1)
 		return NULL;
 
@@ -59,6 +76,18 @@ static void *condmv_init(int argc, char *argv[],
 	else
 		interval= DEFAULT_INTERVAL;
 
+	keepalive= 0;
+	if (opt_keepalive)
+	{
+		keepalive= strtoul(opt_keepalive, &check, 0);
+		if (check[0] != '\0' || keepalive <= 0)
+		{
+			crondlog(LVL8 "unable to parse keepalive '%s'",
+				opt_keepalive);
+			return NULL;
+		}
+	}
+
 	from= argv[optind];
 	to= argv[optind+1];
 
@@ -68,7 +97,13 @@ static void *condmv_init(int argc, char *argv[],
 		fprintf(stderr, "insecure from file '%s'\n", from);
 		return NULL;
 	}
-	rebased_to= rebased_validated_filename(to, SAFE_PREFIX_TO_REL);
+	if (opt & S_FLAG)
+	{
+		rebased_to= rebased_validated_filename(to,
+			SAFE_PREFIX_STORE_REL);
+	}
+	else
+		rebased_to= rebased_validated_filename(to, SAFE_PREFIX_TO_REL);
 	if (!rebased_to)
 	{
 		free(rebased_from); rebased_from= NULL;
@@ -76,7 +111,42 @@ static void *condmv_init(int argc, char *argv[],
 		return NULL;
 	}
 
+	rebased_delta= NULL;
+	if (opt_delta)
+	{
+		rebased_delta= rebased_validated_filename(opt_delta,
+			SAFE_PREFIX_DELTA_REL);
+		if (!rebased_delta)
+		{
+			free(rebased_from); rebased_from= NULL;
+			free(rebased_to); rebased_to= NULL;
+			fprintf(stderr, "insecure delta file '%s'\n", opt_delta);
+			return NULL;
+		}
+	}
+
 	state= malloc(sizeof(*state));
+	state->store= NULL;
+	if (opt & S_FLAG)
+	{
+		state->store= atlas_store_open(rebased_to, 0, 0);
+		if (!state->store)
+		{
+			crondlog(LVL8 "unable to open store '%s': %s",
+				rebased_to, strerror(errno));
+			free(rebased_from); rebased_from= NULL;
+			free(rebased_to); rebased_to= NULL;
+			free(rebased_delta); rebased_delta= NULL;
+			free(state);
+			return NULL;
+		}
+	}
+	state->delta= NULL;
+	if (rebased_delta)
+	{
+		state->delta= atlas_delta_open(rebased_delta, keepalive);
+		free(rebased_delta); rebased_delta= NULL;
+	}
 	state->from= rebased_from; rebased_from= NULL;
 	state->to= rebased_to; rebased_to= NULL;
 	state->atlas= opt_add ? strdup(opt_add) : NULL;
@@ -86,6 +156,48 @@ static void *condmv_init(int argc, char *argv[],
 	return state;
 }
 
+static void delta_file(struct condmvstate *condmvstate)
+{
+	if (!condmvstate->delta)
+		return;
+	if (atlas_delta_file(condmvstate->delta, condmvstate->from) == -1)
+	{
+		/* Whatever is left in 'from' is moved as it is */
+		crondlog(LVL9 "condmv: unable to delta encode '%s': %s\n",
+			condmvstate->from, strerror(errno));
+	}
+}
+
+static void store_file(struct condmvstate *condmvstate)
+{
+	FILE *file;
+
+	if (access(condmvstate->from, F_OK) == -1)
+		return;		/* Nothing new */
+
+	delta_file(condmvstate);
+
+	if (condmvstate->atlas)
+	{
+		file= atlas_fopen_append(condmvstate->from);
+		if (file == NULL)
+		{
+			crondlog(LVL9 "condmv: unable to append to '%s': %s\n",
+				condmvstate->from, strerror(errno));
+			return;
+		}
+		fprintf(file, "%s %lu %s\n", condmvstate->atlas,
+			(unsigned long)time(NULL), condmvstate->from);
+		fclose(file);
+	}
+	if (atlas_store_move_file(condmvstate->store,
+		condmvstate->from) == -1)
+	{
+		crondlog(LVL9 "condmv: unable to store '%s' in '%s': %s\n",
+			condmvstate->from, condmvstate->to, strerror(errno));
+	}
+}
+
 static void condmv_start(void *state)
 {
 	size_t len;
@@ -97,6 +209,12 @@ static void condmv_start(void *state)
 
 	condmvstate= state;
 
+	if (condmvstate->store)
+	{
+		store_file(condmvstate);
+		return;
+	}
+
 	len= strlen(condmvstate->to) + 20;
 	to= malloc(len);
 	snprintf(to, len, "%s.%ld", condmvstate->to,
@@ -110,13 +228,15 @@ static void condmv_start(void *state)
 		return;
 	}
 
+	delta_file(condmvstate);
+
 	if (condmvstate->atlas)
 	{
 		mytime = time(NULL);
 		/* We have to add something to the existing file before moving
 		 * to.
 		 */
-		file= fopen(condmvstate->from, "a");
+		file= atlas_fopen_append(condmvstate->from);
 		if (file == NULL)
 		{
 			crondlog(LVL9 "condmv: unable to append to '%s': %s\n",
@@ -160,6 +280,16 @@ static int condmv_delete(void *state)
 	condmvstate->to= NULL;
 	free(condmvstate->atlas);
 	condmvstate->atlas= NULL;
+	if (condmvstate->store)
+	{
+		atlas_store_close(condmvstate->store);
+		condmvstate->store= NULL;
+	}
+	if (condmvstate->delta)
+	{
+		atlas_delta_close(condmvstate->delta);
+		condmvstate->delta= NULL;
+	}
 
 	free(condmvstate);
 	
@@ -16,7 +16,7 @@
 //kbuild:lib-$(CONFIG_EOOQD) += eooqd.o
 
 //usage:#define eooqd_trivial_usage 
-//usage:       "<queue-file>"
+//usage:       "[-S] <queue-file>"
 //usage:#define eooqd_full_usage 
 
 #include <stdio.h>
@@ -30,11 +30,15 @@
 #include <event2/event_struct.h>
 #include <event2/dns.h>
 
+#include "atlas_ctl.h"
+#include "atlas_store.h"
+#include "atlas_watch.h"
 #include "eperd.h"
 
 #define SUFFIX 		".curr"
 #define OOQD_NEW_PREFIX_REL	"data/new/ooq"
 #define OOQD_OUT_PREFIX_REL	"data/out/ooq"
+#define OOQD_STORE_PREFIX_REL	ATLAS_DATA_STORE_REL "/ooq"
 #define ATLAS_SESSION_FILE_REL	"status/con_session_id.txt"
 #define REPORT_HEADER_REL	"status/p_to_c_report_header"
 #define SESSION_ID_REL		"status/con_session_id.txt"
@@ -53,6 +57,14 @@
 
 #define RESOLV_CONF	"/etc/resolv.conf"
 
+#define S_FLAG	(1 << 5)
+
+struct pending
+{
+	struct pending *next;
+	char *cmdline;
+};
+
 struct slot
 {
 	void *cmdstate;
@@ -72,6 +84,13 @@ static struct
 
 	int barrier;
 	char *barrier_file;
+
+	/* Commands received over the control socket */
+	struct pending *pending_head;
+	struct pending **pending_tail;
+
+	/* Results go to a store instead of to data/out/ooq */
+	struct atlas_store *store;
 } *state;
 
 static struct builtin 
@@ -99,20 +118,30 @@ static const char *queue_id;
 
 static char *resolv_conf;
 static char output_filename[80];
+static char store_name[80];
+
+static struct event *checkQueueEvent;
 
 static void report(const char *fmt, ...);
 static void report_err(const char *fmt, ...);
 
 static void checkQueue(evutil_socket_t fd, short what, void *arg);
+static int check_barrier(void);
 static int add_line(void);
+static void run_line(char *cmdline);
 static void cmddone(void *cmdstate, int error);
 static void re_post(evutil_socket_t fd, short what, void *arg);
 static void post_results(int force_post);
+static int move_results(void);
+static int store_results(void);
+static void store_result(const char *filename);
 static void skip_space(char *cp, char **ncpp);
 static void skip_nonspace(char *cp, char **ncpp);
 static void find_eos(char *cp, char **ncpp);
 static void check_resolv_conf2(const char *out_file, const char *atlasid);
 static const char *get_session_id(void);
+static int watch_queue(void);
+static void listen_ctl(void);
 
 extern int httppost_main(int argc, char *argv[]); /* in networking/httppost.c */
 
@@ -120,10 +149,11 @@ int eooqd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int eooqd_main(int argc, char *argv[])
 {
 	int r;
+	unsigned opt;
 	size_t len;
 	char *pid_file_name, *interface_name, *instance_id_str;
 	char *check;
-	struct event *checkQueueEvent, *rePostEvent;
+	struct event *rePostEvent;
 	struct timeval tv;
 	struct rlimit limit;
 	struct stat sb;
@@ -134,7 +164,7 @@ int eooqd_main(int argc, char *argv[])
 	pid_file_name= NULL;
 	queue_id= "";
 
-	(void)getopt32(argv, "A:I:i:P:q:", &atlas_id, 
+	opt= getopt32(argv, "A:I:i:P:q:S", &atlas_id, 
 		&interface_name, &instance_id_str,
 		&pid_file_name, &queue_id);
 
@@ -189,6 +219,7 @@ int eooqd_main(int argc, char *argv[])
 	state->queue_file= argv[optind];
 
 	state->max_busy= 10;
+	state->pending_tail= &state->pending_head;
 
 	state->slots= xzalloc(sizeof(*state->slots) * state->max_busy);
 
@@ -207,6 +238,19 @@ int eooqd_main(int argc, char *argv[])
 		"%s/" OOQD_OUT_PREFIX_REL "%s/ooq.out",
 		atlas_base(), queue_id);
 
+	if (opt & S_FLAG)
+	{
+		snprintf(store_name, sizeof(store_name),
+			"%s/" OOQD_STORE_PREFIX_REL "%s",
+			atlas_base(), queue_id);
+		state->store= atlas_store_open(store_name, 0, 0);
+		if (!state->store)
+		{
+			report_err("unable to open store '%s'", store_name);
+			return 1;
+		}
+	}
+
 	signal(SIGQUIT, SIG_DFL);
 	limit.rlim_cur= RLIM_INFINITY;
 	limit.rlim_max= RLIM_INFINITY;
@@ -251,10 +295,17 @@ int eooqd_main(int argc, char *argv[])
 		checkQueue, NULL);
 	if (!checkQueueEvent)
 		crondlog(DIE9 "event_new failed"); /* exits */
-	tv.tv_sec= 1;
+
+	/* With inotify, polling the queue is just a fallback */
+	tv.tv_sec= watch_queue() == 0 ? 10 : 1;
 	tv.tv_usec= 0;
 	event_add(checkQueueEvent, &tv);
 
+	/* Let telnetd hand over commands without going through the queue
+	 * file.
+	 */
+	listen_ctl();
+
 	rePostEvent= event_new(EventBase, -1, EV_TIMEOUT|EV_PERSIST,
 		re_post, NULL);
 	if (!rePostEvent)
@@ -274,6 +325,21 @@ static void checkQueue(evutil_socket_t fd UNUSED_PARAM,
 {
 	int r;
 	struct stat sb;
+	struct pending *pending;
+
+	/* Commands from the control socket go first */
+	while (state->pending_head && state->curr_busy < state->max_busy)
+	{
+		if (check_barrier() == -1)
+			return;	/* Wait for barrier to complete */
+		pending= state->pending_head;
+		state->pending_head= pending->next;
+		if (!state->pending_head)
+			state->pending_tail= &state->pending_head;
+		run_line(pending->cmdline);
+		free(pending->cmdline);
+		free(pending);
+	}
 
 	if (!state->curr_file)
 	{
@@ -332,23 +398,9 @@ static void checkQueue(evutil_socket_t fd UNUSED_PARAM,
 	check_resolv_conf2(output_filename, atlas_id);
 }
 
-static int add_line(void)
+static int check_barrier(void)
 {
-	char c;
-	int i, argc, fd, skip, slot;
-	size_t len;
-	char *cp, *ncp;
-	struct builtin *bp;
-	char *p, *validated_fn;
-	const char *reason;
-	void *cmdstate;
-	FILE *fn;
-	const char *argv[ATLAS_NARGS];
-	char args[ATLAS_ARGSIZE];
-	char cmdline[256];
-	char filename[80];
-	char filename2[80];
-	struct stat sb;
+	int fd;
 
 	if (state->barrier)
 	{
@@ -366,6 +418,16 @@ static int add_line(void)
 		state->barrier_file= NULL;
 		state->barrier= 0;
 	}
+	return 0;
+}
+
+static int add_line(void)
+{
+	char *cp;
+	char cmdline[256];
+
+	if (check_barrier() == -1)
+		return -1;
 
 	if (fgets(cmdline, sizeof(cmdline), state->curr_file) == NULL)
 	{
@@ -380,6 +442,27 @@ static int add_line(void)
 	if (cp)
 		*cp= '\0';
 
+	run_line(cmdline);
+	return 0;
+}
+
+static void run_line(char *cmdline)
+{
+	char c;
+	int i, argc, skip, slot;
+	size_t len;
+	char *cp, *ncp;
+	struct builtin *bp;
+	char *p, *validated_fn;
+	const char *reason;
+	void *cmdstate;
+	FILE *fn;
+	const char *argv[ATLAS_NARGS];
+	char args[ATLAS_ARGSIZE];
+	char filename[80];
+	char filename2[80];
+	struct stat sb;
+
 	crondlog(LVL7 "atlas_run: looking for '%s'", cmdline);
 
 	/* Check for post command */
@@ -387,7 +470,7 @@ static int add_line(void)
 	{
 		/* Trigger a post */
 		post_results(1 /* force_post */);
-		return 0;	/* Done */
+		return;	/* Done */
 	}
 
 	/* Check for barrier command */
@@ -408,7 +491,7 @@ static int add_line(void)
 		}
 		state->barrier= 1;
 		state->barrier_file= validated_fn;
-		return 0;
+		return;
 	}
 
 	/* Check for the reload resolv.conf command */
@@ -416,7 +499,7 @@ static int add_line(void)
 	{
 		/* Trigger a reload */
 		check_resolv_conf2(output_filename, atlas_id);
-		return 0;	/* Done */
+		return;	/* Done */
 	}
 
 	cmdstate= NULL;
@@ -583,7 +666,9 @@ error:
 		snprintf(filename2, sizeof(filename2),
 			"%s/" OOQD_OUT_PREFIX_REL "%s/ooq",
 			atlas_base(), queue_id);
-		if (stat(filename2, &sb) == -1 &&
+		if (state->store)
+			store_result(filename);
+		else if (stat(filename2, &sb) == -1 &&
 			stat(filename, &sb) == 0)
 		{
 			if (rename(filename, filename2) == -1)
@@ -594,8 +679,6 @@ error:
 		}
 		post_results(0 /* !force_post */);
 	}
-
-	return 0;
 }
 
 static void cmddone(void *cmdstate, int error UNUSED_PARAM)
@@ -636,7 +719,9 @@ static void cmddone(void *cmdstate, int error UNUSED_PARAM)
 	snprintf(to_filename, sizeof(to_filename), fn_fmt, queue_id, i);
 	free(fn_fmt); fn_fmt= NULL;
 
-	if (stat(to_filename, &sb) == 0)
+	if (state->store)
+		store_result(from_filename);
+	else if (stat(to_filename, &sb) == 0)
 	{
 		report("output file '%s' is busy", to_filename);
 
@@ -652,6 +737,75 @@ static void cmddone(void *cmdstate, int error UNUSED_PARAM)
 	{
 		post_results(0 /* !force_post */);
 	}
+
+	/* A slot is free, continue with the queue */
+	if (state->curr_file || state->pending_head)
+		event_active(checkQueueEvent, EV_TIMEOUT, 0);
+}
+
+static void queue_changed(void *ref UNUSED_PARAM)
+{
+	event_active(checkQueueEvent, EV_TIMEOUT, 0);
+}
+
+static void resolv_conf_changed(void *ref UNUSED_PARAM)
+{
+	check_resolv_conf2(output_filename, atlas_id);
+}
+
+static int watch_queue(void)
+{
+	struct atlas_watch *watch;
+
+	watch= atlas_watch_new();
+	if (!watch)
+	{
+		report("inotify not available, polling queue");
+		return -1;
+	}
+	if (atlas_watch_add(watch, state->queue_file, queue_changed,
+		NULL) == -1 ||
+		atlas_watch_add(watch, resolv_conf, resolv_conf_changed,
+		NULL) == -1 ||
+		atlas_watch_event_new(watch, EventBase) == NULL)
+	{
+		report_err("unable to watch '%s'", state->queue_file);
+		atlas_watch_free(watch);
+		return -1;
+	}
+	return 0;
+}
+
+static int ctl_cb(int type, char *data, size_t len UNUSED_PARAM,
+	void *ref UNUSED_PARAM)
+{
+	struct pending *pending;
+
+	if (type == ATLAS_CTL_CLOSE)
+		return 0;
+	if (type != ATLAS_CTL_ONEOFF)
+	{
+		crondlog(LVL8 "ctl_cb: unsupported record type %d", type);
+		return -1;
+	}
+
+	pending= xzalloc(sizeof(*pending));
+	pending->cmdline= xstrdup(data);
+	*state->pending_tail= pending;
+	state->pending_tail= &pending->next;
+
+	event_active(checkQueueEvent, EV_TIMEOUT, 0);
+	return 0;
+}
+
+static void listen_ctl(void)
+{
+	char *path;
+
+	path= xasprintf("%s" ATLAS_CTL_SUFFIX, state->queue_file);
+	if (!atlas_ctl_listen(EventBase, path, ctl_cb, NULL))
+		report_err("unable to create control socket '%s'", path);
+	free(path);
 }
 
 static void check_resolv_conf2(const char *out_file, const char *atlasid)
@@ -716,9 +870,7 @@ static void post_results(int force_post)
 	const char *fn_header, *fn_session_id, *fn_ooq_sent, *session_id;
 	const char *argv[20];
 	char from_filename[80];
-	char to_filename[80];
 	char url[200];
-	struct stat sb;
 
 	for (j= 0; j<5; j++)
 	{
@@ -726,53 +878,13 @@ static void post_results(int force_post)
 		need_post= force_post;
 		force_post= 0;	/* Only one time */
 
-		snprintf(from_filename, sizeof(from_filename),
-			"%s/" OOQD_NEW_PREFIX_REL "%s",
-			atlas_base(), queue_id);
-		snprintf(to_filename, sizeof(to_filename),
-			"%s/" OOQD_OUT_PREFIX_REL "%s/ooq",
-			atlas_base(), queue_id);
-		if (stat(to_filename, &sb) == 0)
-		{
-			/* There is more to post */
-			need_post= 1;	
-		} else if (stat(from_filename, &sb) == 0)
+		if (state->store)
 		{
-			if (rename(from_filename, to_filename) == 0)
+			if (store_results())
 				need_post= 1;
-			else
-			{
-				report_err("move '%s' to '%s' failed",
-					from_filename, to_filename);
-			}
 		}
-		for (i= 0; i<state->max_busy; i++)
-		{
-			snprintf(from_filename, sizeof(from_filename),
-				"%s/" OOQD_NEW_PREFIX_REL "%s.%d",
-				atlas_base(), queue_id, i);
-			snprintf(to_filename, sizeof(to_filename),
-				"%s/" OOQD_OUT_PREFIX_REL "%s/%d",
-				atlas_base(), queue_id, i);
-			if (stat(to_filename, &sb) == 0)
-			{
-				/* There is more to post */
-				need_post= 1;	
-				continue;
-			}
-			if (stat(from_filename, &sb) == -1)
-			{
-				/* Nothing to do */
-				continue;
-			}
-
+		else if (move_results())
 			need_post= 1;
-			if (rename(from_filename, to_filename) == -1)
-			{
-				report_err("move '%s' to '%s' failed",
-					from_filename, to_filename);
-			}
-		}
 		
 		if (!need_post)
 			break;
@@ -800,8 +912,16 @@ static void post_results(int force_post)
 		argv[i++]= "--delete-file";
 		argv[i++]= "--post-header";
 		argv[i++]= fn_header;
-		argv[i++]= "--post-dir";
-		argv[i++]= from_filename;
+		if (state->store)
+		{
+			argv[i++]= "--post-store";
+			argv[i++]= store_name;
+		}
+		else
+		{
+			argv[i++]= "--post-dir";
+			argv[i++]= from_filename;
+		}
 		argv[i++]= "--post-footer";
 		argv[i++]= fn_session_id;
 		argv[i++]= "-O";
@@ -821,6 +941,103 @@ static void post_results(int force_post)
 	}
 }
 
+/* Move new results to data/out/ooq. Returns whether there is something to
+ * post.
+ */
+static int move_results(void)
+{
+	int i, need_post;
+	char from_filename[80];
+	char to_filename[80];
+	struct stat sb;
+
+	need_post= 0;
+	snprintf(from_filename, sizeof(from_filename),
+		"%s/" OOQD_NEW_PREFIX_REL "%s",
+		atlas_base(), queue_id);
+	snprintf(to_filename, sizeof(to_filename),
+		"%s/" OOQD_OUT_PREFIX_REL "%s/ooq",
+		atlas_base(), queue_id);
+	if (stat(to_filename, &sb) == 0)
+	{
+		/* There is more to post */
+		need_post= 1;
+	} else if (stat(from_filename, &sb) == 0)
+	{
+		if (rename(from_filename, to_filename) == 0)
+			need_post= 1;
+		else
+		{
+			report_err("move '%s' to '%s' failed",
+				from_filename, to_filename);
+		}
+	}
+	for (i= 0; i<state->max_busy; i++)
+	{
+		snprintf(from_filename, sizeof(from_filename),
+			"%s/" OOQD_NEW_PREFIX_REL "%s.%d",
+			atlas_base(), queue_id, i);
+		snprintf(to_filename, sizeof(to_filename),
+			"%s/" OOQD_OUT_PREFIX_REL "%s/%d",
+			atlas_base(), queue_id, i);
+		if (stat(to_filename, &sb) == 0)
+		{
+			/* There is more to post */
+			need_post= 1;
+			continue;
+		}
+		if (stat(from_filename, &sb) == -1)
+		{
+			/* Nothing to do */
+			continue;
+		}
+
+		need_post= 1;
+		if (rename(from_filename, to_filename) == -1)
+		{
+			report_err("move '%s' to '%s' failed",
+				from_filename, to_filename);
+		}
+	}
+
+	return need_post;
+}
+
+/* Append new results to the store. Returns whether there is something to
+ * post.
+ */
+static int store_results(void)
+{
+	int i;
+	char filename[80];
+	struct atlas_store_range range;
+
+	snprintf(filename, sizeof(filename),
+		"%s/" OOQD_NEW_PREFIX_REL "%s",
+		atlas_base(), queue_id);
+	store_result(filename);
+	for (i= 0; i<state->max_busy; i++)
+	{
+		snprintf(filename, sizeof(filename),
+			"%s/" OOQD_NEW_PREFIX_REL "%s.%d",
+			atlas_base(), queue_id, i);
+		store_result(filename);
+	}
+
+	if (atlas_store_peek(state->store, 0, &range) == -1)
+	{
+		report_err("unable to read store '%s'", store_name);
+		return 0;
+	}
+	return range.len > 0;
+}
+
+static void store_result(const char *filename)
+{
+	if (atlas_store_move_file(state->store, filename) == -1)
+		report_err("unable to store '%s'", filename);
+}
+
 static const char *get_session_id(void)
 {
 	static char session_id[80];
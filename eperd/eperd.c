@@ -22,10 +22,11 @@
 
 //applet:IF_EPERD(APPLET(eperd, BB_DIR_BIN, BB_SUID_DROP))
 
-//kbuild:lib-$(CONFIG_EPERD) += eooqd.o eperd.o condmv.o httpget.o ping.o sslgetcert.o traceroute.o evhttpget.o evping.o evsslgetcert.o evtdig.o evtraceroute.o tcputil.o readresolv.o evntp.o ntp.o
+//kbuild:lib-$(CONFIG_EPERD) += eooqd.o eperd.o condmv.o httpget.o ping.o sslgetcert.o traceroute.o evhttpget.o evping.o evsslgetcert.o evtdig.o evtraceroute.o tcputil.o readresolv.o evntp.o ntp.o timeouts.o tlshello.o aggregate.o pace.o sendtimer.o speccache.o schedstate.o
 
 //usage:#define eperd_trivial_usage
-//usage:       "-fbSAD -P pidfile -l N -d N -L LOGFILE -c DIR"
+//usage:       "-fbSADB -P pidfile -l N -d N -L LOGFILE -c DIR -w N -j N -p N"
+//usage:       " -r N -t N -C FILE -R FILE"
 //usage:#define eperd_full_usage "\n\n"
 //usage:       "       -f      Foreground"
 //usage:     "\n       -b      Background (default)"
@@ -37,15 +38,28 @@
 //usage:     "\n       -A      Atlas specific processing"
 //usage:     "\n       -D      Periodically kick watchdog"
 //usage:     "\n       -P      pidfile to use"
+//usage:     "\n       -s      Periodically append resource usage to file"
+//usage:     "\n       -w      Number of worker processes"
+//usage:     "\n       -B      Spread starts to balance the load per second"
+//usage:     "\n       -j      Max number of running measurements (per worker)"
+//usage:     "\n       -p      Max expected packets per second of starts (per worker)"
+//usage:     "\n       -r      Max packets per second sent (per worker)"
+//usage:     "\n       -t      Max packets per second to one destination (per worker)"
+//usage:     "\n       -C      Cache of valid command lines, to start faster"
+//usage:     "\n       -R      Save the schedule to file, continue from it after a restart"
 
 #include "libbb.h"
 #include <syslog.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/prctl.h>
 #include <event2/event.h>
 #include <event2/event_struct.h>
 #include <event2/dns.h>
 
+#include "atlas_ctl.h"
+#include "atlas_pool.h"
+#include "atlas_watch.h"
 #include "eperd.h"
 
 #define SAFE_PREFIX_REL ATLAS_DATA_NEW_REL
@@ -85,6 +99,19 @@
 
 #define RESOLV_CONF	"/etc/resolv.conf"
 
+#define STATS_INTERVAL	300	/* Seconds between resource usage reports */
+#define SCHED_STATE_INTERVAL 60	/* Seconds between schedule checkpoints */
+#define MAX_WORKERS	16	/* Limited by the traceroute instance id */
+#define RESPAWN_DELAY	5	/* Seconds before restarting a worker */
+#define ACCT_HASH_SIZE	256
+#define SCHED_SLOTS	3600	/* Seconds ahead for which starts are tracked */
+#define SCHED_PROBES	1024	/* Max number of offsets tried per start */
+#define SCHED_START_COST 4	/* Weight of a start, in packets */
+#define SCHED_DEF_PKTS	3	/* Packets per run before it is measured */
+#define SCHED_MAX_DEFER	8	/* Seconds a start can be held back, should
+				 * stay below the 10 seconds RunJob allows
+				 */
+
 #ifndef ENABLE_FEATURE_CROND_CALL_SENDMAIL
 #define ENABLE_FEATURE_CROND_CALL_SENDMAIL 0
 #endif
@@ -109,12 +136,26 @@ struct CronLine {
 	struct event event;
 	struct testops *testops;
 	void *teststate;
+	char needs_init;	/* In the spec cache, init at the first run */
+	struct acct_counters acct;
+	CronLine *acct_next;	/* Hash chain for acct_lookup */
+
+	/* Load based scheduling */
+	time_t sched_slot;	/* Second with our reservation, 0 if none */
+	unsigned sched_cost;	/* Packets reserved in that second */
+	unsigned sched_est;	/* Estimated packets per run */
+	unsigned sched_sent;	/* Packets sent since the last start */
+	char sched_have_est;
+	char sched_ran;
+	time_t sched_running;	/* Start of a run that is not done yet */
 
 	/* For cleanup */
 	char needs_delete;
+	unsigned ctl_gen;	/* Last control channel crontab with this line */
+
+	time_t lasttime;	/* Start of the last run */
 
 	/* For debugging */
-	time_t lasttime;
 	time_t nexttime;
 	time_t waittime;
 	time_t debug_cycle;
@@ -135,6 +176,7 @@ enum {
 	OPT_D = (1 << 6),
 	OPT_P = (1 << 7),
 	OPT_d = (1 << 8) * ENABLE_FEATURE_CROND_D,
+	OPT_B = (1 << 13),	/* Position in the getopt32 string */
 };
 #if ENABLE_FEATURE_CROND_D
 #define DebugOpt (option_mask32 & OPT_d)
@@ -153,9 +195,39 @@ static int do_kick_watchdog;
 static char *out_filename= NULL;
 static char *atlas_id= NULL;
 static char *resolv_conf;
+static char *stats_filename= NULL;
+static unsigned nworkers= 1;
+static unsigned worker_id;
+
+int acct_enabled;
+
+/* With -B the number of starts and the expected number of packets they
+ * send are kept for each second in the next hour. do_distr picks the least
+ * loaded second within the range of the line's distribution.
+ */
+struct sched_slot
+{
+	unsigned starts;
+	unsigned pkts;
+};
+static struct sched_slot *sched_slots;
+static int sched_counting;	/* Count packets sent per line */
+static unsigned sched_max_running;
+static unsigned sched_pkt_budget;
+static time_t sched_sec;	/* Second for sched_sec_pkts */
+static unsigned sched_sec_pkts;	/* Expected packets of starts in sched_sec */
+
+static unsigned pace_rate;	/* -r, packets per second */
+static unsigned pace_dest_rate;	/* -t, packets per second per destination */
+
+static char *spec_cache_filename;	/* -C */
+static char *sched_state_filename;	/* -R */
 
 static void CheckUpdates(evutil_socket_t fd, short what, void *arg);
 static void CheckUpdatesHour(evutil_socket_t fd, short what, void *arg);
+static void watch_updates(void);
+static void run_workers(const char *PidFileName);
+static void listen_ctl(void);
 static void SynchronizeDir(void);
 #if ENABLE_FEATURE_CROND_CALL_SENDMAIL
 static void EndJob(const char *user, CronLine *line);
@@ -165,8 +237,25 @@ static void EndJob(const char *user, CronLine *line);
 static void DeleteFile(void);
 static int Insert(CronLine *line);
 static void Start(CronLine *line);
+static int sched_restore(CronLine *line);
 static void atlas_init(CronLine *line);
+
+struct builtin
+{
+	const char *cmd;
+	struct testops *testops;
+};
+static struct builtin *find_builtin(const char *cmdline);
+static void spec_cache_update(void);
+static void sched_state_update(void);
+static void SaveSchedState(evutil_socket_t fd, short what, void *arg);
 static void RunJob(evutil_socket_t fd, short what, void *arg);
+static void skip_space(char *cp, char **ncpp);
+static void skip_nonspace(char *cp, char **ncpp);
+static void print_cmd(FILE *fn, CronLine *line);
+static void acct_link(CronLine *line);
+static void acct_unlink(CronLine *line);
+static void ReportStats(evutil_socket_t fd, short what, void *arg);
 
 void crondlog(const char *ctl, ...)
 {
@@ -255,7 +344,8 @@ int eperd_main(int argc UNUSED_PARAM, char **argv)
 	unsigned seed;
 	size_t len;
 	char *validated_fn;
-	struct event *updateEventMin, *updateEventHour;
+	struct event *updateEventMin, *updateEventHour, *statsEvent;
+	struct event *saveStateEvent;
 	struct timeval tv;
 	struct rlimit limit;
 	struct stat sb;
@@ -267,13 +357,23 @@ int eperd_main(int argc UNUSED_PARAM, char **argv)
 
 	/* "-b after -f is ignored", and so on for every pair a-b */
 	opt_complementary = "d-l"
-			":i+:l+:d+"; /* -i, -l and -d have numeric param */
-	opt = getopt32(argv, "I:i:l:L:fc:A:DP:d:O:",
+			":i+:l+:d+:w+:j+:p+:r+:t+"; /* -i, -l, -d, -w, -j, -p,
+						     * -r and -t have numeric
+						     * param
+						     */
+	opt = getopt32(argv, "I:i:l:L:fc:A:DP:d:O:s:w:Bj:p:r:t:C:R:",
 			&interface_name, &instance_id, &LogLevel,
 			&LogFile, &CDir,
-			&atlas_id, &PidFileName,&LogLevel, &out_filename);
+			&atlas_id, &PidFileName,&LogLevel, &out_filename,
+			&stats_filename, &nworkers, &sched_max_running,
+			&sched_pkt_budget, &pace_rate, &pace_dest_rate,
+			&spec_cache_filename, &sched_state_filename);
 	/* both -d N and -l N set the same variable: LogLevel */
 
+	if (opt & OPT_B)
+		sched_slots= xzalloc(SCHED_SLOTS * sizeof(*sched_slots));
+	sched_counting= (sched_slots || sched_pkt_budget);
+
 	if (out_filename)
 	{
 		validated_fn= rebased_validated_filename(out_filename, 
@@ -287,6 +387,40 @@ int eperd_main(int argc UNUSED_PARAM, char **argv)
 		/* Use validate_fn from now on instead of out_filename */
 		out_filename= validated_fn;
 	}
+	if (stats_filename)
+	{
+		validated_fn= rebased_validated_filename(stats_filename,
+			SAFE_PREFIX_REL);
+		if (validated_fn == NULL)
+		{
+			crondlog(DIE9 "insecure file '%s'. allowed path '%s'", 
+				stats_filename, SAFE_PREFIX_REL);
+		}
+		stats_filename= validated_fn;
+		acct_enabled= 1;
+	}
+	if (spec_cache_filename)
+	{
+		validated_fn= rebased_validated_filename(spec_cache_filename,
+			SAFE_PREFIX_REL);
+		if (validated_fn == NULL)
+		{
+			crondlog(DIE9 "insecure file '%s'. allowed path '%s'", 
+				spec_cache_filename, SAFE_PREFIX_REL);
+		}
+		spec_cache_filename= validated_fn;
+	}
+	if (sched_state_filename)
+	{
+		validated_fn= rebased_validated_filename(sched_state_filename,
+			SAFE_PREFIX_REL);
+		if (validated_fn == NULL)
+		{
+			crondlog(DIE9 "insecure file '%s'. allowed path '%s'", 
+				sched_state_filename, SAFE_PREFIX_REL);
+		}
+		sched_state_filename= validated_fn;
+	}
 
 	if (!(opt & OPT_f)) {
 		/* close stdin, stdout, stderr.
@@ -338,12 +472,31 @@ int eperd_main(int argc UNUSED_PARAM, char **argv)
 	/* Ignore SIGPIPE, broken TCP sessions may trigger them */
 	signal(SIGPIPE, SIG_IGN);
 
+	/* Only returns in the workers */
+	if (nworkers > 1)
+	{
+		run_workers(PidFileName);
+
+		/* Each worker has its own share of the crontab */
+		if (spec_cache_filename)
+		{
+			spec_cache_filename= xasprintf("%s.%u",
+				spec_cache_filename, worker_id);
+		}
+		if (sched_state_filename)
+		{
+			sched_state_filename= xasprintf("%s.%u",
+				sched_state_filename, worker_id);
+		}
+	}
+
 	/* Create libevent event base */
 	EventBase= event_base_new();
 	if (!EventBase)
 	{
 		crondlog(DIE9 "event_base_new failed"); /* exits */
 	}
+	pace_init(EventBase, pace_rate, pace_dest_rate);
 	DnsBase= evdns_base_new(EventBase, 0 /*!initialize*/);
 	if (!DnsBase)
 	{
@@ -380,8 +533,40 @@ int eperd_main(int argc UNUSED_PARAM, char **argv)
 	crondlog(LVL7 "using seed '%u'", seed);
 	srandom(seed);
 
+	/* Lines that were in the previous checkpoint continue with their
+	 * schedule. Only for the initial crontab, lines added later start
+	 * fresh.
+	 */
+	if (sched_state_filename)
+		sched_state_load(sched_state_filename);
+
 	SynchronizeDir();
 
+	if (sched_state_filename)
+	{
+		sched_state_free();
+		sched_state_update();
+
+		saveStateEvent= event_new(EventBase, -1,
+			EV_TIMEOUT|EV_PERSIST, SaveSchedState, NULL);
+		if (!saveStateEvent)
+			crondlog(DIE9 "event_new failed"); /* exits */
+		tv.tv_sec= SCHED_STATE_INTERVAL;
+		tv.tv_usec= 0;
+		event_add(saveStateEvent, &tv);
+	}
+
+	/* Get notified about changes to CRONUPDATE and resolv.conf. The
+	 * timer below only acts as a fallback.
+	 */
+	watch_updates();
+
+	/* Let telnetd push crontab changes directly. Not with workers, each
+	 * worker picks up its share of the crontab from the file.
+	 */
+	if (nworkers == 1)
+		listen_ctl();
+
 	updateEventMin= event_new(EventBase, -1, EV_TIMEOUT|EV_PERSIST,
 		CheckUpdates, NULL);
 	if (!updateEventMin)
@@ -397,8 +582,21 @@ int eperd_main(int argc UNUSED_PARAM, char **argv)
 	tv.tv_sec= 3600;
 	tv.tv_usec= 0;
 	event_add(updateEventHour, &tv);
+
+	if (acct_enabled)
+	{
+		statsEvent= event_new(EventBase, -1, EV_TIMEOUT|EV_PERSIST,
+			ReportStats, NULL);
+		if (!statsEvent)
+			crondlog(DIE9 "event_new failed"); /* exits */
+		tv.tv_sec= STATS_INTERVAL;
+		tv.tv_usec= 0;
+		event_add(statsEvent, &tv);
+	}
 		
-	if(PidFileName)
+	if (nworkers > 1)
+		;	/* The pidfile belongs to the supervisor */
+	else if(PidFileName)
 	{
 		write_pidfile(PidFileName);
 	}
@@ -465,6 +663,89 @@ int eperd_main(int argc UNUSED_PARAM, char **argv)
 	return 0; /* not reached */
 }
 
+/* Fork 'nworkers' copies of eperd. Each worker runs with its own event
+ * base and only the crontab lines that hash to it (see my_line). The
+ * parent stays behind to restart workers that die. Workers append to the
+ * same output files, results are written with atlas_fopen_append so
+ * records do not get mixed up.
+ */
+static void run_workers(const char *PidFileName)
+{
+	int status;
+	unsigned i;
+	pid_t pid, *pids;
+
+	if (nworkers > MAX_WORKERS || instance_id + nworkers > MAX_WORKERS)
+	{
+		crondlog(DIE9 "too many workers (%u) for instance id %u",
+			nworkers, instance_id);
+	}
+
+	write_pidfile(PidFileName ? PidFileName : "/var/run/crond.pid");
+
+	pids= xzalloc(nworkers * sizeof(*pids));
+	for (;;)
+	{
+		for (i= 0; i<nworkers; i++)
+		{
+			if (pids[i] != 0)
+				continue;
+			pid= fork();
+			if (pid == -1)
+			{
+				crondlog(LVL9 "fork failed: %s", strerror(errno));
+				break;
+			}
+			if (pid == 0)
+			{
+				/* Worker. Go away with the supervisor */
+				prctl(PR_SET_PDEATHSIG, SIGTERM);
+				if (getppid() == 1)
+					exit(1);
+				free(pids);
+				worker_id= i;
+
+				/* Keep traceroute ICMP ids apart */
+				instance_id += i;
+				return;
+			}
+			crondlog(LVL8 "started worker %u, pid %d", i, pid);
+			pids[i]= pid;
+		}
+
+		pid= wait(&status);
+		if (pid == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			sleep(RESPAWN_DELAY);
+			continue;
+		}
+		for (i= 0; i<nworkers; i++)
+		{
+			if (pids[i] == pid)
+			{
+				crondlog(LVL9 "worker %u (pid %d) died, status 0x%x",
+					i, pid, status);
+				pids[i]= 0;
+			}
+		}
+
+		/* Do not spin if workers die right away */
+		sleep(RESPAWN_DELAY);
+	}
+}
+
+/* With workers, does 'line' belong to this worker */
+static int my_line(CronLine *line)
+{
+	if (nworkers <= 1)
+		return 1;
+
+	return atlas_hash_str(ATLAS_HASH_INIT, line->cl_Shell) % nworkers ==
+		worker_id;
+}
+
 #if SETENV_LEAKS
 /* We set environment *before* vfork (because we want to use vfork),
  * so we cannot use setenv() - repeated calls to setenv() may leak memory!
@@ -484,12 +765,97 @@ static void safe_setenv4(char **pvar_val, const char *var, const char *val /*, i
 }
 #endif
 
+static struct sched_slot *sched_slot(time_t t)
+{
+	return &sched_slots[t % SCHED_SLOTS];
+}
+
+static unsigned sched_est(CronLine *line)
+{
+	return line->sched_have_est ? line->sched_est : SCHED_DEF_PKTS;
+}
+
+static void sched_release(CronLine *line)
+{
+	struct sched_slot *slot;
+
+	if (!line->sched_slot)
+		return;
+	slot= sched_slot(line->sched_slot);
+	slot->starts--;
+	slot->pkts -= line->sched_cost;
+	line->sched_slot= 0;
+}
+
+static void sched_reserve(CronLine *line, time_t t)
+{
+	time_t now;
+	struct sched_slot *slot;
+
+	now= time(NULL);
+	if (t < now || t >= now+SCHED_SLOTS || t > line->end_time)
+		return;		/* Not tracked, or will not run */
+	slot= sched_slot(t);
+	line->sched_slot= t;
+	line->sched_cost= sched_est(line);
+	slot->starts++;
+	slot->pkts += line->sched_cost;
+}
+
+/* Find the offset in the range of the distribution that starts in the
+ * second with the lowest load. Short ranges are searched completely,
+ * otherwise SCHED_PROBES random offsets are tried. Equal loads are broken
+ * at random. Returns 0 if no offset falls in the tracked window.
+ */
+static int sched_balance(CronLine *line, time_t base, long *offp)
+{
+	long lo, n, i, nprobes, off, best_off;
+	unsigned cost, best_cost, ties;
+	time_t now, t;
+	struct sched_slot *slot;
+
+	now= time(NULL);
+	lo= -(line->distr_param/2);
+	n= line->distr_param+1;
+	nprobes= n <= SCHED_PROBES ? n : SCHED_PROBES;
+
+	ties= 0;
+	best_cost= 0;
+	best_off= 0;
+	for (i= 0; i<nprobes; i++)
+	{
+		off= (n <= SCHED_PROBES) ? lo+i : lo + random() % n;
+		t= base+off;
+		if (t < now || t >= now+SCHED_SLOTS)
+			continue;
+		slot= sched_slot(t);
+		cost= slot->starts*SCHED_START_COST + slot->pkts;
+		if (ties == 0 || cost < best_cost)
+		{
+			best_cost= cost;
+			best_off= off;
+			ties= 1;
+		}
+		else if (cost == best_cost && random() % ++ties == 0)
+			best_off= off;
+	}
+	if (ties == 0)
+		return 0;
+	*offp= best_off;
+	return 1;
+}
+
 static void do_distr(CronLine *line)
 {
-	long n, r, modulus, max;
+	long n, r, modulus, max, off;
+	time_t base;
+
+	if (sched_slots)
+		sched_release(line);
 
 	line->distr_offset.tv_sec= 0;		/* Safe default */
 	line->distr_offset.tv_usec= 0;
+	base= line->start_time + line->nextcycle*line->interval;
 	if (line->distribution == DISTR_UNIFORM)
 	{
 		/* Generate a random number in the range [0..distr_param] */
@@ -503,21 +869,106 @@ static void do_distr(CronLine *line)
 		r %= modulus;
 		line->distr_offset.tv_sec= r - line->distr_param/2;
 		line->distr_offset.tv_usec= random() % 1000000;
+
+		if (sched_slots && sched_balance(line, base, &off))
+			line->distr_offset.tv_sec= off;
 	}
+	if (sched_slots)
+		sched_reserve(line, base + line->distr_offset.tv_sec);
 	crondlog(LVL7 "do_distr: using %f", line->distr_offset.tv_sec + 
 		line->distr_offset.tv_usec/1e6);
 }
 
+/* Parse the 6 fields of a crontab line. Returns NULL for a bad line */
+static CronLine *ParseLine(char *tokens[6])
+{
+	char *check0, *check1, *check2;
+	CronLine *line;
+
+	line = xzalloc(sizeof(*line));
+	line->interval= strtoul(tokens[0], &check0, 10);
+	line->start_time= strtoul(tokens[1], &check1, 10);
+	line->end_time= strtoul(tokens[2], &check2, 10);
+
+	if (line->interval <= 0 ||
+		line->interval > MAX_INTERVAL ||
+		check0[0] != '\0' ||
+		check1[0] != '\0' ||
+		check2[0] != '\0')
+	{
+		crondlog(LVL9 "bad crontab line");
+		free(line);
+		return NULL;
+	}
+
+	if (strcmp(tokens[3], "NONE") == 0)
+	{
+		line->distribution= DISTR_NONE;
+	}
+	else if (strcmp(tokens[3], "UNIFORM") == 0)
+	{
+		line->distribution= DISTR_UNIFORM;
+		line->distr_param=
+			strtoul(tokens[4], &check0, 10);
+		if (check0[0] != '\0')
+		{
+			crondlog(LVL9 "bad crontab line");
+			free(line);
+			return NULL;
+		}
+		if (line->distr_param == 0 ||
+			LONG_MAX/line->distr_param == 0)
+		{
+			line->distribution= DISTR_NONE;
+		}
+	}
+
+	line->lasttime= 0;
+	/* copy command */
+	line->cl_Shell = xstrdup(tokens[5]);
+	if (DebugOpt) {
+		crondlog(LVL5 " command:%s", tokens[5]);
+	}
+	return line;
+}
+
+/* Add a parsed line, or update the matching line that is already there.
+ * Returns the line that ends up in the list.
+ */
+static CronLine *AddLine(CronLine *line)
+{
+	int r;
+
+	evtimer_assign(&line->event, EventBase, RunJob, line);
+
+	r= Insert(line);
+	if (!r)
+	{
+		/* Existing line. Delete new one */
+#if ENABLE_FEATURE_CROND_CALL_SENDMAIL
+		free(line->cl_MailTo);
+#endif
+		free(line->cl_Shell);
+		free(line);
+		return oldLine;
+	}
+
+	/* New line, should schedule start event */
+	Start(line);
+
+	kick_watchdog();
+	return line;
+}
+
 static void SynchronizeFile(const char *fileName)
 {
 	struct parser_t *parser;
 	struct stat sbuf;
-	int r, maxLines;
+	int maxLines;
 	char *tokens[6];
 #if ENABLE_FEATURE_CROND_CALL_SENDMAIL
 	char *mailTo = NULL;
 #endif
-	char *check0, *check1, *check2;
 	CronLine *line;
 
 	if (!fileName)
@@ -526,6 +977,9 @@ static void SynchronizeFile(const char *fileName)
 	for (line= LineBase; line; line= line->cl_Next)
 		line->needs_delete= 1;
 
+	if (spec_cache_filename)
+		spec_cache_open(spec_cache_filename);
+
 	parser = config_open(fileName);
 	if (!parser)
 	{
@@ -534,6 +988,7 @@ static void SynchronizeFile(const char *fileName)
 		 * failure.
 		 */
 		DeleteFile();
+		spec_cache_close();
 		return;
 	}
 
@@ -563,72 +1018,21 @@ static void SynchronizeFile(const char *fileName)
 			/* check if a minimum of tokens is specified */
 			if (n < 6)
 				continue;
-			line = xzalloc(sizeof(*line));
-			line->interval= strtoul(tokens[0], &check0, 10);
-			line->start_time= strtoul(tokens[1], &check1, 10);
-			line->end_time= strtoul(tokens[2], &check2, 10);
-
-			if (line->interval <= 0 ||
-				line->interval > MAX_INTERVAL ||
-				check0[0] != '\0' ||
-				check1[0] != '\0' ||
-				check2[0] != '\0')
+			line= ParseLine(tokens);
+			if (!line)
+				continue;
+			if (!my_line(line))
 			{
-				crondlog(LVL9 "bad crontab line");
+				/* Another worker runs this one */
+				free(line->cl_Shell);
 				free(line);
 				continue;
 			}
-
-			if (strcmp(tokens[3], "NONE") == 0)
-			{
-				line->distribution= DISTR_NONE;
-			}
-			else if (strcmp(tokens[3], "UNIFORM") == 0)
-			{
-				line->distribution= DISTR_UNIFORM;
-				line->distr_param=
-					strtoul(tokens[4], &check0, 10);
-				if (check0[0] != '\0')
-				{
-					crondlog(LVL9 "bad crontab line");
-					free(line);
-					continue;
-				}
-				if (line->distr_param == 0 ||
-					LONG_MAX/line->distr_param == 0)
-				{
-					line->distribution= DISTR_NONE;
-				}
-			}
-
-			line->lasttime= 0;
 #if ENABLE_FEATURE_CROND_CALL_SENDMAIL
 			/* copy mailto (can be NULL) */
 			line->cl_MailTo = xstrdup(mailTo);
 #endif
-			/* copy command */
-			line->cl_Shell = xstrdup(tokens[5]);
-			if (DebugOpt) {
-				crondlog(LVL5 " command:%s", tokens[5]);
-			}
-//bb_error_msg("M[%s]F[%s][%s][%s][%s][%s][%s]", mailTo, tokens[0], tokens[1], tokens[2], tokens[3], tokens[4], tokens[5]);
-
-			evtimer_assign(&line->event, EventBase, RunJob, line);
-
-			r= Insert(line);
-			if (!r)
-			{
-				/* Existing line. Delete new one */
-#if ENABLE_FEATURE_CROND_CALL_SENDMAIL
-				free(line->cl_MailTo);
-#endif
-				free(line->cl_Shell);
-				free(line);
-				continue;
-			}
-
-			/* New line, should schedule start event */
-			Start(line);
+			AddLine(line);
 
 			kick_watchdog();
 		}
@@ -640,6 +1044,7 @@ static void SynchronizeFile(const char *fileName)
 	config_close(parser);
 
 	DeleteFile();
+	spec_cache_update();
 }
 
 static void check_resolv_conf(void)
@@ -665,9 +1070,9 @@ static void check_resolv_conf(void)
 		resolv_conf);
 	evdns_base_resume(DnsBase);
 
-	if ((r != 0 || last_time != -1) && out_filename)
+	if ((r != 0 || last_time != -1) && out_filename && worker_id == 0)
 	{
-		fn= fopen(out_filename, "a");
+		fn= atlas_fopen_append(out_filename);
 		if (!fn)
 			crondlog(DIE9 "unable to append to '%s'", out_filename);
 		fprintf(fn, "RESULT { ");
@@ -685,6 +1090,23 @@ static void check_resolv_conf(void)
 	last_time= sb.st_mtime;
 }
 
+static void check_crontab(void)
+{
+	static struct stat last_sb;
+
+	struct stat sb;
+
+	if (stat("root", &sb) == -1)
+		memset(&sb, '\0', sizeof(sb));
+	if (sb.st_ino == last_sb.st_ino && sb.st_mtime == last_sb.st_mtime &&
+		sb.st_size == last_sb.st_size)
+	{
+		return;
+	}
+	last_sb= sb;
+	SynchronizeFile("root");
+}
+
 static void CheckUpdates(evutil_socket_t __attribute__ ((unused)) fd,
 	short __attribute__ ((unused)) what,
 	void __attribute__ ((unused)) *arg)
@@ -692,6 +1114,17 @@ static void CheckUpdates(evutil_socket_t __attribute__ ((unused)) fd,
 	FILE *fi;
 	char buf[256];
 
+	if (nworkers > 1)
+	{
+		/* Workers cannot share cron.update, look at the crontab
+		 * itself.
+		 */
+		unlink(CRONUPDATE);
+		check_crontab();
+		check_resolv_conf();
+		return;
+	}
+
 	fi = fopen_for_read(CRONUPDATE);
 	if (fi != NULL) {
 		unlink(CRONUPDATE);
@@ -705,6 +1138,153 @@ static void CheckUpdates(evutil_socket_t __attribute__ ((unused)) fd,
 	check_resolv_conf();
 }
 
+static void cron_update_changed(void *ref UNUSED_PARAM)
+{
+	CheckUpdates(-1, 0, NULL);
+}
+
+static void resolv_conf_changed(void *ref UNUSED_PARAM)
+{
+	check_resolv_conf();
+}
+
+static void watch_updates(void)
+{
+	struct atlas_watch *watch;
+
+	watch= atlas_watch_new();
+	if (!watch)
+	{
+		crondlog(LVL8 "inotify not available, polling for updates");
+		return;
+	}
+	if (atlas_watch_add(watch, nworkers > 1 ? "root" : CRONUPDATE,
+		cron_update_changed, NULL) == -1 ||
+		atlas_watch_add(watch, resolv_conf, resolv_conf_changed,
+		NULL) == -1 ||
+		atlas_watch_event_new(watch, EventBase) == NULL)
+	{
+		crondlog(LVL8 "unable to watch for updates: %s",
+			strerror(errno));
+		atlas_watch_free(watch);
+		return;
+	}
+}
+
+/* Control channel. A complete crontab arrives as BEGIN, ADD for each line
+ * and END. Lines that were not sent are deleted at END, telnetd also
+ * writes the crontab file, so nothing needs to be saved. A push that is
+ * aborted half way only adds lines, the next SynchronizeDir cleans up.
+ */
+static unsigned ctl_gen;
+static int ctl_in_push;
+
+/* Split a crontab line the same way SynchronizeFile does: 5 fields and
+ * the rest of the line. Returns the number of tokens.
+ */
+static int ctl_tokenize(char *data, char *tokens[6])
+{
+	int n;
+	char *cp, *ncp;
+
+	cp= strchr(data, '#');
+	if (cp)
+		*cp= '\0';
+
+	cp= data;
+	for (n= 0; n<6; n++)
+	{
+		skip_space(cp, &cp);
+		if (cp[0] == '\0')
+			break;
+		tokens[n]= cp;
+		if (n == 5)
+		{
+			/* Rest of the line, without trailing white space */
+			ncp= cp+strlen(cp);
+			while (ncp > cp && isspace(((unsigned char *)ncp)[-1]))
+				ncp--;
+			*ncp= '\0';
+			return 6;
+		}
+		skip_nonspace(cp, &ncp);
+		if (ncp[0] != '\0')
+			*ncp++= '\0';
+		cp= ncp;
+	}
+	return n;
+}
+
+static int ctl_cb(int type, char *data, size_t len UNUSED_PARAM,
+	void *ref UNUSED_PARAM)
+{
+	int n;
+	char *tokens[6];
+	CronLine *line;
+
+	switch(type)
+	{
+	case ATLAS_CTL_BEGIN:
+		ctl_gen++;
+		ctl_in_push= 1;
+		oldLine= NULL;
+		if (spec_cache_filename)
+			spec_cache_open(spec_cache_filename);
+		return 0;
+
+	case ATLAS_CTL_ADD:
+		if (!ctl_in_push)
+			return -1;
+		n= ctl_tokenize(data, tokens);
+		if (n == 0)
+			return 0;		/* Empty line or comment */
+		if (n < 6)
+			return -1;
+		line= ParseLine(tokens);
+		if (!line)
+			return -1;
+		line= AddLine(line);
+		line->ctl_gen= ctl_gen;
+		return 0;
+
+	case ATLAS_CTL_END:
+		if (!ctl_in_push)
+			return -1;
+		for (line= LineBase; line; line= line->cl_Next)
+		{
+			if (line->ctl_gen != ctl_gen)
+				line->needs_delete= 1;
+		}
+		ctl_in_push= 0;
+		DeleteFile();
+		spec_cache_update();
+		return 0;
+
+	case ATLAS_CTL_CLOSE:
+		if (ctl_in_push)
+		{
+			crondlog(LVL8 "ctl_cb: crontab push aborted");
+			ctl_in_push= 0;
+			oldLine= NULL;
+			spec_cache_close();
+		}
+		return 0;
+	}
+
+	crondlog(LVL8 "ctl_cb: unsupported record type %d", type);
+	return -1;
+}
+
+static void listen_ctl(void)
+{
+	if (!atlas_ctl_listen(EventBase, "root" ATLAS_CTL_SUFFIX, ctl_cb,
+		NULL))
+	{
+		crondlog(LVL8 "unable to create control socket: %s",
+			strerror(errno));
+	}
+}
+
 static void CheckUpdatesHour(evutil_socket_t __attribute__ ((unused)) fd,
 	short __attribute__ ((unused)) what,
 	void __attribute__ ((unused)) *arg)
@@ -774,6 +1354,77 @@ static void set_timeout(CronLine *line, int init_next_cycle)
 	event_add(&line->event, &tv);
 }
 
+/* Continue with the schedule from the checkpoint, if the line is in it.
+ * The offset from the distribution is kept. If the next run is already
+ * past, because eperd was not running or the line ran after the
+ * checkpoint, the first cycle that is still ahead is used with the same
+ * offset. Returns 1 if the line is scheduled.
+ */
+static int sched_restore(CronLine *line)
+{
+	long min_off, max_off, skip;
+	time_t now, next;
+	const struct sched_state *ss;
+
+	if (!sched_state_filename)
+		return 0;
+	ss= sched_state_find(sched_state_key(line->cl_Shell, line->interval,
+		line->start_time));
+	if (!ss)
+		return 0;
+
+	line->lasttime= ss->lastrun;
+	if (ss->flags & SCHED_STATE_HAVE_EST)
+	{
+		line->sched_est= ss->sched_est;
+		line->sched_have_est= 1;
+	}
+
+	/* The distribution may have changed since the checkpoint. This is
+	 * the range of offsets that do_distr generates.
+	 */
+	min_off= max_off= 0;
+	if (line->distribution == DISTR_UNIFORM)
+	{
+		min_off= -(line->distr_param/2);
+		max_off= line->distr_param - line->distr_param/2;
+	}
+	if (ss->nextcycle < 0 ||
+		ss->distr_sec < min_off || ss->distr_sec > max_off ||
+		ss->distr_usec < 0 || ss->distr_usec >= 1000000)
+	{
+		crondlog(LVL7 "sched_restore: not using state for '%s'",
+			line->cl_Shell);
+		return 0;
+	}
+
+	now= time(NULL);
+	skip= 0;
+	next= line->start_time + ss->nextcycle*line->interval + ss->distr_sec;
+	if (next < now)
+	{
+		skip= (now-next)/line->interval + 1;
+		next += skip*line->interval;
+	}
+	if (next > now + line->interval + max_off)
+	{
+		/* Clock went back */
+		crondlog(LVL7 "sched_restore: not using state for '%s'",
+			line->cl_Shell);
+		return 0;
+	}
+
+	line->nextcycle= ss->nextcycle + skip;
+	line->distr_offset.tv_sec= ss->distr_sec;
+	line->distr_offset.tv_usec= ss->distr_usec;
+	if (sched_slots)
+		sched_reserve(line, next);
+	crondlog(LVL7 "sched_restore: next run of '%s' in %ld seconds",
+		line->cl_Shell, (long)(next-now));
+	set_timeout(line, 0 /*!init_nextcycle*/);
+	return 1;
+}
+
 /*
  * Insert - insert if not already there
  */
@@ -835,14 +1486,32 @@ static int Insert(CronLine *line)
 
 static void Start(CronLine *line)
 {
+	struct builtin *bp;
+
 	line->testops= NULL;
 
+	/* A command line that initialized fine before is only parsed
+	 * when it is about to run.
+	 */
+	if (spec_cache_find(line->cl_Shell) &&
+		(bp= find_builtin(line->cl_Shell)) != NULL)
+	{
+		crondlog(LVL7 "Start: '%s' is in the spec cache",
+			line->cl_Shell);
+		line->testops= bp->testops;
+		line->needs_init= 1;
+		if (!sched_restore(line))
+			set_timeout(line, 1 /*init_nextcycle*/);
+		return;
+	}
+
 	/* Parse command line and init test */
 	atlas_init(line);
 	if (!line->testops)
 		return;			/* Test failed to initialize */
 
-	set_timeout(line, 1 /*init_nextcycle*/);
+	if (!sched_restore(line))
+		set_timeout(line, 1 /*init_nextcycle*/);
 }
 
 /*
@@ -866,7 +1535,7 @@ static void DeleteFile(void)
 			continue;
 		}
 		kick_watchdog();
-		if (!line->teststate)
+		if (!line->teststate && !line->needs_init)
 		{
 			crondlog(LVL8 "DeleteFile: no state to delete for '%s'",
 				line->cl_Shell);
@@ -880,10 +1549,13 @@ static void DeleteFile(void)
 				pline= &line->cl_Next;
 				continue;
 			}
+			acct_unlink(line);
 			line->testops= NULL;
 			line->teststate= NULL;
 		}
 		event_del(&line->event);
+		if (sched_slots)
+			sched_release(line);
 		free(line->cl_Shell);
 		line->cl_Shell= NULL;
 
@@ -913,11 +1585,7 @@ static void find_eos(char *cp, char **ncpp)
 	*ncpp= cp;
 }
 
-static struct builtin 
-{
-	const char *cmd;
-	struct testops *testops;
-} builtin_cmds[]=
+static struct builtin builtin_cmds[]=
 {
 	{ "evhttpget", &httpget_ops },
 	{ "evntp", &ntp_ops },
@@ -931,18 +1599,446 @@ static struct builtin
 	{ NULL, NULL }
 };
 
+static struct builtin *find_builtin(const char *cmdline)
+{
+	size_t len;
+	struct builtin *bp;
+
+	for (bp= builtin_cmds; bp->cmd != NULL; bp++)
+	{
+		len= strlen(bp->cmd);
+		if (strncmp(cmdline, bp->cmd, len) != 0)
+			continue;
+		if (cmdline[len] != ' ')
+			continue;
+		return bp;
+	}
+	return NULL;
+}
+
+/* Save the command lines that are valid now. Lines that still have to be
+ * initialized were valid when the cache was written.
+ */
+static void spec_cache_update(void)
+{
+	unsigned n;
+	const char **cmdlines;
+	CronLine *line;
+
+	if (!spec_cache_filename)
+		return;
+
+	n= 0;
+	for (line= LineBase; line; line= line->cl_Next)
+		n++;
+	cmdlines= xmalloc((n+1) * sizeof(*cmdlines));
+	n= 0;
+	for (line= LineBase; line; line= line->cl_Next)
+	{
+		if (line->needs_delete)
+			continue;	/* Busy, on its way out */
+		if (line->teststate || line->needs_init)
+			cmdlines[n++]= line->cl_Shell;
+	}
+	spec_cache_save(spec_cache_filename, cmdlines, n);
+	free(cmdlines);
+	spec_cache_close();
+}
+
+/* Checkpoint the schedule of the lines that are scheduled now */
+static void sched_state_update(void)
+{
+	unsigned n;
+	struct sched_state *states, *ss;
+	CronLine *line;
+
+	n= 0;
+	for (line= LineBase; line; line= line->cl_Next)
+		n++;
+	states= xzalloc((n+1) * sizeof(*states));
+	n= 0;
+	for (line= LineBase; line; line= line->cl_Next)
+	{
+		if (line->needs_delete || !line->testops)
+			continue;
+		ss= &states[n++];
+		ss->key= sched_state_key(line->cl_Shell, line->interval,
+			line->start_time);
+		ss->nextcycle= line->nextcycle;
+		ss->lastrun= line->lasttime;
+		ss->distr_sec= line->distr_offset.tv_sec;
+		ss->distr_usec= line->distr_offset.tv_usec;
+		if (line->sched_have_est)
+		{
+			ss->sched_est= line->sched_est;
+			ss->flags |= SCHED_STATE_HAVE_EST;
+		}
+	}
+	sched_state_save(sched_state_filename, states, n);
+	free(states);
+}
+
+static void SaveSchedState(evutil_socket_t __attribute__ ((unused)) fd,
+	short __attribute__ ((unused)) what,
+	void __attribute__ ((unused)) *arg)
+{
+	sched_state_update();
+}
+
+static void print_cmd(FILE *fn, CronLine *line)
+{
+	char c;
+	char *p;
+
+	fprintf(fn, DBQ(cmd) ": \"");
+	for (p= line->cl_Shell; *p; p++)
+	{
+		c= *p;
+		if (c == '"' || c == '\\')
+			fprintf(fn, "\\%c", c);
+		else if (isprint_asciionly((unsigned char)c))
+			fputc(c, fn);
+		else
+			fprintf(fn, "\\u%04x", (unsigned char)c);
+	}
+	fprintf(fn, "\"");
+}
+
+/* Resource accounting. Measurement instances are found from their test
+ * state through a small hash table.
+ */
+static CronLine *acct_hash[ACCT_HASH_SIZE];
+
+static unsigned acct_bucket(void *teststate)
+{
+	return ((uintptr_t)teststate >> 4) % ACCT_HASH_SIZE;
+}
+
+static void acct_link(CronLine *line)
+{
+	unsigned ind;
+
+	ind= acct_bucket(line->teststate);
+	line->acct_next= acct_hash[ind];
+	acct_hash[ind]= line;
+}
+
+static void acct_unlink(CronLine *line)
+{
+	CronLine **lp;
+
+	for (lp= &acct_hash[acct_bucket(line->teststate)]; *lp;
+		lp= &(*lp)->acct_next)
+	{
+		if (*lp == line)
+		{
+			*lp= line->acct_next;
+			break;
+		}
+	}
+	line->acct_next= NULL;
+}
+
+static CronLine *acct_lookup(void *teststate)
+{
+	CronLine *line;
+
+	for (line= acct_hash[acct_bucket(teststate)]; line;
+		line= line->acct_next)
+	{
+		if (line->teststate == teststate)
+			return line;
+	}
+	return NULL;		/* For example a one-off from eooqd */
+}
+
+static uint64_t ts_diff_us(struct timespec *end, struct timespec *start)
+{
+	return (end->tv_sec-start->tv_sec)*(uint64_t)1000000 +
+		(end->tv_nsec-start->tv_nsec)/1000;
+}
+
+void acct_begin(struct acct_mark *mark)
+{
+	clock_gettime(CLOCK_MONOTONIC, &mark->wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &mark->cpu);
+}
+
+static void acct_charge(struct acct_mark *mark, struct acct_counters *counters,
+	struct acct_counters *line_counters, int is_start)
+{
+	uint64_t wall_us, cpu_us;
+	struct acct_mark now;
+
+	acct_begin(&now);
+	wall_us= ts_diff_us(&now.wall, &mark->wall);
+	cpu_us= ts_diff_us(&now.cpu, &mark->cpu);
+
+	if (is_start)
+		counters->starts++;
+	else
+		counters->callbacks++;
+	counters->wall_us += wall_us;
+	counters->cpu_us += cpu_us;
+	if (!line_counters)
+		return;
+	if (is_start)
+		line_counters->starts++;
+	else
+		line_counters->callbacks++;
+	line_counters->wall_us += wall_us;
+	line_counters->cpu_us += cpu_us;
+}
+
+void acct_end(struct acct_mark *mark, struct testops *ops, void *teststate)
+{
+	CronLine *line;
+
+	if (ops->owner)
+		teststate= ops->owner(teststate);
+	line= acct_lookup(teststate);
+	acct_charge(mark, &ops->acct, line ? &line->acct : NULL,
+		0 /*!is_start*/);
+}
+
+void acct_io(struct testops *ops, void *teststate, int dir, ssize_t len)
+{
+	CronLine *line;
+	struct acct_counters *lc;
+
+	if ((!acct_enabled && !sched_counting) || len < 0)
+		return;
+
+	if (ops->owner)
+		teststate= ops->owner(teststate);
+	line= acct_lookup(teststate);
+	if (line && dir == ACCT_OUT)
+		line->sched_sent++;
+	if (!acct_enabled)
+		return;
+
+	lc= line ? &line->acct : NULL;
+	if (dir == ACCT_IN)
+	{
+		ops->acct.pkts_in++;
+		ops->acct.bytes_in += len;
+		if (lc)
+		{
+			lc->pkts_in++;
+			lc->bytes_in += len;
+		}
+	}
+	else
+	{
+		ops->acct.pkts_out++;
+		ops->acct.bytes_out += len;
+		if (lc)
+		{
+			lc->pkts_out++;
+			lc->bytes_out += len;
+		}
+	}
+}
+
+static void acct_print(FILE *fn, struct acct_counters *counters)
+{
+	fprintf(fn, DBQ(starts) ":%llu, " DBQ(callbacks) ":%llu, "
+		DBQ(pkts_in) ":%llu, " DBQ(bytes_in) ":%llu, "
+		DBQ(pkts_out) ":%llu, " DBQ(bytes_out) ":%llu, "
+		DBQ(wall_us) ":%llu, " DBQ(cpu_us) ":%llu",
+		(unsigned long long)counters->starts,
+		(unsigned long long)counters->callbacks,
+		(unsigned long long)counters->pkts_in,
+		(unsigned long long)counters->bytes_in,
+		(unsigned long long)counters->pkts_out,
+		(unsigned long long)counters->bytes_out,
+		(unsigned long long)counters->wall_us,
+		(unsigned long long)counters->cpu_us);
+}
+
+static int acct_idle(struct acct_counters *counters)
+{
+	return counters->starts == 0 && counters->callbacks == 0 &&
+		counters->pkts_in == 0 && counters->pkts_out == 0;
+}
+
+/* Append what was used since the previous report to the stats file and
+ * start counting from zero again.
+ */
+static void ReportStats(evutil_socket_t __attribute__ ((unused)) fd,
+	short __attribute__ ((unused)) what,
+	void __attribute__ ((unused)) *arg)
+{
+	int first;
+	FILE *fn;
+	CronLine *line;
+	struct builtin *bp;
+
+	fn= atlas_fopen_append(stats_filename);
+	if (!fn)
+	{
+		crondlog(LVL8 "unable to append to '%s'", stats_filename);
+		return;
+	}
+	fprintf(fn, "RESULT { ");
+	if (atlas_id)
+		fprintf(fn, DBQ(id) ":" DBQ(%s) ", ", atlas_id);
+	fprintf(fn, "%s, " DBQ(time) ":%ld, " DBQ(interval) ":%d, ",
+		atlas_get_version_json_str(), (long)time(NULL),
+		STATS_INTERVAL);
+
+	fprintf(fn, DBQ(types) ": [");
+	first= 1;
+	for (bp= builtin_cmds; bp->cmd != NULL; bp++)
+	{
+		if (acct_idle(&bp->testops->acct))
+			continue;
+		fprintf(fn, "%s { " DBQ(type) ":" DBQ(%s) ", ",
+			first ? "" : ",", bp->cmd);
+		acct_print(fn, &bp->testops->acct);
+		fprintf(fn, " }");
+		memset(&bp->testops->acct, '\0', sizeof(bp->testops->acct));
+		first= 0;
+	}
+	fprintf(fn, " ], " DBQ(instances) ": [");
+	first= 1;
+	for (line= LineBase; line; line= line->cl_Next)
+	{
+		if (acct_idle(&line->acct))
+			continue;
+		fprintf(fn, "%s { ", first ? "" : ",");
+		print_cmd(fn, line);
+		fprintf(fn, ", ");
+		acct_print(fn, &line->acct);
+		fprintf(fn, " }");
+		memset(&line->acct, '\0', sizeof(line->acct));
+		first= 0;
+	}
+	fprintf(fn, " ], " DBQ(pools) ": ");
+	atlas_pool_print_json(fn);
+	if (pace_rate || pace_dest_rate)
+	{
+		fprintf(fn, ", " DBQ(pacing) ": ");
+		pace_print_json(fn);
+	}
+	fprintf(fn, ", " DBQ(send_timers) ": ");
+	send_timer_print_json(fn);
+	fprintf(fn, " }\n");
+	fclose(fn);
+}
+
 
 #define ATLAS_NARGS	64	/* Max arguments to a built-in command */
 #define ATLAS_ARGSIZE	512	/* Max size of the command line */
 
+/* evtdig switches to one-shot mode when it gets a done callback and condmv
+ * is finished when start returns. Neither is counted as running.
+ */
+static int sched_tracks(struct testops *ops)
+{
+	return ops != &tdig_ops && ops != &condmv_ops;
+}
+
+static void sched_done(void *teststate, int error UNUSED_PARAM)
+{
+	CronLine *line;
+
+	line= acct_lookup(teststate);
+	if (line)
+		line->sched_running= 0;
+}
+
+/* Check the -j and -p limits. A start that is held back too long goes
+ * ahead anyway, the limits should spread load, not skip measurements.
+ */
+static int sched_may_start(CronLine *line, time_t now)
+{
+	unsigned running;
+	CronLine *l;
+
+	if (now > line->nexttime + SCHED_MAX_DEFER)
+	{
+		crondlog(LVL7 "sched: starting '%s' %d seconds late",
+			line->cl_Shell, (int)(now - line->nexttime));
+		return 1;
+	}
+
+	if (sched_max_running)
+	{
+		/* A run that never reported done is forgotten after
+		 * an interval.
+		 */
+		running= 0;
+		for (l= LineBase; l; l= l->cl_Next)
+		{
+			if (l->sched_running &&
+				now < l->sched_running + (time_t)l->interval)
+			{
+				running++;
+			}
+		}
+		if (running >= sched_max_running)
+		{
+			crondlog(LVL7 "sched: deferring '%s', %u running",
+				line->cl_Shell, running);
+			return 0;
+		}
+	}
+
+	if (sched_pkt_budget)
+	{
+		if (now != sched_sec)
+		{
+			sched_sec= now;
+			sched_sec_pkts= 0;
+		}
+		if (sched_sec_pkts > 0 &&
+			sched_sec_pkts + sched_est(line) > sched_pkt_budget)
+		{
+			crondlog(
+			LVL7 "sched: deferring '%s', %u packets this second",
+				line->cl_Shell, sched_sec_pkts);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void sched_started(CronLine *line, time_t now)
+{
+	/* What was sent since the previous start is the best guess
+	 * for the next run.
+	 */
+	if (line->sched_ran)
+	{
+		line->sched_est= line->sched_have_est ?
+			(3*line->sched_est + line->sched_sent + 2)/4 :
+			line->sched_sent;
+		line->sched_have_est= 1;
+	}
+	line->sched_ran= 1;
+	line->sched_sent= 0;
+
+	if (sched_max_running && sched_tracks(line->testops))
+		line->sched_running= now;
+	if (sched_pkt_budget)
+	{
+		if (now != sched_sec)
+		{
+			sched_sec= now;
+			sched_sec_pkts= 0;
+		}
+		sched_sec_pkts += sched_est(line);
+	}
+}
+
 static void atlas_init(CronLine *line)
 {
-	char c;
 	int i, argc;
 	size_t len;
 	char *cp, *ncp;
 	struct builtin *bp;
-	char *cmdline, *p;
+	char *cmdline;
 	const char *reason;
 	void *state;
 	FILE *fn;
@@ -954,16 +2050,8 @@ static void atlas_init(CronLine *line)
 
 	state= NULL;
 	reason= NULL;
-	for (bp= builtin_cmds; bp->cmd != NULL; bp++)
-	{
-		len= strlen(bp->cmd);
-		if (strncmp(cmdline, bp->cmd, len) != 0)
-			continue;
-		if (cmdline[len] != ' ')
-			continue;
-		break;
-	}
-	if (bp->cmd == NULL)
+	bp= find_builtin(cmdline);
+	if (bp == NULL)
 	{
 		reason="command not found";
 		goto error;
@@ -1051,15 +2139,19 @@ static void atlas_init(CronLine *line)
 	for (i= 0; i<argc; i++)
 		crondlog(LVL7 "atlas_run: argv[%d] = '%s'", i, argv[i]);
 
-	state= bp->testops->init(argc, argv, 0);
+	state= bp->testops->init(argc, argv,
+		(sched_max_running && sched_tracks(bp->testops)) ?
+		sched_done : 0);
 	crondlog(LVL7 "init returned %p for '%s'", state, line->cl_Shell);
 	line->teststate= state;
 	line->testops= bp->testops;
+	if (state)
+		acct_link(line);
 
 error:
 	if (state == NULL && out_filename)
 	{
-		fn= fopen(out_filename, "a");
+		fn= atlas_fopen_append(out_filename);
 		if (!fn)
 			crondlog(DIE9 "unable to append to '%s'", out_filename);
 		fprintf(fn, "RESULT { ");
@@ -1069,18 +2161,7 @@ error:
 			atlas_get_version_json_str(), (long)time(NULL));
 		if (reason)
 			fprintf(fn, DBQ(reason) ":" DBQ(%s) ", ", reason);
-		fprintf(fn, DBQ(cmd) ": \"");
-		for (p= line->cl_Shell; *p; p++)
-		{
-			c= *p;
-			if (c == '"' || c == '\\')
-				fprintf(fn, "\\%c", c);
-			else if (isprint_asciionly((unsigned char)c))
-				fputc(c, fn);
-			else
-				fprintf(fn, "\\u%04x", (unsigned char)c);
-		}
-		fprintf(fn, "\"");
+		print_cmd(fn, line);
 		fprintf(fn, " }\n");
 		fclose(fn);
 	}
@@ -1243,16 +2324,18 @@ static void EndJob(const char *user, CronLine *line)
 static void RunJob(evutil_socket_t __attribute__ ((unused)) fd,
 	short __attribute__ ((unused)) what, void *arg)
 {
-	char c;
-	char *p;
 	CronLine *line;
-	struct timeval now;
+	struct timeval now, tv;
+	struct acct_mark mark;
 	FILE *fn;
 
 	line= arg;
 
 	crondlog(LVL7 "RunJob for %p, '%s'\n", arg, line->cl_Shell);
 
+	if (sched_slots)
+		sched_release(line);	/* The second has come */
+
 	if (line->needs_delete)
 	{
 		crondlog(LVL7 "RunJob: needs delete\n");
@@ -1267,7 +2350,7 @@ static void RunJob(evutil_socket_t __attribute__ ((unused)) fd,
 	{
 		if (out_filename)
 		{
-			fn= fopen(out_filename, "a");
+			fn= atlas_fopen_append(out_filename);
 			if (!fn)
 			{
 				crondlog(DIE9 "unable to append to '%s'",
@@ -1284,18 +2367,7 @@ static void RunJob(evutil_socket_t __attribute__ ((unused)) fd,
 				(int)line->waittime, (int)line->debug_cycle,
 				(int)line->debug_generated);
 
-			fprintf(fn, DBQ(cmd) ": \"");
-			for (p= line->cl_Shell; *p; p++)
-			{
-				c= *p;
-				if (c == '"' || c == '\\')
-					fprintf(fn, "\\%c", c);
-				else if (isprint_asciionly((unsigned char)c))
-					fputc(c, fn);
-				else
-					fprintf(fn, "\\u%04x", (unsigned char)c);
-			}
-			fprintf(fn, "\"");
+			print_cmd(fn, line);
 			fprintf(fn, " }\n");
 			fclose(fn);
 		}
@@ -1314,6 +2386,11 @@ static void RunJob(evutil_socket_t __attribute__ ((unused)) fd,
 		return;			/* This job has expired */
 	}
 
+	if (line->needs_init)
+	{
+		line->needs_init= 0;
+		atlas_init(line);
+	}
 	if (!line->teststate)
 	{
 		crondlog(LVL8 "not starting cmd '%s' (not init)\n",
@@ -1321,7 +2398,30 @@ static void RunJob(evutil_socket_t __attribute__ ((unused)) fd,
 		return;
 	}
 
-	line->testops->start(line->teststate);
+	if ((sched_max_running || sched_pkt_budget) &&
+		!sched_may_start(line, now.tv_sec))
+	{
+		/* Try again in a second, at a random point to avoid
+		 * all waiting lines starting together.
+		 */
+		tv.tv_sec= 1;
+		tv.tv_usec= random() % 1000000;
+		event_add(&line->event, &tv);
+		return;
+	}
+	if (sched_counting || sched_max_running)
+		sched_started(line, now.tv_sec);
+	line->lasttime= now.tv_sec;
+
+	if (acct_enabled)
+	{
+		acct_begin(&mark);
+		line->testops->start(line->teststate);
+		acct_charge(&mark, &line->testops->acct, &line->acct,
+			1 /*is_start*/);
+	}
+	else
+		line->testops->start(line->teststate);
 
 	line->nextcycle++;
 	if (line->start_time + line->nextcycle*line->interval < now.tv_sec)
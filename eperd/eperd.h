@@ -39,14 +39,176 @@ extern struct globals G;
 /* level >= 20 is "error" */
 #define ERR20 "\x14"
 
+/* Resource accounting, per measurement type and per measurement instance.
+ * Only collected when eperd is started with a stats file.
+ */
+struct acct_counters
+{
+	uint64_t starts;
+	uint64_t callbacks;
+	uint64_t pkts_in;
+	uint64_t bytes_in;
+	uint64_t pkts_out;
+	uint64_t bytes_out;
+	uint64_t wall_us;	/* Time spent in start and callbacks */
+	uint64_t cpu_us;
+};
+
+struct acct_mark
+{
+	struct timespec wall;
+	struct timespec cpu;
+};
+
+#define ACCT_IN		0
+#define ACCT_OUT	1
+
 struct testops
 {
 	void *(*init)(int argc, char *argv[],
 		void (*done)(void *teststate, int error));
 	void (*start)(void *teststate);
 	int (*delete)(void *teststate);
+
+	/* Optional. Maps an object that a measurement creates for itself,
+	 * such as a ping target or a traceroute lane, to the state returned
+	 * by init. Resource use is charged to that state.
+	 */
+	void *(*owner)(void *teststate);
+
+	struct acct_counters acct;
 };
 
+extern int acct_enabled;
+
+void acct_begin(struct acct_mark *mark);
+void acct_end(struct acct_mark *mark, struct testops *ops, void *teststate);
+void acct_io(struct testops *ops, void *teststate, int dir, ssize_t len);
+
+/* Define 'name' as a libevent callback that calls 'cb' and charges the
+ * time spent to 'ops' and to the measurement instance 'arg'. 'arg' has to
+ * be the state returned by the init function of 'ops', or an object that
+ * the owner function of 'ops' maps to it.
+ */
+#define ACCT_CALLBACK(name, cb, ops)					\
+static void name(evutil_socket_t fd, short what, void *arg)		\
+{									\
+	struct acct_mark mark;						\
+									\
+	if (!acct_enabled)						\
+	{								\
+		cb(fd, what, arg);					\
+		return;							\
+	}								\
+	acct_begin(&mark);						\
+	cb(fd, what, arg);						\
+	acct_end(&mark, &(ops), arg);					\
+}
+
+/* Timers that are armed with the same timeout over and over again, such
+ * as per-packet no-reply timers, should use common_timer_add. Those go on
+ * a libevent common timeout queue (O(1) add and delete) instead of the
+ * heap. 'ev' has to be a timer without EV_PERSIST or have a fixed
+ * timeout. common_timeout returns the value to pass to event_add.
+ */
+struct event;
+struct event_base;
+const struct timeval *common_timeout(struct event_base *base,
+	const struct timeval *tv);
+int common_timer_add(struct event *ev, const struct timeval *tv);
+
+/* Timers for sending packets at planned times. Due times are absolute,
+ * on the gettime_mono clock. All timers share a single timerfd that is
+ * set to the earliest due time, the timers that are due when it goes off
+ * are run together in order. Periodic sends use send_timer_add_after with
+ * the previous planned time, so the send times do not drift. 'due' is
+ * still valid in the callback, the send can compare it with the time it
+ * actually went.
+ */
+struct send_timer
+{
+	struct send_timer *next;
+	struct timespec due;
+	unsigned gen;
+	char pending;
+	void (*cb)(void *ref);
+	void *ref;
+};
+
+void send_timer_assign(struct send_timer *st, struct event_base *base,
+	void (*cb)(void *ref), void *ref);
+void send_timer_add(struct send_timer *st, const struct timespec *due);
+void send_timer_add_after(struct send_timer *st, const struct timespec *from,
+	unsigned us);
+void send_timer_del(struct send_timer *st);
+void send_timer_print_json(FILE *fh);
+
+/* Pacing of the packets sent by all measurements. There is a global token
+ * bucket and one per destination (hashed, so a few destinations may share
+ * one). A measurement calls pace_send before it sends a packet, with an
+ * entry that is part of its state and starts out zeroed. The return value
+ * is 1 if the packet can go now. It is 0 if the send has to wait, 'cb' is
+ * called with 'ref' when it can go. The callback should retry the send,
+ * pace_send then returns 1. It is -1 (errno ENOBUFS) if the packet should
+ * be dropped, because too many are waiting or it waited too long.
+ * pace_cancel has to be called before the entry is freed.
+ * Without pace_init every send can go at once.
+ */
+struct sockaddr;
+struct pace_entry
+{
+	struct pace_entry *next;
+	char state;
+	unsigned dest;
+	double since;
+	void (*cb)(void *ref);
+	void *ref;
+};
+
+void pace_init(struct event_base *base, unsigned rate, unsigned dest_rate);
+int pace_send(struct pace_entry *pe, const struct sockaddr *dst,
+	void (*cb)(void *ref), void *ref);
+void pace_cancel(struct pace_entry *pe);
+void pace_print_json(FILE *fh);
+
+/* Cache of command lines that initialized fine, so a restart does not have
+ * to parse every line of a large crontab before it can schedule them.
+ * spec_cache_open maps the cache file, spec_cache_find returns 1 for a
+ * command line that is in it. spec_cache_save writes the command lines
+ * that are valid now (if that changed). A cache written by another binary
+ * is ignored.
+ */
+void spec_cache_open(const char *filename);
+int spec_cache_find(const char *cmdline);
+void spec_cache_close(void);
+void spec_cache_save(const char *filename, const char **cmdlines, unsigned n);
+
+/* Checkpoint of the schedule of each line, keyed by sched_state_key. On
+ * startup sched_state_load reads the previous checkpoint, sched_state_find
+ * returns the entry for a line (or NULL) until sched_state_free is called.
+ * sched_state_save sorts 'states' and replaces the file atomically, unless
+ * nothing changed since the previous save.
+ */
+struct sched_state
+{
+	uint64_t key;
+	int64_t nextcycle;
+	int64_t lastrun;	/* Start of the last run, 0 if none */
+	int32_t distr_sec;	/* Offset of the next run */
+	int32_t distr_usec;
+	uint32_t sched_est;	/* Packets per run */
+	uint32_t flags;
+};
+#define SCHED_STATE_HAVE_EST	1
+
+uint64_t sched_state_key(const char *cmdline, unsigned interval,
+	time_t start_time);
+void sched_state_load(const char *filename);
+const struct sched_state *sched_state_find(uint64_t key);
+void sched_state_free(void);
+void sched_state_save(const char *filename, struct sched_state *states,
+	unsigned n);
+
 extern struct testops condmv_ops;
 extern struct testops httpget_ops;
 extern struct testops ntp_ops;
@@ -28,7 +28,8 @@
 //usage:	"\n\t[--store-headers <bytes>] [--timeout <value>] "
 //usage:	"[--user-agent <string>]\n\t[--etim] [--etim] [-I interface] "
 //usage:	"[-A <atlas id>] [-b <bundle id>]\n\t[-O <file>] "
-//usage:	"[-R <file>] [-W <file>]"
+//usage:	"[-R <file>] [-W <file>] [--pipeline]\n\t[--digest] "
+//usage:	"[--digest-checkpoints <offset,...>] <url> [<url> ...]"
 //usage:#define evhttpget_full_usage "\n\n"
 //usage:     "\nOptions:"
 //usage:     "\n       -a --all                Report on all addresses"
@@ -47,6 +48,9 @@
 //usage:     "\n       --user-agent <string>   User agent header"
 //usage:     "\n       --etim                  Extended timings"
 //usage:     "\n       --eetim                 Extended extended timings"
+//usage:     "\n       --pipeline              Send all requests at once (multiple urls)"
+//usage:     "\n       --digest                SHA-256 of the body"
+//usage:     "\n       --digest-checkpoints <list> Also of the first <offset> bytes"
 //usage:     "\n       -0                      HTTP/1.0"
 //usage:     "\n       -1                      HTTP/1.1"
 //usage:     "\n       -I <interface>          Outgoing interface"
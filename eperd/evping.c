@@ -14,10 +14,10 @@
 //kbuild:lib-$(CONFIG_EVPING) += evping.o
 
 //usage:#define evping_trivial_usage
-//usage:	"-[46ep] [-c <count>] [-s <size>] [-A <Atlas ID>] "
+//usage:	"-[46epCL] [-c <count>] [-s <size>] [-A <Atlas ID>] "
 //usage:	"[-B <bundle ID>\n\t[-O <output file>] [-i <interval>] "
 //usage:	"[-I <interface>] [-R <response in>]\n\t[-W <response out>] "
-//usage:	"<target>"
+//usage:	"[-T <targets file>] [-G <window>] <target> ..."
 //usage:#define evping_full_usage "\n\n"
 //usage:       "\nOptions:"
 //usage:       "\n     -4              IPv4"
@@ -33,6 +33,10 @@
 //usage:       "\n     -I <interface>  Outgoing interface"
 //usage:       "\n     -R <response in> Read response from a file"
 //usage:       "\n     -W <response out> Write responses to a file"
+//usage:       "\n     -T <file>       Read more targets from a file"
+//usage:       "\n     -C              One combined result for all targets"
+//usage:       "\n     -L              Report how late each packet was sent"
+//usage:       "\n     -G <window>     Only report a summary every <window> seconds"
 //usage:       "\n"
 
 #include "libbb.h"
@@ -43,8 +47,10 @@
 
 #include "eperd.h"
 
-static void done(void *state UNUSED_PARAM, int error)
+static void done(void *state, int error)
 {
+	/* Flushes a pending summary */
+	ping_ops.delete(state);
 	exit(error);
 }
 
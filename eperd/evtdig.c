@@ -178,6 +178,7 @@
 #include <math.h>
 #include <assert.h>
 
+#include "atlas_pool.h"
 #include "eperd.h" 
 #include "resolv.h"
 #include "readresolv.h"
@@ -448,6 +449,8 @@ struct tdig_base {
 };
 
 static struct tdig_base *tdig_base;
+static struct atlas_pool *qry_pool;
+static struct atlas_pool *outbuff_pool;
 
 /* How to keep track of each user query to send dns query */
 struct query_state {
@@ -521,6 +524,7 @@ struct query_state {
 	struct event nsm_timer;       /* Timer to send UDP */
 	struct event next_qry_timer;  /* Timer event to start next query */
 	struct event done_qry_timer;  /* Timer event to call done */
+	struct pace_entry pace;
 
 	time_t xmit_time;	
 	struct timespec xmit_time_ts;	
@@ -765,6 +769,8 @@ static void noreply_callback(int unused  UNUSED_PARAM, const short event UNUSED_
 static void free_qry_inst(struct query_state *qry);
 static void ready_callback (int unused, const short event, void * arg);
 
+ACCT_CALLBACK(acct_ready_callback, ready_callback, tdig_ops)
+
 u_int32_t get32b (unsigned char *p);
 void ldns_write_uint16(void *dst, uint16_t data);
 uint16_t ldns_read_uint16(const void *src);
@@ -1201,6 +1207,14 @@ static int mk_dns_buff(struct query_state *qry,  u_char *packet,
 } 
 
 /* Attempt to transmit a UDP DNS Request to a server. TCP is else where */
+static void tdig_send_query_callback(int unused, const short event,
+	void *h);
+
+static void tdig_send_query_paced(void *ref)
+{
+	tdig_send_query_callback(0, 0, ref);
+}
+
 static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event UNUSED_PARAM, void *h)
 {
 	int r, fd, on;
@@ -1216,7 +1230,32 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 	evtimer_del(&qry->noreply_timer);
 
 	qry->qst = STATUS_SEND;
-	outbuff = xzalloc(MAX_DNS_OUT_BUF_SIZE);
+
+	r= pace_send(&qry->pace, qry->res->ai_addr,
+		tdig_send_query_paced, qry);
+	if (r == 0)
+		return;		/* Comes back through tdig_send_query_paced */
+	if (r == -1)
+	{
+		/* Dropped by the pacer */
+		base->sendfail++;
+		snprintf(line, DEFAULT_LINE_LENGTH,
+			"%s \"senderror\" : \"%s\"",
+			qry->err.size ? ", " : "", strerror(errno));
+		buf_add(&qry->err, line, strlen(line));
+
+		/* Trigger printing of dst_addr */
+		qry->ressent = qry->res;
+
+		printReply (qry, 0, NULL);
+		return;
+	}
+	if (!outbuff_pool)
+	{
+		outbuff_pool= atlas_pool_new("tdig_outbuff",
+			MAX_DNS_OUT_BUF_SIZE);
+	}
+	outbuff= atlas_pool_zalloc(outbuff_pool);
 	bzero(outbuff, MAX_DNS_OUT_BUF_SIZE);
 	//AA delete qry->outbuff = outbuff;
 	qry->xmit_time= atlas_time();
@@ -1248,7 +1287,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 			snprintf(line, DEFAULT_LINE_LENGTH, "%s \"socket\" : \"socket failed %s\"", qry->err.size ? ", " : "", strerror(errno));
 			buf_add(&qry->err, line, strlen(line));
 			printReply (qry, 0, NULL);
-			free (outbuff);
+			atlas_pool_free(outbuff_pool, outbuff);
 			outbuff = NULL;
 			return;
 		} 
@@ -1277,7 +1316,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 		evutil_make_socket_nonblocking(fd); 
 
 		event_assign(&qry->event, tdig_base->event_base, fd, 
-			EV_READ | EV_PERSIST, ready_callback, qry);
+			EV_READ | EV_PERSIST, acct_ready_callback, qry);
 		if (!qry->response_in)
 			event_add(&qry->event, NULL);
 
@@ -1290,7 +1329,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 					qry->err.size ? ", " : "");
 				buf_add(&qry->err, line, strlen(line));
 				printReply (qry, 0, NULL);
-				free (outbuff);
+				atlas_pool_free(outbuff_pool, outbuff);
 				outbuff = NULL;
 				return;
 			}
@@ -1302,7 +1341,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 				qry->res->ai_addrlen);
 			if (r == -1)
 			{
-				free (outbuff);
+				atlas_pool_free(outbuff_pool, outbuff);
 				outbuff = NULL;
 				snprintf(line, DEFAULT_LINE_LENGTH,
 				"%s \"reason\" : \"address not allowed\"",
@@ -1342,7 +1381,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 					strerror(errno));
 				buf_add(&qry->err, line, strlen(line));
 				printReply (qry, 0, NULL);
-				free (outbuff);
+				atlas_pool_free(outbuff_pool, outbuff);
 				outbuff = NULL;
 				return;
 		}
@@ -1387,7 +1426,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 		if (r == -1)
 		{
 			/* Can't construct a DNS query */
-			free (outbuff);
+			atlas_pool_free(outbuff_pool, outbuff);
 			outbuff = NULL;
 			snprintf(line, DEFAULT_LINE_LENGTH,
 				"%s \"err\" : \"unable to format DNS query\"",
@@ -1405,6 +1444,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 		{
 			nsent = send(qry->udp_fd, outbuff,qry->pktsize,
 				MSG_DONTWAIT);
+			acct_io(&tdig_ops, qry, ACCT_OUT, nsent);
 		}
 		qry->ressent = qry->res;
 
@@ -1418,7 +1458,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 			msecstotv(qry->opt_timeout, &tv_noreply);
 			if (!qry->response_in)
 			{
-				evtimer_add(&qry->noreply_timer, &tv_noreply);
+				common_timer_add(&qry->noreply_timer, &tv_noreply);
 			}
 			if(qry->opt_qbuf) {
 				buf_init(&qry->qbuf, -1);
@@ -1434,7 +1474,7 @@ static void tdig_send_query_callback(int unused UNUSED_PARAM, const short event
 			buf_add(&qry->err, line, strlen(line));
 		}
 	} while ((qry->res = qry->res->ai_next) != NULL);
-	free (outbuff);
+	atlas_pool_free(outbuff_pool, outbuff);
 	outbuff = NULL;
 	if(err) {
 		printReply (qry, 0, NULL);
@@ -1621,7 +1661,12 @@ static void tcp_connected(struct tu_env *env, struct bufferevent *bev)
 	}
 
 	qry->bev_tcp =  bev;
-	outbuff = xzalloc(MAX_DNS_OUT_BUF_SIZE);
+	if (!outbuff_pool)
+	{
+		outbuff_pool= atlas_pool_new("tdig_outbuff",
+			MAX_DNS_OUT_BUF_SIZE);
+	}
+	outbuff= atlas_pool_zalloc(outbuff_pool);
 	bzero(outbuff, MAX_DNS_OUT_BUF_SIZE);
 	mk_dns_buff(qry, outbuff, MAX_DNS_OUT_BUF_SIZE);
 	payload_len = (uint16_t) qry->pktsize;
@@ -1641,7 +1686,7 @@ static void tcp_connected(struct tu_env *env, struct bufferevent *bev)
 		buf_init(&qry->qbuf, -1);
 		buf_add_b64(&qry->qbuf, outbuff, qry->pktsize, 0);
 	}
-	free(outbuff);
+	atlas_pool_free(outbuff_pool, outbuff);
 	free(wire);
 
 	gettime_mono(&qry->qxmit_time_ts);
@@ -2105,6 +2150,7 @@ static void ready_callback (int unused UNUSED_PARAM, const short event UNUSED_PA
 		qry->base->recvfail++;
 		return ;
 	}
+	acct_io(&tdig_ops, qry, ACCT_IN, nrecv);
 	if (qry->response_out)
 	{
 		write_response(qry->resp_file, RESP_PACKET, nrecv,
@@ -2236,7 +2282,9 @@ static void *tdig_init(int argc, char *argv[],
 
 	tdig_base->done = done;
 
-	qry=xzalloc(sizeof(*qry));
+	if (!qry_pool)
+		qry_pool= atlas_pool_new("tdig", sizeof(*qry));
+	qry= atlas_pool_zalloc(qry_pool);
 
 	// initialize per query state variables;
 	qry->qtype = T_TXT; /* TEXT */
@@ -3065,7 +3113,7 @@ static void tdig_stats(int unusg_statsed UNUSED_PARAM, const short event UNUSED_
 	}
 
 	if (qry_h->out_filename) {
-		fh= fopen(qry_h->out_filename, "a");
+		fh= atlas_fopen_append(qry_h->out_filename);
 		if (!fh) {
 			crondlog(LVL8 "evtdig: unable to append to '%s'", qry_h->out_filename);
 			return;
@@ -3074,7 +3122,9 @@ static void tdig_stats(int unusg_statsed UNUSED_PARAM, const short event UNUSED_
 	else
 		fh = stdout;  
 
-	qry=xzalloc(sizeof(*qry));
+	if (!qry_pool)
+		qry_pool= atlas_pool_new("tdig", sizeof(*qry));
+	qry= atlas_pool_zalloc(qry_pool);
 
 	AS("RESULT { ");
 	JS(id, "9201" ); 
@@ -3099,7 +3149,7 @@ static void tdig_stats(int unusg_statsed UNUSED_PARAM, const short event UNUSED_
 		fclose (fh);
 
 	buf_cleanup(&qry->result);
-	free(qry);
+	atlas_pool_free(qry_pool, qry);
 
 	interval.tv_sec =  DEFAULT_STATS_REPORT_INTERVEL;
 	interval.tv_usec =  0;
@@ -3320,6 +3370,7 @@ static int tdig_delete(void *state)
 	/* Delete timers */
 	evtimer_del(&qry->noreply_timer);
 	evtimer_del(&qry->nsm_timer);
+	pace_cancel(&qry->pace);
 
 	if((qry->next == qry->prev) && (qry->next == qry)) {
 		qry->base->qry_head =  NULL;
@@ -3372,7 +3423,7 @@ static int tdig_delete(void *state)
 	}
 	if(qry->base) 
 		qry->base->activeqry--;
-	free(qry);
+	atlas_pool_free(qry_pool, qry);
 	qry  = NULL;
 	return 1;
 } 
@@ -3382,7 +3433,7 @@ void printErrorQuick (struct query_state *qry)
 	FILE *fh; 
 	if (qry->out_filename)
 	{
-		fh= fopen(qry->out_filename, "a");
+		fh= atlas_fopen_append(qry->out_filename);
 		if (!fh){
 			crondlog(LVL8 "evtdig: unable to append to '%s'",
 					qry->out_filename);
@@ -3748,7 +3799,7 @@ truncated:
 	if(write_out && qry->result.size){
 		if (qry->out_filename)
 		{
-			fh= fopen(qry->out_filename, "a");
+			fh= atlas_fopen_append(qry->out_filename);
 			if (!fh) {
 				crondlog(LVL8 "evtdig: unable to append to '%s'",
 						qry->out_filename);
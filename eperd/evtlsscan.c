@@ -38,6 +38,7 @@
 #include <assert.h>
 
 #include "eperd.h"
+#include "tlshello.h"
 
 #include <event2/event.h>
 #include <event2/event_struct.h>
@@ -56,6 +57,8 @@
 
 #define DEFAULT_LINE_LENGTH 1024
 #define DEFAULT_NOREPLY_TIMEOUT 5000
+#define DEFAULT_MAX_CON 8
+#define MAX_MAX_CON 64
 #define O_RETRY  200
 
 #define STATUS_FREE 0
@@ -70,9 +73,28 @@ enum readstate { READ_FIRST, READ_STATUS, READ_HEADER, READ_BODY, READ_SIMPLE,
 enum writestate { WRITE_FIRST, WRITE_HEADER, WRITE_POST_HEADER,
 	WRITE_POST_FILE, WRITE_POST_FOOTER, WRITE_DONE };
 
+#define NR_TLS_VERSIONS 5
+
 /* struct common for all quries */
 struct tls_base {
 	struct event_base *event_base;
+	SSL_CTX *ssl_ctx[NR_TLS_VERSIONS]; /* one per tls_versions[] entry */
+};
+
+static const struct tls_version {
+	int sslv;
+	const char *str;
+	const SSL_METHOD *(*method)(void);
+} tls_versions[NR_TLS_VERSIONS] = {
+#ifndef OPENSSL_NO_SSL3_METHOD
+	{ SSL3_VERSION, SSL_TXT_SSLV3, SSLv3_client_method },
+#else
+	{ SSL3_VERSION, SSL_TXT_SSLV3, NULL },
+#endif
+	{ TLS1_VERSION, SSL_TXT_TLSV1, TLSv1_client_method },
+	{ TLS1_1_VERSION, SSL_TXT_TLSV1_1, TLSv1_1_client_method },
+	{ TLS1_2_VERSION, SSL_TXT_TLSV1_2, TLSv1_2_client_method },
+	{ 0, "TLSv1/SSL2/SSL3", SSLv23_client_method },
 };
 
 static void crondlog_aa(const char *ctl, char *fmt, ...);
@@ -134,6 +156,12 @@ struct tls_state {
 	void (*done)(void *state); /* call back when all queries are done */
 };
 
+/* a cipher to probe with a bare ClientHello */
+struct tls_probe {
+	uint8_t id[2];
+	const char *name;
+};
+
 struct cert_fp {
 	unsigned char fp[EVP_MAX_MD_SIZE];
 	struct cert_fp *next;
@@ -172,6 +200,11 @@ struct tls_qry {
 	bool is_c; 	/* is children? same destination (IP) with different ssl option */
 	int active_c; /* count of active children. delete parent when zero */ 
 	struct tls_qry *p ; /* parent query to same IP with all ciphers */
+	struct tls_probe *probes; /* parent: ciphers to probe */
+	int n_probes;
+	int next_probe;
+	int running; /* parent: probes in flight, at most opt_max_con */
+	struct tls_probe *probe; /* child: the cipher it offers */
 	bool tls_incomplete;
 	enum readstate readstate; 	/* httpget */
 	enum writestate writestate; 	/* httpget */
@@ -186,6 +219,7 @@ static void event_cb(struct bufferevent *bev, short events, void *ptr);
 static void write_cb(struct bufferevent *bev, void *ptr);
 static void http_read_cb(struct bufferevent *bev UNUSED_PARAM, void *ptr);
 static void timeout_cb(int unused  UNUSED_PARAM, const short event UNUSED_PARAM, void *h);
+static void print_tls_resp(struct tls_qry *qry, bool is_err);
 
 static struct tls_base *tls_base = NULL;
 static char line[(DEFAULT_LINE_LENGTH+1)];
@@ -238,10 +272,7 @@ static void free_child_cb(int unused  UNUSED_PARAM, const short event UNUSED_PAR
 		qry->bev = NULL;
 	}
 
-	if(qry->ssl_ctx !=  NULL) {
-		SSL_CTX_free(qry->ssl_ctx);
-		qry->ssl_ctx = NULL;
-	}
+	qry->ssl_ctx = NULL; /* shared, see tls_ctx_get() */
 }
 
 /* Initialize a struct timeval by converting milliseconds */
@@ -251,40 +282,30 @@ static void msecstotv(time_t msecs, struct timeval *tv)
 	tv->tv_usec = msecs % 1000 * 1000;
 }
 
-static bool tls_inst_start (struct tls_qry *qry, const char *cipher_q)
+/* One SSL_CTX per protocol version, shared by all queries. Only the first
+ * query to an address does a full handshake, the other ciphers are probed
+ * without OpenSSL, see probe_ciphers().
+ */
+static SSL_CTX *tls_ctx_get(int sslv, const char **sslv_strp)
 {
-	/* OpenSSL is initialized, SSL_library_init() should be called already */
-
-	/* 
-	 ssl_ctx are not shared between quries. It could but not sure how to 
-	 set structures with specific versions and algorithms. Instead using
-	 one ctx per query.
-	 */
+	int i;
 
-	switch(qry->sslv)
-	{
-		case SSL3_VERSION:
-			qry->ssl_ctx = SSL_CTX_new(SSLv3_client_method());
-			qry->sslv_str = SSL_TXT_SSLV3;
+	for (i = 0; i < NR_TLS_VERSIONS - 1; i++) {
+		if (tls_versions[i].sslv == sslv)
 			break;
-		case TLS1_VERSION:
-			qry->ssl_ctx = SSL_CTX_new(TLSv1_client_method());
-			qry->sslv_str = SSL_TXT_TLSV1;
-			break;
-		case TLS1_1_VERSION:
-			qry->ssl_ctx = SSL_CTX_new(TLSv1_1_client_method());
-			qry->sslv_str = SSL_TXT_TLSV1_1;
-			break;
-		case TLS1_2_VERSION:
-			qry->ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-			qry->sslv_str = SSL_TXT_TLSV1_2;
-			break;
-		default:
-			qry->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-			qry->sslv_str = "TLSv1/SSL2/SSL3";
-			break;
-
 	}
+	*sslv_strp = tls_versions[i].str;
+
+	if (tls_base->ssl_ctx[i] == NULL && tls_versions[i].method != NULL)
+		tls_base->ssl_ctx[i] = SSL_CTX_new(tls_versions[i].method());
+	return tls_base->ssl_ctx[i];
+}
+
+static bool tls_inst_start (struct tls_qry *qry, const char *cipher_q)
+{
+	/* OpenSSL is initialized, SSL_library_init() should be called already */
+
+	qry->ssl_ctx = tls_ctx_get(qry->sslv, &qry->sslv_str);
 
 	qry->cipher_q =  cipher_q;
 
@@ -321,6 +342,7 @@ static bool tls_inst_start (struct tls_qry *qry, const char *cipher_q)
 
 	//bufferevent_openssl_set_allow_dirty_shutdown(qry->bev, 1);
 	bufferevent_setcb(qry->bev, http_read_cb, write_cb, event_cb, qry);
+	bufferevent_enable(qry->bev, EV_READ);
 
 	{
 		void *ptr = NULL;
@@ -356,58 +378,239 @@ static bool tls_inst_start (struct tls_qry *qry, const char *cipher_q)
 	}
 	return FALSE;
 }
-static void ssl_c_init(struct tls_qry *qry)
+static void probe_start(struct tls_qry *qry);
+
+/* Called exactly once per probe, 'accepted' when the server picked the
+ * offered cipher.
+ */
+static void probe_done(struct tls_qry *cqry, bool accepted)
 {
-	int i;
-	const char *p;
-	SSL *ssl = SSL_new(qry->ssl_ctx); /* this is a local one */
+	struct tls_qry *qry = cqry->p;
+
+	evtimer_del(&cqry->timeout_ev);
+	if (cqry->bev != NULL) {
+		bufferevent_free(cqry->bev);
+		cqry->bev = NULL;
+	}
+
+	crondlog_aa(LVL7, "%s dst %s active = %d active_c = %d %s %s %s",
+			__func__, cqry->addrstr, cqry->ui->active,
+			qry->active_c, cqry->sslv_str, cqry->cipher_q,
+			accepted ? "accepted" : "rejected");
+
+	cqry->tls_incomplete = !accepted;
+	qry->running--;
+	print_tls_resp(cqry, !accepted);
+
+	/* print_tls_resp may schedule this, nothing to free for a probe */
+	evtimer_del(&cqry->free_child_ev);
+	if (cqry->err.size)
+		buf_cleanup(&cqry->err);
+	free(cqry);
+
+	if (qry->next_probe < qry->n_probes)
+		probe_start(qry);
+	else if (qry->running == 0) {
+		free(qry->probes);
+		qry->probes = NULL;
+		qry->n_probes = qry->next_probe = 0;
+	}
+}
 
-	if (ssl == NULL)
+static void probe_error(struct tls_qry *cqry, const char *key,
+		const char *err)
+{
+	snprintf(line, DEFAULT_LINE_LENGTH, "%s \"%s\" : \"%s\"",
+			cqry->err.size ? ", " : "", key, err);
+	buf_add(&cqry->err, line, strlen(line));
+}
+
+static void probe_timeout_cb(int unused UNUSED_PARAM,
+		const short event UNUSED_PARAM, void *h)
+{
+	struct tls_qry *cqry = h;
+
+	/* a connect error is reported through here as well */
+	if (cqry->err.size == 0) {
+		snprintf(line, DEFAULT_LINE_LENGTH, "\"timeout\" : %d",
+				DEFAULT_NOREPLY_TIMEOUT);
+		buf_add(&cqry->err, line, strlen(line));
+	}
+	probe_done(cqry, FALSE);
+}
+
+static void probe_read_cb(struct bufferevent *bev, void *ptr)
+{
+	struct tls_qry *cqry = ptr;
+	struct evbuffer *input;
+	struct tls_reply reply;
+	unsigned cipher;
+	size_t len;
+	int r;
+
+	input = bufferevent_get_input(bev);
+	len = evbuffer_get_length(input);
+	r = tls_server_reply(evbuffer_pullup(input, len), len, &reply);
+
+	switch (r) {
+	case TLS_REPLY_MORE:
+		return;
+	case TLS_REPLY_HELLO:
+		cipher = (cqry->probe->id[0] << 8) | cqry->probe->id[1];
+		probe_done(cqry, reply.cipher == cipher);
+		return;
+	case TLS_REPLY_ALERT:
+		/* usually handshake_failure, the cipher is not supported */
+		probe_done(cqry, FALSE);
+		return;
+	default:
+		probe_error(cqry, "hello", reply.err);
+		probe_done(cqry, FALSE);
 		return;
+	}
+}
 
-	for (i=0; ; i++)
-	{
-		struct tls_qry *cqry = NULL; /* next child query */
+static void probe_event_cb(struct bufferevent *bev, short events, void *ptr)
+{
+	struct tls_qry *cqry = ptr;
+	uint8_t hello[TLS_HELLO_MAX];
+	size_t len;
+	int sslv;
+
+	if (events & BEV_EVENT_CONNECTED) {
+		/* same version as the handshake on the parent */
+		sslv = cqry->sslv ? cqry->sslv : TLS1_2_VERSION;
+		len = tls_client_hello(hello, sizeof(hello),
+				sslv >> 8, sslv & 0xff, cqry->probe->id,
+				sizeof(cqry->probe->id), cqry->ui->host);
+		if (len == 0 || bufferevent_write(bev, hello, len) != 0) {
+			probe_error(cqry, "hello", "unable to send");
+			probe_done(cqry, FALSE);
+			return;
+		}
+		cqry->writestate = WRITE_DONE;
+		return;
+	}
 
-		p = SSL_get_cipher_list(ssl,i);
-		if (p == NULL) {
-			crondlog_aa(LVL7, "%s dst %s active = %d" " active_c = %d %s %s %s created %d children",  __func__,
-				qry->addrstr, qry->ui->active, qry->active_c, qry->sslv_str, p, qry->ui->host, i);
-			break;
+	if (events & (BEV_EVENT_ERROR|BEV_EVENT_EOF)) {
+		/* some servers just close the connection to reject a
+		 * cipher. Anything before that is a connect error.
+		 */
+		if (cqry->writestate != WRITE_DONE) {
+			probe_error(cqry, "connect",
+				evutil_socket_error_to_string(
+				EVUTIL_SOCKET_ERROR()));
 		}
+		probe_done(cqry, FALSE);
+	}
+}
+
+static void probe_start(struct tls_qry *qry)
+{
+	struct timeval asap = { 0, 0 };
+	struct tls_qry *cqry;
+
+	cqry = xzalloc(sizeof(struct tls_qry));
+	cqry->probe = &qry->probes[qry->next_probe++];
+	qry->running++;
+
+	cqry->ui = qry->ui;
+	qry->ui->q_serial++;
+	cqry->serial = qry->ui->q_serial;
+	cqry->addr_curr = qry->addr_curr;
+	cqry->result = qry->result;
+	cqry->sslv = qry->sslv;
+	cqry->sslv_str = qry->sslv_str;
+	cqry->is_c = TRUE;
+	cqry->p = qry;
+	cqry->cc = qry->cc;
+	cqry->certs = qry->certs;
+	cqry->cfps = qry->cfps;
+	cqry->ciphers_s_buf = qry->ciphers_s_buf;
+	cqry->cipher_q = cqry->probe->name;
+	cqry->tls_incomplete = TRUE;
+	strcpy(cqry->addrstr, qry->addrstr);
+	evtimer_assign(&cqry->timeout_ev, EventBase, probe_timeout_cb, cqry);
+	evtimer_assign(&cqry->free_child_ev, EventBase, free_child_cb, cqry);
+
+	gettimeofday(&cqry->start_time, NULL);
+	cqry->bev = bufferevent_socket_new(EventBase, -1, BEV_OPT_CLOSE_ON_FREE);
+	if (cqry->bev == NULL) {
+		probe_error(cqry, "connect", "bufferevent_socket_new failed");
+		evtimer_add(&cqry->timeout_ev, &asap);
+		return;
+	}
+	bufferevent_setcb(cqry->bev, probe_read_cb, NULL, probe_event_cb,
+			cqry);
+	bufferevent_enable(cqry->bev, EV_READ);
+
+	if (bufferevent_socket_connect(cqry->bev, qry->addr_curr->ai_addr,
+				qry->addr_curr->ai_addrlen)) {
+		/* report from the timer, never from inside print_tls_resp */
+		probe_error(cqry, "connect", evutil_socket_error_to_string(
+					EVUTIL_SOCKET_ERROR()));
+		evtimer_add(&cqry->timeout_ev, &asap);
+		return;
+	}
+	evtimer_add(&cqry->timeout_ev, &qry->ui->timeout_tv);
+}
+
+/*
+ * The server accepted a full handshake on qry. Find out which of the other
+ * ciphers it supports by sending a bare ClientHello per cipher, offering
+ * just that one. The ServerHello (or alert) tells whether it is
+ * accepted, the handshake is never completed.
+ */
+static void probe_ciphers(struct tls_qry *qry)
+{
+	int i, n;
+	unsigned long id;
+	const SSL_CIPHER *c;
+	struct tls_probe *probe;
+	STACK_OF(SSL_CIPHER) *sk = SSL_get_ciphers(qry->ssl);
+
+	if (sk == NULL)
+		return;
+
+	n = sk_SSL_CIPHER_num(sk);
+	qry->probes = xzalloc(n * sizeof(struct tls_probe));
+	qry->n_probes = qry->next_probe = qry->running = 0;
+
+	for (i = 0; i < n; i++) {
+		c = sk_SSL_CIPHER_value(sk, i);
+		id = SSL_CIPHER_get_id(c);
+
+		/* SSLv2 suites do not fit a TLS ClientHello. TLS 1.3 suites
+		 * need a key share, which the ClientHello does not offer
+		 */
+		if ((id & 0xff000000) != 0x03000000 || (id & 0xff00) == 0x1300)
+			continue;
+
 		/* skip the one that server picked. We know that is supported */
-		if (strlen(p) && strncmp(p, qry->cipher_r, strlen(p)) == 0)
+		if (strcmp(SSL_CIPHER_get_name(c), qry->cipher_r) == 0)
 			continue;
 
-		qry->ui->active++;
-		cqry = xzalloc(sizeof(struct tls_qry));
+		probe = &qry->probes[qry->n_probes++];
+		probe->id[0] = id >> 8;
+		probe->id[1] = id;
+		probe->name = SSL_CIPHER_get_name(c);
+	}
 
-		if (cqry == NULL)
-			break;
+	crondlog_aa(LVL7, "%s dst %s active = %d %s %s probing %d ciphers, "
+			"%d at a time", __func__, qry->addrstr, qry->ui->active,
+			qry->sslv_str, qry->ui->host, qry->n_probes,
+			qry->ui->opt_max_con);
+
+	/* count them all now, the results are written when the last one
+	 * is done
+	 */
+	qry->ui->active += qry->n_probes;
+	qry->active_c += qry->n_probes;
 
-		qry->tls_incomplete = TRUE;
-		cqry->ui = qry->ui;
-		qry->ui->q_serial++;
-		qry->active_c++;
-		cqry->serial =  qry->ui->q_serial;
-
-		cqry->addr_curr = qry->addr_curr;
-		cqry->result = qry->result;
-		evtimer_assign(&cqry->timeout_ev, EventBase, timeout_cb, cqry);
-		evtimer_assign(&cqry->free_child_ev, EventBase, free_child_cb, cqry);
-		cqry->sslv  = qry->sslv;
-		crondlog_aa(LVL7, "%s dst %s active = %d" " active_c = %d %s %s %s",  __func__,
-				qry->addrstr, qry->ui->active, qry->active_c, qry->sslv_str, p, qry->ui->host);
-		cqry->is_c = TRUE;
-		cqry->p = qry;
-		cqry->cc = qry->cc;
-		cqry->certs = qry->certs;
-		cqry->cfps = qry->cfps;
-		cqry->ciphers_s_buf = qry->ciphers_s_buf;
-		cqry->cipher_q = p;
-		tls_inst_start(cqry, p);
-	}
-	SSL_free(ssl);
+	while (qry->next_probe < qry->n_probes &&
+			qry->running < qry->ui->opt_max_con) {
+		probe_start(qry);
+	}
 }
 
 static void atlas_cert_char_encode (struct buf *lbuf, BUF_MEM *bptr)
@@ -660,8 +863,9 @@ static void fmt_ssl_summary(struct tls_qry *qry, bool is_err)
 		}
 
 	}
-	if ( !is_err && (qry->ssl_ctx != NULL) && (qry->ssl != NULL) &&
-			(!qry->tls_incomplete)) {
+	/* a child is a probe, it has no SSL object */
+	if ( !is_err && (qry->is_c || ((qry->ssl_ctx != NULL) &&
+			(qry->ssl != NULL))) && (!qry->tls_incomplete)) {
 		qry->ui->q_success++;
 		lbuf = qry->ciphers_s_buf; /* note lbuf changed */
 		if (qry->ciphers_s_buf->size == 0) {
@@ -671,16 +875,21 @@ static void fmt_ssl_summary(struct tls_qry *qry, bool is_err)
 		}
 
 		AS ("\"");
-		qry->cipher_r = SSL_CIPHER_get_name(SSL_get_current_cipher(qry->ssl));
+		if (qry->is_c)
+			qry->cipher_r = qry->cipher_q;
+		else
+			qry->cipher_r = SSL_CIPHER_get_name(SSL_get_current_cipher(qry->ssl));
 		AS (qry->cipher_r);
 		AS("\"");
-		get_cert_chain(qry);
+
+		if (qry->is_c == FALSE)
+			get_cert_chain(qry);
 
 		if ((qry->is_c == FALSE) && (qry->ui->opt_all_tests == TRUE))  {
-			/* this is a successful child. 
-			 * create children with cipher algorithm varients 
+			/* this is a successful parent.
+			 * probe the other ciphers
 			 */
-			ssl_c_init(qry);
+			probe_ciphers(qry);
 		}
 	}
 }
@@ -722,20 +931,27 @@ static void fmt_ssl_cert_full_resp(struct tls_qry *qry, bool is_err)
 		JS_NC(version, qry->sslv_str);
 	}
 
-	if ( !is_err && (qry->ssl_ctx != NULL) && (qry->ssl != NULL) &&
+	if ( !is_err && qry->is_c && (qry->tls_incomplete == FALSE)) {
+		/* a probe, the server picked the cipher it offered */
+		qry->ui->q_success++;
+		AS(",");
+		JS_NC(cipher, qry->cipher_q);
+	}
+	else if ( !is_err && (qry->ssl_ctx != NULL) && (qry->ssl != NULL) &&
 			(qry->tls_incomplete == FALSE)) {
 		int i;
 		qry->ui->q_success++;
 		AS(",");
-		JS_NC(cipher, SSL_CIPHER_get_name(SSL_get_current_cipher(qry->ssl)));
+		qry->cipher_r = SSL_CIPHER_get_name(SSL_get_current_cipher(qry->ssl));
+		JS_NC(cipher, qry->cipher_r);
 
 	 	add_certs_to_result(qry);
 
-		if ((qry->is_c == FALSE) && (qry->ui->opt_all_tests == TRUE))  {
-			/* this is a successful child. 
-			 * create children with cipher algorithm varients 
+		if (qry->ui->opt_all_tests == TRUE)  {
+			/* this is a successful parent.
+			 * probe the other ciphers
 			 */
-			ssl_c_init(qry);
+			probe_ciphers(qry);
 		}
 	}
 
@@ -769,7 +985,7 @@ static void write_results(struct tls_qry *qry)
 
 	if (qry->ui->out_filename)
 	{
-		fh= fopen(qry->ui->out_filename, "a");
+		fh= atlas_fopen_append(qry->ui->out_filename);
 		if (!fh) {
 			crondlog(LVL8 "unable to append to '%s'",
 					qry->ui->out_filename);
@@ -1225,6 +1441,7 @@ static struct tls_state * tlsscan_init (int argc, char *argv[], void (*done)(voi
 	pqry->done = done;
 	pqry->opt_all_tests = TRUE;
 	pqry->timeout_tv.tv_sec = 5;
+	pqry->opt_max_con = DEFAULT_MAX_CON;
 	pqry->opt_out_format = OUTPUT_FMT_CERTS_ARRAY;
 //	pqry->opt_out_format = OUTPUT_FMT_CERTS_FULL;
 
@@ -1232,7 +1449,7 @@ static struct tls_state * tlsscan_init (int argc, char *argv[], void (*done)(voi
 		evtimer_assign(&pqry->done_ev, EventBase, done_cb, pqry);
 
 	optind = 0;
-	while (c= getopt_long(argc, argv, "46O:A?", longopts, NULL), c != -1) {
+	while (c= getopt_long(argc, argv, "46c:O:A?", longopts, NULL), c != -1) {
 		switch (c) {
 			case '4':
 				pqry->opt_v4 = 1;
@@ -1246,6 +1463,16 @@ static struct tls_state * tlsscan_init (int argc, char *argv[], void (*done)(voi
 				pqry->opt_all_tests = TRUE;
 				break;
 
+			case 'c':
+				pqry->opt_max_con = strtoul(optarg, NULL, 10);
+				if ((pqry->opt_max_con <= 0) || (pqry->opt_max_con > MAX_MAX_CON)) {
+					fprintf(stderr, "ERROR invalid concurrency "
+							"-c %s ??.  1 - %d\n", optarg, MAX_MAX_CON);
+					tlsscan_delete(pqry);
+					return (0);
+				}
+				break;
+
 			case 'O':
                                 pqry->out_filename = strdup(optarg);
                                 break;
@@ -1349,7 +1576,7 @@ static void printErrorQuick (struct tls_state *pqry)
 	struct timeval now;
 	if (pqry->out_filename)
 	{
-		fh= fopen(pqry->out_filename, "a");
+		fh= atlas_fopen_append(pqry->out_filename);
 		if (!fh){
 			crondlog(LVL8 "unable to append to '%s'",
 					pqry->out_filename);
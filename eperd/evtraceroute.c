@@ -14,16 +14,18 @@
 //kbuild:lib-$(CONFIG_EVTRACEROUTE) += evtraceroute.o
 
 //usage:#define evtraceroute_trivial_usage
-//usage:       "-[46FIrTU] [-a <paris mod>] [-b <paris base>] [-c <count>]"
+//usage:       "-[46FILrTU] [-a <paris mod>] [-b <paris base>] [-c <count>]"
 //usage:       "\n\t[-f <hop>] [-g <gap>] [-i <interface>] [-m <maxhops>] "
 //usage:       "[-p <port>]\n\t[-t <tos>] [-w <ms>] [-z <ms>] [-A <string>] "
 //usage:       "[-B <bundle>] [-O <file>]\n\t[-S <size>] [-H <hbh size>] "
-//usage:       "[-D <dest. opt. size>] [-R <response in>]\n\t[-W <response out]"
+//usage:       "[-D <dest. opt. size>] [-R <response in>]\n\t[-W <response out] "
+//usage:       "[-x <window>] [-y <ms>] [-G <secs>]"
 //usage:#define evtraceroute_full_usage "\n"
 //usage:     "\n       -4                      Use IPv4 (default)"
 //usage:     "\n       -6                      Use IPv6"
 //usage:     "\n       -F                      Don't fragment"
 //usage:     "\n       -I                      Use ICMP"
+//usage:     "\n       -L                      Report how late each packet was sent"
 //usage:     "\n       -r                      Name resolution during each run"
 //usage:     "\n       -T                      Use TCP"
 //usage:     "\n       -U                      Use UDP (default)"
@@ -46,6 +48,9 @@
 //usage:     "\n       -D <size>               Add IPv6 Destination Option this size"
 //usage:     "\n       -R <file>               Response in file"
 //usage:     "\n       -W <file>               Response out file"
+//usage:     "\n       -x <hops>               Probe this many hops in parallel"
+//usage:     "\n       -y <ms>                 Time between parallel hops (default 10)"
+//usage:     "\n       -G <secs>               Only report a summary every <secs> seconds"
 
 #include "libbb.h"
 #include <syslog.h>
@@ -55,8 +60,10 @@
 
 #include "eperd.h"
 
-static void done(void *state UNUSED_PARAM, int error)
+static void done(void *state, int error)
 {
+	/* Flushes a pending summary */
+	traceroute_ops.delete(state);
 	exit(error);
 }
 
@@ -13,6 +13,7 @@
 #include <event2/event.h>
 #include <event2/event_struct.h>
 
+#include "atlas_pool.h"
 #include "eperd.h"
 #include "tcputil.h"
 
@@ -29,6 +30,9 @@
 #define MAX_LINE_LEN	2048	/* We don't deal with lines longer than this */
 #define POST_BUF_SIZE	2048	/* Big enough to be efficient? */
 
+#define SHA256_SIZE	32
+#define MAX_CHECKPOINTS	16	/* Digests at intermediate offsets */
+
 #define RESP_PACKET	1
 #define RESP_SOCKNAME	2
 #define RESP_DSTADDR	3
@@ -51,6 +55,9 @@ static struct option longopts[]=
 	{ "timeout",	required_argument, NULL, 'S' },
 	{ "etim",	no_argument, NULL, 't' },
 	{ "eetim",	no_argument, NULL, 'T' },
+	{ "pipeline",	no_argument, NULL, 'L' },
+	{ "digest",	no_argument, NULL, 'D' },
+	{ "digest-checkpoints", required_argument, NULL, 'K' },
 	{ NULL, }
 };
 
@@ -89,6 +96,10 @@ struct hgstate
 	char do_post;
 	bool do_tls;
 	char do_http10;
+	char do_pipeline;	/* Send all requests at once */
+	char do_digest;		/* SHA-256 of the body */
+	size_t *checkpoints;	/* Also report digests at these offsets */
+	int ncheckpoints;
 	char *user_agent;
 	char *post_header;
 	char *post_file;
@@ -111,7 +122,9 @@ struct hgstate
 	char *host;
 	char *port;
 	char *hostport;
-	char *path;
+	char **paths;		/* More than one for a persistent connection */
+	int npaths;
+	int reqid;		/* Current request on the connection */
 	struct bufferevent *bev;
 	enum readstate readstate;
 	enum writestate writestate;
@@ -139,10 +152,15 @@ struct hgstate
 	FILE *post_fh;
 	char *post_buf;
 
-	char *line;
-	size_t linemax;		/* Allocated size of line */
-	size_t linelen;		/* Current amount of data in line */
-	size_t lineoffset;	/* Offset in line where to start processing */
+	sha256_ctx_t sha256_ctx;
+	char digest_active;	/* Body is being hashed */
+	int checkpoints_done;
+	uint8_t *check_digests;	/* SHA256_SIZE bytes per checkpoint */
+
+	struct evbuffer *inbuf;	/* Received data that is not yet parsed */
+	char *line;		/* Current line, points into inbuf */
+	size_t line_used;	/* Length of line including the line ending */
+	char line_nul;		/* Line contains a nul byte */
 
 	/* Base and index in table */
 	struct hgbase *base;
@@ -165,8 +183,14 @@ struct hgstate
 };
 
 static struct hgbase *hg_base;
+static struct atlas_pool *state_pool;
 
 static void report(struct hgstate *state);
+static void add_hex(struct hgstate *state, const uint8_t *data, size_t len);
+static void line_done(struct hgstate *state);
+static void add_entry(struct hgstate *state);
+static void add_request(struct hgstate *state, struct evbuffer *output,
+	int reqid);
 static void add_str(struct hgstate *state, const char *str);
 static void add_str_quoted(struct hgstate *state, char *str);
 static void add_str2(struct hgstate *state, const char *str);
@@ -387,11 +411,10 @@ static void timeout_callback(int __attribute((unused)) unused,
 #if 1
 		snprintf(errline, sizeof(errline), 
 			DBQ(err) ":"
-	DBQ(timeout reading chunk: state %ld linelen %ld lineoffset %ld)
+	DBQ(timeout reading chunk: state %ld pending %ld)
 			", ",
 			(long)state->readstate,
-			(long)state->linelen,
-			(long)state->lineoffset);
+			(long)evbuffer_get_length(state->inbuf));
 		add_str(state, errline);
 #else
 		add_str(state, DBQ(err) ":" DBQ(timeout reading chunk) ", ");
@@ -409,11 +432,16 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 {
 	int c, i, do_combine, do_get, do_head, do_post,
 		max_headers, max_body, only_v4, only_v6,
-		do_all, do_http10, do_etim, do_eetim;
-	bool do_tls;
+		do_all, do_http10, do_etim, do_eetim, do_pipeline, npaths,
+		do_digest, ncheckpoints;
+	bool do_tls, do_tls2;
 	size_t newsiz, read_limit;
 	unsigned timeout;
-	char *url, *check;
+	char *url, *check, *cp;
+	char *host2, *port2, *hostport2;
+	char *checkpoints_str;
+	char **paths;
+	size_t checkpoints[MAX_CHECKPOINTS];
 	char *host_arg, *post_file, *output_file, *post_footer, *post_header,
 		*A_arg, *b_arg, *store_headers, *store_body, *read_limit_str,
 		*timeout_str, *infname, *response_in, *response_out;
@@ -454,6 +482,9 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 	only_v6= 0;
 	do_etim= 0;
 	do_eetim= 0;
+	do_pipeline= 0;
+	do_digest= 0;
+	checkpoints_str= NULL;
 	user_agent= "httpget for atlas.ripe.net";
 
 	if (!hg_base)
@@ -506,6 +537,13 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 		case 'c':				/* --combine */
 			do_combine= 1;
 			break;
+		case 'D':				/* --digest */
+			do_digest= 1;
+			break;
+		case 'K':			/* --digest-checkpoints */
+			checkpoints_str= optarg;
+			do_digest= 1;
+			break;
 		case 'E':				/* --head */
 			do_get = 0;
 			do_head = 1;
@@ -528,6 +566,9 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 		case 'I':
 			infname= optarg;
 			break;
+		case 'L':				/* --pipeline */
+			do_pipeline= 1;
+			break;
 		case 'n':
 			host_arg= optarg;		/* --host */
 			break;
@@ -563,12 +604,22 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 		}
 	}
 
-	if (optind != argc-1)
+	if (optind >= argc)
 	{
-		crondlog(LVL8 "exactly one url expected");
+		crondlog(LVL8 "url expected");
+		return NULL;
+	}
+
+	/* More than one url means that all requests go over one
+	 * persistent connection.
+	 */
+	npaths= argc-optind;
+	if (npaths > 1 && (do_all || do_post || response_in || response_out))
+	{
+		crondlog(LVL8
+		"multiple urls cannot be combined with --all, --post, -R or -W");
 		return NULL;
 	}
-	url= argv[optind];
 
 	if (response_in)
 	{
@@ -602,7 +653,7 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 			crondlog(LVL8 "insecure file '%s'", output_file);
 			goto err;
 		}
-		fh= fopen(validated_output_file, "a");
+		fh= atlas_fopen_append(validated_output_file);
 		if (!fh)
 		{
 			crondlog(LVL8 "httpget: unable to append to '%s'",
@@ -700,6 +751,40 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 		}
 	}
 
+	ncheckpoints= 0;
+	if (checkpoints_str)
+	{
+		/* Comma separated list of increasing offsets */
+		cp= checkpoints_str;
+		for (;;)
+		{
+			if (ncheckpoints >= MAX_CHECKPOINTS)
+			{
+				crondlog(LVL8
+			"too many offsets (--digest-checkpoints) '%s'",
+					checkpoints_str);
+				return NULL;
+			}
+			checkpoints[ncheckpoints]= strtoul(cp, &check, 10);
+			if (check == cp || (check[0] != '\0' &&
+				check[0] != ',') ||
+				checkpoints[ncheckpoints] == 0 ||
+				(ncheckpoints > 0 &&
+				checkpoints[ncheckpoints] <=
+				checkpoints[ncheckpoints-1]))
+			{
+				crondlog(LVL8
+		"unable to parse argument (--digest-checkpoints) '%s'",
+					checkpoints_str);
+				return NULL;
+			}
+			ncheckpoints++;
+			if (check[0] == '\0')
+				break;
+			cp= check+1;
+		}
+	}
+
 	timeout= CONN_TO;
 	if (timeout_str)
 	{
@@ -713,12 +798,37 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 		}
 	}
 
+	url= argv[optind];
 	if (!parse_url(url, &host, &port, &hostport, &path, &do_tls))
 	{
 		/* Do we need to report an error? */
 		return NULL;
 	}
 
+	paths= xmalloc(npaths * sizeof(*paths));
+	paths[0]= path;
+	for (i= 1; i<npaths; i++)
+	{
+		if (!parse_url(argv[optind+i], &host2, &port2, &hostport2,
+			&path, &do_tls2))
+		{
+			goto err_paths;
+		}
+		c= (strcmp(host, host2) == 0 && strcmp(port, port2) == 0 &&
+			do_tls == do_tls2);
+		free(host2);
+		free(port2);
+		free(hostport2);
+		paths[i]= path;
+		if (!c)
+		{
+			crondlog(LVL8 "url '%s' is not on the same server",
+				argv[optind+i]);
+			i++;
+			goto err_paths;
+		}
+	}
+
 	if (host_arg)
 	{
 		/* Replace hostport from the URL with host_arg */
@@ -731,7 +841,9 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 	//printf("hostport: %s\n", hostport);
 	//printf("path: %s\n", path);
 
-	state= xzalloc(sizeof(*state));
+	if (!state_pool)
+		state_pool= atlas_pool_new("httpget", sizeof(*state));
+	state= atlas_pool_zalloc(state_pool);
 	state->base= hg_base;
 	state->atlas= A_arg ? strdup(A_arg) : NULL;
 	state->bundle= b_arg ? strdup(b_arg) : NULL;
@@ -744,7 +856,19 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 	state->host= host;
 	state->port= port;
 	state->hostport= hostport;
-	state->path= path;
+	state->paths= paths;
+	state->npaths= npaths;
+	state->do_pipeline= do_pipeline;
+	state->do_digest= do_digest;
+	if (ncheckpoints)
+	{
+		state->checkpoints= xmalloc(ncheckpoints *
+			sizeof(*state->checkpoints));
+		memcpy(state->checkpoints, checkpoints,
+			ncheckpoints * sizeof(*state->checkpoints));
+		state->ncheckpoints= ncheckpoints;
+		state->check_digests= xmalloc(ncheckpoints * SHA256_SIZE);
+	}
 	state->do_all= do_all;
 	state->do_combine= !!do_combine;
 	state->do_get= do_get;
@@ -781,10 +905,9 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 	//evtimer_assign(&state->timer, state->base->event_base,
 	//	timeout_callback, state);
 
+	state->inbuf= evbuffer_new();
 	state->line= NULL;
-	state->linemax= 0;
-	state->linelen= 0;
-	state->lineoffset= 0;
+	state->line_used= 0;
 
 	for (i= 0; i<hg_base->tabsiz; i++)
 	{
@@ -807,6 +930,13 @@ static void *httpget_init(int __attribute((unused)) argc, char *argv[],
 
 	return state;
 
+err_paths:
+	while (i > 0)
+		free(paths[--i]);
+	free(paths);
+	free(host);
+	free(port);
+	free(hostport);
 err:
 	if (validated_response_in) free(validated_response_in);
 	if (validated_response_out) free(validated_response_out);
@@ -819,10 +949,8 @@ err:
 
 static void report(struct hgstate *state)
 {
-	int done, do_output;
+	int do_output;
 	FILE *fh;
-	char namebuf[NI_MAXHOST];
-	char line[160];
 
 	//event_del(&state->timer);
 
@@ -839,7 +967,7 @@ static void report(struct hgstate *state)
 	{
 		if (state->output_file)
 		{
-			fh= fopen(state->output_file, "a");
+			fh= atlas_fopen_append(state->output_file);
 			if (!fh)
 				crondlog(DIE9 "httpget: unable to append to '%s'",
 					state->output_file);
@@ -872,6 +1000,60 @@ static void report(struct hgstate *state)
 		fprintf(fh, DBQ(result) ":[ ");
 	}
 
+	add_entry(state);
+
+	if (!do_output)
+		add_str(state, ", ");
+	else
+		add_str(state, " ]");
+
+	if (do_output)
+	{
+		fprintf(fh, "%s }\n", state->result);
+		free(state->result);
+		state->result= NULL;
+		state->resmax= 0;
+		state->reslen= 0;
+
+		if (state->output_file)
+			fclose(fh);
+	}
+
+	free(state->post_buf);
+	state->post_buf= NULL;
+
+	if (state->do_all && state->subid < state->submax)
+	{
+		tu_restart_connect(&state->tu_env);
+		return;
+	}
+	line_done(state);
+	evbuffer_drain(state->inbuf, evbuffer_get_length(state->inbuf));
+
+	state->bev= NULL;
+
+	if (!state->response_in)
+		tu_cleanup(&state->tu_env);
+
+	if (state->resp_file)
+	{
+		fclose(state->resp_file);
+		state->resp_file= NULL;
+	}
+
+	state->busy= 0;
+	if (state->base->done)
+		state->base->done(state, 0);
+}
+
+/* Add the result of one request (or connection attempt) */
+static void add_entry(struct hgstate *state)
+{
+	int i, done;
+	uint8_t digest[SHA256_SIZE];
+	char namebuf[NI_MAXHOST];
+	char line[160];
+
 	if (state->do_all && !state->dnserr)
 	{
 		if (state->do_combine)
@@ -897,6 +1079,13 @@ static void report(struct hgstate *state)
 			state->sin6.sin6_family == AF_INET6 ? 6 : 4);
 		add_str(state, line);
 
+		if (state->npaths > 1)
+		{
+			add_str(state, ", " DBQ(path) ":\"");
+			add_str_quoted(state, state->paths[state->reqid]);
+			add_str(state, "\"");
+		}
+
 		if (state->read_truncated)
 			add_str(state, ", " DBQ(read-truncated) ": True");
 
@@ -950,7 +1139,30 @@ static void report(struct hgstate *state)
 			state->headers_size,
 			state->content_offset);
 		add_str(state, line);
-		if (state->etim >= 1)
+		if (state->digest_active)
+		{
+			sha256_end(&state->sha256_ctx, digest);
+			add_str(state, ", " DBQ(sha256) ":\"");
+			add_hex(state, digest, SHA256_SIZE);
+			add_str(state, "\"");
+			if (state->checkpoints_done)
+				add_str(state, ", " DBQ(digests) ": [ ");
+			for (i= 0; i<state->checkpoints_done; i++)
+			{
+				snprintf(line, sizeof(line),
+					"%s{ " DBQ(o) ": %lu, " DBQ(sha256)
+					":\"", i == 0 ? "" : ", ",
+					(unsigned long)state->checkpoints[i]);
+				add_str(state, line);
+				add_hex(state, state->check_digests +
+					i*SHA256_SIZE, SHA256_SIZE);
+				add_str(state, "\" }");
+			}
+			if (state->checkpoints_done)
+				add_str(state, " ]");
+			state->digest_active= 0;
+		}
+		if (state->etim >= 1 && state->reqid == 0)
 		{
 			snprintf(line, sizeof(line),
 				", " DBQ(ttr) ":%f"
@@ -961,96 +1173,80 @@ static void report(struct hgstate *state)
 				state->ttfb);
 			add_str(state, line);
 		}
+		else if (state->etim >= 1)
+		{
+			/* Connection setup is only part of the first
+			 * request.
+			 */
+			snprintf(line, sizeof(line), ", " DBQ(ttfb) ":%f",
+				state->ttfb);
+			add_str(state, line);
+		}
 	}
 
 	if (!state->dnserr)
 	{
 		add_str(state, " }");
 	}
-	if (!do_output)
-		add_str(state, ", ");
-	else
-		add_str(state, " ]");
-
-	if (do_output)
-	{
-		fprintf(fh, "%s }\n", state->result);
-		free(state->result);
-		state->result= NULL;
-		state->resmax= 0;
-		state->reslen= 0;
-
-		if (state->output_file)
-			fclose(fh);
-	}
+}
 
-	free(state->post_buf);
-	state->post_buf= NULL;
+/* A response on a persistent connection is complete and there are more
+ * requests. Send the next request (unless it was pipelined) and restart
+ * the timing, so that ttfb and rt do not include earlier requests.
+ */
+static void next_request(struct hgstate *state)
+{
+	add_entry(state);
+	add_str(state, ", { ");
 
-	if (state->do_all && state->subid < state->submax)
-	{
-		tu_restart_connect(&state->tu_env);
-		return;
-	}
-	if (state->linemax)
-	{
-		state->linemax= 0;
-		free(state->line);
-		state->line= NULL;
-	}
+	state->reqid++;
+	state->readstate= READ_FIRST;
+	state->digest_active= 0;
+	state->http_result= 0;
+	state->headers_size= 0;
+	state->tot_headers= 0;
+	state->chunked= 0;
+	state->content_length= -1;
+	state->content_offset= 0;
+	state->read_truncated= 0;
 
-	state->bev= NULL;
+	if (!state->do_pipeline)
+		add_request(state, bufferevent_get_output(state->bev),
+			state->reqid);
+	gettime_mono(&state->start);
+}
 
-	if (!state->response_in)
-		tu_cleanup(&state->tu_env);
+/* Save what was received for replaying later. Keep packets small enough
+ * for the buffer in get_input.
+ */
+static void save_response(struct hgstate *state, struct evbuffer *input)
+{
+	size_t len, offset;
+	struct evbuffer_ptr ptr;
+	char buf[MAX_LINE_LEN];
 
-	if (state->resp_file)
+	evbuffer_ptr_set(input, &ptr, 0, EVBUFFER_PTR_SET);
+	for (offset= 0; offset < evbuffer_get_length(input); offset += len)
 	{
-		fclose(state->resp_file);
-		state->resp_file= NULL;
+		len= evbuffer_copyout_from(input, &ptr, buf, sizeof(buf));
+		if (len == 0 || len == (size_t)-1)
+			break;
+		write_response(state->resp_file, RESP_PACKET, len, buf);
+		evbuffer_ptr_set(input, &ptr, len, EVBUFFER_PTR_ADD);
 	}
-
-	state->busy= 0;
-	if (state->base->done)
-		state->base->done(state, 0);
 }
 
-static int get_input(struct hgstate *state)
+/* Move newly received data to inbuf. This moves the buffers of the
+ * bufferevent, the data itself is not copied.
+ */
+static void get_input(struct hgstate *state)
 {
-	int n;
+	size_t n;
 	double t;
+	struct evbuffer *input;
 	struct timespec endtime;
 	char line[80];
 
-	/* Assume that we always end up with a full buffer anyway */
-	if (state->linemax == 0)
-	{
-		if (state->line)
-			crondlog(DIE9 "line is not empty");
-
-		state->linemax= MAX_LINE_LEN;
-		state->line= xmalloc(state->linemax);
-	}
-
-	if (state->lineoffset)
-	{
-		if (state->linelen > state->lineoffset)
-		{
-			memmove(state->line, &state->line[state->lineoffset],
-				state->linelen-state->lineoffset);
-			state->linelen -= state->lineoffset;
-		}
-		else
-		{
-			state->linelen= 0;
-		}
-		state->lineoffset= 0;
-	}
-	if (state->linelen >= state->linemax)
-	{
-		return -1;	/* We cannot get more data */
-	}
-
 	if (state->etim >= 2 && state->report_roffset)
 	{
 		gettime_mono(&endtime);
@@ -1067,29 +1263,140 @@ static int get_input(struct hgstate *state)
 
 	if (state->response_in)
 	{
-		size_t tmplen;
+		char buf[MAX_LINE_LEN];
 
-		tmplen= state->linemax-state->linelen;
-		read_response_file(state->resp_file, RESP_PACKET,
-			&tmplen, &state->line[state->linelen]);
-		n= tmplen;
+		n= sizeof(buf);
+		read_response_file(state->resp_file, RESP_PACKET, &n, buf);
+		evbuffer_add(state->inbuf, buf, n);
 	}
 	else
 	{
-		n= bufferevent_read(state->bev,
-			&state->line[state->linelen],
-			state->linemax-state->linelen);
+		input= bufferevent_get_input(state->bev);
+		n= evbuffer_get_length(input);
+		if (state->response_out)
+			save_response(state, input);
+		evbuffer_add_buffer(state->inbuf, input);
 	}
-	if (n < 0)
-		return -1;
-	if (state->response_out)
+	state->roffset += n;
+}
+
+/* Find the next line in inbuf. The line is made contiguous in inbuf,
+ * NUL terminated in place and the line ending is removed. It stays in
+ * inbuf until line_done is called.
+ */
+static char *peek_line(struct hgstate *state)
+{
+	size_t len, eol_len;
+	char *line;
+	struct evbuffer_ptr ptr;
+
+	ptr= evbuffer_search_eol(state->inbuf, NULL, &eol_len,
+		EVBUFFER_EOL_LF);
+	if (ptr.pos == -1)
+		return NULL;
+
+	len= ptr.pos;
+	line= (char *)evbuffer_pullup(state->inbuf, len+eol_len);
+	state->line= line;
+	state->line_used= len+eol_len;
+	state->line_nul= (memchr(line, '\0', len) != NULL);
+
+	line[len]= '\0';
+	if (len > 0 && line[len-1] == '\r')
+		line[len-1]= '\0';
+	return line;
+}
+
+static void line_done(struct hgstate *state)
+{
+	if (!state->line_used)
+		return;
+	evbuffer_drain(state->inbuf, state->line_used);
+	state->line= NULL;
+	state->line_used= 0;
+}
+
+static void digest_begin(struct hgstate *state)
+{
+	if (!state->do_digest)
+		return;
+	sha256_begin(&state->sha256_ctx);
+	state->digest_active= 1;
+	state->checkpoints_done= 0;
+}
+
+/* Hash body data. 'offset' is the offset in the body of 'data'. Record
+ * the digest of everything before a checkpoint when it is passed.
+ */
+static void digest_add(struct hgstate *state, const char *data, size_t len,
+	size_t offset)
+{
+	size_t n, check;
+	sha256_ctx_t ctx;
+
+	while (len > 0)
 	{
-		write_response(state->resp_file, RESP_PACKET,
-				n, &state->line[state->linelen]);
+		n= len;
+		if (state->checkpoints_done < state->ncheckpoints)
+		{
+			check= state->checkpoints[state->checkpoints_done];
+			if (offset+n > check)
+				n= check-offset;
+		}
+		sha256_hash(&state->sha256_ctx, data, n);
+		data += n;
+		len -= n;
+		offset += n;
+
+		if (state->checkpoints_done < state->ncheckpoints &&
+			offset == state->checkpoints[state->checkpoints_done])
+		{
+			/* Finish a copy, hashing continues */
+			ctx= state->sha256_ctx;
+			sha256_end(&ctx, state->check_digests +
+				state->checkpoints_done*SHA256_SIZE);
+			state->checkpoints_done++;
+		}
 	}
-	state->linelen += n;
-	state->roffset += n;
-	return 0;
+}
+
+/* Body data is counted (and hashed) without copying it out of inbuf */
+static void consume_body(struct hgstate *state, size_t len)
+{
+	int i, n;
+	size_t offset, done;
+	struct evbuffer_iovec vec[8];
+
+	offset= state->content_offset;
+	while (state->digest_active && len > 0)
+	{
+		n= evbuffer_peek(state->inbuf, len, NULL, vec, 8);
+		if (n > 8)
+			n= 8;
+		done= 0;
+		for (i= 0; i<n && done < len; i++)
+		{
+			if (vec[i].iov_len > len-done)
+				vec[i].iov_len= len-done;
+			digest_add(state, vec[i].iov_base, vec[i].iov_len,
+				offset+done);
+			done += vec[i].iov_len;
+		}
+		evbuffer_drain(state->inbuf, done);
+		offset += done;
+		len -= done;
+	}
+	evbuffer_drain(state->inbuf, len);
+}
+
+static void add_hex(struct hgstate *state, const uint8_t *data, size_t len)
+{
+	size_t i;
+	char buf[2*SHA256_SIZE+1];
+
+	for (i= 0; i<len && 2*i+2 < sizeof(buf); i++)
+		snprintf(buf+2*i, 3, "%02x", data[i]);
+	add_str(state, buf);
 }
 
 static void skip_spaces(const char *cp, char **ncp)
@@ -1190,7 +1497,7 @@ static void err_chunked(struct hgstate *state, const char *reason)
 
 static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 {
-	int r, major, minor, need_line, no_body;
+	int major, minor, need_line, no_body;
 	size_t len;
 	char *cp, *ncp, *check, *line;
 	const char *prefix, *kw;
@@ -1200,8 +1507,12 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 	state= ENV2STATE(ptr);
 
 	state->report_roffset= 1;
+	line= NULL;
 	for (;;)
 	{
+		/* The previous line has been processed */
+		line_done(state);
+
 		if (state->read_limit > 0 &&
 			state->roffset >= state->read_limit)
 		{
@@ -1247,25 +1558,17 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 		if (need_line)
 		{
 			/* Wait for a complete line */
-			if (state->linemax == 0 ||
-				memchr(&state->line[state->lineoffset], '\n',
-				state->linelen-state->lineoffset) == NULL)
+			line= peek_line(state);
+			if (line == NULL)
 			{
-				r= get_input(state);
-				if (r == -1)
-				{
-					printf(
-			"readcb: get_input failed, should do something\n");
-					return;
-				}
+				get_input(state);
 
 				/* Did we get what we want? */
-				if (memchr(&state->line[state->lineoffset],
-					'\n', state->linelen-state->lineoffset)
-					== NULL)
+				line= peek_line(state);
+				if (line == NULL)
 				{
 					/* No */
-					if (state->linelen-state->lineoffset >=
+					if (evbuffer_get_length(state->inbuf) >=
 						MAX_LINE_LEN)
 					{
 						add_str(state, DBQ(err) ":"
@@ -1281,21 +1584,12 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 		switch(state->readstate)
 		{
 		case READ_STATUS:
-			line= &state->line[state->lineoffset];
-			cp= strchr(line, '\n');
-			if (cp == NULL)
+			if (state->line_nul)
 			{
-				/* Contains nul */
 				err_status(state, "contains nul");
 				return;
 			}
 
-			state->lineoffset += (cp-line+1);
-
-			cp[0]= '\0';
-			if (cp > line && cp[-1] == '\r')
-				cp[-1]= '\0';
-
 			/* Check http version */
 			prefix= "http/";
 			len= strlen(prefix);
@@ -1344,20 +1638,13 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 			continue;
 
 		case READ_HEADER:
-			line= &state->line[state->lineoffset];
-			cp= strchr(line, '\n');
-			if (cp == NULL)
+			if (state->line_nul)
 			{
 				err_header(state, "contains nul");
 				return;
 			}
 
-			len= (cp-line+1);
-			state->lineoffset += len;
-
-			cp[0]= '\0';
-			if (cp > line && cp[-1] == '\r')
-				cp[-1]= '\0';
+			len= state->line_used;
 
 			if (line[0] == '\0')
 			{
@@ -1509,31 +1796,24 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 				state->readstate= READ_CHUNKED;
 				state->content_offset= 0;
 				state->tot_chunked= 0;
+				digest_begin(state);
 			}
 			else
 			{
 				state->readstate= READ_SIMPLE;
 				state->content_offset= 0;
+				digest_begin(state);
 			}
 
 			continue;
 
 		case READ_CHUNKED:
-			line= &state->line[state->lineoffset];
-			cp= strchr(line, '\n');
-			if (cp == NULL)
+			if (state->line_nul)
 			{
 				err_chunked(state, "contains nul");
 				return;
 			}
 
-			len= (cp-line+1);
-			state->lineoffset += len;
-
-			cp[0]= '\0';
-			if (cp > line && cp[-1] == '\r')
-				cp[-1]= '\0';
-
 			len= strtoul(line, &check, 16);
 			if (check == line || (check[0] != '\0' &&
 				!isspace(*(unsigned char *)check)))
@@ -1560,26 +1840,19 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 			}
 
 			/* Do we need more input? */
-			if (state->linemax == 0 ||
-				state->lineoffset >= state->linelen)
+			if (evbuffer_get_length(state->inbuf) == 0)
 			{
-				r= get_input(state);
-				if (r == -1)
-				{
-					printf(
-			"readcb: get_input failed, should do something\n");
-					return;
-				}
+				get_input(state);
 
 				/* Did we get what we want? */
-				if (state->lineoffset >= state->linelen)
+				if (evbuffer_get_length(state->inbuf) == 0)
 				{
 					/* No */
 					return;
 				}
 			}
 
-			len= state->linelen-state->lineoffset;
+			len= evbuffer_get_length(state->inbuf);
 			if (state->content_offset+len > state->tot_chunked)
 				len= state->tot_chunked-state->content_offset;
 
@@ -1611,27 +1884,18 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 				"readcb: should add truncation indicator\n");
 			}
 
+			consume_body(state, len);
 			state->content_offset += len;
-			state->lineoffset += len;
 
 			continue;
 
 		case READ_CHUNK_END:
-			line= &state->line[state->lineoffset];
-			cp= strchr(line, '\n');
-			if (cp == NULL)
+			if (state->line_nul)
 			{
 				err_chunked(state, "contains nul");
 				return;
 			}
 
-			len= (cp-line+1);
-			state->lineoffset += len;
-
-			cp[0]= '\0';
-			if (cp > line && cp[-1] == '\r')
-				cp[-1]= '\0';
-
 			if (strlen(line) != 0)
 			{
 				err_chunked(state,
@@ -1643,21 +1907,12 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 			continue;
 
 		case READ_CHUNKED_TRAILER:
-			line= &state->line[state->lineoffset];
-			cp= strchr(line, '\n');
-			if (cp == NULL)
+			if (state->line_nul)
 			{
 				err_chunked(state, "contains nul");
 				return;
 			}
 
-			len= (cp-line+1);
-			state->lineoffset += len;
-
-			cp[0]= '\0';
-			if (cp > line && cp[-1] == '\r')
-				cp[-1]= '\0';
-
 			if (line[0] == '\0')
 			{
 				state->readstate= READ_DONE;
@@ -1674,26 +1929,29 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 			}
 
 			/* Do we need more input? */
-			if (state->linemax == 0 ||
-				state->lineoffset >= state->linelen)
+			if (evbuffer_get_length(state->inbuf) == 0)
 			{
-				r= get_input(state);
-				if (r == -1)
-				{
-					printf(
-			"readcb: get_input failed, should do something\n");
-					return;
-				}
+				get_input(state);
 
 				/* Did we get what we want? */
-				if (state->lineoffset >= state->linelen)
+				if (evbuffer_get_length(state->inbuf) == 0)
 				{
 					/* No */
 					return;
 				}
 			}
 
-			len= state->linelen-state->lineoffset;
+			len= evbuffer_get_length(state->inbuf);
+			if (state->content_length >= 0 &&
+				state->content_offset+len >
+				state->content_length)
+			{
+				/* Anything after that belongs to the next
+				 * response.
+				 */
+				len= state->content_length-
+					state->content_offset;
+			}
 			if (state->content_offset+len <= state->max_body)
 			{
 #if 0
@@ -1722,21 +1980,38 @@ static void readcb(struct bufferevent *bev UNUSED_PARAM, void *ptr)
 				"readcb: should add truncation indicator\n");
 			}
 
+			consume_body(state, len);
 			state->content_offset += len;
-			state->lineoffset += len;
 
 			continue;
 
 		case READ_DONE:
 			if (state->bev || state->response_in)
 			{
-				state->bev= NULL;
 				gettime_mono(&endtime);
 				state->resptime=
 					(endtime.tv_sec-
 					state->start.tv_sec)*1e3 +
 					(endtime.tv_nsec-
 					state->start.tv_nsec)/1e6;
+				if (state->reqid+1 < state->npaths)
+				{
+					next_request(state);
+
+					/* Wait for the next response unless
+					 * (part of) it is already here.
+					 */
+					if (evbuffer_get_length(
+						state->inbuf) == 0 &&
+						evbuffer_get_length(
+						bufferevent_get_input(
+						state->bev)) == 0)
+					{
+						return;
+					}
+					continue;
+				}
+				state->bev= NULL;
 				report(state);
 			}
 			return;
@@ -1786,9 +2061,34 @@ static int post_file(struct hgstate *state, const char *filename)
 	return r;
 }
 
+/* Add the request line and headers. The empty line that ends the headers
+ * is left to the caller for a POST.
+ */
+static void add_request(struct hgstate *state, struct evbuffer *output,
+	int reqid)
+{
+	evbuffer_add_printf(output, "%s %s HTTP/1.%c\r\n",
+		state->do_get ? "GET" :
+		state->do_head ? "HEAD" : "POST", state->paths[reqid],
+		state->do_http10 ? '0' : '1');
+	evbuffer_add_printf(output, "Host: %s\r\n",
+		state->hostport);
+	evbuffer_add_printf(output, "Connection: %s\r\n",
+		reqid+1 < state->npaths ? "keep-alive" : "close");
+	evbuffer_add_printf(output, "User-Agent: %s\r\n",
+		state->user_agent);
+	if (state->do_post)
+	{
+		evbuffer_add_printf(output,
+	"Content-Type: application/x-www-form-urlencoded\r\n");
+	}
+	else
+		evbuffer_add_printf(output, "\r\n");
+}
+
 static void writecb(struct bufferevent *bev, void *ptr)
 {
-	int r;
+	int i, r;
 	struct hgstate *state;
 	struct evbuffer *output;
 	off_t cLength;
@@ -1819,24 +2119,23 @@ static void writecb(struct bufferevent *bev, void *ptr)
 				continue;
 			}
 			output= bufferevent_get_output(bev);
-			evbuffer_add_printf(output, "%s %s HTTP/1.%c\r\n",
-				state->do_get ? "GET" :
-				state->do_head ? "HEAD" : "POST", state->path,
-				state->do_http10 ? '0' : '1');
-			evbuffer_add_printf(output, "Host: %s\r\n",
-				state->hostport);
-			evbuffer_add_printf(output, "Connection: close\r\n");
-			evbuffer_add_printf(output, "User-Agent: %s\r\n",
-				state->user_agent);
-			if (state->do_post)
+			add_request(state, output, 0);
+			if (state->do_pipeline)
 			{
-				evbuffer_add_printf(output,
-			"Content-Type: application/x-www-form-urlencoded\r\n");
+				for (i= 1; i<state->npaths; i++)
+					add_request(state, output, i);
+			}
+			if (state->npaths > 1)
+			{
+				/* Time requests from here, ttc covers
+				 * the connection setup.
+				 */
+				gettime_mono(&state->start);
 			}
 
-			cLength= 0;
 			if (state->do_post)
 			{
+				cLength= 0;
 				if (state->post_header)
 				{
 					if (stat(state->post_header, &sb) == 0)
@@ -1855,9 +2154,9 @@ static void writecb(struct bufferevent *bev, void *ptr)
 				evbuffer_add_printf(output,
 					"Content-Length: %lu\r\n",
 					(unsigned long)cLength);
+				evbuffer_add_printf(output, "\r\n");
 			}
 
-			evbuffer_add_printf(output, "\r\n");
 			if (state->do_post)
 				state->writestate = WRITE_POST_HEADER;
 			else
@@ -1922,6 +2221,7 @@ static void err_reading(struct hgstate *state)
 
 	switch(state->readstate)
 	{
+	case READ_FIRST:
 	case READ_STATUS:
 		add_str(state, ", " DBQ(err) ":" DBQ(error reading status));
 		report(state);
@@ -1987,8 +2287,9 @@ static void beforeconnect(struct tu_env *env,
 	state->readstate= READ_FIRST;
 	state->writestate= WRITE_FIRST;
 
-	state->linelen= 0;
-	state->lineoffset= 0;
+	line_done(state);
+	evbuffer_drain(state->inbuf, evbuffer_get_length(state->inbuf));
+	state->digest_active= 0;
 	state->headers_size= 0;
 	state->tot_headers= 0;
 	state->roffset= 0;
@@ -2129,6 +2430,8 @@ static void httpget_start(void *state)
 	}
 	hgstate->busy= 1;
 
+	hgstate->reqid= 0;
+	hgstate->digest_active= 0;
 	hgstate->dnserr= 0;
 	hgstate->connecting= 0;
 	hgstate->readstate= READ_STATUS;
@@ -2222,9 +2525,6 @@ static int httpget_delete(void *state)
 	if (hgstate->busy)
 		return 0;
 
-	if (hgstate->line)
-		crondlog(DIE9 "line is not empty");
-
 	base= hgstate->base;
 	ind= hgstate->index;
 
@@ -2248,8 +2548,10 @@ static int httpget_delete(void *state)
 	hgstate->hostport= NULL;
 	free(hgstate->port);
 	hgstate->port= NULL;
-	free(hgstate->path);
-	hgstate->path= NULL;
+	for (ind= 0; ind<hgstate->npaths; ind++)
+		free(hgstate->paths[ind]);
+	free(hgstate->paths);
+	hgstate->paths= NULL;
 	free(hgstate->user_agent);
 	hgstate->user_agent= NULL;
 	free(hgstate->post_header);
@@ -2258,8 +2560,14 @@ static int httpget_delete(void *state)
 	hgstate->post_file= NULL;
 	free(hgstate->post_footer);
 	hgstate->post_footer= NULL;
-
-	free(hgstate);
+	evbuffer_free(hgstate->inbuf);
+	hgstate->inbuf= NULL;
+	free(hgstate->checkpoints);
+	hgstate->checkpoints= NULL;
+	free(hgstate->check_digests);
+	hgstate->check_digests= NULL;
+
+	atlas_pool_free(state_pool, hgstate);
 
 	return 1;
 }
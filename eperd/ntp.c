@@ -16,6 +16,7 @@
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 
+#include "atlas_pool.h"
 #include "eperd.h"
 
 #define SAFE_PREFIX_REL ATLAS_DATA_NEW_REL
@@ -31,10 +32,11 @@
 
 #define NTP_PORT	123
 
-#define NTP_OPT_STRING ("!46c:i:w:A:B:O:R:W:")
+#define NTP_OPT_STRING ("!46c:i:w:A:B:O:R:W:g:")
 
 #define OPT_4	(1 << 0)
 #define OPT_6	(1 << 1)
+#define OPT_g	(1 << 10)
 
 #define IPHDR              20
 
@@ -54,6 +56,33 @@ struct ntp_ts
 	uint32_t ntp_fraction;
 };
 
+struct ntphdr
+{
+	uint8_t ntp_flags;
+	uint8_t ntp_stratum;
+	int8_t ntp_poll;
+	int8_t ntp_precision;
+	uint32_t ntp_root_delay;
+	uint32_t ntp_root_dispersion;
+	uint32_t ntp_reference_id;
+	struct ntp_ts ntp_reference_ts;
+	struct ntp_ts ntp_origin_ts;
+	struct ntp_ts ntp_receive_ts;
+	struct ntp_ts ntp_transmit_ts;
+};
+
+/* Burst mode, one per packet */
+struct ntp_slot
+{
+	struct ntp_ts xmit_ts;		/* Also identifies the reply */
+	enum { SLOT_SENT, SLOT_ANSWERED, SLOT_ERROR } status;
+	int error;			/* errno for SLOT_ERROR */
+	struct ntphdr reply;
+	struct timeval final_time;
+	double rtt;
+	double offset;
+};
+
 struct ntpbase
 {
 	struct event_base *event_base;
@@ -84,6 +113,10 @@ struct ntpstate
 	char do_v6;
 	char count;
 	unsigned timeout;
+	unsigned gap;			/* Burst mode, us between packets */
+	unsigned burst:1;		/* Send all packets without waiting
+					 * for replies
+					 */
 	char *response_in;	/* Fuzzing */
 	char *response_out;
 
@@ -133,6 +166,7 @@ struct ntpstate
 	struct ntp_ts ntp_reference_ts;
 
 	struct event timer;
+	struct pace_entry pace;
 
 	unsigned long min;
 	unsigned long max;
@@ -141,6 +175,13 @@ struct ntpstate
 	int rcvdpkts;
 	int duppkts;
 
+	struct ntp_slot *slots;		/* Burst mode, 'count' of them */
+	int answered;
+	double rtt_min;			/* Burst summary */
+	double rtt_median;
+	double offset_best;		/* Offset of the fastest reply */
+	double offset_median;
+
 	char *result;
 	size_t reslen;
 	size_t resmax;
@@ -150,21 +191,7 @@ struct ntpstate
 };
 
 static struct ntpbase *ntp_base;
-
-struct ntphdr
-{
-	uint8_t ntp_flags;
-	uint8_t ntp_stratum;
-	int8_t ntp_poll;
-	int8_t ntp_precision;
-	uint32_t ntp_root_delay;
-	uint32_t ntp_root_dispersion;
-	uint32_t ntp_reference_id;
-	struct ntp_ts ntp_reference_ts;
-	struct ntp_ts ntp_origin_ts;
-	struct ntp_ts ntp_receive_ts;
-	struct ntp_ts ntp_transmit_ts;
-};
+static struct atlas_pool *state_pool;
 
 #define NTP_LI_MASK		0xC0
 #define NTP_LI_SHIFT		   6
@@ -197,6 +224,10 @@ struct ntphdr
 static void ready_callback(int __attribute((unused)) unused,
 	const short __attribute((unused)) event, void *s);
 static int create_socket(struct ntpstate *state);
+static void burst_reply(struct ntpstate *state, struct ntphdr *ntphdr,
+	struct timeval *now);
+
+ACCT_CALLBACK(acct_ready_callback, ready_callback, ntp_ops)
 
 static void add_str(struct ntpstate *state, const char *str)
 {
@@ -352,7 +383,7 @@ static void report(struct ntpstate *state)
 
 	if (state->out_filename)
 	{
-		fh= fopen(state->out_filename, "a");
+		fh= atlas_fopen_append(state->out_filename);
 		if (!fh)
 			crondlog(DIE9 "ntp: unable to append to '%s'",
 				state->out_filename);
@@ -455,6 +486,14 @@ static void report(struct ntpstate *state)
 		fprintf(fh, ", %s", line);
 	}
 
+	if (state->burst && state->rcvdpkts)
+	{
+		fprintf(fh, ", " DBQ(rtt-min) ": %f, " DBQ(rtt-median) ": %f"
+			", " DBQ(offset-best) ": %f, " DBQ(offset-median) ": %f",
+			state->rtt_min, state->rtt_median,
+			state->offset_best, state->offset_median);
+	}
+
 	fprintf(fh, ", " DBQ(result) ": [ %s ] }\n", state->result);
 
 	free(state->result);
@@ -477,11 +516,19 @@ static void report(struct ntpstate *state)
 		state->base->done(state, 0);
 }
 
+static void send_pkt(struct ntpstate *state);
+
+static void send_paced(void *ref)
+{
+	send_pkt(ref);
+}
+
 static void send_pkt(struct ntpstate *state)
 {
-	int r, len, serrno;
+	int r, len, serrno, paced;
 	struct ntpbase *base;
 	struct ntphdr *ntphdr;
+	struct ntp_slot *slot;
 	double d;
 	struct timeval interval;
 	char line[80];
@@ -498,7 +545,14 @@ static void send_pkt(struct ntpstate *state)
 		report(state);
 		return;
 	}
+
+	paced= pace_send(&state->pace, (struct sockaddr *)&state->sin6,
+		send_paced, state);
+	if (paced == 0)
+		return;		/* Comes back through send_paced */
+
 	state->seq++;
+	slot= state->burst ? &state->slots[state->sent] : NULL;
 
 	ntphdr= (struct ntphdr *)base->packet;
 	len= sizeof(*ntphdr);
@@ -512,9 +566,24 @@ static void send_pkt(struct ntpstate *state)
 		htonl(state->xmit_time.tv_sec + NTP_1970);
 	d= state->xmit_time.tv_usec / 1e6;
 	d *= NTP_4G;
-	ntphdr->ntp_transmit_ts.ntp_fraction= htonl((uint32_t)d);
+	if (slot)
+	{
+		/* Replies are matched on the transmit timestamp, put the
+		 * packet number in the low bits to make it unique.
+		 */
+		ntphdr->ntp_transmit_ts.ntp_fraction=
+			htonl(((uint32_t)d & ~0xffU) | state->sent);
+		slot->xmit_ts= ntphdr->ntp_transmit_ts;
+		slot->status= SLOT_SENT;
+	}
+	else
+		ntphdr->ntp_transmit_ts.ntp_fraction= htonl((uint32_t)d);
 
-	if (state->sin6.sin6_family == AF_INET6)
+	if (paced == -1)
+	{
+		/* Dropped by the pacer, times out like a lost packet */
+	}
+	else if (state->sin6.sin6_family == AF_INET6)
 	{
 		/* Set port */
 		state->sin6.sin6_port= htons(NTP_PORT);
@@ -529,6 +598,7 @@ static void send_pkt(struct ntpstate *state)
 			r= sendto(state->socket, base->packet, len, 0,
 				(struct sockaddr *)&state->sin6,
 				state->socklen);
+			acct_io(&ntp_ops, state, ACCT_OUT, r);
 		}
 
 #if 0
@@ -540,6 +610,13 @@ static void send_pkt(struct ntpstate *state)
 		if (r == -1)
 		{
 			if (serrno != EACCES &&
+				serrno != ECONNREFUSED &&
+				serrno != EMSGSIZE && slot)
+			{
+				slot->status= SLOT_ERROR;
+				slot->error= serrno;
+			}
+			else if (serrno != EACCES &&
 				serrno != ECONNREFUSED &&
 				serrno != EMSGSIZE)
 			{
@@ -572,6 +649,7 @@ static void send_pkt(struct ntpstate *state)
 			r= sendto(state->socket, base->packet, len, 0,
 				(struct sockaddr *)&state->sin6,
 				state->socklen);
+			acct_io(&ntp_ops, state, ACCT_OUT, r);
 		}
 
 #if 0
@@ -582,7 +660,12 @@ static void send_pkt(struct ntpstate *state)
 		serrno= errno;
 		if (r == -1)
 		{
-			if (serrno != EMSGSIZE)
+			if (serrno != EMSGSIZE && slot)
+			{
+				slot->status= SLOT_ERROR;
+				slot->error= serrno;
+			}
+			else if (serrno != EMSGSIZE)
 			{
 				serrno= errno;
 
@@ -597,18 +680,42 @@ static void send_pkt(struct ntpstate *state)
 		}
 	}
 
-	if (state->open_result)
-		add_str(state, " }, ");
-	add_str(state, "{ ");
-	state->open_result= 0;
+	if (slot)
+	{
+		/* The result is put together at the end */
+		state->sent++;
 
-	/* Increment packets sent */
-	state->sent++;
+		/* Next packet after the gap, after the last one wait for
+		 * the replies.
+		 */
+		if (state->sent < state->count)
+		{
+			interval.tv_sec= state->gap/1000000;
+			interval.tv_usec= state->gap % 1000000;
+			evtimer_add(&state->timer, &interval);
+		}
+		else
+		{
+			interval.tv_sec= state->timeout/1000000;
+			interval.tv_usec= state->timeout % 1000000;
+			common_timer_add(&state->timer, &interval);
+		}
+	}
+	else
+	{
+		if (state->open_result)
+			add_str(state, " }, ");
+		add_str(state, "{ ");
+		state->open_result= 0;
 
-	/* Set timer */
-	interval.tv_sec= state->timeout/1000000;
-	interval.tv_usec= state->timeout % 1000000;
-	evtimer_add(&state->timer, &interval);
+		/* Increment packets sent */
+		state->sent++;
+
+		/* Set timer */
+		interval.tv_sec= state->timeout/1000000;
+		interval.tv_usec= state->timeout % 1000000;
+		common_timer_add(&state->timer, &interval);
+	}
 
 	if (state->response_in)
 	{
@@ -619,100 +726,53 @@ static void send_pkt(struct ntpstate *state)
 	}
 }
 
-static void ready_callback(int __attribute((unused)) unused,
-	const short __attribute((unused)) event, void *s)
+static void ntp_final_ts(struct timeval *now, struct ntp_ts *final_ts)
 {
-	struct ntpbase *base;
-	struct ntpstate *state;
-	int head;
-	ssize_t nrecv;
-	socklen_t slen;
 	double d;
-	struct ntphdr *ntphdr;
-	struct timeval now;
-	struct ntp_ts final_ts;
-	struct sockaddr_in remote;
-	char line[80];
 
-	state= s;
-
-	if (state->response_in)
-	{
-		size_t len;
-
-		len= sizeof(now);
-		read_response(state->socket, RESP_TIMEOFDAY,
-				&len, &now);
-	}
-	else
-	{
-		gettimeofday(&now, NULL);
-		if (state->resp_file_out)
-		{
-			write_response(state->resp_file_out, RESP_TIMEOFDAY,
-				sizeof(now), &now);
-		}
-	}
-
-	base= state->base;
-
-	slen= sizeof(remote);
-	if (state->response_in)
-	{
-		size_t len;
-
-		len= sizeof(base->packet);
-		read_response(state->socket, RESP_PACKET,
-			&len, base->packet);
-		nrecv= len;
-		len= sizeof(remote);
-		read_response(state->socket, RESP_DSTADDR,
-			&len, &remote);
-		slen= len;
-	}
-	else
-	{
-		nrecv= recvfrom(state->socket, base->packet,
-			sizeof(base->packet),
-			MSG_DONTWAIT, (struct sockaddr *)&remote, &slen);
-	}
-	if (nrecv == -1)
-	{
-		/* Strange, read error */
-		printf("ready_callback: read error '%s'\n", strerror(errno));
-		return;
-	}
-	// printf("ready_callback: got packet\n");
-
-	if (state->resp_file_out)
-	{
-		write_response(state->resp_file_out, RESP_PACKET,
-			nrecv, base->packet);
-		write_response(state->resp_file_out, RESP_DSTADDR,
-			sizeof(remote), &remote);
-	}
+	final_ts->ntp_seconds= now->tv_sec + NTP_1970;
+	d= now->tv_usec / 1e6;
+	d *= 4294967296.0;
+	final_ts->ntp_fraction= d;
+}
 
+/* Round trip time and clock offset from the four timestamps */
+static void ntp_times(struct ntphdr *ntphdr, struct ntp_ts *final_ts,
+	double *rttp, double *offsetp)
+{
+	*rttp= final_ts->ntp_seconds -
+		ntohl(ntphdr->ntp_origin_ts.ntp_seconds) -
+		(ntohl(ntphdr->ntp_transmit_ts.ntp_seconds) -
+		ntohl(ntphdr->ntp_receive_ts.ntp_seconds)) +
+		final_ts->ntp_fraction/NTP_4G -
+		ntohl(ntphdr->ntp_origin_ts.ntp_fraction)/NTP_4G -
+		(ntohl(ntphdr->ntp_transmit_ts.ntp_fraction)/NTP_4G -
+		ntohl(ntphdr->ntp_receive_ts.ntp_fraction)/NTP_4G);
 
-	if (nrecv < sizeof(*ntphdr))
-	{
-		/* Short packet */
-		printf("ready_callback: too short %d\n", (int)nrecv);
-		return;
-	}
+	*offsetp= (ntohl(ntphdr->ntp_origin_ts.ntp_seconds) +
+		final_ts->ntp_seconds)/2.0 -
+		(ntohl(ntphdr->ntp_receive_ts.ntp_seconds) +
+		ntohl(ntphdr->ntp_transmit_ts.ntp_seconds))/2.0 +
+		(ntohl(ntphdr->ntp_origin_ts.ntp_fraction)/NTP_4G +
+		final_ts->ntp_fraction/NTP_4G)/2.0 -
+		(ntohl(ntphdr->ntp_receive_ts.ntp_fraction)/NTP_4G +
+		ntohl(ntphdr->ntp_transmit_ts.ntp_fraction)/NTP_4G)/2.0;
+}
 
-	if (!state->busy)
-	{
-printf("%s, %d: sin6_family = %d\n", __FILE__, __LINE__, state->sin6.sin6_family);
-		return;
-	}
+/* Add the result for one reply */
+static void add_reply(struct ntpstate *state, struct ntphdr *ntphdr,
+	struct timeval *now)
+{
+	int head;
+	double d, rtt, offset;
+	struct ntp_ts final_ts;
+	char line[80];
 
 	if (state->open_result)
 		add_str(state, " }, { ");
 
 	head= 1;
 
-	ntphdr= (struct ntphdr *)base->packet;
-
 	if (state->first)
 	{
 		/* Copy mostly static fields */
@@ -845,39 +905,233 @@ printf("%s, %d: sin6_family = %d\n", __FILE__, __LINE__, state->sin6.sin6_family
 	snprintf(line, sizeof(line), ", " DBQ(transmit-ts) ": %.9f", d);
 	add_str(state, line);
 
-	final_ts.ntp_seconds= now.tv_sec + NTP_1970;
-	d= now.tv_usec / 1e6;
-	d *= 4294967296.0;
-	final_ts.ntp_fraction= d;
+	ntp_final_ts(now, &final_ts);
 
 	d= final_ts.ntp_seconds + final_ts.ntp_fraction/NTP_4G;
 	snprintf(line, sizeof(line), ", " DBQ(final-ts) ": %.9f", d);
 	add_str(state, line);
 
-	/* Compute rtt */
-	d= final_ts.ntp_seconds - ntohl(ntphdr->ntp_origin_ts.ntp_seconds) -
-		(ntohl(ntphdr->ntp_transmit_ts.ntp_seconds) -
-		ntohl(ntphdr->ntp_receive_ts.ntp_seconds)) +
-		final_ts.ntp_fraction/NTP_4G -
-		ntohl(ntphdr->ntp_origin_ts.ntp_fraction)/NTP_4G -
-		(ntohl(ntphdr->ntp_transmit_ts.ntp_fraction)/NTP_4G -
-		ntohl(ntphdr->ntp_receive_ts.ntp_fraction)/NTP_4G);
-	snprintf(line, sizeof(line), ", " DBQ(rtt) ": %f", d);
+	ntp_times(ntphdr, &final_ts, &rtt, &offset);
+	snprintf(line, sizeof(line), ", " DBQ(rtt) ": %f", rtt);
 	add_str(state, line);
 
-	d= (ntohl(ntphdr->ntp_origin_ts.ntp_seconds) +
-		final_ts.ntp_seconds)/2.0 -
-		(ntohl(ntphdr->ntp_receive_ts.ntp_seconds) +
-		ntohl(ntphdr->ntp_transmit_ts.ntp_seconds))/2.0 +
-		(ntohl(ntphdr->ntp_origin_ts.ntp_fraction)/NTP_4G +
-		final_ts.ntp_fraction/NTP_4G)/2.0 -
-		(ntohl(ntphdr->ntp_receive_ts.ntp_fraction)/NTP_4G +
-		ntohl(ntphdr->ntp_transmit_ts.ntp_fraction)/NTP_4G)/2.0;
-	snprintf(line, sizeof(line), ", " DBQ(offset) ": %f", d);
+	snprintf(line, sizeof(line), ", " DBQ(offset) ": %f", offset);
 	add_str(state, line);
 
 	state->open_result= 1;
-		
+}
+
+static int cmp_double(const void *p1, const void *p2)
+{
+	double d1, d2;
+
+	d1= *(const double *)p1;
+	d2= *(const double *)p2;
+	return d1 < d2 ? -1 : d1 > d2 ? 1 : 0;
+}
+
+static double median(double *values, int n)
+{
+	qsort(values, n, sizeof(*values), cmp_double);
+	if (n % 2)
+		return values[n/2];
+	return (values[n/2-1] + values[n/2])/2;
+}
+
+/* All packets of a burst are done (or timed out). Put the results
+ * together in the order the packets were sent.
+ */
+static void burst_done(struct ntpstate *state)
+{
+	int i, n, best;
+	struct ntp_slot *slot;
+	double *rtts, *offsets;
+	char line[80];
+
+	event_del(&state->timer);
+
+	for (i= 0; i<state->sent; i++)
+	{
+		slot= &state->slots[i];
+		add_str(state, i == 0 ? "{ " : " }, { ");
+		state->open_result= 0;
+		switch(slot->status)
+		{
+		case SLOT_ANSWERED:
+			add_reply(state, &slot->reply, &slot->final_time);
+			break;
+		case SLOT_ERROR:
+			snprintf(line, sizeof(line),
+				DBQ(error) ":" DBQ(sendto failed: %s),
+				strerror(slot->error));
+			add_str(state, line);
+			break;
+		default:
+			add_str(state, DBQ(x) ":" DBQ(*));
+			break;
+		}
+	}
+	if (state->sent)
+		add_str(state, " }");
+
+	/* Summary */
+	rtts= xmalloc(state->sent * sizeof(*rtts) + 1);
+	offsets= xmalloc(state->sent * sizeof(*offsets) + 1);
+	n= 0;
+	best= -1;
+	for (i= 0; i<state->sent; i++)
+	{
+		slot= &state->slots[i];
+		if (slot->status != SLOT_ANSWERED)
+			continue;
+		rtts[n]= slot->rtt;
+		offsets[n]= slot->offset;
+		n++;
+		if (best == -1 || slot->rtt < state->slots[best].rtt)
+			best= i;
+	}
+	if (n)
+	{
+		state->rtt_min= state->slots[best].rtt;
+		state->offset_best= state->slots[best].offset;
+		state->rtt_median= median(rtts, n);
+		state->offset_median= median(offsets, n);
+	}
+	state->rcvdpkts= n;
+	free(rtts);
+	free(offsets);
+
+	report(state);
+}
+
+static void burst_reply(struct ntpstate *state, struct ntphdr *ntphdr,
+	struct timeval *now)
+{
+	int i;
+	struct ntp_slot *slot;
+	struct ntp_ts final_ts;
+
+	for (i= 0, slot= state->slots; i<state->sent; i++, slot++)
+	{
+		if (memcmp(&slot->xmit_ts, &ntphdr->ntp_origin_ts,
+			sizeof(slot->xmit_ts)) == 0)
+		{
+			break;
+		}
+	}
+	if (i >= state->sent)
+		return;		/* Not for us */
+	if (slot->status != SLOT_SENT)
+	{
+		state->duppkts++;
+		return;
+	}
+
+	slot->status= SLOT_ANSWERED;
+	slot->reply= *ntphdr;
+	slot->final_time= *now;
+	ntp_final_ts(now, &final_ts);
+	ntp_times(ntphdr, &final_ts, &slot->rtt, &slot->offset);
+	state->answered++;
+
+	if (state->sent >= state->count && state->answered >= state->count)
+		burst_done(state);
+}
+
+static void ready_callback(int __attribute((unused)) unused,
+	const short __attribute((unused)) event, void *s)
+{
+	struct ntpbase *base;
+	struct ntpstate *state;
+	ssize_t nrecv;
+	socklen_t slen;
+	struct ntphdr *ntphdr;
+	struct timeval now;
+	struct sockaddr_in remote;
+
+	state= s;
+
+	if (state->response_in)
+	{
+		size_t len;
+
+		len= sizeof(now);
+		read_response(state->socket, RESP_TIMEOFDAY,
+				&len, &now);
+	}
+	else
+	{
+		gettimeofday(&now, NULL);
+		if (state->resp_file_out)
+		{
+			write_response(state->resp_file_out, RESP_TIMEOFDAY,
+				sizeof(now), &now);
+		}
+	}
+
+	base= state->base;
+
+	slen= sizeof(remote);
+	if (state->response_in)
+	{
+		size_t len;
+
+		len= sizeof(base->packet);
+		read_response(state->socket, RESP_PACKET,
+			&len, base->packet);
+		nrecv= len;
+		len= sizeof(remote);
+		read_response(state->socket, RESP_DSTADDR,
+			&len, &remote);
+		slen= len;
+	}
+	else
+	{
+		nrecv= recvfrom(state->socket, base->packet,
+			sizeof(base->packet),
+			MSG_DONTWAIT, (struct sockaddr *)&remote, &slen);
+	}
+	if (nrecv == -1)
+	{
+		/* Strange, read error */
+		printf("ready_callback: read error '%s'\n", strerror(errno));
+		return;
+	}
+	acct_io(&ntp_ops, state, ACCT_IN, nrecv);
+	// printf("ready_callback: got packet\n");
+
+	if (state->resp_file_out)
+	{
+		write_response(state->resp_file_out, RESP_PACKET,
+			nrecv, base->packet);
+		write_response(state->resp_file_out, RESP_DSTADDR,
+			sizeof(remote), &remote);
+	}
+
+
+	if (nrecv < sizeof(*ntphdr))
+	{
+		/* Short packet */
+		printf("ready_callback: too short %d\n", (int)nrecv);
+		return;
+	}
+
+	if (!state->busy)
+	{
+printf("%s, %d: sin6_family = %d\n", __FILE__, __LINE__, state->sin6.sin6_family);
+		return;
+	}
+
+	ntphdr= (struct ntphdr *)base->packet;
+
+	if (state->burst)
+	{
+		burst_reply(state, ntphdr, &now);
+		return;
+	}
+
+	add_reply(state, ntphdr, &now);
+
 	send_pkt(state);
 }
 
@@ -910,6 +1164,16 @@ static void noreply_callback(int __attribute((unused)) unused,
 		state->gotresp);
 #endif
 
+	if (state->burst)
+	{
+		/* Either time for the next packet or the end */
+		if (state->sent < state->count)
+			send_pkt(state);
+		else
+			burst_done(state);
+		return;
+	}
+
 	if (!state->gotresp)
 	{
 		if (state->open_result)
@@ -936,6 +1200,7 @@ static void *ntp_init(int __attribute((unused)) argc, char *argv[],
 	const char *destportstr;
 	char *interface;
 	char *response_in, *response_out;
+	unsigned gap;
 	char *validated_response_in= NULL;
 	char *validated_response_out= NULL;
 	char *validated_out_filename= NULL;
@@ -958,11 +1223,12 @@ static void *ntp_init(int __attribute((unused)) argc, char *argv[],
 	out_filename= NULL;
 	response_in= NULL;
 	response_out= NULL;
-	opt_complementary = "=1:4--6:i--u:c+:w+:";
+	gap= 0;
+	opt_complementary = "=1:4--6:i--u:c+:w+:g+:";
 
 	opt = getopt32(argv, NTP_OPT_STRING, &count,
 		&interface, &timeout, &str_Atlas, &str_bundle, &out_filename,
-		&response_in, &response_out);
+		&response_in, &response_out, &gap);
 	hostname = argv[optind];
 
 	if (opt == 0xffffffff)
@@ -973,6 +1239,13 @@ static void *ntp_init(int __attribute((unused)) argc, char *argv[],
 
 	do_v6= !!(opt & OPT_6);
 
+	/* The packet number goes in the low bits of the transmit timestamp */
+	if ((opt & OPT_g) && (count < 1 || count > 127))
+	{
+		crondlog(LVL8 "bad count for burst mode: %u", count);
+		return NULL;
+	}
+
 	if (response_in)
 	{
 		validated_response_in= rebased_validated_filename(response_in,
@@ -1005,7 +1278,7 @@ static void *ntp_init(int __attribute((unused)) argc, char *argv[],
 			crondlog(LVL8 "insecure file '%s'", out_filename);
 			goto err;
 		}
-		fh= fopen(validated_out_filename, "a");
+		fh= atlas_fopen_append(validated_out_filename);
 		if (!fh)
 		{
 			crondlog(LVL8 "ntp: unable to append to '%s'",
@@ -1034,11 +1307,19 @@ static void *ntp_init(int __attribute((unused)) argc, char *argv[],
 
 	destportstr= "123";
 
-	state= xzalloc(sizeof(*state));
+	if (!state_pool)
+		state_pool= atlas_pool_new("ntp", sizeof(*state));
+	state= atlas_pool_zalloc(state_pool);
 	state->count= count;
 	state->interface= interface ? strdup(interface) : NULL;
 	state->destportstr= strdup(destportstr);
 	state->timeout= timeout*1000;
+	if (opt & OPT_g)
+	{
+		state->burst= 1;
+		state->gap= gap*1000;
+		state->slots= xzalloc(count * sizeof(*state->slots));
+	}
 	state->atlas= str_Atlas ? strdup(str_Atlas) : NULL;
 	state->bundle= str_bundle ? strdup(str_bundle) : NULL;
 	state->hostname= strdup(hostname);
@@ -1109,6 +1390,7 @@ static void traceroute_start2(void *state)
 	ntpstate->duppkts= 0;
 
 	ntpstate->sent= 0;
+	ntpstate->answered= 0;
 	ntpstate->seq= 0;
 	ntpstate->first= 1;
 	ntpstate->done= 0;
@@ -1247,7 +1529,7 @@ static int create_socket(struct ntpstate *state)
 	event_assign(&state->event_socket, state->base->event_base,
 		state->socket,
 		EV_READ | EV_PERSIST,
-		(af == AF_INET6 ? ready_callback : ready_callback),
+		acct_ready_callback,
 		state);
 	if (!state->response_in)
 		event_add(&state->event_socket, NULL);
@@ -1417,6 +1699,7 @@ static int ntp_delete(void *state)
 	base->table[ind]= NULL;
 
 	event_del(&ntpstate->timer);
+	pace_cancel(&ntpstate->pace);
 
 	free(ntpstate->atlas);
 	ntpstate->atlas= NULL;
@@ -1430,8 +1713,10 @@ static int ntp_delete(void *state)
 	ntpstate->out_filename= NULL;
 	free(ntpstate->interface);
 	ntpstate->interface= NULL;
+	free(ntpstate->slots);
+	ntpstate->slots= NULL;
 
-	free(ntpstate);
+	atlas_pool_free(state_pool, ntpstate);
 
 	return 1;
 }
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * pace.c -- token bucket pacing of the packets sent by all measurements
+ */
+
+#include "libbb.h"
+#include <event2/event.h>
+#include <event2/event_struct.h>
+
+#include "eperd.h"
+
+#define DBQ(str) "\"" #str "\""
+
+#define PACE_DEST_BUCKETS	256	/* Destinations are hashed into these */
+#define PACE_MAX_QUEUE		256	/* Waiting sends, more are dropped */
+#define PACE_MAX_WAIT		2.0	/* Seconds, then the send is dropped */
+#define PACE_MIN_TICK		0.001	/* Seconds */
+
+enum { PACE_IDLE, PACE_WAITING, PACE_GRANTED, PACE_DROPPED };
+
+struct bucket
+{
+	double tokens;
+	double last;		/* Time of the last refill */
+};
+
+static int pace_enabled;
+static unsigned pace_rate;	/* Packets per second, 0 for no limit */
+static unsigned pace_dest_rate;
+static struct bucket global_bucket;
+static struct bucket dest_buckets[PACE_DEST_BUCKETS];
+static struct event pace_timer;
+
+static struct pace_entry *queue_head;
+static struct pace_entry *queue_tail;
+static unsigned queue_len;
+
+static struct pace_counters
+{
+	uint64_t sent;		/* Without waiting */
+	uint64_t deferred;
+	uint64_t dropped;
+	double max_wait;	/* Seconds */
+} counters;
+
+static void pace_tick(evutil_socket_t fd, short what, void *arg);
+
+static double now_mono(void)
+{
+	struct timespec ts;
+
+	gettime_mono(&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Hash of the address, the port is not part of the destination */
+static unsigned dest_hash(const struct sockaddr *sa)
+{
+	const uint8_t *p;
+	size_t len;
+
+	if (sa->sa_family == AF_INET6)
+	{
+		p= (const uint8_t *)&((const struct sockaddr_in6 *)sa)->
+			sin6_addr;
+		len= sizeof(struct in6_addr);
+	}
+	else
+	{
+		p= (const uint8_t *)&((const struct sockaddr_in *)sa)->
+			sin_addr;
+		len= sizeof(struct in_addr);
+	}
+	return atlas_hash(ATLAS_HASH_INIT, p, len) % PACE_DEST_BUCKETS;
+}
+
+/* A rate of 0 means no limit. The bucket holds one second of tokens */
+static void refill(struct bucket *b, unsigned rate, double now)
+{
+	if (!rate)
+		return;
+	b->tokens += (now - b->last)*rate;
+	if (b->tokens > rate)
+		b->tokens= rate;
+	b->last= now;
+}
+
+/* Seconds until the bucket has a token */
+static double wait_time(struct bucket *b, unsigned rate)
+{
+	if (!rate || b->tokens >= 1)
+		return 0;
+	return (1 - b->tokens)/rate;
+}
+
+static int may_send(unsigned dest, double now)
+{
+	refill(&global_bucket, pace_rate, now);
+	refill(&dest_buckets[dest], pace_dest_rate, now);
+	return (!pace_rate || global_bucket.tokens >= 1) &&
+		(!pace_dest_rate || dest_buckets[dest].tokens >= 1);
+}
+
+static void take(unsigned dest)
+{
+	if (pace_rate)
+		global_bucket.tokens--;
+	if (pace_dest_rate)
+		dest_buckets[dest].tokens--;
+}
+
+static void unlink_entry(struct pace_entry *pe, struct pace_entry *prev)
+{
+	if (prev)
+		prev->next= pe->next;
+	else
+		queue_head= pe->next;
+	if (queue_tail == pe)
+		queue_tail= prev;
+	pe->next= NULL;
+	queue_len--;
+}
+
+static void schedule(double now)
+{
+	double t, wait;
+	struct pace_entry *pe;
+	struct timeval tv;
+
+	if (!queue_head)
+		return;
+
+	/* Next time one of the waiting sends can go, or has to be
+	 * dropped.
+	 */
+	wait= PACE_MAX_WAIT;
+	for (pe= queue_head; pe; pe= pe->next)
+	{
+		t= wait_time(&global_bucket, pace_rate);
+		if (wait_time(&dest_buckets[pe->dest], pace_dest_rate) > t)
+			t= wait_time(&dest_buckets[pe->dest], pace_dest_rate);
+		if (pe->since + PACE_MAX_WAIT - now < t)
+			t= pe->since + PACE_MAX_WAIT - now;
+		if (t < wait)
+			wait= t;
+	}
+	if (wait < PACE_MIN_TICK)
+		wait= PACE_MIN_TICK;
+	tv.tv_sec= wait;
+	tv.tv_usec= (wait - tv.tv_sec)*1e6;
+	event_add(&pace_timer, &tv);
+}
+
+void pace_init(struct event_base *base, unsigned rate, unsigned dest_rate)
+{
+	unsigned i;
+	double now;
+
+	pace_rate= rate;
+	pace_dest_rate= dest_rate;
+	pace_enabled= (rate || dest_rate);
+	if (!pace_enabled)
+		return;
+
+	now= now_mono();
+	global_bucket.tokens= rate;
+	global_bucket.last= now;
+	for (i= 0; i<PACE_DEST_BUCKETS; i++)
+	{
+		dest_buckets[i].tokens= dest_rate;
+		dest_buckets[i].last= now;
+	}
+	evtimer_assign(&pace_timer, base, pace_tick, NULL);
+}
+
+int pace_send(struct pace_entry *pe, const struct sockaddr *dst,
+	void (*cb)(void *ref), void *ref)
+{
+	double now;
+
+	if (!pace_enabled)
+		return 1;
+
+	switch(pe->state)
+	{
+	case PACE_GRANTED:
+		pe->state= PACE_IDLE;
+		return 1;
+	case PACE_DROPPED:
+		pe->state= PACE_IDLE;
+		errno= ENOBUFS;
+		return -1;
+	case PACE_WAITING:
+		return 0;	/* Still in the queue */
+	}
+
+	now= now_mono();
+	pe->dest= dest_hash(dst);
+
+	/* Do not overtake sends that are waiting */
+	if (!queue_head && may_send(pe->dest, now))
+	{
+		take(pe->dest);
+		counters.sent++;
+		return 1;
+	}
+
+	if (queue_len >= PACE_MAX_QUEUE)
+	{
+		counters.dropped++;
+		errno= ENOBUFS;
+		return -1;
+	}
+
+	pe->state= PACE_WAITING;
+	pe->since= now;
+	pe->cb= cb;
+	pe->ref= ref;
+	pe->next= NULL;
+	if (queue_tail)
+		queue_tail->next= pe;
+	else
+		queue_head= pe;
+	queue_tail= pe;
+	queue_len++;
+	counters.deferred++;
+
+	if (!evtimer_pending(&pace_timer, NULL))
+		schedule(now);
+	return 0;
+}
+
+void pace_cancel(struct pace_entry *pe)
+{
+	struct pace_entry *prev, *e;
+
+	if (pe->state != PACE_WAITING)
+	{
+		pe->state= PACE_IDLE;
+		return;
+	}
+	for (prev= NULL, e= queue_head; e; prev= e, e= e->next)
+	{
+		if (e == pe)
+		{
+			unlink_entry(pe, prev);
+			break;
+		}
+	}
+	pe->state= PACE_IDLE;
+	counters.dropped++;
+}
+
+/* Grant tokens to the waiting sends in order. A send for a destination that
+ * is over its budget is skipped, later sends to other destinations can go.
+ * Every measurement has at most one send waiting, so going through the
+ * queue in order takes turns between measurements.
+ */
+static void pace_tick(evutil_socket_t fd UNUSED_PARAM,
+	short what UNUSED_PARAM, void *arg UNUSED_PARAM)
+{
+	double now;
+	struct pace_entry *pe, *prev, *next, *ready, **readyp;
+
+	now= now_mono();
+	ready= NULL;
+	readyp= &ready;
+	for (prev= NULL, pe= queue_head; pe; pe= next)
+	{
+		next= pe->next;
+		if (now - pe->since >= PACE_MAX_WAIT)
+		{
+			pe->state= PACE_DROPPED;
+			counters.dropped++;
+		}
+		else if (may_send(pe->dest, now))
+		{
+			take(pe->dest);
+			pe->state= PACE_GRANTED;
+			if (now - pe->since > counters.max_wait)
+				counters.max_wait= now - pe->since;
+		}
+		else
+		{
+			prev= pe;
+			continue;
+		}
+		unlink_entry(pe, prev);
+		*readyp= pe;
+		readyp= &pe->next;
+	}
+
+	/* The callbacks may add new sends to the queue */
+	while (ready)
+	{
+		pe= ready;
+		ready= pe->next;
+		pe->next= NULL;
+		pe->cb(pe->ref);
+	}
+
+	if (!evtimer_pending(&pace_timer, NULL))
+		schedule(now_mono());
+}
+
+void pace_print_json(FILE *fh)
+{
+	fprintf(fh, "{ " DBQ(rate) ":%u, " DBQ(dest_rate) ":%u, "
+		DBQ(sent) ":%llu, " DBQ(deferred) ":%llu, "
+		DBQ(dropped) ":%llu, " DBQ(queued) ":%u, "
+		DBQ(max_wait_ms) ":%.3f }",
+		pace_rate, pace_dest_rate,
+		(unsigned long long)counters.sent,
+		(unsigned long long)counters.deferred,
+		(unsigned long long)counters.dropped,
+		queue_len, counters.max_wait*1000);
+	memset(&counters, '\0', sizeof(counters));
+}
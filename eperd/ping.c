@@ -17,16 +17,19 @@
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 
+#include "atlas_pool.h"
 #include "eperd.h"
+#include "aggregate.h"
 
 #define SAFE_PREFIX_REL ATLAS_DATA_NEW_REL
+#define SAFE_PREFIX_IN_REL ATLAS_DATA_OUT_REL
 
 /* Don't report psize yet. */
 #define DO_PSIZE	0
 
 #define DBQ(str) "\"" #str "\""
 
-#define PING_OPT_STRING ("!46eprc:s:A:B:O:i:I:R:W:")
+#define PING_OPT_STRING ("!46eprCLc:s:A:B:O:i:I:R:W:T:G:")
 
 enum 
 {
@@ -35,11 +38,14 @@ enum
 	opt_e = (1 << 2),
 	opt_p = (1 << 3),
 	opt_r = (1 << 4),
+	opt_C = (1 << 5),
+	opt_L = (1 << 6),
 };
 
 /* Intervals and timeouts (all are in milliseconds unless otherwise specified)
  */
 #define DEFAULT_PING_INTERVAL   1000           /* 1 sec - 0 means flood mode */
+#define MIN_GROUP_TICK		100		/* Microseconds */
 
 /* Max IP packet size is 65536 while fixed IP header size is 20;
  * the traditional ping program transmits 56 bytes of data, so the
@@ -108,6 +114,7 @@ struct pingstate
 	char *out_filename;
 	char include_probe_id;
 	char delay_name_res;
+	char report_sendlag;
 	unsigned interval;
 
 	/* State */
@@ -156,14 +163,42 @@ struct pingstate
 					 */
 	double ttr;			/* Time to resolve a name, in ms */
 
-	struct event ping_timer;       /* Timer to ping host at given
-					* intervals
-					*/
+	struct send_timer ping_timer;	/* Timer to ping host at given
+					 * intervals
+					 */
+	struct pace_entry pace;
+	struct timespec planned;	/* When the next packet should go */
+	char have_planned;
+	double sendlag;			/* Last packet went this late, in ms */
 
 	/* Packets Counters */
 	size_t cursize;
 	counter_t sentpkts;            /* Total # of ICMP Echo Requests sent */
 
+	/* Multiple targets. The group owns the socket and a single timer
+	 * that paces the packets for all targets. Each target is a
+	 * pingstate of its own, with an index in the table, so replies
+	 * are matched in the usual way.
+	 */
+	struct pingstate *group;	/* Set for a target in a group */
+	struct pingstate **targets;
+	unsigned ntargets;
+	unsigned nexttarget;		/* Round robin */
+	unsigned tick;			/* Time between sends, in us */
+	char combined;			/* One RESULT for all targets */
+
+	/* Summaries. With a window, replies are only counted and the
+	 * round trip times go into a histogram. A summary RESULT is
+	 * written for the first run that ends after the window.
+	 */
+	unsigned aggwin;		/* In seconds, 0 is off */
+	time_t aggstart;
+	unsigned aggruns;
+	unsigned aggsent;
+	unsigned aggrcvd;
+	unsigned aggdup;
+	struct agg_hist *agghist;
+
 	/* For fuzzing */
 	char *response_in;
 	char *response_out;
@@ -190,13 +225,11 @@ static void ready_callback4(int __attribute((unused)) unused,
 static void ready_callback6(int __attribute((unused)) unused,
 	const short __attribute((unused)) event, void * arg);
 
-/* Initialize a struct timeval by converting milliseconds */
-static void
-msecstotv(time_t msecs, struct timeval *tv)
-{
-	tv->tv_sec  = msecs / 1000;
-	tv->tv_usec = msecs % 1000 * 1000;
-}
+ACCT_CALLBACK(acct_ready_callback4, ready_callback4, ping_ops)
+ACCT_CALLBACK(acct_ready_callback6, ready_callback6, ping_ops)
+
+static struct atlas_pool *state_pool;
+static struct atlas_pool *target_pool;
 
 static void add_str(struct pingstate *state, const char *str)
 {
@@ -213,17 +246,13 @@ static void add_str(struct pingstate *state, const char *str)
 	//printf("add_str: result = '%s'\n", state->result);
 }
 
-static void report(struct pingstate *state)
+static FILE *report_head(struct pingstate *state)
 {
-	int r;
 	FILE *fh;
-	struct addrinfo *ai;
-	char namebuf[NI_MAXHOST];
-	struct addrinfo hints;
 
 	if (state->out_filename)
 	{
-		fh= fopen(state->out_filename, "a");
+		fh= atlas_fopen_append(state->out_filename);
 		if (!fh)
 			crondlog(DIE9 "ping: unable to append to '%s'",
 				state->out_filename);
@@ -244,6 +273,16 @@ static void report(struct pingstate *state)
 		if (state->bundle_id)
 			fprintf(fh, DBQ(bundle) ":%s, ", state->bundle_id);
 	}
+	return fh;
+}
+
+/* Everything but the result */
+static void report_target(struct pingstate *state, FILE *fh)
+{
+	int r;
+	struct addrinfo *ai;
+	char namebuf[NI_MAXHOST];
+	struct addrinfo hints;
 
 	fprintf(fh, DBQ(dst_name) ":" DBQ(%s),
 		state->hostname);
@@ -295,14 +334,116 @@ static void report(struct pingstate *state)
 	if (state->psize != -1)
 		fprintf(fh, ", " DBQ(psize) ":%d", state->psize);
 #endif /* DO_PSIZE */
+}
 
-	fprintf(fh, ", \"result\": [ %s ] }\n", state->result);
+static void report_body(struct pingstate *state, FILE *fh)
+{
+	report_target(state, fh);
+	fprintf(fh, ", \"result\": [ %s ]", state->result);
+}
 
-	free(state->result);
-	state->result= NULL;
+/* Count a run that ended */
+static void agg_run(struct pingstate *state)
+{
+	if (state->aggruns == 0)
+		state->aggstart= atlas_time();
+	state->aggruns++;
+	state->aggsent += state->sentpkts;
+}
+
+static int agg_due(struct pingstate *state)
+{
+	return state->aggruns > 0 &&
+		atlas_time() - state->aggstart >= (time_t)state->aggwin;
+}
+
+/* Add the summary of a target and start a new window */
+static void agg_report(struct pingstate *state, FILE *fh)
+{
+	fprintf(fh, ", " DBQ(summary) ": { " DBQ(start) ":%ld, "
+		DBQ(window) ":%u, " DBQ(runs) ":%u, " DBQ(sent) ":%u, "
+		DBQ(rcvd) ":%u, " DBQ(dup) ":%u",
+		(long)state->aggstart, state->aggwin, state->aggruns,
+		state->aggsent, state->aggrcvd, state->aggdup);
+	agg_hist_report(fh, state->agghist);
+	fprintf(fh, " }");
+
+	state->aggruns= 0;
+	state->aggsent= 0;
+	state->aggrcvd= 0;
+	state->aggdup= 0;
+	agg_hist_init(state->agghist);
+}
+
+static void report_summary(struct pingstate *state)
+{
+	FILE *fh;
 
+	fh= report_head(state);
+	report_target(state, fh);
+	agg_report(state, fh);
+	fprintf(fh, " }\n");
 	if (state->out_filename)
 		fclose(fh);
+}
+
+static void group_summary(struct pingstate *group)
+{
+	unsigned i;
+	FILE *fh;
+
+	fh= report_head(group);
+	fprintf(fh, DBQ(targets) ": [ ");
+	for (i= 0; i<group->ntargets; i++)
+	{
+		fprintf(fh, "%s{ ", i ? ", " : "");
+		report_target(group->targets[i], fh);
+		agg_report(group->targets[i], fh);
+		fprintf(fh, " }");
+	}
+	fprintf(fh, " ] }\n");
+	if (group->out_filename)
+		fclose(fh);
+	group->aggruns= 0;
+}
+
+static void report(struct pingstate *state)
+{
+	FILE *fh;
+
+	if (state->aggwin)
+		agg_run(state);
+
+	if (state->group && state->group->combined)
+	{
+		/* The group reports all targets at the end */
+		state->busy= 0;
+		return;
+	}
+
+	if (state->aggwin)
+	{
+		if (agg_due(state))
+			report_summary(state);
+	}
+	else
+	{
+		fh= report_head(state);
+		report_body(state, fh);
+		fprintf(fh, " }\n");
+		if (state->out_filename)
+			fclose(fh);
+	}
+
+	free(state->result);
+	state->result= NULL;
+
+	if (state->group)
+	{
+		/* Socket belongs to the group */
+		state->busy= 0;
+		return;
+	}
 
 	/* Kill the event and close socket */
 	if (!state->response_in)
@@ -369,6 +510,23 @@ static void ping_cb(int result, int bytes, int psize,
 			DBQ(rtt) ":%f",
 			nsecs/1e6);
 		add_str(pingstate, line);
+		if (pingstate->report_sendlag && result != PING_ERR_DUP)
+		{
+			snprintf(line, sizeof(line),
+				", " DBQ(sendlag) ":%.3f", pingstate->sendlag);
+			add_str(pingstate, line);
+		}
+
+		if (pingstate->aggwin)
+		{
+			if (result == PING_ERR_DUP)
+				pingstate->aggdup++;
+			else
+			{
+				pingstate->aggrcvd++;
+				agg_hist_add(pingstate->agghist, nsecs/1e6);
+			}
+		}
 
 		if (!pingstate->got_reply && result != PING_ERR_DUP)
 		{
@@ -440,6 +598,12 @@ static void ping_cb(int result, int bytes, int psize,
 	}
 	if (result == PING_ERR_TIMEOUT || result == PING_ERR_SENDTO)
 	{
+		if (pingstate->report_sendlag)
+		{
+			snprintf(line, sizeof(line),
+				", " DBQ(sendlag) ":%.3f", pingstate->sendlag);
+			add_str(pingstate, line);
+		}
 		add_str(pingstate, " }");
 		pingstate->first= 0;
 	}
@@ -658,15 +822,37 @@ static void fmticmp6(u_char *buffer, size_t *sizep,
 }
 
 
+static void group_done(struct pingstate *group);
+
+static void ping_done(struct pingstate *state, int error)
+{
+	if (state->group)
+	{
+		group_done(state->group);
+		return;
+	}
+	if (state->base->done)
+		state->base->done(state, error);
+}
+
 /* Attempt to transmit an ICMP Echo Request to a given host */
+static void ping_xmit(struct pingstate *host);
+
+static void ping_paced(void *ref)
+{
+	ping_xmit(ref);
+}
+
 static void ping_xmit(struct pingstate *host)
 {
 	struct pingbase *base = host->base;
-	int nsent;
-	struct timeval tv_interval;
+	int nsent, paced;
+	struct timespec now;
 
 	if (host->sentpkts >= host->maxpkts)
 	{
+		host->have_planned= 0;
+
 		/* Done. */
 		ping_cb(PING_ERR_DONE, host->cursize, host->psize,
 			(struct sockaddr *)&host->sin6, host->socklen,
@@ -678,21 +864,55 @@ static void ping_xmit(struct pingstate *host)
 			evutil_freeaddrinfo(host->dns_res);
 			host->dns_res= NULL;
 		}
-		if (host->base->done)
-			host->base->done(host, host->error);
+		ping_done(host, host->error);
 
 		return;
 	}
 
+	/* Without a timer, the packet is planned to go now. A wait for
+	 * the pacer counts as lateness. Replies that are read from a file
+	 * have no real send times.
+	 */
+	if (!host->have_planned && !host->response_in)
+	{
+		gettime_mono(&host->planned);
+		host->have_planned= 1;
+	}
+
+	paced= pace_send(&host->pace, (struct sockaddr *)&host->sin6,
+		ping_paced, host);
+	if (paced == 0)
+		return;		/* Comes back through ping_paced */
+
+	if (host->have_planned)
+	{
+		gettime_mono(&now);
+		host->sendlag= (now.tv_sec-host->planned.tv_sec)*1e3 +
+			(now.tv_nsec-host->planned.tv_nsec)/1e6;
+		host->have_planned= 0;
+	}
+
 	/* Transmit the request over the network */
-	if (host->sin6.sin6_family == AF_INET6)
+	if (paced == -1)
+	{
+		/* Dropped by the pacer, reported as a failed send with
+		 * errno ENOBUFS.
+		 */
+		nsent= -1;
+	}
+	else if (host->sin6.sin6_family == AF_INET6)
 	{
 		/* Format the ICMP Echo Reply packet to send */
 		fmticmp6(base->packet, &host->cursize, host->seq, host->index,
 			base->pid, &host->cookie, host->include_probe_id);
 
-		host->loc_socklen= sizeof(host->loc_sin6);
-		if (host->response_in)
+		if (host->group)
+		{
+			/* Shared socket is not connected, keep the
+			 * address from target_start2.
+			 */
+		}
+		else if (host->response_in)
 		{
 			size_t len;
 
@@ -703,6 +923,7 @@ static void ping_xmit(struct pingstate *host)
 		}
 		else
 		{
+			host->loc_socklen= sizeof(host->loc_sin6);
 			getsockname(host->socket, &host->loc_sin6,
 				&host->loc_socklen);
 			if (host->resp_file_out)
@@ -734,8 +955,12 @@ static void ping_xmit(struct pingstate *host)
 			host->index, base->pid, &host->cookie,
 			host->include_probe_id);
 
-		host->loc_socklen= sizeof(host->loc_sin6);
-		getsockname(host->socket, &host->loc_sin6, &host->loc_socklen);
+		if (!host->group)
+		{
+			host->loc_socklen= sizeof(host->loc_sin6);
+			getsockname(host->socket, &host->loc_sin6,
+				&host->loc_socklen);
+		}
 
 		if (host->response_in)
 		{
@@ -755,6 +980,7 @@ static void ping_xmit(struct pingstate *host)
 	  {
 	    /* Update timestamps and counters */
 	    host->sentpkts++;
+	    acct_io(&ping_ops, host, ACCT_OUT, nsent);
 
 	  }
 	else
@@ -771,10 +997,16 @@ static void ping_xmit(struct pingstate *host)
 	}
 
 
-	/* Add the timer to handle no reply condition in the given timeout */
-	msecstotv(host->interval, &tv_interval);
-	if (!host->response_in)
-		evtimer_add(&host->ping_timer, &tv_interval);
+	/* Add the timer to handle no reply condition in the given timeout.
+	 * The next packet is planned one interval after this one was,
+	 * not after it actually went. In a group, the group timer comes
+	 * back to this target.
+	 */
+	if (!host->response_in && !host->group)
+	{
+		send_timer_add_after(&host->ping_timer, &host->planned,
+			host->interval*1000);
+	}
 
 	if (host->response_in)
 	{
@@ -804,6 +1036,16 @@ static void noreply_callback(int __attribute((unused)) unused, const short __att
 	ping_xmit(host);
 }
 
+/* The next packet is due */
+static void ping_timer_cb(void *ref)
+{
+	struct pingstate *host = ref;
+
+	host->planned= host->ping_timer.due;
+	host->have_planned= 1;
+	noreply_callback(-1, -1, host);
+}
+
 /*
  * Called by libevent when the kernel says that the raw socket is ready for reading.
  *
@@ -859,6 +1101,7 @@ static void ready_callback4 (int __attribute((unused)) unused,
 	  {
 	    goto done;
 	  }
+	acct_io(&ping_ops, state, ACCT_IN, nrecv);
 
 	if (state->resp_file_out)
 	{
@@ -914,7 +1157,11 @@ static void ready_callback4 (int __attribute((unused)) unused,
 
 	/* Get the pointer to the host descriptor in our internal table */
 	if (state != base->table[data->index])
-		goto done;	/* Not for us */
+	{
+		if (base->table[data->index]->group != state)
+			goto done;	/* Not for us */
+		state= base->table[data->index];
+	}
 
 	/* Make sure we got the right cookie */
 	if (memcmp(&state->cookie, &data->cookie, sizeof(state->cookie)) != 0)
@@ -969,7 +1216,7 @@ static void ready_callback4 (int __attribute((unused)) unused,
 		state->seq = (state->seq + 1) % 256;
 	    }
 	  }
-	else
+	else if (!state->group)
 	{
 	  /* Handle this condition exactly as the request has expired */
 	  noreply_callback (-1, -1, state);
@@ -1059,6 +1306,7 @@ static void ready_callback6 (int __attribute((unused)) unused,
 	  {
 	    goto done;
 	  }
+	acct_io(&ping_ops, state, ACCT_IN, nrecv);
 
 	if (state->resp_file_out)
 	{
@@ -1090,7 +1338,11 @@ static void ready_callback6 (int __attribute((unused)) unused,
 
 	/* Get the pointer to the host descriptor in our internal table */
 	if (state != base->table[data->index])
-		goto done;	/* Not for us */
+	{
+		if (base->table[data->index]->group != state)
+			goto done;	/* Not for us */
+		state= base->table[data->index];
+	}
 
 	/* Make sure we got the right cookie */
 	if (memcmp(&state->cookie, &data->cookie, sizeof(state->cookie)) != 0)
@@ -1179,7 +1431,7 @@ static void ready_callback6 (int __attribute((unused)) unused,
 	    if (!isDup)
 		state->got_reply= 1;
 	}
-	else
+	else if (!state->group)
 	  /* Handle this condition exactly as the request has expired */
 	  noreply_callback (-1, -1, state);
 
@@ -1189,15 +1441,110 @@ done:
 }
 
 
+static void table_add(struct pingbase *base, struct pingstate *state)
+{
+	int i, newsiz;
+
+	for (i= 0; i<base->tabsiz; i++)
+	{
+		if (base->table[i] == NULL)
+			break;
+	}
+	if (i >= base->tabsiz)
+	{
+		newsiz= 2*base->tabsiz;
+		base->table= xrealloc(base->table,
+			newsiz*sizeof(*base->table));
+		for (i= base->tabsiz; i<newsiz; i++)
+			base->table[i]= NULL;
+		i= base->tabsiz;
+		base->tabsiz= newsiz;
+	}
+	state->index= i;
+	base->table[i]= state;
+}
+
+/* Add the targets in 'filename', one per line. Empty lines and lines
+ * starting with '#' are skipped.
+ */
+static char **read_targets(const char *filename, char **names,
+	unsigned *countp)
+{
+	size_t len;
+	FILE *fh;
+	char *cp;
+	char line[256];
+
+	fh= fopen(filename, "r");
+	if (!fh)
+	{
+		crondlog(LVL8 "ping: unable to open '%s'", filename);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), fh) != NULL)
+	{
+		cp= line;
+		while (*cp == ' ' || *cp == '\t')
+			cp++;
+		len= strlen(cp);
+		while (len > 0 && isspace((unsigned char)cp[len-1]))
+			cp[--len]= '\0';
+		if (len == 0 || *cp == '#')
+			continue;
+		names= xrealloc(names, (*countp+1) * sizeof(*names));
+		names[(*countp)++]= xstrdup(cp);
+	}
+	fclose(fh);
+	return names;
+}
+
+static struct pingstate *target_new(struct pingstate *group, char *hostname)
+{
+	struct pingstate *target;
+
+	if (!target_pool)
+		target_pool= atlas_pool_new("ping_target", sizeof(*target));
+	target= atlas_pool_zalloc(target_pool);
+	target->group= group;
+	target->base= group->base;
+	target->af= group->af;
+	target->include_probe_id= group->include_probe_id;
+	target->delay_name_res= 1;
+	target->report_sendlag= group->report_sendlag;
+	target->interval= group->interval;
+	target->interface= group->interface;
+	target->socket= -1;
+	target->seq= 1;
+	target->pingcount= group->pingcount;
+	target->atlas= group->atlas;
+	target->bundle_id= group->bundle_id;
+	target->out_filename= group->out_filename;
+	target->cookie= group->cookie;
+	target->maxsize= group->maxsize;
+	target->hostname= hostname;
+	target->aggwin= group->aggwin;
+	if (target->aggwin)
+		target->agghist= xmalloc(sizeof(*target->agghist));
+	if (target->agghist)
+		agg_hist_init(target->agghist);
+
+	table_add(target->base, target);
+
+	return target;
+}
+
+static void group_tick(void *s);
+static void dns_cb(int result, struct evutil_addrinfo *res, void *ctx);
+
 static void *ping_init(int __attribute((unused)) argc, char *argv[],
 	void (*done)(void *state, int error))
 {
 	static struct pingbase *ping_base;
 
-	int i, r, fd, newsiz, include_probe_id, delay_name_res;
+	int r, fd, include_probe_id, delay_name_res, group;
 	uint32_t opt;
 	unsigned pingcount; /* must be int-sized */
-	unsigned size, interval;
+	unsigned size, interval, aggwin, i, nnames;
 	sa_family_t af;
 	const char *hostname;
 	char *str_Atlas;
@@ -1205,9 +1552,12 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 	char *out_filename;
 	char *interface;
 	char *response_in, *response_out;
+	char *targets_file;
+	char **names= NULL, **list;
 	char *validated_response_in= NULL;
 	char *validated_response_out= NULL;
 	char *validated_out_filename= NULL;
+	char *validated_targets_file= NULL;
 	struct pingstate *state;
 	len_and_sockaddr *lsa;
 	FILE *fh;
@@ -1257,12 +1607,13 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 	interface= NULL;
 	response_in= NULL;
 	response_out= NULL;
-	/* exactly one argument needed; -c NUM */
-	opt_complementary = "=1:c+:s+:i+";
+	targets_file= NULL;
+	aggwin= 0;
+	/* -c NUM. Targets are checked below */
+	opt_complementary = "c+:s+:i+:G+";
 	opt = getopt32(argv, PING_OPT_STRING, &pingcount, &size,
 		&str_Atlas, &str_bundle, &out_filename, &interval, &interface,
-		&response_in, &response_out);
-	hostname = argv[optind];
+		&response_in, &response_out, &targets_file, &aggwin);
 
 	if (opt == 0xffffffff)
 	{
@@ -1270,6 +1621,19 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 		return NULL;
 	}
 
+	nnames= argc-optind;
+	group= (nnames > 1 || targets_file || (opt & opt_C));
+	if (nnames == 0 && !targets_file)
+	{
+		crondlog(LVL8 "no targets");
+		return NULL;
+	}
+	if (group && (response_in || response_out))
+	{
+		crondlog(LVL8 "no response files with multiple targets");
+		return NULL;
+	}
+
 	if (interval < 1 || interval > 60000)
 	{
 		crondlog(LVL8 "bad interval");
@@ -1307,7 +1671,7 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 			crondlog(LVL8 "insecure file '%s'", out_filename);
 			goto err;
 		}
-		fh= fopen(validated_out_filename, "a");
+		fh= atlas_fopen_append(validated_out_filename);
 		if (!fh)
 		{
 			crondlog(LVL8 "ping: unable to append to '%s'",
@@ -1334,6 +1698,32 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 		}
 	}
 
+	names= xmalloc((nnames ? nnames : 1) * sizeof(*names));
+	for (i= 0; i<nnames; i++)
+		names[i]= xstrdup(argv[optind+i]);
+	if (targets_file)
+	{
+		validated_targets_file= rebased_validated_filename(
+			targets_file, SAFE_PREFIX_IN_REL);
+		if (!validated_targets_file)
+		{
+			crondlog(LVL8 "insecure file '%s'", targets_file);
+			goto err;
+		}
+		list= read_targets(validated_targets_file, names, &nnames);
+		free(validated_targets_file);
+		validated_targets_file= NULL;
+		if (!list)
+			goto err;
+		names= list;
+		if (nnames == 0)
+		{
+			crondlog(LVL8 "no targets in '%s'", targets_file);
+			goto err;
+		}
+	}
+	hostname= names[0];
+
 	if (opt & opt_4)
 		af= AF_INET;
 	else
@@ -1346,7 +1736,7 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 				 * place for now.
 				 */
 	/* Introduce a new option to use the libc stub resolver */
-	if (opt & opt_e)
+	if ((opt & opt_e) && !group)
 		delay_name_res= 0;
 
 	if (!delay_name_res)
@@ -1369,7 +1759,9 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 		}
 	}
 
-	state= xzalloc(sizeof(*state));
+	if (!state_pool)
+		state_pool= atlas_pool_new("ping", sizeof(*state));
+	state= atlas_pool_zalloc(state_pool);
 
 	memset(&state->loc_sin6, '\0', sizeof(state->loc_sin6));
 	state->loc_socklen= 0;
@@ -1384,6 +1776,7 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 	state->af= af;
 	state->include_probe_id= include_probe_id;
 	state->delay_name_res= delay_name_res;
+	state->report_sendlag= !!(opt & opt_L);
 	state->interval= interval;
 	state->interface= interface ? strdup(interface) : NULL;
 	state->socket= -1;
@@ -1403,26 +1796,10 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 	/* Define here the callbacks to ping the host and to handle no reply
 	 * timeouts
 	 */
-	evtimer_assign(&state->ping_timer, state->base->event_base,
-		noreply_callback, state);
+	send_timer_assign(&state->ping_timer, state->base->event_base,
+		ping_timer_cb, state);
 
-	for (i= 0; i<ping_base->tabsiz; i++)
-	{
-		if (ping_base->table[i] == NULL)
-			break;
-	}
-	if (i >= ping_base->tabsiz)
-	{
-		newsiz= 2*ping_base->tabsiz;
-		ping_base->table= xrealloc(ping_base->table,
-			newsiz*sizeof(*ping_base->table));
-		for (i= ping_base->tabsiz; i<newsiz; i++)
-			ping_base->table[i]= NULL;
-		i= ping_base->tabsiz;
-		ping_base->tabsiz= newsiz;
-	}
-	state->index= i;
-	ping_base->table[i]= state;
+	table_add(ping_base, state);
 
 	state->pingcount= pingcount;
 	state->atlas= str_Atlas ? strdup(str_Atlas) : NULL;
@@ -1439,16 +1816,279 @@ static void *ping_init(int __attribute((unused)) argc, char *argv[],
 	state->maxsize = size;
 	state->base->done= done;
 
+	state->aggwin= aggwin;
+	if (aggwin)
+	{
+		state->agghist= xmalloc(sizeof(*state->agghist));
+		agg_hist_init(state->agghist);
+	}
+
+	if (group)
+	{
+		state->combined= !!(opt & opt_C);
+		state->targets= xmalloc(nnames * sizeof(*state->targets));
+		for (i= 0; i<nnames; i++)
+			state->targets[i]= target_new(state, names[i]);
+		state->ntargets= nnames;
+
+		/* One timer that takes turns for all targets */
+		send_timer_assign(&state->ping_timer,
+			state->base->event_base, group_tick, state);
+	}
+	else
+		free(names[0]);
+	free(names);
+
 	return state;
 
 err:
 	if (validated_response_in) free(validated_response_in);
 	if (validated_response_out) free(validated_response_out);
 	if (validated_out_filename) free(validated_out_filename);
+	if (names)
+	{
+		for (i= 0; i<nnames; i++)
+			free(names[i]);
+		free(names);
+	}
 
 	return NULL;
 }
 
+static void target_begin(struct pingstate *state)
+{
+	if (state->result) free(state->result);
+	state->resmax= 80;
+	state->result= xmalloc(state->resmax);
+	state->result[0]= '\0';
+	state->reslen= 0;
+
+	state->first= 1;
+	state->got_reply= 0;
+	state->no_dst= 1;
+	state->no_src= 0;
+	state->error= 0;
+	state->send_error= 0;
+	state->busy= 1;
+	state->maxpkts= state->pingcount;
+	state->sentpkts= 0;
+	state->cursize= state->maxsize;
+	state->loc_socklen= 0;
+}
+
+/* Name resolution for a target in a group is done. Find out which source
+ * address will be used, the shared socket cannot tell us.
+ */
+static void target_start2(struct pingstate *target)
+{
+	int fd;
+	struct sockaddr_in6 sin6;
+
+	target->no_dst= 0;
+
+	fd= socket(target->af, SOCK_DGRAM, 0);
+	if (fd != -1 && target->interface)
+		bind_interface(fd, target->af, target->interface);
+
+	/* Connect a UDP socket, that does not send anything. Port 0 is
+	 * not allowed. Both address families have the port at the same
+	 * offset.
+	 */
+	sin6= target->sin6;
+	sin6.sin6_port= htons(7);
+	target->loc_socklen= sizeof(target->loc_sin6);
+	if (fd == -1 ||
+		connect(fd, (struct sockaddr *)&sin6, target->socklen) == -1 ||
+		getsockname(fd, (struct sockaddr *)&target->loc_sin6,
+		&target->loc_socklen) == -1)
+	{
+		target->loc_socklen= 0;
+		target->no_src= 1;
+	}
+	if (fd != -1)
+		close(fd);
+
+	/* The first packet is sent when it is this target's turn */
+}
+
+static void group_finish(struct pingstate *group)
+{
+	unsigned i;
+	int error;
+	FILE *fh;
+	struct pingstate *target;
+
+	send_timer_del(&group->ping_timer);
+	if (group->socket != -1)
+	{
+		event_del(&group->event);
+		close(group->socket);
+		group->socket= -1;
+	}
+
+	error= 1;
+	for (i= 0; i<group->ntargets; i++)
+	{
+		if (group->targets[i]->got_reply)
+			error= 0;
+	}
+
+	if (group->combined && group->aggwin)
+	{
+		if (group->aggruns == 0)
+			group->aggstart= atlas_time();
+		group->aggruns++;
+		if (agg_due(group))
+			group_summary(group);
+		for (i= 0; i<group->ntargets; i++)
+		{
+			free(group->targets[i]->result);
+			group->targets[i]->result= NULL;
+		}
+	}
+	else if (group->combined)
+	{
+		fh= report_head(group);
+		fprintf(fh, DBQ(targets) ": [ ");
+		for (i= 0; i<group->ntargets; i++)
+		{
+			target= group->targets[i];
+			fprintf(fh, "%s{ ", i ? ", " : "");
+			report_body(target, fh);
+			fprintf(fh, " }");
+			free(target->result);
+			target->result= NULL;
+		}
+		fprintf(fh, " ] }\n");
+		if (group->out_filename)
+			fclose(fh);
+	}
+
+	group->busy= 0;
+	if (group->base->done)
+		group->base->done(group, error);
+}
+
+static void group_done(struct pingstate *group)
+{
+	unsigned i;
+
+	for (i= 0; i<group->ntargets; i++)
+	{
+		if (group->targets[i]->busy)
+			return;
+	}
+	group_finish(group);
+}
+
+static void group_tick(void *s)
+{
+	struct pingstate *group, *target;
+	struct timespec planned;
+
+	group= s;
+	target= group->targets[group->nexttarget];
+	group->nexttarget= (group->nexttarget+1) % group->ntargets;
+
+	planned= group->ping_timer.due;
+	send_timer_add_after(&group->ping_timer, &planned, group->tick);
+
+	if (!target->busy || target->dnsip)
+		return;		/* Done or still resolving */
+
+	target->planned= planned;
+	target->have_planned= 1;
+
+	if (target->sentpkts == 0)
+		ping_xmit(target);
+	else
+		noreply_callback(-1, -1, target);
+}
+
+static void group_start(struct pingstate *group)
+{
+	int fd, on;
+	unsigned i, usecs;
+	struct pingstate *target;
+	struct evutil_addrinfo hints;
+	struct timespec now;
+	char line[80];
+
+	/* All targets are busy before the first one can finish */
+	for (i= 0; i<group->ntargets; i++)
+		target_begin(group->targets[i]);
+
+	group->nexttarget= 0;
+	group->socket= -1;
+
+	fd= socket(group->af, SOCK_RAW,
+		group->af == AF_INET ? IPPROTO_ICMP : IPPROTO_ICMPV6);
+	if (fd == -1)
+	{
+		snprintf(line, sizeof(line),
+			"{ " DBQ(error) ":" DBQ(socket failed: %s) " }",
+			strerror(errno));
+		goto fail;
+	}
+	if (group->af == AF_INET6)
+	{
+		on = 1;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on,
+			sizeof(on));
+
+		on = 1;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on,
+			sizeof(on));
+	}
+	evutil_make_socket_nonblocking(fd);
+	if (group->interface &&
+		bind_interface(fd, group->af, group->interface) == -1)
+	{
+		close(fd);
+		snprintf(line, sizeof(line),
+			"{ " DBQ(error) ":" DBQ(bind to interface failed) " }");
+		goto fail;
+	}
+	group->socket= fd;
+
+	event_assign(&group->event, group->base->event_base, fd,
+		EV_READ | EV_PERSIST,
+		group->af == AF_INET ? acct_ready_callback4 :
+		acct_ready_callback6, group);
+	event_add(&group->event, NULL);
+
+	/* Spread the packets for all targets evenly over the interval */
+	usecs= group->interval*1000 / group->ntargets;
+	if (usecs < MIN_GROUP_TICK)
+		usecs= MIN_GROUP_TICK;
+	group->tick= usecs;
+	gettime_mono(&now);
+	send_timer_add_after(&group->ping_timer, &now, usecs);
+
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_socktype= SOCK_DGRAM;
+	hints.ai_family= group->af;
+	for (i= 0; i<group->ntargets; i++)
+	{
+		target= group->targets[i];
+		target->socket= fd;
+		target->dnsip= 1;
+		gettime_mono(&target->start_time);
+		(void) evdns_getaddrinfo(DnsBase, target->hostname, NULL,
+			&hints, dns_cb, target);
+	}
+	return;
+
+fail:
+	for (i= 0; i<group->ntargets; i++)
+	{
+		target= group->targets[i];
+		add_str(target, line);
+		report(target);
+	}
+	group_finish(group);
+}
+
 static void ping_start2(void *state)
 {
 	int p_proto, on, fd;
@@ -1465,6 +2105,7 @@ static void ping_start2(void *state)
 	pingstate->no_dst= 0;
 	pingstate->no_src= 0;
 	pingstate->error= 0;
+	pingstate->have_planned= 0;
 
 	if (pingstate->af == AF_INET)
 	{
@@ -1488,8 +2129,7 @@ static void ping_start2(void *state)
 				" }", strerror(errno));
 			add_str(pingstate, line);
 			report(pingstate);
-			if (pingstate->base->done)
-				pingstate->base->done(pingstate, 1);
+			ping_done(pingstate, 1);
 			return;
 		}
 		pingstate->socket= fd;
@@ -1498,7 +2138,7 @@ static void ping_start2(void *state)
 		 * raw file descriptor to those monitored for read events */
 		event_assign(&pingstate->event, pingstate->base->event_base,
 			pingstate->socket, EV_READ | EV_PERSIST,
-			ready_callback4, state);
+			acct_ready_callback4, state);
 	}
 	else
 	{
@@ -1520,8 +2160,7 @@ static void ping_start2(void *state)
 				" }", strerror(errno));
 			add_str(pingstate, line);
 			report(pingstate);
-			if (pingstate->base->done)
-				pingstate->base->done(pingstate, 1);
+			ping_done(pingstate, 1);
 			return;
 		}
 
@@ -1543,7 +2182,7 @@ static void ping_start2(void *state)
 			event_assign(&pingstate->event,
 				pingstate->base->event_base,
 				pingstate->socket, EV_READ | EV_PERSIST,
-				ready_callback6, state);
+				acct_ready_callback6, state);
 		}
 	}
 
@@ -1560,8 +2199,7 @@ static void ping_start2(void *state)
 				" }");
 			add_str(pingstate, line);
 			report(pingstate);
-			if (pingstate->base->done)
-				pingstate->base->done(pingstate, 1);
+			ping_done(pingstate, 1);
 			return;
 		}
 	}
@@ -1575,8 +2213,7 @@ static void ping_start2(void *state)
 			" }", strerror(errno));
 		add_str(pingstate, line);
 		report(pingstate);
-		if (pingstate->base->done)
-			pingstate->base->done(pingstate, 1);
+		ping_done(pingstate, 1);
 		return;
 	}
 
@@ -1652,8 +2289,7 @@ static void dns_cb(int result, struct evutil_addrinfo *res, void *ctx)
 			(struct sockaddr *)NULL, 0,
 			0, 0, NULL,
 			env);
-		if (env->base->done)
-			env->base->done(env, 1);
+		ping_done(env, 1);
 		return;
 	}
 
@@ -1686,12 +2322,14 @@ static void dns_cb(int result, struct evutil_addrinfo *res, void *ctx)
 				(struct sockaddr *)NULL, 0,
 				0, 0, NULL,
 				env);
-			if (env->base->done)
-				env->base->done(env, 1);
+			ping_done(env, 1);
 			return;
 		}
 
-		ping_start2(env);
+		if (env->group)
+			target_start2(env);
+		else
+			ping_start2(env);
 
 		return;
 	}
@@ -1705,8 +2343,7 @@ static void dns_cb(int result, struct evutil_addrinfo *res, void *ctx)
 		(struct sockaddr *)NULL, 0,
 		0, 0, NULL,
 		env);
-	if (env->base->done)
-		env->base->done(env, 1);
+	ping_done(env, 1);
 }
 
 static void ping_start(void *state)
@@ -1732,6 +2369,12 @@ static void ping_start(void *state)
 
 	pingstate->maxpkts= pingstate->pingcount;
 
+	if (pingstate->ntargets)
+	{
+		group_start(pingstate);
+		return;
+	}
+
 	if (pingstate->response_out)
 	{
 		pingstate->resp_file_out= fopen(pingstate->response_out, "w");
@@ -1760,7 +2403,8 @@ static void ping_start(void *state)
 
 static int ping_delete(void *state)
 {
-	struct pingstate *pingstate;
+	unsigned i;
+	struct pingstate *pingstate, *target;
 	struct pingbase *base;
 
 	pingstate= state;
@@ -1775,10 +2419,38 @@ static int ping_delete(void *state)
 
 	base= pingstate->base;
 
-	evtimer_del(&pingstate->ping_timer);
+	send_timer_del(&pingstate->ping_timer);
+	pace_cancel(&pingstate->pace);
+
+	/* Do not lose the last partial window */
+	if (pingstate->aggruns)
+	{
+		if (pingstate->combined)
+			group_summary(pingstate);
+		else if (pingstate->ntargets == 0)
+			report_summary(pingstate);
+	}
 
 	base->table[pingstate->index]= NULL;
 
+	for (i= 0; i<pingstate->ntargets; i++)
+	{
+		target= pingstate->targets[i];
+		base->table[target->index]= NULL;
+		if (target->dns_res)
+			evutil_freeaddrinfo(target->dns_res);
+		if (target->aggruns && !pingstate->combined)
+			report_summary(target);
+		pace_cancel(&target->pace);
+		free(target->hostname);
+		free(target->result);
+		free(target->agghist);
+		atlas_pool_free(target_pool, target);
+	}
+	free(pingstate->targets);
+	pingstate->targets= NULL;
+	pingstate->ntargets= 0;
+
 	free(pingstate->atlas);
 	pingstate->atlas= NULL;
 	free(pingstate->bundle_id);
@@ -1789,11 +2461,21 @@ static int ping_delete(void *state)
 	pingstate->hostname= NULL;
 	free(pingstate->out_filename);
 	pingstate->out_filename= NULL;
+	free(pingstate->agghist);
+	pingstate->agghist= NULL;
 
-	free(pingstate);
+	atlas_pool_free(state_pool, pingstate);
 
 	return 1;
 }
 
-struct testops ping_ops = { ping_init, ping_start, ping_delete };
+/* Targets of a group are charged to the group */
+static void *ping_owner(void *state)
+{
+	struct pingstate *pingstate= state;
+
+	return pingstate->group ? pingstate->group : pingstate;
+}
+
+struct testops ping_ops = { ping_init, ping_start, ping_delete, ping_owner };
 
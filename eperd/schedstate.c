@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * schedstate.c -- checkpoint of the schedule of each crontab line, so a
+ *		   restarted eperd continues where the previous one was
+ */
+
+#include "libbb.h"
+
+#include "eperd.h"
+
+#define SCHED_STATE_MAGIC	"EPSS"
+#define SCHED_STATE_VERSION	1
+#define SCHED_STATE_MAX		(1024*1024)	/* Entries, sanity check */
+
+/* File layout: header, then entries sorted by key. Numbers are in host
+ * byte order.
+ */
+struct sched_state_hdr
+{
+	char magic[4];
+	uint32_t version;
+	int64_t saved;		/* Wall clock time of the checkpoint */
+	uint32_t count;
+	uint32_t pad;
+};
+
+static struct sched_state *loaded;
+static uint32_t loaded_count;
+
+static struct sched_state *saved_image;	/* Last one written */
+static uint32_t saved_count;
+
+/* Hash of what Insert uses to match lines */
+uint64_t sched_state_key(const char *cmdline, unsigned interval,
+	time_t start_time)
+{
+	unsigned char buf[8];
+	uint64_t v;
+	unsigned i;
+
+	/* Least significant byte first, independent of the host */
+	v= ((uint64_t)interval << 32) ^ (uint64_t)start_time;
+	for (i= 0; i<8; i++, v >>= 8)
+		buf[i]= v & 0xff;
+	return atlas_hash(atlas_hash_str(ATLAS_HASH_INIT, cmdline),
+		buf, sizeof(buf));
+}
+
+static int state_cmp(const void *a, const void *b)
+{
+	const struct sched_state *sa= a, *sb= b;
+
+	if (sa->key != sb->key)
+		return sa->key < sb->key ? -1 : 1;
+	return 0;
+}
+
+void sched_state_load(const char *filename)
+{
+	int fd;
+	uint32_t i;
+	size_t size;
+	struct stat sb;
+	struct sched_state_hdr hdr;
+
+	sched_state_free();
+
+	fd= open(filename, O_RDONLY);
+	if (fd == -1)
+		return;
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		memcmp(hdr.magic, SCHED_STATE_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != SCHED_STATE_VERSION ||
+		hdr.count > SCHED_STATE_MAX)
+	{
+		crondlog(LVL7 "sched_state_load: ignoring '%s'", filename);
+		close(fd);
+		return;
+	}
+	/* Do not trust the count before allocating, the file has to be
+	 * exactly that size.
+	 */
+	size= hdr.count * sizeof(*loaded);
+	if (fstat(fd, &sb) == -1 || sb.st_size != (off_t)(sizeof(hdr)+size))
+	{
+		crondlog(LVL8 "sched_state_load: bad size of '%s'", filename);
+		close(fd);
+		return;
+	}
+	loaded= xmalloc(size+1);
+	if (read(fd, loaded, size) != (ssize_t)size)
+	{
+		crondlog(LVL8 "sched_state_load: unable to read '%s'",
+			filename);
+		close(fd);
+		sched_state_free();
+		return;
+	}
+	close(fd);
+
+	/* Entries should be sorted, sched_state_find depends on it */
+	for (i= 1; i<hdr.count; i++)
+	{
+		if (loaded[i-1].key > loaded[i].key)
+		{
+			crondlog(LVL8 "sched_state_load: bad order in '%s'",
+				filename);
+			sched_state_free();
+			return;
+		}
+	}
+	loaded_count= hdr.count;
+	crondlog(LVL7 "sched_state_load: %u entries from %ld seconds ago",
+		loaded_count, (long)(time(NULL) - hdr.saved));
+}
+
+const struct sched_state *sched_state_find(uint64_t key)
+{
+	struct sched_state ss;
+
+	if (!loaded_count)
+		return NULL;
+	ss.key= key;
+	return bsearch(&ss, loaded, loaded_count, sizeof(*loaded),
+		state_cmp);
+}
+
+void sched_state_free(void)
+{
+	free(loaded);
+	loaded= NULL;
+	loaded_count= 0;
+}
+
+void sched_state_save(const char *filename, struct sched_state *states,
+	unsigned n)
+{
+	int r;
+	unsigned i, count;
+	char *tmpname;
+	struct sched_state_hdr hdr;
+	FILE *file;
+
+	qsort(states, n, sizeof(*states), state_cmp);
+
+	/* Lines with the same key cannot be told apart on restore, drop
+	 * them all.
+	 */
+	count= 0;
+	for (i= 0; i<n; i++)
+	{
+		if ((i > 0 && states[i-1].key == states[i].key) ||
+			(i+1 < n && states[i+1].key == states[i].key))
+		{
+			continue;
+		}
+		states[count++]= states[i];
+	}
+
+	/* Nothing to do if no line ran or got rescheduled */
+	if (saved_image && saved_count == count &&
+		memcmp(saved_image, states, count*sizeof(*states)) == 0)
+	{
+		return;
+	}
+
+	memset(&hdr, '\0', sizeof(hdr));
+	memcpy(hdr.magic, SCHED_STATE_MAGIC, sizeof(hdr.magic));
+	hdr.version= SCHED_STATE_VERSION;
+	hdr.saved= time(NULL);
+	hdr.count= count;
+
+	tmpname= xasprintf("%s.new", filename);
+	file= fopen(tmpname, "w");
+	if (!file)
+	{
+		crondlog(LVL8 "sched_state_save: unable to create '%s': %s",
+			tmpname, strerror(errno));
+		free(tmpname);
+		return;
+	}
+	r= (fwrite(&hdr, sizeof(hdr), 1, file) == 1);
+	if (r && count)
+		r= (fwrite(states, count*sizeof(*states), 1, file) == 1);
+	if (fclose(file) == -1)
+		r= 0;
+	if (!r || rename(tmpname, filename) == -1)
+	{
+		crondlog(LVL8 "sched_state_save: unable to save '%s': %s",
+			filename, strerror(errno));
+		unlink(tmpname);
+		free(tmpname);
+		return;
+	}
+	free(tmpname);
+
+	free(saved_image);
+	saved_image= xmalloc(count*sizeof(*states)+1);
+	memcpy(saved_image, states, count*sizeof(*states));
+	saved_count= count;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * sendtimer.c -- precise timing of packet sends with a timerfd
+ */
+
+#include "libbb.h"
+#include <sys/timerfd.h>
+#include <event2/event.h>
+#include <event2/event_struct.h>
+
+#include "eperd.h"
+
+#define DBQ(str) "\"" #str "\""
+
+static struct event_base *timer_base;
+static int timer_fd= -1;		/* -1 if there is no timerfd */
+static struct event timer_event;
+static struct timespec timer_armed;	/* Due time the timerfd is set to */
+static unsigned timer_gen;
+
+static struct send_timer *timer_head;	/* Sorted by due time */
+
+static struct send_timer_counters
+{
+	uint64_t fired;
+	uint64_t ticks;
+	unsigned max_batch;
+	double max_late;	/* Seconds */
+} counters;
+
+static void send_timer_tick(evutil_socket_t fd, short what, void *arg);
+
+static int ts_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+static double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec)/1e9;
+}
+
+static void ts_add_us(struct timespec *ts, unsigned us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void arm(void)
+{
+	struct itimerspec its;
+	struct timespec now;
+	struct timeval tv;
+	double d;
+
+	if (timer_fd != -1)
+	{
+		memset(&its, '\0', sizeof(its));
+		if (timer_head)
+		{
+			if (ts_cmp(&timer_head->due, &timer_armed) == 0)
+				return;
+			its.it_value= timer_head->due;
+
+			/* A zero value would disarm the timer */
+			if (its.it_value.tv_sec == 0 &&
+				its.it_value.tv_nsec == 0)
+			{
+				its.it_value.tv_nsec= 1;
+			}
+		}
+		else if (timer_armed.tv_sec == 0 && timer_armed.tv_nsec == 0)
+			return;		/* Not armed */
+		timer_armed= its.it_value;
+		if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its,
+			NULL) == -1)
+		{
+			crondlog(LVL8 "send_timer: timerfd_settime failed: %s",
+				strerror(errno));
+		}
+		return;
+	}
+
+	/* No timerfd, a libevent timer gets us close */
+	if (!timer_head)
+	{
+		event_del(&timer_event);
+		return;
+	}
+	gettime_mono(&now);
+	d= ts_diff(&timer_head->due, &now);
+	if (d < 0)
+		d= 0;
+	tv.tv_sec= d;
+	tv.tv_usec= (d - tv.tv_sec)*1e6;
+	event_add(&timer_event, &tv);
+}
+
+void send_timer_assign(struct send_timer *st, struct event_base *base,
+	void (*cb)(void *ref), void *ref)
+{
+	memset(st, '\0', sizeof(*st));
+	st->cb= cb;
+	st->ref= ref;
+
+	if (timer_base)
+		return;
+	timer_base= base;
+	timer_fd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd == -1)
+	{
+		crondlog(LVL8 "send_timer: timerfd_create failed: %s",
+			strerror(errno));
+		evtimer_assign(&timer_event, base, send_timer_tick, NULL);
+		return;
+	}
+	event_assign(&timer_event, base, timer_fd, EV_READ | EV_PERSIST,
+		send_timer_tick, NULL);
+	event_add(&timer_event, NULL);
+}
+
+static void unlink_timer(struct send_timer *st)
+{
+	struct send_timer **stp;
+
+	for (stp= &timer_head; *stp; stp= &(*stp)->next)
+	{
+		if (*stp == st)
+		{
+			*stp= st->next;
+			break;
+		}
+	}
+	st->next= NULL;
+	st->pending= 0;
+}
+
+void send_timer_add(struct send_timer *st, const struct timespec *due)
+{
+	struct send_timer **stp;
+
+	if (st->pending)
+		unlink_timer(st);
+
+	st->due= *due;
+	st->gen= timer_gen;
+	st->pending= 1;
+
+	/* Timers with the same due time go off in the order they
+	 * were added.
+	 */
+	for (stp= &timer_head; *stp; stp= &(*stp)->next)
+	{
+		if (ts_cmp(&st->due, &(*stp)->due) < 0)
+			break;
+	}
+	st->next= *stp;
+	*stp= st;
+
+	arm();
+}
+
+void send_timer_add_after(struct send_timer *st, const struct timespec *from,
+	unsigned us)
+{
+	struct timespec due, now;
+
+	due= *from;
+	ts_add_us(&due, us);
+
+	/* After a long stall, continue from now instead of catching up
+	 * with a burst.
+	 */
+	gettime_mono(&now);
+	if (ts_diff(&now, &due) > us/1e6)
+		due= now;
+	send_timer_add(st, &due);
+}
+
+void send_timer_del(struct send_timer *st)
+{
+	if (!st->pending)
+		return;
+	unlink_timer(st);
+	arm();
+}
+
+/* Run all timers that are due in one go, in order. Timers added by the
+ * callbacks wait for the next tick, even if they are due already.
+ */
+static void send_timer_tick(evutil_socket_t fd UNUSED_PARAM,
+	short what UNUSED_PARAM, void *arg UNUSED_PARAM)
+{
+	unsigned gen, batch;
+	uint64_t expirations;
+	double late;
+	struct timespec now;
+	struct send_timer *st;
+
+	if (timer_fd != -1)
+	{
+		if (read(timer_fd, &expirations, sizeof(expirations)) !=
+			sizeof(expirations))
+		{
+			return;	/* Spurious wakeup, timer was reset */
+		}
+		timer_armed.tv_sec= 0;
+		timer_armed.tv_nsec= 0;
+	}
+
+	gettime_mono(&now);
+	gen= timer_gen++;
+	batch= 0;
+	while (timer_head && timer_head->gen <= gen &&
+		ts_cmp(&timer_head->due, &now) <= 0)
+	{
+		st= timer_head;
+		timer_head= st->next;
+		st->next= NULL;
+		st->pending= 0;
+
+		late= ts_diff(&now, &st->due);
+		if (late > counters.max_late)
+			counters.max_late= late;
+		batch++;
+
+		st->cb(st->ref);
+	}
+	counters.fired += batch;
+	counters.ticks++;
+	if (batch > counters.max_batch)
+		counters.max_batch= batch;
+
+	arm();
+}
+
+void send_timer_print_json(FILE *fh)
+{
+	fprintf(fh, "{ " DBQ(timerfd) ":%s, " DBQ(fired) ":%llu, "
+		DBQ(ticks) ":%llu, " DBQ(max_batch) ":%u, "
+		DBQ(max_late_ms) ":%.3f }",
+		timer_fd != -1 ? "true" : "false",
+		(unsigned long long)counters.fired,
+		(unsigned long long)counters.ticks,
+		counters.max_batch, counters.max_late*1000);
+	memset(&counters, '\0', sizeof(counters));
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * speccache.c -- cache of measurement command lines that are known to be
+ *		  valid
+ */
+
+#include "libbb.h"
+#include <sys/mman.h>
+
+#include "eperd.h"
+
+#define SPEC_CACHE_MAGIC	"EPSC"
+#define SPEC_CACHE_VERSION	1
+
+/* File layout: header, entries sorted by hash, then the command lines. The
+ * file is only used by the binary that wrote it, numbers are in host byte
+ * order.
+ */
+struct spec_cache_hdr
+{
+	char magic[4];
+	uint32_t version;
+	char build[96];		/* Binary that wrote the cache */
+	uint32_t count;		/* Number of entries */
+	uint32_t strsize;	/* Size of the command lines */
+};
+
+struct spec_cache_ent
+{
+	uint64_t hash;
+	uint32_t off;		/* Into the command lines */
+	uint32_t len;		/* Without the terminating null */
+};
+
+static void *map;
+static size_t map_size;
+static const struct spec_cache_ent *map_ents;
+static const char *map_strs;
+static uint32_t map_count;
+
+static uint64_t spec_hash(const char *cmdline)
+{
+	return atlas_hash_str(ATLAS_HASH_INIT, cmdline);
+}
+
+/* A new binary may parse command lines differently, it starts with an
+ * empty cache.
+ */
+static void spec_build(char *build, size_t size)
+{
+	struct stat sb;
+
+	memset(build, '\0', size);
+	if (stat("/proc/self/exe", &sb) == -1)
+	{
+		sb.st_size= 0;
+		sb.st_mtime= 0;
+	}
+	snprintf(build, size, "%s %llu %ld", atlas_get_version_json_str(),
+		(unsigned long long)sb.st_size, (long)sb.st_mtime);
+}
+
+void spec_cache_open(const char *filename)
+{
+	int fd;
+	uint32_t i;
+	struct stat sb;
+	const struct spec_cache_hdr *hdr;
+	char build[sizeof(hdr->build)];
+
+	spec_cache_close();
+
+	fd= open(filename, O_RDONLY);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*hdr))
+	{
+		close(fd);
+		return;
+	}
+	map= mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		map= NULL;
+		return;
+	}
+	map_size= sb.st_size;
+
+	hdr= map;
+	spec_build(build, sizeof(build));
+	if (memcmp(hdr->magic, SPEC_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->version != SPEC_CACHE_VERSION ||
+		memcmp(hdr->build, build, sizeof(build)) != 0 ||
+		hdr->count > (map_size-sizeof(*hdr))/sizeof(*map_ents) ||
+		sizeof(*hdr) + hdr->count*sizeof(*map_ents) + hdr->strsize !=
+		map_size)
+	{
+		crondlog(LVL7 "spec_cache_open: ignoring '%s'", filename);
+		spec_cache_close();
+		return;
+	}
+	map_ents= (const struct spec_cache_ent *)(hdr+1);
+	map_strs= (const char *)(map_ents+hdr->count);
+	for (i= 0; i<hdr->count; i++)
+	{
+		if (map_ents[i].off > hdr->strsize ||
+			map_ents[i].len >= hdr->strsize-map_ents[i].off ||
+			map_strs[map_ents[i].off+map_ents[i].len] != '\0')
+		{
+			crondlog(LVL8 "spec_cache_open: bad entry in '%s'",
+				filename);
+			spec_cache_close();
+			return;
+		}
+	}
+	map_count= hdr->count;
+}
+
+int spec_cache_find(const char *cmdline)
+{
+	uint32_t lo, hi, mid;
+	uint64_t h;
+
+	if (!map_count)
+		return 0;
+
+	h= spec_hash(cmdline);
+	lo= 0;
+	hi= map_count;
+	while (lo < hi)
+	{
+		mid= lo + (hi-lo)/2;
+		if (map_ents[mid].hash < h)
+			lo= mid+1;
+		else
+			hi= mid;
+	}
+
+	/* Check the command line itself, there may be collisions */
+	for (; lo < map_count && map_ents[lo].hash == h; lo++)
+	{
+		if (strcmp(map_strs+map_ents[lo].off, cmdline) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+void spec_cache_close(void)
+{
+	if (map)
+		munmap(map, map_size);
+	map= NULL;
+	map_size= 0;
+	map_ents= NULL;
+	map_strs= NULL;
+	map_count= 0;
+}
+
+static int ent_cmp(const void *a, const void *b)
+{
+	const struct spec_cache_ent *ea= a, *eb= b;
+
+	if (ea->hash != eb->hash)
+		return ea->hash < eb->hash ? -1 : 1;
+	return 0;
+}
+
+void spec_cache_save(const char *filename, const char **cmdlines, unsigned n)
+{
+	int r;
+	unsigned i, j, count;
+	size_t len, strsize, size;
+	char *image, *strs, *tmpname;
+	struct spec_cache_hdr *hdr;
+	struct spec_cache_ent *ents;
+	FILE *file;
+
+	strsize= 0;
+	for (i= 0; i<n; i++)
+		strsize += strlen(cmdlines[i])+1;
+	size= sizeof(*hdr) + n*sizeof(*ents) + strsize;
+	image= xzalloc(size);
+	hdr= (struct spec_cache_hdr *)image;
+	ents= (struct spec_cache_ent *)(hdr+1);
+
+	/* Entries first, the command lines are appended once duplicates
+	 * are gone.
+	 */
+	for (i= 0; i<n; i++)
+	{
+		ents[i].hash= spec_hash(cmdlines[i]);
+		ents[i].off= i;		/* Index for now */
+	}
+	qsort(ents, n, sizeof(*ents), ent_cmp);
+
+	count= 0;
+	for (i= 0; i<n; i++)
+	{
+		for (j= count; j > 0 && ents[j-1].hash == ents[i].hash; j--)
+		{
+			if (strcmp(cmdlines[ents[j-1].off],
+				cmdlines[ents[i].off]) == 0)
+			{
+				break;
+			}
+		}
+		if (j > 0 && ents[j-1].hash == ents[i].hash)
+			continue;	/* Duplicate */
+		ents[count++]= ents[i];
+	}
+
+	strs= (char *)(ents+count);
+	strsize= 0;
+	for (i= 0; i<count; i++)
+	{
+		len= strlen(cmdlines[ents[i].off]);
+		memcpy(strs+strsize, cmdlines[ents[i].off], len+1);
+		ents[i].off= strsize;
+		ents[i].len= len;
+		strsize += len+1;
+	}
+
+	memcpy(hdr->magic, SPEC_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version= SPEC_CACHE_VERSION;
+	spec_build(hdr->build, sizeof(hdr->build));
+	hdr->count= count;
+	hdr->strsize= strsize;
+	size= sizeof(*hdr) + count*sizeof(*ents) + strsize;
+
+	/* Nothing to do if the cache did not change */
+	if (map && map_size == size && memcmp(map, image, size) == 0)
+	{
+		free(image);
+		return;
+	}
+
+	tmpname= xasprintf("%s.new", filename);
+	file= fopen(tmpname, "w");
+	if (!file)
+	{
+		crondlog(LVL8 "spec_cache_save: unable to create '%s': %s",
+			tmpname, strerror(errno));
+		free(tmpname);
+		free(image);
+		return;
+	}
+	r= fwrite(image, size, 1, file);
+	if (fclose(file) == -1)
+		r= 0;
+	if (r != 1 || rename(tmpname, filename) == -1)
+	{
+		crondlog(LVL8 "spec_cache_save: unable to save '%s': %s",
+			filename, strerror(errno));
+		unlink(tmpname);
+	}
+	free(tmpname);
+	free(image);
+}
@@ -13,8 +13,10 @@ Created:	April 2013 by Philip Homburg for RIPE NCC
 #include <event2/event.h>
 #include <event2/event_struct.h>
 
+#include "atlas_pool.h"
 #include "eperd.h"
 #include "tcputil.h"
+#include "tlshello.h"
 
 #define SAFE_PREFIX_IN ATLAS_DATA_OUT
 #define SAFE_PREFIX_OUT_REL ATLAS_DATA_NEW_REL
@@ -133,20 +135,13 @@ struct state
 
 #define BUF_CHUNK	4096
 
-#define MSG_ALERT	21
-#define MSG_HANDSHAKE	22
-#define HS_CLIENT_HELLO	 1
-#define HS_SERVER_HELLO	 2
-#define HS_CERTIFICATE	 11
-
 struct hsbuf
 {
 	struct buf buffer;
 };
 
-#define URANDOM_DEV	"/dev/urandom"
-
 static struct hgbase *hg_base;
+static struct atlas_pool *state_pool;
 
 static int eat_server_hello(struct state *state);
 static int eat_certificate(struct state *state);
@@ -483,30 +478,6 @@ static void hsbuf_add(struct hsbuf *hsbuf, const void *buf, size_t len)
 	buf_add(&hsbuf->buffer, buf, len);
 }
 
-static void hsbuf_add_u16(struct hsbuf *hsbuf, unsigned u16)
-{
-	uint8_t c;
-	
-	c= (u16 >> 8);
-	buf_add(&hsbuf->buffer, &c, 1);
-
-	c= u16;
-	buf_add(&hsbuf->buffer, &c, 1);
-}
-
-static size_t hsbuf_len(struct hsbuf *hsbuf)
-{
-	return hsbuf->buffer.size - hsbuf->buffer.offset;
-}
-
-static void hsbuf_copy(struct hsbuf *dst, struct hsbuf *src)
-{
-	size_t len;
-
-	len= src->buffer.size - src->buffer.offset;
-	hsbuf_add(dst, src->buffer.buf + src->buffer.offset, len);
-}
-
 static void hsbuf_cleanup(struct hsbuf *hsbuf)
 {
 	buf_cleanup(&hsbuf->buffer);
@@ -535,180 +506,6 @@ static void hsbuf_final(struct hsbuf *hsbuf, int type, struct msgbuf *msgbuf)
 	hsbuf->buffer.offset += len;
 }
 
-static void add_random(struct hsbuf *hsbuf)
-{
-	int fd;
-	time_t t;
-	uint8_t buf[32];
-
-	t= time(NULL);
-	buf[0]= t >> 24;
-	buf[1]= t >> 16;
-	buf[2]= t >> 8;
-	buf[3]= t;
-
-	fd= open(URANDOM_DEV, O_RDONLY);
-
-	/* Best effort, just ignore errors */
-	if (fd != -1)
-	{
-		read(fd, buf+4, sizeof(buf)-4);
-		close(fd);
-	}
-	hsbuf_add(hsbuf, buf, sizeof(buf));
-}
-
-static void add_sessionid(struct hsbuf *hsbuf)
-{
-	uint8_t c;
-
-	c= 0;
-	hsbuf_add(hsbuf, &c, 1);
-}
-
-static void add_ciphers(struct hsbuf *hsbuf)
-{
-	size_t len;
-	uint8_t ciphers[]= {
-		/* From Firefox 57.0.1 */
-		0xc0,0x2b,	/* TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256 */
-		0xc0,0x2f,	/* TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256 */
-		0xcc,0xa9,	/* TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256 */
-		0xcc,0xa8,	/* TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256 */
-		0xc0,0x2c,	/* TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384 */
-		0xc0,0x30,	/* TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384 */
-		0xc0,0x0a,	/* TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA */
-		0xc0,0x09,	/* TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA */
-		0xc0,0x13,	/* TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA */
-		0xc0,0x14,	/* TLS_ECDHE_RSA_WITH_AES_256_CBC_SHA */
-		0x00,0x33,	/* TLS_DHE_RSA_WITH_AES_128_CBC_SHA */
-		0x00,0x39,	/* TLS_DHE_RSA_WITH_AES_256_CBC_SHA */
-		0x00,0x2f,	/* TLS_RSA_WITH_AES_128_CBC_SHA */
-		0x00,0x35,	/* TLS_RSA_WITH_AES_256_CBC_SHA */
-		0x00,0x0a,	/* TLS_RSA_WITH_3DES_EDE_CBC_SHA */
-	 };
-
-	len= sizeof(ciphers);
-
-	hsbuf_add_u16(hsbuf, len);
-	hsbuf_add(hsbuf, ciphers, len);
-}
-
-static void add_compression(struct hsbuf *hsbuf)
-{
-	uint8_t c;
-	size_t len;
-	uint8_t compression[]= { 0x1, 0x0 };
-
-	len= sizeof(compression);
-
-	c= len;
-	hsbuf_add(hsbuf, &c, 1);
-
-	hsbuf_add(hsbuf, compression, len);
-}
-
-static void ext_sigs(struct hsbuf *hsbuf)
-{
-	uint16_t sigextlen, siglen;
-	uint8_t sigs[] =
-	{
-		/* From wget 1.19.1 */
-		0x04, 0x01,	/* SHA256, RSA */
-		0x04, 0x03,	/* SHA256, ECDSA */
-		0x05, 0x01,	/* SHA384, RSA */
-		0x05, 0x03,	/* SHA384, ECDSA */
-		0x06, 0x01,	/* SHA512, RSA */
-		0x06, 0x03,	/* SHA512, ECDSA */
-		0x03, 0x01,	/* SHA224, RSA */
-		0x03, 0x03,	/* SHA224, ECDSA */
-		0x02, 0x01,	/* SHA1, RSA */
-		0x02, 0x01,	/* SHA1, ECDSA */
-	};
-
-	siglen= sizeof(sigs);
-	sigextlen= siglen + 2;
-
-	hsbuf_add_u16(hsbuf, 13 /*signature_algorithms*/);
-	hsbuf_add_u16(hsbuf, sigextlen);
-	hsbuf_add_u16(hsbuf, siglen);
-	hsbuf_add(hsbuf, sigs, siglen);
-}
-
-static void elliptic_curves(struct hsbuf *hsbuf)
-{
-	uint16_t curvesextlen, curveslen;
-	uint8_t curves[] =
-	{
-		/* From wget 1.19.1 */
-		0x00, 0x17,	/* secp256r1 */
-		0x00, 0x18,	/* secp384r1 */
-		0x00, 0x19,	/* secp521r1 */
-		0x00, 0x15,	/* secp224r1 */
-		0x00, 0x13,	/* secp192r1 */
-	};
-
-	curveslen= sizeof(curves);
-	curvesextlen= curveslen + 2;
-
-	hsbuf_add_u16(hsbuf, 10 /*elliptic_curves*/);
-	hsbuf_add_u16(hsbuf, curvesextlen);
-	hsbuf_add_u16(hsbuf, curveslen);
-	hsbuf_add(hsbuf, curves, curveslen);
-}
-
-static void sni(struct hsbuf *hsbuf, const char *server_name)
-{
-	uint8_t c;
-	size_t size_hostname, size_server_name_list, size_extension_data;
-
-	size_hostname= strlen(server_name);
-	size_server_name_list= 1 /*name_type*/ + 2 /*size_hostname*/ +
-		size_hostname;
-	size_extension_data= 2 /*size_server_name_list*/ +
-		size_server_name_list;
-
-	hsbuf_add_u16(hsbuf, 0 /* server_name */);
-	hsbuf_add_u16(hsbuf, size_extension_data);
-	hsbuf_add_u16(hsbuf, size_server_name_list);
-	c= 0;	/* host_name */
-	hsbuf_add(hsbuf, &c, 1);
-	hsbuf_add_u16(hsbuf, size_hostname);
-	hsbuf_add(hsbuf, server_name, size_hostname);
-}
-
-static void add_extensions(struct state *state, struct hsbuf *hsbuf)
-{
-	size_t size_extensions;
-	struct hsbuf ext_sigs_buf;
-	struct hsbuf sni_buf;
-	struct hsbuf elliptic_curves_buf;
-
-	/* SNI */
-	hsbuf_init(&sni_buf);
-	if (state->sni)
-		sni(&sni_buf, state->sni);
-
-	/* Signatures */
-	hsbuf_init(&ext_sigs_buf);
-	ext_sigs(&ext_sigs_buf);
-
-	/* Elliptic curvers */
-	hsbuf_init(&elliptic_curves_buf);
-	elliptic_curves(&elliptic_curves_buf);
-
-	size_extensions= hsbuf_len(&sni_buf) + hsbuf_len(&ext_sigs_buf) +
-		hsbuf_len(&elliptic_curves_buf);
-
-	hsbuf_add_u16(hsbuf, size_extensions);
-	hsbuf_copy(hsbuf, &sni_buf);
-	hsbuf_cleanup(&sni_buf);
-	hsbuf_copy(hsbuf, &ext_sigs_buf);
-	hsbuf_cleanup(&ext_sigs_buf);
-	hsbuf_copy(hsbuf, &elliptic_curves_buf);
-	hsbuf_cleanup(&elliptic_curves_buf);
-}
-
 static struct hgbase *sslgetcert_base_new(struct event_base *event_base)
 {
 	struct hgbase *base;
@@ -892,7 +689,7 @@ static void *sslgetcert_init(int __attribute((unused)) argc, char *argv[],
 			crondlog(LVL8 "insecure file '%s'", output_file);
 			goto err;
 		}
-		fh= fopen(validated_output_file, "a");
+		fh= atlas_fopen_append(validated_output_file);
 		if (!fh)
 		{
 			crondlog(LVL8 "sslgetcert: unable to append to '%s'",
@@ -945,7 +742,9 @@ static void *sslgetcert_init(int __attribute((unused)) argc, char *argv[],
 		goto err;
 	}
 
-	state= xzalloc(sizeof(*state));
+	if (!state_pool)
+		state_pool= atlas_pool_new("sslgetcert", sizeof(*state));
+	state= atlas_pool_zalloc(state_pool);
 	state->base= hg_base;
 	state->atlas= A_arg ? strdup(A_arg) : NULL;
 	state->bundle= B_arg ? strdup(B_arg) : NULL;
@@ -1012,7 +811,7 @@ static void report(struct state *state)
 	fh= NULL;
 	if (state->output_file)
 	{
-		fh= fopen(state->output_file, "a");
+		fh= atlas_fopen_append(state->output_file);
 		if (!fh)
 			crondlog(DIE9 "sslgetcert: unable to append to '%s'",
 				state->output_file);
@@ -1162,7 +961,7 @@ static FILE *report_head(struct state *state)
 	fh= NULL;
 	if (state->output_file)
 	{
-		fh= fopen(state->output_file, "a");
+		fh= atlas_fopen_append(state->output_file);
 		if (!fh)
 		{
 			crondlog(DIE9 "sslgetcert: unable to append to '%s'",
@@ -1280,7 +1079,7 @@ static int eat_alert(struct state *state)
 				}
 				return -1;
 			}
-			if (type != MSG_ALERT)
+			if (type != TLS_MSG_ALERT)
 			{
 				fprintf(stderr,
 			"eat_alert: got bad type %d from msgbuf_read\n",
@@ -1316,9 +1115,12 @@ static int eat_alert(struct state *state)
 static int eat_server_hello(struct state *state)
 {
 	int r, type;
-	size_t o, len, seslen, totlen;
+	unsigned version;
+	size_t len, totlen;
 	uint8_t *p;
+	const char *errstr;
 	struct msgbuf *msgbuf;
+	char errline[80];
 
 	msgbuf= &state->msginbuf;
 
@@ -1335,14 +1137,14 @@ static int eat_server_hello(struct state *state)
 				return -1;
 
 			}
-			if (type == MSG_ALERT)
+			if (type == TLS_MSG_ALERT)
 			{
 				r= eat_alert(state);
 				if (r == 0)
 					continue;
 				return r;	/* No need to continue */
 			}
-			if (type != MSG_HANDSHAKE)
+			if (type != TLS_MSG_HANDSHAKE)
 			{
 				fprintf(stderr,
 			"eat_server_hello: got bad type %d from msgbuf_read\n",
@@ -1354,7 +1156,7 @@ static int eat_server_hello(struct state *state)
 			continue;
 		}
 		p= (uint8_t *)msgbuf->buffer.buf+msgbuf->buffer.offset;
-		if (p[0] != HS_SERVER_HELLO)
+		if (p[0] != TLS_HS_SERVER_HELLO)
 		{
 			fprintf(stderr, "eat_server_hello: got type %d\n",
 				p[0]);
@@ -1373,7 +1175,7 @@ static int eat_server_hello(struct state *state)
 				"eat_server_hello: msgbuf_read failed\n");
 				return -1;
 			}
-			if (type != MSG_HANDSHAKE)
+			if (type != TLS_MSG_HANDSHAKE)
 			{
 				fprintf(stderr,
 			"eat_server_hello: got bad type %d from msgbuf_read\n",
@@ -1386,65 +1188,17 @@ static int eat_server_hello(struct state *state)
 		}
 
 		totlen= 4+len;
-		o= 4;
-
-		/* ProtocolVersion */
-		if (o+2 > totlen)
-		{
-			add_str(state, DBQ(err) ":"
-				DBQ(Server Hello too short (ProtocolVersion)));
-			report(state);
-			return -1;
-		}
-		o += 2;
-
-		/* Random */
-		if (o+32 > totlen)
-		{
-			add_str(state, DBQ(err) ":"
-				DBQ(Server Hello too short (Random)));
-			report(state);
-			return -1;
-		}
-		o += 32;
-
-		/* opaque SessionID<0..32> */
-		if (o+1 > totlen)
-		{
-			add_str(state, DBQ(err) ":"
-				DBQ(Server Hello too short (SessionID len)));
-			report(state);
-			return -1;
-		}
-		seslen= p[o];
-		o++;
-		if (seslen > 32)
-		{
-			add_str(state, DBQ(err) ":"
-				DBQ(Server Hello bad SessionID len));
-			report(state);
-			return -1;
-		}
-		if (o+seslen > totlen)
-		{
-			add_str(state, DBQ(err) ":"
-				DBQ(Server Hello too short (SessionID)));
-			report(state);
-			return -1;
-		}
-		o += seslen;
 
-
-		/* CipherSuite */
-		if (o+2 > totlen)
+		errstr= tls_server_hello(p+4, len, &version,
+			&state->server_cipher);
+		if (errstr)
 		{
-			add_str(state, DBQ(err) ":"
-				DBQ(Server Hello too short (CipherSuite)));
+			snprintf(errline, sizeof(errline),
+				DBQ(err) ":" DBQ(%s), errstr);
+			add_str(state, errline);
 			report(state);
 			return -1;
 		}
-		state->server_cipher= (p[o] << 8) | p[o+1];
-		o += 2;
 
 		msgbuf->buffer.offset += totlen;
 		break;
@@ -1479,7 +1233,7 @@ static int eat_certificate(struct state *state)
 				}
 				return -1;
 			}
-			if (type != MSG_HANDSHAKE)
+			if (type != TLS_MSG_HANDSHAKE)
 			{
 				fprintf(stderr,
 			"eat_certificate: got bad type %d from msgbuf_read\n",
@@ -1491,7 +1245,7 @@ static int eat_certificate(struct state *state)
 			continue;
 		}
 		p= (uint8_t *)msgbuf->buffer.buf+msgbuf->buffer.offset;
-		if (p[0] != HS_CERTIFICATE)
+		if (p[0] != TLS_HS_CERTIFICATE)
 		{
 			fprintf(stderr, "eat_certificate: got type %d\n", p[0]);
 			add_str(state, DBQ(err) ":" DBQ(bad type));
@@ -1516,7 +1270,7 @@ static int eat_certificate(struct state *state)
 				"eat_certificate: msgbuf_read failed\n");
 				return -1;
 			}
-			if (type != MSG_HANDSHAKE)
+			if (type != TLS_MSG_HANDSHAKE)
 			{
 				fprintf(stderr,
 			"eat_certificate: got bad type %d from msgbuf_read\n",
@@ -1611,11 +1365,12 @@ static int eat_certificate(struct state *state)
 
 static void writecb(struct bufferevent *bev, void *ptr)
 {
-	char c;
+	size_t len;
 	struct state *state;
 	struct buf outbuf;
 	struct msgbuf msgoutbuf;
 	struct hsbuf hsbuf;
+	uint8_t hello[TLS_HELLO_MAX];
 
 	state= ENV2STATE(ptr);
 
@@ -1630,21 +1385,13 @@ static void writecb(struct bufferevent *bev, void *ptr)
 			msgbuf_init(&msgoutbuf, NULL, &outbuf);
 			hsbuf_init(&hsbuf);
 
-			/* Major/minor */
-			c= state->major_version;
-			hsbuf_add(&hsbuf, &c, 1);
-
-			c= state->minor_version;
-			hsbuf_add(&hsbuf, &c, 1);
-			add_random(&hsbuf);
-			add_sessionid(&hsbuf);
-			add_ciphers(&hsbuf);
-			add_compression(&hsbuf);
-
-			add_extensions(state, &hsbuf);
+			len= tls_hello_body(hello, sizeof(hello),
+				state->major_version, state->minor_version,
+				NULL, 0, state->sni);
+			hsbuf_add(&hsbuf, hello, len);
 
-			hsbuf_final(&hsbuf, HS_CLIENT_HELLO, &msgoutbuf);
-			msgbuf_final(&msgoutbuf, MSG_HANDSHAKE);
+			hsbuf_final(&hsbuf, TLS_HS_CLIENT_HELLO, &msgoutbuf);
+			msgbuf_final(&msgoutbuf, TLS_MSG_HANDSHAKE);
 
 			/* Ignore error */
 			if (!state->response_in)
@@ -1928,7 +1675,7 @@ static int sslgetcert_delete(void *vstate)
 	free(state->infname);
 	state->infname= NULL;
 
-	free(state);
+	atlas_pool_free(state_pool, state);
 
 	return 1;
 }
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * timeouts.c -- libevent common timeout queues for per-packet timers
+ */
+
+#include "libbb.h"
+#include <event2/event.h>
+
+#include "eperd.h"
+
+/* libevent allows 256 per event base. Only a few distinct timeouts are
+ * expected, anything beyond this limit just goes on the heap.
+ */
+#define MAX_COMMON	64
+
+static struct common_timeout
+{
+	struct event_base *base;
+	struct timeval tv;		/* Requested timeout */
+	const struct timeval *ctv;	/* Magic value from libevent */
+} common_timeouts[MAX_COMMON];
+static int n_common;
+
+const struct timeval *common_timeout(struct event_base *base,
+	const struct timeval *tv)
+{
+	int i;
+	const struct timeval *ctv;
+
+	for (i= 0; i<n_common; i++)
+	{
+		if (common_timeouts[i].base == base &&
+			common_timeouts[i].tv.tv_sec == tv->tv_sec &&
+			common_timeouts[i].tv.tv_usec == tv->tv_usec)
+		{
+			return common_timeouts[i].ctv;
+		}
+	}
+
+	if (n_common >= MAX_COMMON)
+		return tv;
+	ctv= event_base_init_common_timeout(base, tv);
+	if (!ctv)
+		return tv;
+
+	common_timeouts[n_common].base= base;
+	common_timeouts[n_common].tv= *tv;
+	common_timeouts[n_common].ctv= ctv;
+	n_common++;
+	return ctv;
+}
+
+int common_timer_add(struct event *ev, const struct timeval *tv)
+{
+	return event_add(ev, common_timeout(event_get_base(ev), tv));
+}
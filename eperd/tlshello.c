@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * tlshello.c -- hand built ClientHello and ServerHello parsing, no handshake
+ */
+
+#include "libbb.h"
+
+#include "tlshello.h"
+
+#define URANDOM_DEV	"/dev/urandom"
+
+struct wbuf
+{
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+	int full;
+};
+
+static void wbuf_add(struct wbuf *wbuf, const void *data, size_t len)
+{
+	if (wbuf->full || len > wbuf->size - wbuf->len)
+	{
+		wbuf->full= 1;
+		return;
+	}
+	memcpy(wbuf->buf+wbuf->len, data, len);
+	wbuf->len += len;
+}
+
+static void wbuf_add_u8(struct wbuf *wbuf, unsigned u8)
+{
+	uint8_t c;
+
+	c= u8;
+	wbuf_add(wbuf, &c, 1);
+}
+
+static void wbuf_add_u16(struct wbuf *wbuf, unsigned u16)
+{
+	wbuf_add_u8(wbuf, u16 >> 8);
+	wbuf_add_u8(wbuf, u16);
+}
+
+/* Fill in a 16-bit length that was reserved at 'o' */
+static void wbuf_set_len16(struct wbuf *wbuf, size_t o)
+{
+	size_t len;
+
+	if (wbuf->full)
+		return;
+	len= wbuf->len - o - 2;
+	wbuf->buf[o]= len >> 8;
+	wbuf->buf[o+1]= len;
+}
+
+static void add_random(struct wbuf *wbuf)
+{
+	int fd;
+	time_t t;
+	uint8_t buf[32];
+
+	t= time(NULL);
+	buf[0]= t >> 24;
+	buf[1]= t >> 16;
+	buf[2]= t >> 8;
+	buf[3]= t;
+
+	fd= open(URANDOM_DEV, O_RDONLY);
+
+	/* Best effort, just ignore errors */
+	if (fd != -1)
+	{
+		read(fd, buf+4, sizeof(buf)-4);
+		close(fd);
+	}
+	wbuf_add(wbuf, buf, sizeof(buf));
+}
+
+static void add_sessionid(struct wbuf *wbuf)
+{
+	wbuf_add_u8(wbuf, 0);
+}
+
+static void add_ciphers(struct wbuf *wbuf, const uint8_t *ciphers,
+	size_t cipherslen)
+{
+	static const uint8_t default_ciphers[]= {
+		/* From Firefox 57.0.1 */
+		0xc0,0x2b,	/* TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256 */
+		0xc0,0x2f,	/* TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256 */
+		0xcc,0xa9,	/* TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256 */
+		0xcc,0xa8,	/* TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256 */
+		0xc0,0x2c,	/* TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384 */
+		0xc0,0x30,	/* TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384 */
+		0xc0,0x0a,	/* TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA */
+		0xc0,0x09,	/* TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA */
+		0xc0,0x13,	/* TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA */
+		0xc0,0x14,	/* TLS_ECDHE_RSA_WITH_AES_256_CBC_SHA */
+		0x00,0x33,	/* TLS_DHE_RSA_WITH_AES_128_CBC_SHA */
+		0x00,0x39,	/* TLS_DHE_RSA_WITH_AES_256_CBC_SHA */
+		0x00,0x2f,	/* TLS_RSA_WITH_AES_128_CBC_SHA */
+		0x00,0x35,	/* TLS_RSA_WITH_AES_256_CBC_SHA */
+		0x00,0x0a,	/* TLS_RSA_WITH_3DES_EDE_CBC_SHA */
+	 };
+
+	if (ciphers == NULL)
+	{
+		ciphers= default_ciphers;
+		cipherslen= sizeof(default_ciphers);
+	}
+
+	wbuf_add_u16(wbuf, cipherslen);
+	wbuf_add(wbuf, ciphers, cipherslen);
+}
+
+static void add_compression(struct wbuf *wbuf)
+{
+	static const uint8_t compression[]= { 0x1, 0x0 };
+
+	wbuf_add_u8(wbuf, sizeof(compression));
+	wbuf_add(wbuf, compression, sizeof(compression));
+}
+
+static void ext_sigs(struct wbuf *wbuf)
+{
+	static const uint8_t sigs[] =
+	{
+		/* From wget 1.19.1 */
+		0x04, 0x01,	/* SHA256, RSA */
+		0x04, 0x03,	/* SHA256, ECDSA */
+		0x05, 0x01,	/* SHA384, RSA */
+		0x05, 0x03,	/* SHA384, ECDSA */
+		0x06, 0x01,	/* SHA512, RSA */
+		0x06, 0x03,	/* SHA512, ECDSA */
+		0x03, 0x01,	/* SHA224, RSA */
+		0x03, 0x03,	/* SHA224, ECDSA */
+		0x02, 0x01,	/* SHA1, RSA */
+		0x02, 0x01,	/* SHA1, ECDSA */
+	};
+
+	wbuf_add_u16(wbuf, 13 /*signature_algorithms*/);
+	wbuf_add_u16(wbuf, sizeof(sigs) + 2);
+	wbuf_add_u16(wbuf, sizeof(sigs));
+	wbuf_add(wbuf, sigs, sizeof(sigs));
+}
+
+static void elliptic_curves(struct wbuf *wbuf)
+{
+	static const uint8_t curves[] =
+	{
+		/* From wget 1.19.1 */
+		0x00, 0x17,	/* secp256r1 */
+		0x00, 0x18,	/* secp384r1 */
+		0x00, 0x19,	/* secp521r1 */
+		0x00, 0x15,	/* secp224r1 */
+		0x00, 0x13,	/* secp192r1 */
+	};
+
+	wbuf_add_u16(wbuf, 10 /*elliptic_curves*/);
+	wbuf_add_u16(wbuf, sizeof(curves) + 2);
+	wbuf_add_u16(wbuf, sizeof(curves));
+	wbuf_add(wbuf, curves, sizeof(curves));
+}
+
+static void sni(struct wbuf *wbuf, const char *server_name)
+{
+	size_t size_hostname, size_server_name_list, size_extension_data;
+
+	size_hostname= strlen(server_name);
+	size_server_name_list= 1 /*name_type*/ + 2 /*size_hostname*/ +
+		size_hostname;
+	size_extension_data= 2 /*size_server_name_list*/ +
+		size_server_name_list;
+
+	wbuf_add_u16(wbuf, 0 /* server_name */);
+	wbuf_add_u16(wbuf, size_extension_data);
+	wbuf_add_u16(wbuf, size_server_name_list);
+	wbuf_add_u8(wbuf, 0 /* host_name */);
+	wbuf_add_u16(wbuf, size_hostname);
+	wbuf_add(wbuf, server_name, size_hostname);
+}
+
+static void add_extensions(struct wbuf *wbuf, const char *server_name)
+{
+	size_t o;
+
+	o= wbuf->len;
+	wbuf_add_u16(wbuf, 0);	/* Length, filled in below */
+
+	if (server_name)
+		sni(wbuf, server_name);
+	ext_sigs(wbuf);
+	elliptic_curves(wbuf);
+
+	wbuf_set_len16(wbuf, o);
+}
+
+size_t tls_hello_body(uint8_t *buf, size_t bufsize, int major, int minor,
+	const uint8_t *ciphers, size_t cipherslen, const char *sni)
+{
+	struct wbuf wbuf;
+
+	wbuf.buf= buf;
+	wbuf.size= bufsize;
+	wbuf.len= 0;
+	wbuf.full= 0;
+
+	wbuf_add_u8(&wbuf, major);
+	wbuf_add_u8(&wbuf, minor);
+	add_random(&wbuf);
+	add_sessionid(&wbuf);
+	add_ciphers(&wbuf, ciphers, cipherslen);
+	add_compression(&wbuf);
+	add_extensions(&wbuf, sni);
+
+	return wbuf.full ? 0 : wbuf.len;
+}
+
+size_t tls_client_hello(uint8_t *buf, size_t bufsize, int major, int minor,
+	const uint8_t *ciphers, size_t cipherslen, const char *sni)
+{
+	size_t len;
+
+	/* Record header (5) and handshake header (4) */
+	if (bufsize < 9)
+		return 0;
+	len= tls_hello_body(buf+9, bufsize-9, major, minor,
+		ciphers, cipherslen, sni);
+	if (len == 0 || len+4 > 0x4000)
+		return 0;
+
+	buf[0]= TLS_MSG_HANDSHAKE;
+	buf[1]= 3;
+	buf[2]= 0;
+	buf[3]= (len+4) >> 8;
+	buf[4]= (len+4);
+
+	buf[5]= TLS_HS_CLIENT_HELLO;
+	buf[6]= len >> 16;
+	buf[7]= len >> 8;
+	buf[8]= len;
+
+	return len+9;
+}
+
+const char *tls_server_hello(const uint8_t *p, size_t len,
+	unsigned *versionp, unsigned *cipherp)
+{
+	size_t o, seslen;
+
+	o= 0;
+
+	/* ProtocolVersion */
+	if (o+2 > len)
+		return "Server Hello too short (ProtocolVersion)";
+	*versionp= (p[o] << 8) | p[o+1];
+	o += 2;
+
+	/* Random */
+	if (o+32 > len)
+		return "Server Hello too short (Random)";
+	o += 32;
+
+	/* opaque SessionID<0..32> */
+	if (o+1 > len)
+		return "Server Hello too short (SessionID len)";
+	seslen= p[o];
+	o++;
+	if (seslen > 32)
+		return "Server Hello bad SessionID len";
+	if (o+seslen > len)
+		return "Server Hello too short (SessionID)";
+	o += seslen;
+
+	/* CipherSuite */
+	if (o+2 > len)
+		return "Server Hello too short (CipherSuite)";
+	*cipherp= (p[o] << 8) | p[o+1];
+
+	return NULL;
+}
+
+int tls_server_reply(const uint8_t *p, size_t len, struct tls_reply *reply)
+{
+	size_t reclen, hslen;
+
+	memset(reply, '\0', sizeof(*reply));
+
+	/* Only the first record matters. Servers put the ServerHello
+	 * at the start of their first flight.
+	 */
+	if (len < 5)
+		return TLS_REPLY_MORE;
+	reclen= (p[3] << 8) | p[4];
+	if (reclen > 0x4000 + 2048)
+	{
+		reply->err= "bad record length";
+		return TLS_REPLY_ERR;
+	}
+
+	switch(p[0])
+	{
+	case TLS_MSG_ALERT:
+		if (len < 5+2)
+			return TLS_REPLY_MORE;
+		reply->alert_level= p[5];
+		reply->alert_descr= p[6];
+		return TLS_REPLY_ALERT;
+
+	case TLS_MSG_HANDSHAKE:
+		if (len < 5+4)
+			return TLS_REPLY_MORE;
+		if (p[5] != TLS_HS_SERVER_HELLO)
+		{
+			reply->err= "bad handshake type";
+			return TLS_REPLY_ERR;
+		}
+		hslen= (p[6] << 16) | (p[7] << 8) | p[8];
+		if (hslen+4 > reclen)
+		{
+			reply->err= "Server Hello split across records";
+			return TLS_REPLY_ERR;
+		}
+		if (len < 5+4+hslen)
+			return TLS_REPLY_MORE;
+		reply->err= tls_server_hello(p+9, hslen, &reply->version,
+			&reply->cipher);
+		return reply->err ? TLS_REPLY_ERR : TLS_REPLY_HELLO;
+
+	default:
+		reply->err= "bad record type";
+		return TLS_REPLY_ERR;
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * tlshello.h -- hand built ClientHello and ServerHello parsing, no handshake
+ */
+
+#define TLS_MSG_ALERT		21
+#define TLS_MSG_HANDSHAKE	22
+#define TLS_HS_CLIENT_HELLO	 1
+#define TLS_HS_SERVER_HELLO	 2
+#define TLS_HS_CERTIFICATE	11
+
+#define TLS_HELLO_MAX		1024	/* Enough for a ClientHello record */
+
+/* Results of tls_server_reply */
+#define TLS_REPLY_MORE		0	/* Need more data */
+#define TLS_REPLY_HELLO		1	/* Got a ServerHello */
+#define TLS_REPLY_ALERT		2	/* Got an alert */
+#define TLS_REPLY_ERR		3	/* Something else, see 'err' */
+
+struct tls_reply
+{
+	unsigned version;	/* Version from the ServerHello */
+	unsigned cipher;	/* Cipher suite picked by the server */
+	int alert_level;
+	int alert_descr;
+	const char *err;
+};
+
+/* Build the body of a ClientHello handshake message. 'ciphers' is a list
+ * of 2 byte cipher suites, NULL gets a default list. 'sni' can be NULL.
+ * Returns the length or 0 if it does not fit.
+ */
+size_t tls_hello_body(uint8_t *buf, size_t bufsize, int major, int minor,
+	const uint8_t *ciphers, size_t cipherslen, const char *sni);
+
+/* Same, but wrapped in a handshake header and a record header */
+size_t tls_client_hello(uint8_t *buf, size_t bufsize, int major, int minor,
+	const uint8_t *ciphers, size_t cipherslen, const char *sni);
+
+/* Parse the body of a ServerHello handshake message. Returns NULL or a
+ * description of what is wrong.
+ */
+const char *tls_server_hello(const uint8_t *p, size_t len,
+	unsigned *versionp, unsigned *cipherp);
+
+/* Look at the start of what a server sent in response to a ClientHello */
+int tls_server_reply(const uint8_t *p, size_t len, struct tls_reply *reply);
@@ -15,7 +15,9 @@
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 
+#include "atlas_pool.h"
 #include "eperd.h"
+#include "aggregate.h"
 
 #define SAFE_PREFIX_REL ATLAS_DATA_NEW_REL
 
@@ -26,7 +28,7 @@
 #define uh_sum check
 #endif
 
-#define TRACEROUTE_OPT_STRING ("!46IUFrTa:b:c:f:g:i:m:p:t:w:z:A:B:O:S:H:D:R:W:")
+#define TRACEROUTE_OPT_STRING ("!46IUFrTLa:b:c:f:g:i:m:p:t:w:z:A:B:O:S:H:D:R:W:x:y:G:")
 
 #define OPT_4	(1 << 0)
 #define OPT_6	(1 << 1)
@@ -35,6 +37,7 @@
 #define OPT_F	(1 << 4)
 #define OPT_r	(1 << 5)
 #define OPT_T	(1 << 6)
+#define OPT_L	(1 << 7)
 
 #define IPHDR              20
 #define ICMP6_HDR 	(sizeof(struct icmp6_hdr))
@@ -67,6 +70,13 @@
 #define RESP_RCVDTCLASS	6
 #define RESP_SENDTO	7
 
+#define MAX_HOPS	256	/* Size of per-hop tables in flash mode */
+
+#define HOP_DONE	0x01	/* Lane has finished */
+#define HOP_RESP	0x02	/* Got a reply for this hop */
+#define HOP_DEST	0x04	/* Reached the destination */
+#define HOP_ERR		0x08	/* Lane stopped with an error */
+
 struct trtbase
 {
 	struct event_base *event_base;
@@ -115,6 +125,9 @@ struct trtstate
 	unsigned duptimeout;
 	unsigned timeout;
 	int tos;
+	unsigned flashwin;	/* Hops to probe in parallel, 0 is off */
+	unsigned flashgap;	/* Minimum time between lane starts, in us */
+	char report_sendlag;	/* Report how late each packet went */
 
 	char *response_in;	/* Fuzzing */
 	char *response_out;
@@ -160,6 +173,8 @@ struct trtstate
 
 	time_t starttime;
 	struct timespec xmit_time;
+	struct timespec planned;	/* When the next packet should go */
+	char have_planned;
 
 	struct timespec start_time;	/* At the moment only for
 					 * DNS resolution
@@ -167,6 +182,7 @@ struct trtstate
 	double ttr;			/* Time to resolve a name, in ms */
 
 	struct event timer;
+	struct pace_entry pace;
 
 	unsigned long min;
 	unsigned long max;
@@ -180,10 +196,42 @@ struct trtstate
 	size_t resmax;
 	char open_result;
 
+	/* Flash mode. The parent starts a lane for each hop. A lane is a
+	 * trtstate of its own (with its own index, so replies find it
+	 * through the usual id/seq encoding) that probes a single hop.
+	 * Finished lanes hand their result to the parent, which puts
+	 * the hops back in order when it reports.
+	 */
+	struct trtstate *parent;	/* Set for a lane */
+	struct trtstate **lanes;	/* Running lanes, by hop */
+	char **hopres;			/* Results of finished lanes */
+	unsigned char *hopflags;	/* HOP_* */
+	unsigned nexthop;		/* Next hop to start a lane for */
+	unsigned nlanes;		/* Number of running lanes */
+	struct timespec flashlast;	/* Planned start of the last lane */
+	struct send_timer flash_timer;
+
+	/* Summaries. With a window, round trip times are kept by hop and
+	 * a summary RESULT is written for the first run that ends after
+	 * the window. Lanes add to their parent.
+	 */
+	unsigned aggwin;		/* In seconds, 0 is off */
+	time_t aggstart;
+	unsigned aggruns;
+	struct agghop **agghops;	/* By hop, maxhops+1 entries */
+
 	FILE *resp_file_out;	/* Fuzzing */
 };
 
+struct agghop
+{
+	char from[INET6_ADDRSTRLEN];	/* Last address that replied */
+	struct agg_hist hist;
+};
+
 static struct trtbase *trt_base;
+static struct atlas_pool *state_pool;
+static struct atlas_pool *lane_pool;
 
 struct v4_ph
 {
@@ -213,6 +261,8 @@ struct v6info
 };
 
 static int create_socket(struct trtstate *state, int do_tcp);
+static void traceroute_start2(void *state);
+static void flash_lane_done(struct trtstate *lane);
 static void ready_callback4(int __attribute((unused)) unused,
 	const short __attribute((unused)) event, void *s);
 static void ready_tcp4(int __attribute((unused)) unused,
@@ -335,7 +385,24 @@ static void add_str(struct trtstate *state, const char *str)
 	//printf("add_str: result = '%s'\n", state->result);
 }
 
-static void report(struct trtstate *state)
+static void close_sockets(struct trtstate *state)
+{
+	if (state->socket_icmp != -1)
+	{
+		event_del(&state->event_icmp);
+		close(state->socket_icmp);
+		state->socket_icmp= -1;
+	}
+	if (state->socket_tcp != -1)
+	{
+		event_del(&state->event_tcp);
+		close(state->socket_tcp);
+		state->socket_tcp= -1;
+	}
+}
+
+/* Everything up to the result */
+static FILE *report_head(struct trtstate *state)
 {
 	int r;
 	FILE *fh;
@@ -344,11 +411,9 @@ static void report(struct trtstate *state)
 	char namebuf[NI_MAXHOST];
 	struct addrinfo hints;
 
-	event_del(&state->timer);
-
 	if (state->out_filename)
 	{
-		fh= fopen(state->out_filename, "a");
+		fh= atlas_fopen_append(state->out_filename);
 		if (!fh)
 			crondlog(DIE9 "traceroute: unable to append to '%s'",
 				state->out_filename);
@@ -423,27 +488,96 @@ static void report(struct trtstate *state)
 	{
 		fprintf(fh, ", " DBQ(paris_id) ":%d", state->paris);
 	}
-	fprintf(fh, ", " DBQ(result) ": [ %s ] }\n", state->result);
+	return fh;
+}
 
-	free(state->result);
-	state->result= NULL;
+static void agg_sample(struct trtstate *state, const char *from, double ms)
+{
+	struct trtstate *top;
+	struct agghop *agghop;
+
+	top= state->parent ? state->parent : state;
+	if (!top->aggwin || state->hop > top->maxhops)
+		return;
+	agghop= top->agghops[state->hop];
+	if (agghop == NULL)
+	{
+		agghop= xmalloc(sizeof(*agghop));
+		agg_hist_init(&agghop->hist);
+		top->agghops[state->hop]= agghop;
+	}
+	strlcpy(agghop->from, from, sizeof(agghop->from));
+	agg_hist_add(&agghop->hist, ms);
+}
+
+/* Write the summary and start a new window */
+static void report_summary(struct trtstate *state)
+{
+	unsigned hop;
+	const char *sep;
+	FILE *fh;
+	struct agghop *agghop;
+
+	fh= report_head(state);
+	fprintf(fh, ", " DBQ(summary) ": { " DBQ(start) ":%ld, "
+		DBQ(window) ":%u, " DBQ(runs) ":%u, " DBQ(hops) ": [ ",
+		(long)state->aggstart, state->aggwin, state->aggruns);
+	sep= "";
+	for (hop= 0; hop <= state->maxhops; hop++)
+	{
+		agghop= state->agghops[hop];
+		if (agghop == NULL)
+			continue;
+		fprintf(fh, "%s{ " DBQ(hop) ":%u, " DBQ(from) ":" DBQ(%s) ", "
+			DBQ(rcvd) ":%u", sep, hop, agghop->from,
+			agghop->hist.n);
+		agg_hist_report(fh, &agghop->hist);
+		fprintf(fh, " }");
+		sep= ", ";
+
+		free(agghop);
+		state->agghops[hop]= NULL;
+	}
+	fprintf(fh, " ] } }\n");
 
 	if (state->out_filename)
 		fclose(fh);
+	state->aggruns= 0;
+}
 
-	/* Kill the event and close socket */
-	if (state->socket_icmp != -1)
+static void report(struct trtstate *state)
+{
+	FILE *fh;
+
+	event_del(&state->timer);
+
+	if (state->parent)
 	{
-		event_del(&state->event_icmp);
-		close(state->socket_icmp);
-		state->socket_icmp= -1;
+		flash_lane_done(state);
+		return;
 	}
-	if (state->socket_tcp != -1)
+
+	if (state->aggwin)
 	{
-		event_del(&state->event_tcp);
-		close(state->socket_tcp);
-		state->socket_tcp= -1;
+		if (state->aggruns == 0)
+			state->aggstart= atlas_time();
+		state->aggruns++;
+		if (atlas_time() - state->aggstart >= (time_t)state->aggwin)
+			report_summary(state);
 	}
+	else
+	{
+		fh= report_head(state);
+		fprintf(fh, ", " DBQ(result) ": [ %s ] }\n", state->result);
+		if (state->out_filename)
+			fclose(fh);
+	}
+
+	free(state->result);
+	state->result= NULL;
+
+	/* Kill the event and close socket */
+	close_sockets(state);
 
 	state->busy= 0;
 
@@ -493,9 +627,16 @@ static int set_tos(struct trtstate *state, int sock, int af, int inner)
 	return 0;
 }
 
+static void send_pkt(struct trtstate *state);
+
+static void send_paced(void *ref)
+{
+	send_pkt(ref);
+}
+
 static void send_pkt(struct trtstate *state)
 {
-	int r, hop, len, on, sock, serrno;
+	int r, hop, len, on, sock, serrno, paced;
 	uint16_t sum, val;
 	unsigned usum;
 	struct trtbase *base;
@@ -516,8 +657,6 @@ static void send_pkt(struct trtstate *state)
 		int error;
 	} r_errno;
 
-	state->gotresp= 0;
-
 	base= state->base;
 
 	if (state->sent >= state->trtcount)
@@ -571,11 +710,37 @@ static void send_pkt(struct trtstate *state)
 		add_str(state, line);
 		state->open_result= 0;
 	}
+
+	/* Unless a flash lane planned its first packet, the packet is
+	 * planned to go now. A wait for the pacer counts as lateness.
+	 * Replies that are read from a file have no real send times.
+	 * Only packets that really go wait for the pacer, not the end of
+	 * a hop or of the traceroute above.
+	 */
+	if (!state->have_planned && !state->response_in)
+	{
+		gettime_mono(&state->planned);
+		state->have_planned= 1;
+	}
+
+	paced= pace_send(&state->pace, (struct sockaddr *)&state->sin6,
+		send_paced, state);
+	if (paced == 0)
+		return;		/* Comes back through send_paced */
+	state->have_planned= 0;
+
+	state->gotresp= 0;
 	state->seq++;
 
 	gettime_mono(&state->xmit_time);
 
-	if (state->sin6.sin6_family == AF_INET6)
+	if (paced == -1)
+	{
+		/* Dropped by the pacer. Like a packet that is too big,
+		 * it times out as a probe without a reply.
+		 */
+	}
+	else if (state->sin6.sin6_family == AF_INET6)
 	{
 		hop= state->hop;
 
@@ -715,6 +880,7 @@ static void send_pkt(struct trtstate *state)
 					(struct sockaddr *)&sin6copy,
 					state->socklen);
 				serrno= errno;
+				acct_io(&traceroute_ops, state, ACCT_OUT, r);
 				if (state->resp_file_out)
 				{
 					r_errno.r= r;
@@ -858,6 +1024,7 @@ static void send_pkt(struct trtstate *state)
 					len, 0, (struct sockaddr *)&sin6copy,
 					sizeof(sin6copy));
 				serrno= errno;
+				acct_io(&traceroute_ops, state, ACCT_OUT, r);
 				if (state->resp_file_out)
 				{
 					r_errno.r= r;
@@ -1015,6 +1182,7 @@ static void send_pkt(struct trtstate *state)
 					(struct sockaddr *)&state->sin6,
 					state->socklen);
 				serrno= errno;
+				acct_io(&traceroute_ops, state, ACCT_OUT, r);
 				if (state->resp_file_out)
 				{
 					r_errno.r= r;
@@ -1210,6 +1378,7 @@ static void send_pkt(struct trtstate *state)
 					(struct sockaddr *)&state->sin6,
 					state->socklen);
 				serrno= errno;
+				acct_io(&traceroute_ops, state, ACCT_OUT, r);
 				if (state->resp_file_out)
 				{
 					r_errno.r= r;
@@ -1335,6 +1504,7 @@ static void send_pkt(struct trtstate *state)
 					(struct sockaddr *)&state->sin6,
 					state->socklen);
 				serrno= errno;
+				acct_io(&traceroute_ops, state, ACCT_OUT, r);
 				if (state->resp_file_out)
 				{
 					r_errno.r= r;
@@ -1508,6 +1678,7 @@ static void send_pkt(struct trtstate *state)
 					(struct sockaddr *)&state->sin6,
 					state->socklen);
 				serrno= errno;
+				acct_io(&traceroute_ops, state, ACCT_OUT, r);
 				if (state->resp_file_out)
 				{
 					r_errno.r= r;
@@ -1546,13 +1717,21 @@ static void send_pkt(struct trtstate *state)
 	add_str(state, "{ ");
 	state->open_result= 0;
 
+	if (state->report_sendlag)
+	{
+		snprintf(line, sizeof(line), DBQ(sendlag) ":%.3f, ",
+			(state->xmit_time.tv_sec-state->planned.tv_sec)*1e3 +
+			(state->xmit_time.tv_nsec-state->planned.tv_nsec)/1e6);
+		add_str(state, line);
+	}
+
 	/* Increment packets sent */
 	state->sent++;
 
 	/* Set timer */
 	interval.tv_sec= state->timeout/1000000;
 	interval.tv_usec= state->timeout % 1000000;
-	evtimer_add(&state->timer, &interval);
+	common_timer_add(&state->timer, &interval);
 
 	if (state->response_in)
 	{
@@ -1755,6 +1934,7 @@ static void ready_callback4(int __attribute((unused)) unused,
 		printf("ready_callback4: read error '%s'\n", strerror(errno));
 		return;
 	}
+	acct_io(&traceroute_ops, state, ACCT_IN, nrecv);
 	// printf("ready_callback4: got packet\n");
 
 	if (state->resp_file_out)
@@ -1913,6 +2093,9 @@ static void ready_callback4(int __attribute((unused)) unused,
 				snprintf(line, sizeof(line),
 					", " DBQ(rtt) ":%.3f", ms);
 				add_str(state, line);
+				if (!isDup)
+					agg_sample(state,
+						inet_ntoa(remote.sin_addr), ms);
 			}
 
 			if (eip->ip_ttl != 1)
@@ -2139,6 +2322,9 @@ static void ready_callback4(int __attribute((unused)) unused,
 				snprintf(line, sizeof(line),
 					", " DBQ(rtt) ":%.3f", ms);
 				add_str(state, line);
+				if (!isDup)
+					agg_sample(state,
+						inet_ntoa(remote.sin_addr), ms);
 			}
 			if (eip->ip_ttl != 1)
 			{
@@ -2374,6 +2560,9 @@ static void ready_callback4(int __attribute((unused)) unused,
 				snprintf(line, sizeof(line),
 					", " DBQ(rtt) ":%.3f", ms);
 				add_str(state, line);
+				if (!isDup)
+					agg_sample(state,
+						inet_ntoa(remote.sin_addr), ms);
 			}
 
 			if (eip->ip_ttl != 1)
@@ -2546,7 +2735,7 @@ static void ready_callback4(int __attribute((unused)) unused,
 				state->gotresp= 1;
 				interval.tv_sec= state->duptimeout/1000000;
 				interval.tv_usec= state->duptimeout % 1000000;
-				evtimer_add(&state->timer, &interval);
+				common_timer_add(&state->timer, &interval);
 			}
 			else
 			{
@@ -2664,6 +2853,9 @@ static void ready_callback4(int __attribute((unused)) unused,
 		{
 			snprintf(line, sizeof(line), ", " DBQ(rtt) ":%.3f", ms);
 			add_str(state, line);
+			if (!isDup)
+				agg_sample(state,
+					inet_ntoa(remote.sin_addr), ms);
 		}
 
 #if 0
@@ -2686,7 +2878,7 @@ static void ready_callback4(int __attribute((unused)) unused,
 				state->gotresp= 1;
 				interval.tv_sec= state->duptimeout/1000000;
 				interval.tv_usec= state->duptimeout % 1000000;
-				evtimer_add(&state->timer, &interval);
+				common_timer_add(&state->timer, &interval);
 			}
 			else
 			{
@@ -2806,6 +2998,7 @@ static void ready_tcp4(int __attribute((unused)) unused,
 		printf("ready_tcp4: read error '%s'\n", strerror(errno));
 		return;
 	}
+	acct_io(&traceroute_ops, state, ACCT_IN, nrecv);
 
 	if (state->resp_file_out)
 	{
@@ -2937,6 +3130,9 @@ static void ready_tcp4(int __attribute((unused)) unused,
 	{
 		snprintf(line, sizeof(line), ", " DBQ(rtt) ":%.3f", ms);
 		add_str(state, line);
+		if (!isDup)
+			agg_sample(state,
+				inet_ntoa(remote.sin_addr), ms);
 	}
 
 #if 0
@@ -2959,7 +3155,7 @@ static void ready_tcp4(int __attribute((unused)) unused,
 			state->gotresp= 1;
 			interval.tv_sec= state->duptimeout/1000000;
 			interval.tv_usec= state->duptimeout % 1000000;
-			evtimer_add(&state->timer, &interval);
+			common_timer_add(&state->timer, &interval);
 		}
 		else
 		{
@@ -3036,6 +3232,7 @@ static void ready_tcp6(int __attribute((unused)) unused,
 		printf("ready_tcp6: read error '%s'\n", strerror(errno));
 		return;
 	}
+	acct_io(&traceroute_ops, state, ACCT_IN, nrecv);
 
 	if (state->resp_file_out)
 	{
@@ -3213,6 +3410,8 @@ static void ready_tcp6(int __attribute((unused)) unused,
 	{
 		snprintf(line, sizeof(line), ", " DBQ(rtt) ":%.3f", ms);
 		add_str(state, line);
+		if (!isDup)
+			agg_sample(state, buf, ms);
 	}
 
 #if 0
@@ -3235,7 +3434,7 @@ static void ready_tcp6(int __attribute((unused)) unused,
 			state->gotresp= 1;
 			interval.tv_sec= state->duptimeout/1000000;
 			interval.tv_usec= state->duptimeout % 1000000;
-			evtimer_add(&state->timer, &interval);
+			common_timer_add(&state->timer, &interval);
 		}
 		else
 		{
@@ -3368,6 +3567,7 @@ static void ready_callback6(int __attribute((unused)) unused,
 			strerror(errno));
 		return;
 	}
+	acct_io(&traceroute_ops, state, ACCT_IN, nrecv);
 
 	if (state->response_out)
 	{
@@ -3785,6 +3985,8 @@ static void ready_callback6(int __attribute((unused)) unused,
 				DBQ(size) ":%d",
 				rcvdttl, ms, (int)(nrecv-ICMP6_HDR));
 			add_str(state, line);
+			if (!late && !isDup)
+				agg_sample(state, buf, ms);
 			if (eip->ip6_hops != 1)
 			{
 				snprintf(line, sizeof(line),
@@ -3947,7 +4149,7 @@ static void ready_callback6(int __attribute((unused)) unused,
 				state->gotresp= 1;
 				interval.tv_sec= state->duptimeout/1000000;
 				interval.tv_usec= state->duptimeout % 1000000;
-				evtimer_add(&state->timer, &interval);
+				common_timer_add(&state->timer, &interval);
 			}
 			else
 			{
@@ -4079,6 +4281,8 @@ static void ready_callback6(int __attribute((unused)) unused,
 		", " DBQ(ttl) ":%d, " DBQ(rtt) ":%.3f, " DBQ(size) ":%d",
 			rcvdttl, ms, (int)(nrecv - ICMP6_HDR));
 		add_str(state, line);
+		if (!late && !isDup)
+			agg_sample(state, buf, ms);
 		if (rcvdtclass != 0 || state->tos != 0)
 		{
 			snprintf(line, sizeof(line), ", " DBQ(itos) ":%d",
@@ -4104,7 +4308,7 @@ static void ready_callback6(int __attribute((unused)) unused,
 				state->gotresp= 1;
 				interval.tv_sec= state->duptimeout/1000000;
 				interval.tv_usec= state->duptimeout % 1000000;
-				evtimer_add(&state->timer, &interval);
+				common_timer_add(&state->timer, &interval);
 			}
 			else
 			{
@@ -4189,17 +4393,331 @@ static void noreply_callback(int __attribute((unused)) unused,
 	}
 }
 
+static void table_add(struct trtbase *base, struct trtstate *state)
+{
+	int i;
+	size_t newsiz;
+
+	for (i= 0; i<base->tabsiz; i++)
+	{
+		if (base->table[i] == NULL)
+			break;
+	}
+	if (i >= base->tabsiz)
+	{
+		newsiz= 2*base->tabsiz;
+		base->table= xrealloc(base->table,
+			newsiz*sizeof(*base->table));
+		for (i= base->tabsiz; i<newsiz; i++)
+			base->table[i]= NULL;
+		i= base->tabsiz;
+		base->tabsiz= newsiz;
+	}
+	state->index= i;
+	base->table[i]= state;
+}
+
+static void flash_wakeup(struct trtstate *state)
+{
+	struct timespec now;
+
+	gettime_mono(&now);
+	send_timer_add(&state->flash_timer, &now);
+}
+
+static void flash_lane_start(struct trtstate *state, unsigned hop,
+	const struct timespec *planned)
+{
+	struct trtstate *lane;
+
+	if (!lane_pool)
+		lane_pool= atlas_pool_new("traceroute_lane", sizeof(*lane));
+	lane= atlas_pool_zalloc(lane_pool);
+	lane->parent= state;
+	lane->base= state->base;
+	lane->hostname= state->hostname;
+	lane->interface= state->interface;
+	lane->do_icmp= state->do_icmp;
+	lane->do_tcp= state->do_tcp;
+	lane->do_udp= state->do_udp;
+	lane->do_v6= state->do_v6;
+	lane->dont_fragment= state->dont_fragment;
+	lane->trtcount= state->trtcount;
+	lane->maxpacksize= state->maxpacksize;
+	lane->hbhoptsize= state->hbhoptsize;
+	lane->destoptsize= state->destoptsize;
+	lane->firsthop= hop;
+	lane->maxhops= hop;
+	lane->gaplimit= state->gaplimit;
+	lane->parismod= state->parismod;
+	lane->parisbase= state->parisbase;
+	lane->paris= state->paris;
+	lane->duptimeout= state->duptimeout;
+	lane->timeout= state->timeout;
+	lane->tos= state->tos;
+	lane->sin6= state->sin6;
+	lane->socklen= state->socklen;
+	lane->socket_icmp= -1;
+	lane->socket_tcp= -1;
+	lane->report_sendlag= state->report_sendlag;
+	lane->planned= *planned;
+	lane->have_planned= 1;
+
+	table_add(lane->base, lane);
+	evtimer_assign(&lane->timer, lane->base->event_base,
+		noreply_callback, lane);
+
+	free(state->hopres[hop]);
+	state->hopres[hop]= NULL;
+	state->hopflags[hop]= 0;
+	state->lanes[hop]= lane;
+	state->nlanes++;
+
+	lane->busy= 1;
+	traceroute_start2(lane);
+}
+
+static void flash_lane_free(struct trtstate *lane)
+{
+	event_del(&lane->timer);
+	pace_cancel(&lane->pace);
+	close_sockets(lane);
+	if (lane->base->table[lane->index] != lane)
+		crondlog(DIE9 "strange, lane not in table");
+	lane->base->table[lane->index]= NULL;
+	free(lane->result);
+	atlas_pool_free(lane_pool, lane);
+}
+
+/* Called through report() when a lane is done. The lane is still in
+ * use by the callback that got us here, so freeing it is left to
+ * flash_step.
+ */
+static void flash_lane_done(struct trtstate *lane)
+{
+	int hop;
+	unsigned char flags;
+	struct trtstate *state;
+
+	state= lane->parent;
+	hop= lane->hop;
+
+	close_sockets(lane);
+
+	flags= HOP_DONE;
+	if (lane->sent < lane->trtcount)
+		flags |= HOP_ERR;	/* Did not get through all packets */
+	if (lane->last_response_hop == hop)
+		flags |= HOP_RESP;
+	if (lane->done && !lane->not_done)
+		flags |= HOP_DEST;
+
+	free(state->hopres[hop]);
+	state->hopres[hop]= lane->result;
+	lane->result= NULL;
+	state->hopflags[hop]= flags;
+
+	if (state->loc_socklen == 0 && lane->loc_socklen != 0)
+	{
+		state->loc_sin6= lane->loc_sin6;
+		state->loc_socklen= lane->loc_socklen;
+	}
+
+	lane->busy= 0;
+	flash_wakeup(state);
+}
+
+static void flash_report(struct trtstate *state, int lasthop)
+{
+	int hop;
+
+	send_timer_del(&state->flash_timer);
+
+	for (hop= state->firsthop; hop<MAX_HOPS; hop++)
+	{
+		if (!state->hopres[hop])
+			continue;
+		if (hop <= lasthop ||
+			(hop == MAX_HOPS-1 && state->lastditch))
+		{
+			if (state->reslen)
+				add_str(state, ", ");
+			add_str(state, state->hopres[hop]);
+		}
+		free(state->hopres[hop]);
+	}
+	free(state->hopres);
+	state->hopres= NULL;
+	free(state->hopflags);
+	state->hopflags= NULL;
+	free(state->lanes);
+	state->lanes= NULL;
+
+	if (state->loc_socklen == 0)
+		state->no_src= 1;
+
+	report(state);
+}
+
+/* 'planned' is when the step was supposed to run. New lanes are planned to
+ * start then, or one gap after the previous lane.
+ */
+static void flash_step(struct trtstate *state, const struct timespec *planned)
+{
+	int hop, last_resp, max_resp, stop, gap;
+	double late;
+	struct trtstate *lane;
+	struct timespec now, next;
+
+	/* Free lanes that are done */
+	for (hop= 0; hop<MAX_HOPS; hop++)
+	{
+		lane= state->lanes[hop];
+		if (lane && !lane->busy)
+		{
+			flash_lane_free(lane);
+			state->lanes[hop]= NULL;
+			state->nlanes--;
+		}
+	}
+
+	/* Apply the rules of a serial traceroute to the hops that are
+	 * complete: stop at the destination, an error, the max. hop or
+	 * when the gap limit is reached.
+	 */
+	stop= 0;
+	gap= 0;
+	last_resp= state->firsthop-1;
+	for (hop= state->firsthop; hop <= state->maxhops; hop++)
+	{
+		if (!(state->hopflags[hop] & HOP_DONE))
+			break;
+		if (state->hopflags[hop] & HOP_RESP)
+			last_resp= hop;
+		if ((state->hopflags[hop] & (HOP_DEST|HOP_ERR)) ||
+			hop >= state->maxhops)
+		{
+			stop= hop;
+			break;
+		}
+		if (hop - last_resp >= state->gaplimit)
+		{
+			stop= hop;
+			gap= 1;
+			break;
+		}
+	}
+
+	if (stop)
+	{
+		/* Anything beyond the last hop is not needed */
+		for (hop= stop+1; hop <= state->maxhops; hop++)
+		{
+			lane= state->lanes[hop];
+			if (lane)
+			{
+				flash_lane_free(lane);
+				state->lanes[hop]= NULL;
+				state->nlanes--;
+			}
+		}
+		if (gap && !state->lastditch &&
+			!(state->hopflags[stop] & HOP_ERR))
+		{
+			state->lastditch= 1;
+			flash_lane_start(state, MAX_HOPS-1, planned);
+		}
+		if (state->nlanes == 0)
+			flash_report(state, stop);
+		return;
+	}
+
+	max_resp= state->firsthop-1;
+	for (hop= state->firsthop; hop <= state->maxhops; hop++)
+	{
+		if (state->hopflags[hop] & HOP_RESP)
+			max_resp= hop;
+	}
+
+	/* Start new lanes. Hops more than the gap limit past the last
+	 * hop that replied are not started, they will not be reported.
+	 */
+	while (state->nlanes < state->flashwin &&
+		state->nexthop <= state->maxhops &&
+		((int)state->nexthop - max_resp <= state->gaplimit ||
+		state->nexthop == state->firsthop))
+	{
+		next= *planned;
+		if (state->flashgap)
+		{
+			/* Space the lanes from their planned starts, a late
+			 * timer does not push back the lanes after it.
+			 */
+			next= state->flashlast;
+			next.tv_nsec += (state->flashgap % 1000000)*1000;
+			next.tv_sec += state->flashgap/1000000 +
+				next.tv_nsec/1000000000;
+			next.tv_nsec %= 1000000000;
+			if ((next.tv_sec-planned->tv_sec) +
+				(next.tv_nsec-planned->tv_nsec)/1e9 < 0)
+			{
+				next= *planned;
+			}
+			gettime_mono(&now);
+			late= (now.tv_sec-next.tv_sec) +
+				(now.tv_nsec-next.tv_nsec)/1e9;
+			if (late < 0)
+			{
+				send_timer_add(&state->flash_timer, &next);
+				break;
+			}
+
+			/* After a stall, do not catch up with a burst */
+			if (late > state->flashgap/1e6)
+				next= now;
+			state->flashlast= next;
+		}
+		flash_lane_start(state, state->nexthop++, &next);
+	}
+}
+
+static void flash_timer_cb(void *s)
+{
+	struct trtstate *state;
+
+	state= s;
+	flash_step(state, &state->flash_timer.due);
+}
+
+static void flash_start(struct trtstate *state)
+{
+	struct timespec now;
+
+	state->lanes= xzalloc(MAX_HOPS * sizeof(*state->lanes));
+	state->hopres= xzalloc(MAX_HOPS * sizeof(*state->hopres));
+	state->hopflags= xzalloc(MAX_HOPS * sizeof(*state->hopflags));
+	state->nexthop= state->firsthop;
+	state->nlanes= 0;
+	state->lastditch= 0;
+	state->loc_socklen= 0;
+	state->flashlast.tv_sec= 0;
+	state->flashlast.tv_nsec= 0;
+
+	gettime_mono(&now);
+	flash_step(state, &now);
+}
+
 static void *traceroute_init(int __attribute((unused)) argc, char *argv[],
 	void (*done)(void *state, int error))
 {
 	uint16_t destport;
 	uint32_t opt;
-	int i, do_icmp, do_v6, dont_fragment, delay_name_res, do_tcp, do_udp;
+	int do_icmp, do_v6, dont_fragment, delay_name_res, do_tcp, do_udp;
 	int tos;
 	unsigned count, duptimeout, firsthop, gaplimit, maxhops, maxpacksize,
-		hbhoptsize, destoptsize, parismod, parisbase, timeout;
+		hbhoptsize, destoptsize, parismod, parisbase, timeout,
+		flashwin, flashgap, aggwin;
 		/* must be int-sized */
-	size_t newsiz;
 	char *str_Atlas;
 	char *str_bundle;
 	const char *hostname;
@@ -4238,19 +4756,24 @@ static void *traceroute_init(int __attribute((unused)) argc, char *argv[],
 	hbhoptsize= 0;
 	destoptsize= 0;
 	tos= 0;
+	flashwin= 0;
+	flashgap= 10;
+	aggwin= 0;
 	str_Atlas= NULL;
 	str_bundle= NULL;
 	out_filename= NULL;
 	response_in= NULL;
 	response_out= NULL;
-	opt_complementary = "=1:4--6:i--u:a+:b+:c+:f+:g+:m+:t+:w+:z+:S+:H+:D+";
+	opt_complementary = "=1:4--6:i--u:a+:b+:c+:f+:g+:m+:t+:w+:z+:S+:H+:D+"
+		":x+:y+:G+";
 
 	opt = getopt32(argv, TRACEROUTE_OPT_STRING, &parismod, &parisbase,
 		&count,
 		&firsthop, &gaplimit, &interface, &maxhops, &destportstr,
 		&tos, &timeout, &duptimeout,
 		&str_Atlas, &str_bundle, &out_filename, &maxpacksize,
-		&hbhoptsize, &destoptsize, &response_in, &response_out);
+		&hbhoptsize, &destoptsize, &response_in, &response_out,
+		&flashwin, &flashgap, &aggwin);
 	hostname = argv[optind];
 
 	if (opt == 0xffffffff)
@@ -4273,6 +4796,21 @@ static void *traceroute_init(int __attribute((unused)) argc, char *argv[],
 		crondlog(LVL8 "max. packet size too big");
 		return NULL;
 	}
+	if (flashwin &&
+		(firsthop < 1 || firsthop > maxhops || maxhops >= MAX_HOPS))
+	{
+		crondlog(LVL8 "bad first or max. hop");
+		return NULL;
+	}
+	if (flashwin >= MAX_HOPS)
+		flashwin= MAX_HOPS-1;
+	if (response_in || response_out)
+	{
+		/* Responses are replayed in the order of a serial
+		 * traceroute.
+		 */
+		flashwin= 0;
+	}
 
 	if (response_in)
 	{
@@ -4306,7 +4844,7 @@ static void *traceroute_init(int __attribute((unused)) argc, char *argv[],
 			crondlog(LVL8 "insecure file '%s'", out_filename);
 			goto err;
 		}
-		fh= fopen(validated_out_filename, "a");
+		fh= atlas_fopen_append(validated_out_filename);
 		if (!fh)
 		{
 			crondlog(LVL8 "traceroute: unable to append to '%s'",
@@ -4363,7 +4901,9 @@ static void *traceroute_init(int __attribute((unused)) argc, char *argv[],
 		af= -1;
 	}
 
-	state= xzalloc(sizeof(*state));
+	if (!state_pool)
+		state_pool= atlas_pool_new("traceroute", sizeof(*state));
+	state= atlas_pool_zalloc(state_pool);
 	state->parismod= parismod;
 	state->parisbase= parisbase;
 	state->trtcount= count;
@@ -4376,6 +4916,15 @@ static void *traceroute_init(int __attribute((unused)) argc, char *argv[],
 	state->duptimeout= duptimeout*1000;
 	state->timeout= timeout*1000;
 	state->tos= tos;
+	state->flashwin= flashwin;
+	state->flashgap= flashgap*1000;
+	state->report_sendlag= !!(opt & OPT_L);
+	state->aggwin= aggwin;
+	if (aggwin)
+	{
+		state->agghops= xzalloc((maxhops+1) *
+			sizeof(*state->agghops));
+	}
 	state->atlas= str_Atlas ? strdup(str_Atlas) : NULL;
 	state->bundle_id= str_bundle ? strdup(str_bundle) : NULL;
 	state->hostname= strdup(hostname);
@@ -4405,23 +4954,7 @@ static void *traceroute_init(int __attribute((unused)) argc, char *argv[],
 	if (response_in || response_out)
 		trt_base->my_pid= 42;
 
-	for (i= 0; i<trt_base->tabsiz; i++)
-	{
-		if (trt_base->table[i] == NULL)
-			break;
-	}
-	if (i >= trt_base->tabsiz)
-	{
-		newsiz= 2*trt_base->tabsiz;
-		trt_base->table= xrealloc(trt_base->table,
-			newsiz*sizeof(*trt_base->table));
-		for (i= trt_base->tabsiz; i<newsiz; i++)
-			trt_base->table[i]= NULL;
-		i= trt_base->tabsiz;
-		trt_base->tabsiz= newsiz;
-	}
-	state->index= i;
-	trt_base->table[i]= state;
+	table_add(trt_base, state);
 	trt_base->done= done;
 
 	memset(&state->loc_sin6, '\0', sizeof(state->loc_sin6));
@@ -4444,6 +4977,11 @@ static void *traceroute_init(int __attribute((unused)) argc, char *argv[],
 
 	evtimer_assign(&state->timer, state->base->event_base,
 		noreply_callback, state);
+	if (state->flashwin)
+	{
+		send_timer_assign(&state->flash_timer,
+			state->base->event_base, flash_timer_cb, state);
+	}
 
 	return state;
 
@@ -4478,7 +5016,7 @@ static void traceroute_start2(void *state)
 	trtstate->hop= trtstate->firsthop;
 	trtstate->sent= 0;
 	trtstate->seq= 0;
-	if (trtstate->parismod)
+	if (trtstate->parismod && !trtstate->parent)
 	{
 		trtstate->paris= (trtstate->paris-trtstate->parisbase+1+
 			trtstate->parismod) % trtstate->parismod +
@@ -4500,6 +5038,14 @@ static void traceroute_start2(void *state)
 
 	trtstate->socket_icmp= -1;
 	trtstate->socket_tcp= -1;
+	if (!trtstate->parent)
+		trtstate->have_planned= 0;
+
+	if (trtstate->flashwin)
+	{
+		flash_start(trtstate);
+		return;
+	}
 
 	snprintf(line, sizeof(line), "{ " DBQ(hop) ":%d", trtstate->hop);
 	add_str(trtstate, line);
@@ -4548,6 +5094,11 @@ static void traceroute_start2(void *state)
 	send_pkt(trtstate);
 }
 
+ACCT_CALLBACK(acct_ready_callback4, ready_callback4, traceroute_ops)
+ACCT_CALLBACK(acct_ready_callback6, ready_callback6, traceroute_ops)
+ACCT_CALLBACK(acct_ready_tcp4, ready_tcp4, traceroute_ops)
+ACCT_CALLBACK(acct_ready_tcp6, ready_tcp6, traceroute_ops)
+
 static int create_socket(struct trtstate *state, int do_tcp)
 {
 	int af, type, protocol;
@@ -4695,7 +5246,7 @@ static int create_socket(struct trtstate *state, int do_tcp)
 	event_assign(&state->event_icmp, state->base->event_base,
 		state->socket_icmp,
 		EV_READ | EV_PERSIST,
-		(af == AF_INET6 ? ready_callback6 : ready_callback4),
+		(af == AF_INET6 ? acct_ready_callback6 : acct_ready_callback4),
 		state);
 	if (!state->response_in)
 		event_add(&state->event_icmp, NULL);
@@ -4767,7 +5318,7 @@ static int create_socket(struct trtstate *state, int do_tcp)
 		event_assign(&state->event_tcp, state->base->event_base,
 			state->socket_tcp,
 			EV_READ | EV_PERSIST,
-			(af == AF_INET6 ? ready_tcp6 : ready_tcp4),
+			(af == AF_INET6 ? acct_ready_tcp6 : acct_ready_tcp4),
 			state);
 		if (!state->response_in)
 			event_add(&state->event_tcp, NULL);
@@ -4924,6 +5475,7 @@ static void traceroute_start(void *state)
 static int traceroute_delete(void *state)
 {
 	int ind;
+	unsigned i;
 	struct trtstate *trtstate;
 	struct trtbase *base;
 
@@ -4943,6 +5495,18 @@ static int traceroute_delete(void *state)
 	base->table[ind]= NULL;
 
 	event_del(&trtstate->timer);
+	pace_cancel(&trtstate->pace);
+
+	if (trtstate->agghops)
+	{
+		/* Do not lose the last partial window */
+		if (trtstate->aggruns)
+			report_summary(trtstate);
+		for (i= 0; i <= trtstate->maxhops; i++)
+			free(trtstate->agghops[i]);
+		free(trtstate->agghops);
+		trtstate->agghops= NULL;
+	}
 
 	free(trtstate->atlas);
 	trtstate->atlas= NULL;
@@ -4957,11 +5521,19 @@ static int traceroute_delete(void *state)
 	free(trtstate->out_filename);
 	trtstate->out_filename= NULL;
 
-	free(trtstate);
+	atlas_pool_free(state_pool, trtstate);
 
 	return 1;
 }
 
+/* Flash lanes are charged to the traceroute that started them */
+static void *traceroute_owner(void *state)
+{
+	struct trtstate *trtstate= state;
+
+	return trtstate->parent ? trtstate->parent : trtstate;
+}
+
 struct testops traceroute_ops = { traceroute_init, traceroute_start,
-	traceroute_delete };
+	traceroute_delete, traceroute_owner };
 
@@ -269,6 +269,11 @@ IF_DESKTOP(long long) int unpack_bz2_stream(transformer_state_t *xstate) FAST_FU
 IF_DESKTOP(long long) int unpack_lzma_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_xz_stream(transformer_state_t *xstate) FAST_FUNC;
 
+/* Streaming gzip compression, in archival/gzip.c */
+int gzip_stream(ssize_t (*read_fn)(void *ctx, void *buf, size_t size),
+		int (*write_fn)(void *ctx, const void *buf, size_t size),
+		void *ctx) FAST_FUNC;
+
 char* append_ext(char *filename, const char *expected_ext) FAST_FUNC;
 int bbunpack(char **argv,
 		IF_DESKTOP(long long) int FAST_FUNC (*unpacker)(transformer_state_t *xstate),
@@ -21,10 +21,11 @@ static struct builtin
 {
 	const char *cmd;
 	int (*func)(int argc, char *argv[]);
+	int async;	/* Can take long, run in a worker process */
 } builtin_cmds[]=
 {
-	{ "condmv", condmv_main },
-	{ "httppost", httppost_main },
+	{ "condmv", condmv_main, 0 },
+	{ "httppost", httppost_main, 1 },
 #if 0
 	{ "ping6", ping6_main },
 	{ "ping", ping_main },
@@ -32,7 +33,7 @@ static struct builtin
 	{ "traceroute", traceroute_main },
 #endif
 #if ENABLE_OOQD
-	{ "wifimsm", wifimsm_main },
+	{ "wifimsm", wifimsm_main, 0 },
 #endif
 	{ NULL, 0 }
 };
@@ -460,6 +460,7 @@ char *is_suffixed_with(const char *string, const char *key) FAST_FUNC;
 #define ATLAS_DATA_OOQ_OUT_REL     "data/ooq.out"
 #define ATLAS_DATA_NEW_REL         "data/new"
 #define ATLAS_DATA_STORAGE_REL     "data/storage"
+#define ATLAS_DATA_STORE_REL       "data/store"
 #define ATLAS_TIMESYNC_FILE_REL    ATLAS_DATA_NEW_REL "/timesync.vol"
 #define ATLAS_FUZZING_REL          "data"
 
@@ -477,6 +478,16 @@ extern char *atlas_path(const char *rel_path);
 extern char *atlas_name_macro(char *str);
 extern int atlas_tests(void);
 extern time_t atlas_time(void);
+/* Like fopen(filename, "a"), but everything is written when the file is
+ * closed, in a single write. Use one per result record.
+ */
+extern FILE *atlas_fopen_append(const char *filename);
+/* 64-bit FNV-1a. Start with ATLAS_HASH_INIT, pass the result of one call
+ * as 'h' of the next to hash more data.
+ */
+#define ATLAS_HASH_INIT 14695981039346656037ULL
+extern uint64_t atlas_hash(uint64_t h, const void *data, size_t len);
+extern uint64_t atlas_hash_str(uint64_t h, const char *str);
 extern int do_ipv6_option(int sock, int hbh_dest, unsigned size);
 extern void route_set_flags(char *flagstr, int flags);
 extern void peek_response(int fd, int *typep);
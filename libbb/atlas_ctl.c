@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_ctl.c -- local control socket for pushing crontab changes
+ */
+
+#include "libbb.h"
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <event2/event.h>
+
+#include "atlas_ctl.h"
+
+#define HDR_SIZE	3
+#define CLIENT_TO	2	/* Seconds, for the client side */
+
+struct ctl_conn
+{
+	struct ctl_conn *next;
+	struct atlas_ctl *ctl;
+	int fd;
+	struct event *event;
+	size_t len;
+	char buf[HDR_SIZE+ATLAS_CTL_MAX+1];
+};
+
+struct atlas_ctl
+{
+	int fd;
+	char *path;
+	struct event_base *base;
+	struct event *event;
+	atlas_ctl_cb_t cb;
+	void *ref;
+	struct ctl_conn *conns;
+};
+
+static int fill_addr(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, '\0', sizeof(*sun));
+	sun->sun_family= AF_UNIX;
+	if (strlen(path)+1 > sizeof(sun->sun_path))
+	{
+		errno= ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun->sun_path, path);
+	return 0;
+}
+
+static void conn_free(struct ctl_conn *conn)
+{
+	struct ctl_conn **connp;
+
+	for (connp= &conn->ctl->conns; *connp; connp= &(*connp)->next)
+	{
+		if (*connp == conn)
+		{
+			*connp= conn->next;
+			break;
+		}
+	}
+	event_free(conn->event);
+	close(conn->fd);
+	free(conn);
+}
+
+/* Let the callback know, it may be waiting for the rest of a crontab */
+static void conn_close(struct ctl_conn *conn)
+{
+	struct atlas_ctl *ctl;
+
+	ctl= conn->ctl;
+	conn_free(conn);
+	ctl->cb(ATLAS_CTL_CLOSE, (char *)"", 0, ctl->ref);
+}
+
+static void conn_cb(evutil_socket_t fd, short what UNUSED_PARAM, void *arg)
+{
+	int type, r;
+	size_t len, reclen;
+	ssize_t n;
+	char ack;
+	struct ctl_conn *conn;
+
+	conn= arg;
+
+	n= read(fd, conn->buf+conn->len, HDR_SIZE+ATLAS_CTL_MAX-conn->len);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0)
+	{
+		conn_close(conn);
+		return;
+	}
+	conn->len += n;
+
+	/* Process all complete records */
+	while (conn->len >= HDR_SIZE)
+	{
+		type= (unsigned char)conn->buf[0];
+		len= ((unsigned char)conn->buf[1] << 8) |
+			(unsigned char)conn->buf[2];
+		if (len > ATLAS_CTL_MAX)
+		{
+			bb_error_msg("control record too big (%u)",
+				(unsigned)len);
+			conn_close(conn);
+			return;
+		}
+		reclen= HDR_SIZE+len;
+		if (conn->len < reclen)
+			break;
+
+		/* NUL terminate the payload, save the byte that is there */
+		ack= conn->buf[reclen];
+		conn->buf[reclen]= '\0';
+		r= conn->ctl->cb(type, conn->buf+HDR_SIZE, len,
+			conn->ctl->ref);
+		conn->buf[reclen]= ack;
+
+		if (type == ATLAS_CTL_END || type == ATLAS_CTL_ONEOFF)
+		{
+			ack= (r == 0) ? ATLAS_CTL_ACK_OK : ATLAS_CTL_ACK_FAIL;
+			if (write(fd, &ack, 1) != 1)
+			{
+				conn_close(conn);
+				return;
+			}
+		}
+
+		memmove(conn->buf, conn->buf+reclen, conn->len-reclen);
+		conn->len -= reclen;
+	}
+}
+
+static void listen_cb(evutil_socket_t fd, short what UNUSED_PARAM, void *arg)
+{
+	int nfd;
+	struct atlas_ctl *ctl;
+	struct ctl_conn *conn;
+
+	ctl= arg;
+
+	nfd= accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (nfd == -1)
+		return;
+
+	conn= xzalloc(sizeof(*conn));
+	conn->ctl= ctl;
+	conn->fd= nfd;
+	conn->event= event_new(ctl->base, nfd, EV_READ|EV_PERSIST, conn_cb,
+		conn);
+	if (!conn->event || event_add(conn->event, NULL) == -1)
+	{
+		if (conn->event)
+			event_free(conn->event);
+		close(nfd);
+		free(conn);
+		return;
+	}
+	conn->next= ctl->conns;
+	ctl->conns= conn;
+}
+
+struct atlas_ctl *atlas_ctl_listen(struct event_base *base, const char *path,
+	atlas_ctl_cb_t cb, void *ref)
+{
+	int fd, t_errno;
+	struct sockaddr_un sun;
+	struct atlas_ctl *ctl;
+
+	if (fill_addr(&sun, path) == -1)
+		return NULL;
+
+	fd= socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return NULL;
+
+	/* Left behind by an earlier instance */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+		chmod(path, 0600) == -1 ||
+		listen(fd, 4) == -1)
+	{
+		t_errno= errno;
+		close(fd);
+		errno= t_errno;
+		return NULL;
+	}
+
+	ctl= xzalloc(sizeof(*ctl));
+	ctl->fd= fd;
+	ctl->path= xstrdup(path);
+	ctl->base= base;
+	ctl->cb= cb;
+	ctl->ref= ref;
+	ctl->event= event_new(base, fd, EV_READ|EV_PERSIST, listen_cb, ctl);
+	if (!ctl->event || event_add(ctl->event, NULL) == -1)
+	{
+		atlas_ctl_free(ctl);
+		return NULL;
+	}
+	return ctl;
+}
+
+void atlas_ctl_free(struct atlas_ctl *ctl)
+{
+	while (ctl->conns)
+		conn_free(ctl->conns);
+	if (ctl->event)
+		event_free(ctl->event);
+	close(ctl->fd);
+	unlink(ctl->path);
+	free(ctl->path);
+	free(ctl);
+}
+
+int atlas_ctl_connect(const char *path)
+{
+	int fd;
+	struct timeval tv;
+	struct sockaddr_un sun;
+
+	if (fill_addr(&sun, path) == -1)
+		return -1;
+
+	fd= socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	/* Do not let a stuck daemon hang the caller */
+	tv.tv_sec= CLIENT_TO;
+	tv.tv_usec= 0;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int atlas_ctl_send(int fd, int type, const char *data, size_t len)
+{
+	struct iovec iov[2];
+	unsigned char hdr[HDR_SIZE];
+
+	if (len > ATLAS_CTL_MAX)
+	{
+		errno= EMSGSIZE;
+		return -1;
+	}
+	hdr[0]= type;
+	hdr[1]= len >> 8;
+	hdr[2]= len & 0xff;
+	iov[0].iov_base= hdr;
+	iov[0].iov_len= HDR_SIZE;
+	iov[1].iov_base= (void *)data;
+	iov[1].iov_len= len;
+
+	/* Records are small, a short write means the daemon is not
+	 * reading.
+	 */
+	if (writev(fd, iov, 2) != (ssize_t)(HDR_SIZE+len))
+		return -1;
+	return 0;
+}
+
+int atlas_ctl_wait_ack(int fd)
+{
+	char ack;
+
+	if (read(fd, &ack, 1) != 1)
+		return -1;
+	return ack == ATLAS_CTL_ACK_OK ? 0 : -1;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_ctl.h -- local control socket for pushing crontab changes
+ */
+
+struct event;
+struct event_base;
+struct atlas_ctl;
+
+/* The socket is created next to the file it replaces, for example
+ * crons/main/root.ctl for crons/main/root.
+ */
+#define ATLAS_CTL_SUFFIX	".ctl"
+
+/* Records are a one byte type, a two byte length (network byte order)
+ * and that many bytes of payload.
+ */
+#define ATLAS_CTL_BEGIN		'B'	/* Start of a complete crontab */
+#define ATLAS_CTL_ADD		'A'	/* Add a crontab line */
+#define ATLAS_CTL_END		'E'	/* End of crontab, drop lines not sent */
+#define ATLAS_CTL_ONEOFF	'O'	/* Run a command once */
+#define ATLAS_CTL_CLOSE		'C'	/* Not sent, passed to the callback
+					 * when a connection goes away
+					 */
+
+#define ATLAS_CTL_MAX		1024	/* Max payload */
+
+/* END and ONEOFF are acknowledged with one byte */
+#define ATLAS_CTL_ACK_OK	'0'
+#define ATLAS_CTL_ACK_FAIL	'1'
+
+/* Called for each record, 'data' is NUL terminated. The return value (0
+ * or -1) is sent back for records that are acknowledged. When a connection
+ * is closed, the type is ATLAS_CTL_CLOSE with an empty 'data'.
+ */
+typedef int (*atlas_ctl_cb_t)(int type, char *data, size_t len, void *ref);
+
+/* Server side. Removes a stale socket at 'path'. Returns NULL on failure */
+struct atlas_ctl *atlas_ctl_listen(struct event_base *base, const char *path,
+	atlas_ctl_cb_t cb, void *ref);
+void atlas_ctl_free(struct atlas_ctl *ctl);
+
+/* Client side, plain blocking I/O with a short timeout. All return -1 on
+ * failure, the caller should then fall back to updating files.
+ */
+int atlas_ctl_connect(const char *path);
+int atlas_ctl_send(int fd, int type, const char *data, size_t len);
+int atlas_ctl_wait_ack(int fd);
@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_delta.c -- delta encoding of repetitive RESULT lines
+ */
+
+#include "libbb.h"
+
+#include "atlas_delta.h"
+
+#define RESULT_PREFIX	"RESULT "
+#define WORK_SUFFIX	".delta"
+#define DELTA_FIELD	"delta"
+
+#define DBQ(str) "\"" #str "\""
+
+struct field
+{
+	char *key;		/* Without the quotes */
+	char *value;		/* As it appears in the result */
+};
+
+struct result
+{
+	char *buf;		/* Copy of the line, fields point into it */
+	struct field *fields;
+	unsigned nfields;
+	unsigned maxfields;
+};
+
+struct base
+{
+	char *key;		/* Id, address family and target */
+	time_t time;
+	char *line;		/* As it was sent */
+	struct result result;
+};
+
+struct atlas_delta
+{
+	char *state_file;
+	int keepalive;
+	struct base *bases;
+	unsigned nbases;
+};
+
+/* Fields that are sent with every delta. The first ones identify the
+ * measurement, the others are expected to change every time.
+ */
+static const char *const always_sent[]=
+{
+	"id", "af", "dst_name",
+	"fw", "mver", "lts", "time", "endtime", "bundle",
+	NULL
+};
+
+/* 'p' points after the opening quote. Returns a pointer to the closing
+ * quote or NULL.
+ */
+static char *skip_string(char *p)
+{
+	for (; *p; p++)
+	{
+		if (p[0] == '\\' && p[1] != '\0')
+			p++;
+		else if (p[0] == '"')
+			return p;
+	}
+	return NULL;
+}
+
+static void result_free(struct result *res)
+{
+	free(res->buf);
+	free(res->fields);
+	memset(res, '\0', sizeof(*res));
+}
+
+/* Split the top level object of a RESULT line into fields. Values are
+ * not parsed, nested objects and arrays are compared as text.
+ */
+static int result_parse(const char *line, struct result *res)
+{
+	int depth;
+	char c, *p, *key, *value, *end;
+
+	memset(res, '\0', sizeof(*res));
+	if (strncmp(line, RESULT_PREFIX, strlen(RESULT_PREFIX)) != 0)
+		return -1;
+	res->buf= xstrdup(line+strlen(RESULT_PREFIX));
+
+	p= skip_whitespace(res->buf);
+	if (*p != '{')
+		goto err;
+	p++;
+	for (;;)
+	{
+		p= skip_whitespace(p);
+		if (*p == '}' && res->nfields == 0)
+			break;
+		if (*p != '"')
+			goto err;
+		key= p+1;
+		p= skip_string(key);
+		if (p == NULL)
+			goto err;
+		*p= '\0';
+		p= skip_whitespace(p+1);
+		if (*p != ':')
+			goto err;
+		value= skip_whitespace(p+1);
+
+		depth= 0;
+		for (p= value; *p; p++)
+		{
+			if (*p == '"')
+			{
+				p= skip_string(p+1);
+				if (p == NULL)
+					goto err;
+			}
+			else if (*p == '{' || *p == '[')
+				depth++;
+			else if (*p == '}' || *p == ']')
+			{
+				if (depth == 0)
+					break;
+				depth--;
+			}
+			else if (*p == ',' && depth == 0)
+				break;
+		}
+		c= *p;
+		if (c != ',' && c != '}')
+			goto err;
+		for (end= p; end > value && isspace(end[-1]); end--)
+			;
+		if (end == value)
+			goto err;
+		*end= '\0';
+
+		if (res->nfields >= res->maxfields)
+		{
+			res->maxfields= res->maxfields*2 + 16;
+			res->fields= xrealloc(res->fields,
+				res->maxfields * sizeof(res->fields[0]));
+		}
+		res->fields[res->nfields].key= key;
+		res->fields[res->nfields].value= value;
+		res->nfields++;
+
+		if (c == '}')
+			break;
+		p++;
+	}
+	return 0;
+
+err:
+	result_free(res);
+	return -1;
+}
+
+static struct field *result_find(struct result *res, const char *key)
+{
+	unsigned i;
+
+	for (i= 0; i<res->nfields; i++)
+	{
+		if (strcmp(res->fields[i].key, key) == 0)
+			return &res->fields[i];
+	}
+	return NULL;
+}
+
+/* Measurements without a dst_name are told apart by their dst_addr */
+static int is_always_sent(struct result *res, const char *key)
+{
+	int i;
+
+	for (i= 0; always_sent[i]; i++)
+	{
+		if (strcmp(always_sent[i], key) == 0)
+			return 1;
+	}
+	return strcmp(key, "dst_addr") == 0 &&
+		result_find(res, "dst_name") == NULL;
+}
+
+static char *result_key(struct result *res)
+{
+	struct field *id, *af, *target;
+
+	id= result_find(res, "id");
+	if (id == NULL)
+		return NULL;
+	af= result_find(res, "af");
+	target= result_find(res, "dst_name");
+	if (target == NULL)
+		target= result_find(res, "dst_addr");
+	return xasprintf("%s\t%s\t%s", id->value, af ? af->value : "",
+		target ? target->value : "");
+}
+
+static time_t result_time(struct result *res)
+{
+	struct field *f;
+
+	f= result_find(res, "time");
+	if (f == NULL)
+		return time(NULL);
+	return strtol(f->value, NULL, 10);
+}
+
+static int is_changed(struct result *res, struct base *base, struct field *f)
+{
+	struct field *bf;
+
+	if (is_always_sent(res, f->key))
+		return 0;
+	bf= result_find(&base->result, f->key);
+	return bf == NULL || strcmp(bf->value, f->value) != 0;
+}
+
+static int is_removed(struct result *res, struct base *base, struct field *bf)
+{
+	return !is_always_sent(&base->result, bf->key) &&
+		result_find(res, bf->key) == NULL;
+}
+
+static struct base *find_base(struct atlas_delta *delta, const char *key)
+{
+	unsigned i;
+
+	for (i= 0; i<delta->nbases; i++)
+	{
+		if (strcmp(delta->bases[i].key, key) == 0)
+			return &delta->bases[i];
+	}
+	return NULL;
+}
+
+/* Takes over 'key' and 'res' */
+static void set_base(struct atlas_delta *delta, char *key, time_t t,
+	const char *line, struct result *res)
+{
+	unsigned i;
+	struct base *base;
+
+	base= find_base(delta, key);
+	if (base == NULL && delta->nbases < ATLAS_DELTA_MAX_BASES)
+	{
+		delta->bases= xrealloc(delta->bases,
+			(delta->nbases+1) * sizeof(delta->bases[0]));
+		base= &delta->bases[delta->nbases++];
+		memset(base, '\0', sizeof(*base));
+	}
+	if (base == NULL)
+	{
+		/* Replace the one that was not seen for the longest time */
+		base= &delta->bases[0];
+		for (i= 1; i<delta->nbases; i++)
+		{
+			if (delta->bases[i].time < base->time)
+				base= &delta->bases[i];
+		}
+	}
+
+	free(base->key);
+	free(base->line);
+	result_free(&base->result);
+	base->key= key;
+	base->time= t;
+	base->line= xstrdup(line);
+	base->result= *res;
+}
+
+static void write_delta(struct result *res, struct base *base, FILE *out)
+{
+	int removed;
+	unsigned i;
+	const char *sep;
+	struct field *f;
+
+	fprintf(out, RESULT_PREFIX "{ ");
+	sep= "";
+	for (i= 0; i<res->nfields; i++)
+	{
+		f= &res->fields[i];
+		if (!is_always_sent(res, f->key) && !is_changed(res, base, f))
+			continue;
+		fprintf(out, "%s\"%s\":%s", sep, f->key, f->value);
+		sep= ", ";
+	}
+	fprintf(out, "%s\"" DELTA_FIELD "\": { " DBQ(base) ":%ld", sep,
+		(long)base->time);
+	removed= 0;
+	for (i= 0; i<base->result.nfields; i++)
+	{
+		f= &base->result.fields[i];
+		if (!is_removed(res, base, f))
+			continue;
+		fprintf(out, "%s\"%s\"", removed ? ", " :
+			", " DBQ(removed) ": [ ", f->key);
+		removed= 1;
+	}
+	if (removed)
+		fprintf(out, " ]");
+	fprintf(out, " } }\n");
+}
+
+static void encode(struct atlas_delta *delta, const char *line, FILE *out)
+{
+	unsigned i;
+	size_t len;
+	int changed;
+	time_t t;
+	char *key;
+	struct base *base;
+	struct field *f;
+	struct result res;
+
+	if (result_parse(line, &res) == -1)
+	{
+		fprintf(out, "%s\n", line);
+		return;
+	}
+	/* Results without an id and deltas are passed as they are */
+	key= result_find(&res, DELTA_FIELD) ? NULL : result_key(&res);
+	if (key == NULL)
+	{
+		result_free(&res);
+		fprintf(out, "%s\n", line);
+		return;
+	}
+	t= result_time(&res);
+
+	base= find_base(delta, key);
+	if (base && t >= base->time && t - base->time < delta->keepalive)
+	{
+		/* Estimate the size of the delta */
+		changed= 0;
+		len= 40;
+		for (i= 0; i<res.nfields; i++)
+		{
+			f= &res.fields[i];
+			if (is_changed(&res, base, f))
+				changed= 1;
+			else if (!is_always_sent(&res, f->key))
+				continue;
+			len += strlen(f->key) + strlen(f->value) + 6;
+		}
+		for (i= 0; i<base->result.nfields; i++)
+		{
+			f= &base->result.fields[i];
+			if (!is_removed(&res, base, f))
+				continue;
+			changed= 1;
+			len += strlen(f->key) + 4;
+		}
+
+		/* A result from the same second as the base is sent again.
+		 * It is most likely the base itself, from a file that is
+		 * encoded a second time.
+		 */
+		if (!changed && t > base->time)
+		{
+			/* Same as the base, nothing to send */
+			free(key);
+			result_free(&res);
+			return;
+		}
+		if (changed && len*2 < strlen(line))
+		{
+			write_delta(&res, base, out);
+			free(key);
+			result_free(&res);
+			return;
+		}
+	}
+
+	fprintf(out, "%s\n", line);
+	set_base(delta, key, t, line, &res);
+}
+
+/* Like getline but without the newline */
+static ssize_t get_line(char **linep, size_t *sizep, FILE *file)
+{
+	ssize_t len;
+
+	len= getline(linep, sizep, file);
+	if (len > 0 && (*linep)[len-1] == '\n')
+		(*linep)[--len]= '\0';
+	return len;
+}
+
+static void load_state(struct atlas_delta *delta)
+{
+	long t;
+	size_t size;
+	char *line, *check, *key;
+	FILE *file;
+	struct result res;
+
+	file= fopen(delta->state_file, "r");
+	if (file == NULL)
+		return;
+	line= NULL;
+	size= 0;
+	while (get_line(&line, &size, file) != -1)
+	{
+		t= strtol(line, &check, 10);
+		if (check != line && check[0] == ' ' &&
+			result_parse(check+1, &res) == 0)
+		{
+			key= result_key(&res);
+			if (key)
+				set_base(delta, key, t, check+1, &res);
+			else
+				result_free(&res);
+		}
+	}
+	free(line);
+	fclose(file);
+}
+
+static int save_state(struct atlas_delta *delta)
+{
+	unsigned i;
+	char *new_file;
+	FILE *file;
+
+	new_file= xasprintf("%s.new", delta->state_file);
+	file= fopen(new_file, "w");
+	if (file == NULL)
+	{
+		free(new_file);
+		return -1;
+	}
+	for (i= 0; i<delta->nbases; i++)
+	{
+		fprintf(file, "%ld %s\n", (long)delta->bases[i].time,
+			delta->bases[i].line);
+	}
+	if (fclose(file) != 0 || rename(new_file, delta->state_file) == -1)
+	{
+		unlink(new_file);
+		free(new_file);
+		return -1;
+	}
+	free(new_file);
+	return 0;
+}
+
+static void free_bases(struct atlas_delta *delta)
+{
+	unsigned i;
+
+	for (i= 0; i<delta->nbases; i++)
+	{
+		free(delta->bases[i].key);
+		free(delta->bases[i].line);
+		result_free(&delta->bases[i].result);
+	}
+	free(delta->bases);
+	delta->bases= NULL;
+	delta->nbases= 0;
+}
+
+struct atlas_delta *atlas_delta_open(const char *state_file, int keepalive)
+{
+	struct atlas_delta *delta;
+
+	delta= xzalloc(sizeof(*delta));
+	delta->state_file= xstrdup(state_file);
+	delta->keepalive= keepalive > 0 ? keepalive : ATLAS_DELTA_KEEPALIVE;
+	load_state(delta);
+	return delta;
+}
+
+void atlas_delta_close(struct atlas_delta *delta)
+{
+	free_bases(delta);
+	free(delta->state_file);
+	free(delta);
+}
+
+int atlas_delta_file(struct atlas_delta *delta, const char *filename)
+{
+	int r, t_errno;
+	size_t size;
+	char *work, *line;
+	FILE *in, *out;
+
+	/* Measurements keep appending to 'filename'. Move it out of the way
+	 * and append the result of the encoding, that way nothing written
+	 * in the mean time gets lost. A work file that is still there is
+	 * from a call that could not write its output, that one goes first.
+	 */
+	work= xasprintf("%s" WORK_SUFFIX, filename);
+	if (access(work, F_OK) == -1 && rename(filename, work) == -1)
+	{
+		t_errno= errno;
+		free(work);
+		if (t_errno == ENOENT)
+			return 0;
+		errno= t_errno;
+		return -1;
+	}
+	in= fopen(work, "r");
+	out= in ? atlas_fopen_append(filename) : NULL;
+	if (out == NULL)
+	{
+		t_errno= errno;
+		if (in)
+			fclose(in);
+		free(work);
+		errno= t_errno;
+		return -1;
+	}
+
+	line= NULL;
+	size= 0;
+	while (get_line(&line, &size, in) != -1)
+		encode(delta, line, out);
+	free(line);
+	fclose(in);
+	r= ferror(out) ? -1 : 0;
+	if (fclose(out) != 0)
+		r= -1;
+	if (r == -1)
+	{
+		/* Keep the work file and go back to the saved bases, the
+		 * next call encodes the same results again.
+		 */
+		t_errno= errno;
+		free_bases(delta);
+		load_state(delta);
+		free(work);
+		errno= t_errno;
+		return -1;
+	}
+	unlink(work);
+	free(work);
+
+	return save_state(delta);
+}
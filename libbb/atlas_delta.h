@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_delta.h -- delta encoding of repetitive RESULT lines
+ */
+
+struct atlas_delta;
+
+/* For each (measurement id, address family, target) the last RESULT that
+ * was sent in full is kept as the base. A new result that is the same as
+ * the base, apart from fields such as "time", is dropped until the base
+ * is older than the keepalive. A result that differs is sent with only
+ * the fields that changed and a "delta" object that refers to the base:
+ *
+ *	"delta": { "base": <time of base>, "removed": [ "field", ... ] }
+ *
+ * If that does not save much, or the keepalive expired, the result is
+ * sent in full and becomes the new base. Lines that are not a RESULT
+ * with an "id" are passed unchanged.
+ */
+#define ATLAS_DELTA_KEEPALIVE	3600
+#define ATLAS_DELTA_MAX_BASES	256
+
+/* Load the bases from 'state_file', which need not exist. A keepalive
+ * of 0 selects the default. Dies if out of memory (like xzalloc).
+ */
+struct atlas_delta *atlas_delta_open(const char *state_file, int keepalive);
+void atlas_delta_close(struct atlas_delta *delta);
+
+/* Delta encode the results in 'filename' and save the bases. The file is
+ * renamed out of the way first, the encoded results are appended to a
+ * new 'filename'. If they cannot be written, the renamed file and the
+ * saved bases are kept and the next call encodes it again. A missing
+ * file is not an error. Returns 0 or -1.
+ */
+int atlas_delta_file(struct atlas_delta *delta, const char *filename);
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_fopen_append.c -- append a result to a file with a single write
+ */
+
+#include "libbb.h"
+
+struct append_cookie
+{
+	char *filename;
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static ssize_t append_write(void *c, const char *data, size_t len)
+{
+	struct append_cookie *cookie= c;
+
+	if (cookie->len + len > cookie->size)
+	{
+		cookie->size= cookie->size ? 2*cookie->size : 4096;
+		if (cookie->size < cookie->len + len)
+			cookie->size= cookie->len + len;
+		cookie->buf= xrealloc(cookie->buf, cookie->size);
+	}
+	memcpy(cookie->buf+cookie->len, data, len);
+	cookie->len += len;
+	return len;
+}
+
+static int append_close(void *c)
+{
+	int fd, r;
+	ssize_t n;
+	struct append_cookie *cookie= c;
+
+	/* One write with O_APPEND, other processes that append to the
+	 * same file cannot end up in the middle of it. The file is opened
+	 * again here, a file that was renamed away since fopen (see
+	 * atlas_store_move_file) does not get the result.
+	 */
+	r= 0;
+	if (cookie->len)
+	{
+		fd= open(cookie->filename,
+			O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+		if (fd == -1)
+			r= -1;
+		else
+		{
+			n= write(fd, cookie->buf, cookie->len);
+			if (n != (ssize_t)cookie->len)
+			{
+				if (n >= 0)
+					errno= ENOSPC;
+				r= -1;
+			}
+			if (close(fd) == -1)
+				r= -1;
+		}
+	}
+	free(cookie->filename);
+	free(cookie->buf);
+	free(cookie);
+	return r;
+}
+
+FILE *atlas_fopen_append(const char *filename)
+{
+	int fd;
+	FILE *file;
+	struct append_cookie *cookie;
+	cookie_io_functions_t funcs;
+
+	/* Fail here, like fopen, if the file cannot be appended to */
+	fd= open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	if (fd == -1)
+		return NULL;
+	close(fd);
+
+	cookie= xzalloc(sizeof(*cookie));
+	cookie->filename= xstrdup(filename);
+
+	memset(&funcs, '\0', sizeof(funcs));
+	funcs.write= append_write;
+	funcs.close= append_close;
+	file= fopencookie(cookie, "a", funcs);
+	if (!file)
+	{
+		free(cookie->filename);
+		free(cookie);
+		return NULL;
+	}
+	return file;
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_hash.c -- FNV-1a hash
+ */
+
+#include "libbb.h"
+
+uint64_t atlas_hash(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p;
+
+	for (p= data; len > 0; p++, len--)
+	{
+		h ^= *p;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+uint64_t atlas_hash_str(uint64_t h, const char *str)
+{
+	return atlas_hash(h, str, strlen(str));
+}
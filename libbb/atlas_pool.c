@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_pool.c -- fixed size object pools
+ */
+
+#include "libbb.h"
+
+#include "atlas_pool.h"
+
+#define SLAB_SIZE	16384
+#define SLAB_MIN_OBJS	4
+
+struct pool_free
+{
+	struct pool_free *next;
+};
+
+struct atlas_pool
+{
+	struct atlas_pool *next;
+	const char *name;
+	size_t size;		/* Object size, rounded up */
+	unsigned per_slab;
+	struct pool_free *free_list;
+
+	/* Statistics */
+	unsigned slabs;
+	unsigned used;
+	unsigned nfree;
+	unsigned long long allocs;
+};
+
+static struct atlas_pool *pools;
+
+struct atlas_pool *atlas_pool_new(const char *name, size_t size)
+{
+	struct atlas_pool *pool;
+
+	pool= xzalloc(sizeof(*pool));
+	pool->name= name;
+
+	/* Room for the free list link and aligned for anything */
+	if (size < sizeof(struct pool_free))
+		size= sizeof(struct pool_free);
+	pool->size= (size + sizeof(long long)-1) & ~(sizeof(long long)-1);
+	pool->per_slab= SLAB_SIZE / pool->size;
+	if (pool->per_slab < SLAB_MIN_OBJS)
+		pool->per_slab= SLAB_MIN_OBJS;
+
+	pool->next= pools;
+	pools= pool;
+	return pool;
+}
+
+static void add_slab(struct atlas_pool *pool)
+{
+	unsigned i;
+	char *slab;
+	struct pool_free *obj;
+
+	slab= xmalloc(pool->per_slab * pool->size);
+	for (i= pool->per_slab; i > 0; i--)
+	{
+		obj= (struct pool_free *)(slab + (i-1)*pool->size);
+		obj->next= pool->free_list;
+		pool->free_list= obj;
+	}
+	pool->slabs++;
+	pool->nfree += pool->per_slab;
+}
+
+void *atlas_pool_zalloc(struct atlas_pool *pool)
+{
+	struct pool_free *obj;
+
+	if (!pool->free_list)
+		add_slab(pool);
+	obj= pool->free_list;
+	pool->free_list= obj->next;
+	pool->nfree--;
+	pool->used++;
+	pool->allocs++;
+
+	memset(obj, '\0', pool->size);
+	return obj;
+}
+
+void atlas_pool_free(struct atlas_pool *pool, void *obj)
+{
+	struct pool_free *fobj;
+
+	if (!obj)
+		return;
+	fobj= obj;
+	fobj->next= pool->free_list;
+	pool->free_list= fobj;
+	pool->used--;
+	pool->nfree++;
+}
+
+void atlas_pool_print_json(FILE *file)
+{
+	int first;
+	struct atlas_pool *pool;
+
+	fprintf(file, "[");
+	first= 1;
+	for (pool= pools; pool; pool= pool->next)
+	{
+		fprintf(file, "%s { \"name\":\"%s\", \"size\":%lu, "
+			"\"slabs\":%u, \"used\":%u, \"free\":%u, "
+			"\"allocs\":%llu }",
+			first ? "" : ",", pool->name,
+			(unsigned long)pool->size, pool->slabs, pool->used,
+			pool->nfree, pool->allocs);
+		first= 0;
+	}
+	fprintf(file, " ]");
+}
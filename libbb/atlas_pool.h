@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_pool.h -- fixed size object pools
+ */
+
+struct atlas_pool;
+
+/* Objects come from slabs that are never given back. Freed objects are
+ * reused for the next allocation from the same pool, which keeps
+ * long-running daemons from fragmenting the heap with objects that are
+ * created and deleted all the time. 'name' has to stay around.
+ */
+struct atlas_pool *atlas_pool_new(const char *name, size_t size);
+
+/* Returns a zeroed object, dies if out of memory (like xzalloc) */
+void *atlas_pool_zalloc(struct atlas_pool *pool);
+void atlas_pool_free(struct atlas_pool *pool, void *obj);
+
+/* Print a JSON array with the statistics of all pools */
+void atlas_pool_print_json(FILE *file);
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_proc.c -- reading /proc files and buffering reports
+ */
+
+#include "libbb.h"
+
+#include "atlas_proc.h"
+
+#define PROC_BUF_MIN	4096
+#define OBUF_MIN	1024
+
+int atlas_proc_read(struct atlas_proc *proc, const char *filename)
+{
+	int fd, t_errno;
+	ssize_t r;
+
+	proc->len= 0;
+	proc->offset= 0;
+
+	fd= open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	/* Files in /proc have no meaningful size. Read until EOF and grow
+	 * the buffer when it fills up. Keep one byte for the final NUL.
+	 */
+	for (;;)
+	{
+		if (proc->size - proc->len < 2)
+		{
+			proc->size= proc->size ? 2*proc->size : PROC_BUF_MIN;
+			proc->buf= xrealloc(proc->buf, proc->size);
+		}
+		r= read(fd, proc->buf+proc->len, proc->size-proc->len-1);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			t_errno= errno;
+			close(fd);
+			proc->len= 0;
+			errno= t_errno;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		proc->len += r;
+	}
+	close(fd);
+	proc->buf[proc->len]= '\0';
+	return 0;
+}
+
+char *atlas_proc_line(struct atlas_proc *proc)
+{
+	char *line, *nl;
+
+	if (proc->offset >= proc->len)
+		return NULL;
+
+	line= proc->buf+proc->offset;
+	nl= memchr(line, '\n', proc->len-proc->offset);
+	if (nl)
+	{
+		*nl= '\0';
+		proc->offset= nl+1-proc->buf;
+	}
+	else
+		proc->offset= proc->len;	/* Last line, already NUL terminated */
+	return line;
+}
+
+void atlas_proc_free(struct atlas_proc *proc)
+{
+	free(proc->buf);
+	proc->buf= NULL;
+	proc->size= 0;
+	proc->len= 0;
+	proc->offset= 0;
+}
+
+static char *skip_blanks(char *cp)
+{
+	while (*cp == ' ' || *cp == '\t')
+		cp++;
+	return cp;
+}
+
+char *atlas_proc_word(char **cpp)
+{
+	char *cp, *word;
+
+	word= cp= skip_blanks(*cpp);
+	while (*cp != '\0' && *cp != ' ' && *cp != '\t')
+		cp++;
+	if (*cp != '\0')
+		*cp++= '\0';
+	*cpp= cp;
+	return word;
+}
+
+void atlas_proc_skip(char **cpp, unsigned count)
+{
+	char *cp;
+
+	cp= *cpp;
+	while (count-- > 0)
+	{
+		cp= skip_blanks(cp);
+		while (*cp != '\0' && *cp != ' ' && *cp != '\t')
+			cp++;
+	}
+	*cpp= cp;
+}
+
+int atlas_proc_dec(char **cpp, unsigned long long *valp)
+{
+	unsigned d;
+	unsigned long long val;
+	char *cp;
+
+	cp= skip_blanks(*cpp);
+	d= (unsigned char)*cp - '0';
+	if (d > 9)
+		return -1;
+	val= 0;
+	do
+	{
+		val= val*10 + d;
+		cp++;
+		d= (unsigned char)*cp - '0';
+	} while (d <= 9);
+	*valp= val;
+	*cpp= cp;
+	return 0;
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;	/* Lower case */
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+int atlas_proc_hex(char **cpp, unsigned long long *valp)
+{
+	int d;
+	unsigned long long val;
+	char *cp;
+
+	cp= skip_blanks(*cpp);
+	d= hex_digit(*cp);
+	if (d < 0)
+		return -1;
+	val= 0;
+	do
+	{
+		val= (val << 4) | d;
+		cp++;
+		d= hex_digit(*cp);
+	} while (d >= 0);
+	*valp= val;
+	*cpp= cp;
+	return 0;
+}
+
+int atlas_proc_hexbytes(char **cpp, uint8_t *bytes, size_t len)
+{
+	int d1, d2;
+	size_t i;
+	char *cp;
+
+	cp= skip_blanks(*cpp);
+	for (i= 0; i<len; i++)
+	{
+		d1= hex_digit(cp[0]);
+		if (d1 < 0)
+			return -1;
+		d2= hex_digit(cp[1]);
+		if (d2 < 0)
+			return -1;
+		bytes[i]= (d1 << 4) | d2;
+		cp += 2;
+	}
+	*cpp= cp;
+	return 0;
+}
+
+static void obuf_reserve(struct atlas_obuf *obuf, size_t len)
+{
+	if (obuf->size - obuf->len > len)
+		return;
+	if (obuf->size == 0)
+		obuf->size= OBUF_MIN;
+	while (obuf->size - obuf->len <= len)
+		obuf->size *= 2;
+	obuf->buf= xrealloc(obuf->buf, obuf->size);
+}
+
+void atlas_obuf_mem(struct atlas_obuf *obuf, const void *data, size_t len)
+{
+	obuf_reserve(obuf, len);
+	memcpy(obuf->buf+obuf->len, data, len);
+	obuf->len += len;
+}
+
+void atlas_obuf_str(struct atlas_obuf *obuf, const char *str)
+{
+	atlas_obuf_mem(obuf, str, strlen(str));
+}
+
+void atlas_obuf_ull(struct atlas_obuf *obuf, unsigned long long val)
+{
+	char *cp;
+	char buf[sizeof(val)*3];
+
+	cp= buf+sizeof(buf);
+	do
+	{
+		*--cp= '0' + val % 10;
+		val /= 10;
+	} while (val != 0);
+	atlas_obuf_mem(obuf, cp, buf+sizeof(buf)-cp);
+}
+
+void atlas_obuf_printf(struct atlas_obuf *obuf, const char *fmt, ...)
+{
+	int r;
+	va_list ap;
+
+	obuf_reserve(obuf, 0);
+	va_start(ap, fmt);
+	r= vsnprintf(obuf->buf+obuf->len, obuf->size-obuf->len, fmt, ap);
+	va_end(ap);
+	if (r < 0)
+		return;
+	if (r >= obuf->size-obuf->len)
+	{
+		obuf_reserve(obuf, r);
+		va_start(ap, fmt);
+		vsnprintf(obuf->buf+obuf->len, obuf->size-obuf->len, fmt, ap);
+		va_end(ap);
+	}
+	obuf->len += r;
+}
+
+int atlas_obuf_write(struct atlas_obuf *obuf, FILE *file)
+{
+	size_t len;
+
+	len= obuf->len;
+	obuf->len= 0;
+	if (len == 0)
+		return 0;
+	if (fwrite(obuf->buf, 1, len, file) != len)
+		return -1;
+	return 0;
+}
+
+void atlas_obuf_free(struct atlas_obuf *obuf)
+{
+	free(obuf->buf);
+	obuf->buf= NULL;
+	obuf->size= 0;
+	obuf->len= 0;
+}
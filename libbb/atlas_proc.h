@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_proc.h -- reading /proc files and buffering reports
+ */
+
+/* A buffer that holds the contents of a /proc file. Zero initialize before
+ * first use. The buffer is kept between calls to atlas_proc_read, so
+ * reading the same or similar files again does not allocate.
+ */
+struct atlas_proc
+{
+	char *buf;
+	size_t size;		/* Allocated size */
+	size_t len;		/* Length of the data */
+	size_t offset;		/* Start of the next line */
+};
+
+/* Read all of 'filename'. Returns -1 (with errno set) on failure. */
+int atlas_proc_read(struct atlas_proc *proc, const char *filename);
+
+/* Return the next line (without newline, NUL terminated) or NULL at the
+ * end of the data. Lines are modified in place and stay valid until the
+ * next call to atlas_proc_read.
+ */
+char *atlas_proc_line(struct atlas_proc *proc);
+
+void atlas_proc_free(struct atlas_proc *proc);
+
+/* Parsers for the fields in a line. Leading spaces and tabs are skipped
+ * and *cpp is advanced past the field. The number parsers return -1 if
+ * no digits are found.
+ */
+char *atlas_proc_word(char **cpp);
+void atlas_proc_skip(char **cpp, unsigned count);
+int atlas_proc_dec(char **cpp, unsigned long long *valp);
+int atlas_proc_hex(char **cpp, unsigned long long *valp);
+
+/* Exactly 'len' bytes as 2*len hex digits, as in /proc/net/if_inet6 */
+int atlas_proc_hexbytes(char **cpp, uint8_t *bytes, size_t len);
+
+/* Output is collected in an atlas_obuf and written out in one go. Zero
+ * initialize before first use.
+ */
+struct atlas_obuf
+{
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+void atlas_obuf_str(struct atlas_obuf *obuf, const char *str);
+void atlas_obuf_mem(struct atlas_obuf *obuf, const void *data, size_t len);
+void atlas_obuf_ull(struct atlas_obuf *obuf, unsigned long long val);
+void atlas_obuf_printf(struct atlas_obuf *obuf, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+/* Write the collected output and empty the buffer. Returns -1 on error. */
+int atlas_obuf_write(struct atlas_obuf *obuf, FILE *file);
+
+void atlas_obuf_free(struct atlas_obuf *obuf);
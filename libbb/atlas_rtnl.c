@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_rtnl.c -- rtnetlink snapshots of links, addresses and routes
+ */
+
+#include "libbb.h"
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "atlas_rtnl.h"
+
+#define RECV_SIZE	32768
+
+#define FNV_INIT	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static unsigned dump_seq;
+
+int atlas_rtnl_open(unsigned groups)
+{
+	int fd;
+	struct sockaddr_nl snl;
+
+	fd= socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1)
+		return -1;
+
+	memset(&snl, '\0', sizeof(snl));
+	snl.nl_family= AF_NETLINK;
+	snl.nl_groups= groups;
+	if (bind(fd, (struct sockaddr *)&snl, sizeof(snl)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	if (groups)
+		ndelay_on(fd);
+	return fd;
+}
+
+int atlas_rtnl_dump(int fd, int type, int family, atlas_rtnl_cb_t cb,
+	void *ref)
+{
+	int done, t_errno;
+	unsigned seq;
+	ssize_t r;
+	size_t hdrlen;
+	char *buf;
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *err;
+	struct sockaddr_nl snl;
+	struct iovec iov;
+	struct msghdr msg;
+	struct
+	{
+		struct nlmsghdr nlh;
+		union
+		{
+			struct ifinfomsg ifi;
+			struct ifaddrmsg ifa;
+			struct rtmsg rtm;
+		} u;
+	} req;
+
+	memset(&req, '\0', sizeof(req));
+	switch(type)
+	{
+	case RTM_GETLINK:
+		hdrlen= sizeof(req.u.ifi);
+		req.u.ifi.ifi_family= family;
+		break;
+	case RTM_GETADDR:
+		hdrlen= sizeof(req.u.ifa);
+		req.u.ifa.ifa_family= family;
+		break;
+	case RTM_GETROUTE:
+		hdrlen= sizeof(req.u.rtm);
+		req.u.rtm.rtm_family= family;
+		break;
+	default:
+		errno= EINVAL;
+		return -1;
+	}
+	seq= ++dump_seq;
+	req.nlh.nlmsg_len= NLMSG_LENGTH(hdrlen);
+	req.nlh.nlmsg_type= type;
+	req.nlh.nlmsg_flags= NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq= seq;
+
+	memset(&snl, '\0', sizeof(snl));
+	snl.nl_family= AF_NETLINK;
+	if (sendto(fd, &req, req.nlh.nlmsg_len, 0,
+		(struct sockaddr *)&snl, sizeof(snl)) == -1)
+	{
+		return -1;
+	}
+
+	buf= xmalloc(RECV_SIZE);
+	done= 0;
+	while (!done)
+	{
+		iov.iov_base= buf;
+		iov.iov_len= RECV_SIZE;
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_name= &snl;
+		msg.msg_namelen= sizeof(snl);
+		msg.msg_iov= &iov;
+		msg.msg_iovlen= 1;
+		r= recvmsg(fd, &msg, 0);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+		if (msg.msg_flags & MSG_TRUNC)
+		{
+			errno= EMSGSIZE;
+			goto error;
+		}
+		if (snl.nl_pid != 0)
+			continue;	/* Not from the kernel */
+
+		for (nlh= (struct nlmsghdr *)buf; NLMSG_OK(nlh, r);
+			nlh= NLMSG_NEXT(nlh, r))
+		{
+			if (nlh->nlmsg_seq != seq)
+				continue;	/* Stale reply */
+			if (nlh->nlmsg_type == NLMSG_DONE)
+			{
+				done= 1;
+				break;
+			}
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+			{
+				err= NLMSG_DATA(nlh);
+				errno= nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(*err)) ?
+					-err->error : EPROTO;
+				goto error;
+			}
+			cb(nlh, ref);
+		}
+	}
+	free(buf);
+	return 0;
+
+error:
+	t_errno= errno;
+	free(buf);
+	errno= t_errno;
+	return -1;
+}
+
+uint64_t atlas_rtnl_hash_mem(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p;
+
+	for (p= data; len > 0; p++, len--)
+	{
+		hash ^= *p;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static uint64_t hash_attrs(uint64_t hash, struct rtattr *rta, int len,
+	const unsigned short *types)
+{
+	const unsigned short *tp;
+
+	for (; RTA_OK(rta, len); rta= RTA_NEXT(rta, len))
+	{
+		for (tp= types; *tp != 0; tp++)
+		{
+			if (rta->rta_type == *tp)
+				break;
+		}
+		if (*tp == 0)
+			continue;
+		hash= atlas_rtnl_hash_mem(hash, &rta->rta_type,
+			sizeof(rta->rta_type));
+		hash= atlas_rtnl_hash_mem(hash, RTA_DATA(rta),
+			RTA_PAYLOAD(rta));
+	}
+	return hash;
+}
+
+static const unsigned short link_attrs[]=
+{
+	IFLA_IFNAME, IFLA_ADDRESS, IFLA_MTU, IFLA_MASTER, IFLA_OPERSTATE, 0
+};
+static const unsigned short addr_attrs[]=
+{
+	IFA_ADDRESS, IFA_LOCAL, IFA_LABEL, 0
+};
+static const unsigned short route_attrs[]=
+{
+	RTA_DST, RTA_SRC, RTA_GATEWAY, RTA_OIF, RTA_PRIORITY, RTA_PREFSRC,
+	RTA_TABLE, RTA_MULTIPATH, 0
+};
+
+static void snapshot_cb(struct nlmsghdr *nlh, void *ref)
+{
+	unsigned flags;
+	uint64_t hash, *sump;
+	struct ifinfomsg *ifi;
+	struct ifaddrmsg *ifa;
+	struct rtmsg *rtm;
+
+	sump= ref;
+	hash= atlas_rtnl_hash_mem(FNV_INIT, &nlh->nlmsg_type,
+		sizeof(nlh->nlmsg_type));
+
+	switch(nlh->nlmsg_type)
+	{
+	case RTM_NEWLINK:
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+			return;
+		ifi= NLMSG_DATA(nlh);
+		flags= ifi->ifi_flags & (IFF_UP | IFF_RUNNING);
+		hash= atlas_rtnl_hash_mem(hash, &ifi->ifi_index,
+			sizeof(ifi->ifi_index));
+		hash= atlas_rtnl_hash_mem(hash, &ifi->ifi_type,
+			sizeof(ifi->ifi_type));
+		hash= atlas_rtnl_hash_mem(hash, &flags, sizeof(flags));
+		hash= hash_attrs(hash, IFLA_RTA(ifi), IFLA_PAYLOAD(nlh),
+			link_attrs);
+		break;
+	case RTM_NEWADDR:
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+			return;
+		ifa= NLMSG_DATA(nlh);
+		/* Skip ifa_flags, addresses move from tentative to
+		 * valid and between preferred and deprecated without
+		 * anything that gets reported changing.
+		 */
+		hash= atlas_rtnl_hash_mem(hash, &ifa->ifa_family,
+			sizeof(ifa->ifa_family));
+		hash= atlas_rtnl_hash_mem(hash, &ifa->ifa_prefixlen,
+			sizeof(ifa->ifa_prefixlen));
+		hash= atlas_rtnl_hash_mem(hash, &ifa->ifa_scope,
+			sizeof(ifa->ifa_scope));
+		hash= atlas_rtnl_hash_mem(hash, &ifa->ifa_index,
+			sizeof(ifa->ifa_index));
+		hash= hash_attrs(hash, IFA_RTA(ifa), IFA_PAYLOAD(nlh),
+			addr_attrs);
+		break;
+	case RTM_NEWROUTE:
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm)))
+			return;
+		rtm= NLMSG_DATA(nlh);
+		if (rtm->rtm_flags & RTM_F_CLONED)
+			return;		/* Cache entry */
+		/* All of the header except rtm_flags */
+		hash= atlas_rtnl_hash_mem(hash, rtm,
+			offsetof(struct rtmsg, rtm_flags));
+		hash= hash_attrs(hash, RTM_RTA(rtm), RTM_PAYLOAD(nlh),
+			route_attrs);
+		break;
+	default:
+		return;
+	}
+
+	/* Addition keeps the result independent of the dump order */
+	*sump += hash;
+}
+
+int atlas_rtnl_snapshot_hash(int fd, int family, uint64_t *hashp)
+{
+	uint64_t sum;
+
+	sum= 0;
+	if (atlas_rtnl_dump(fd, RTM_GETLINK, AF_UNSPEC, snapshot_cb, &sum) == -1)
+		return -1;
+	if (atlas_rtnl_dump(fd, RTM_GETADDR, family, snapshot_cb, &sum) == -1)
+		return -1;
+	if (family == AF_UNSPEC)
+	{
+		/* A dump for AF_UNSPEC also returns multicast routing
+		 * tables, stick to unicast.
+		 */
+		if (atlas_rtnl_dump(fd, RTM_GETROUTE, AF_INET,
+			snapshot_cb, &sum) == -1 ||
+			atlas_rtnl_dump(fd, RTM_GETROUTE, AF_INET6,
+			snapshot_cb, &sum) == -1)
+		{
+			return -1;
+		}
+	}
+	else if (atlas_rtnl_dump(fd, RTM_GETROUTE, family,
+		snapshot_cb, &sum) == -1)
+	{
+		return -1;
+	}
+
+	*hashp= atlas_rtnl_hash_mem(FNV_INIT, &sum, sizeof(sum));
+	return 0;
+}
+
+int atlas_rtnl_drain(int fd)
+{
+	int n;
+	ssize_t r;
+	struct nlmsghdr *nlh;
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct nlmsghdr))));
+
+	n= 0;
+	for (;;)
+	{
+		r= recv(fd, buf, sizeof(buf), 0);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			if (errno == ENOBUFS)
+			{
+				/* Lost notifications, assume something
+				 * changed.
+				 */
+				n++;
+				continue;
+			}
+			return -1;
+		}
+		if (r == 0)
+			break;
+		for (nlh= (struct nlmsghdr *)buf; NLMSG_OK(nlh, r);
+			nlh= NLMSG_NEXT(nlh, r))
+		{
+			switch(nlh->nlmsg_type)
+			{
+			case RTM_NEWLINK: case RTM_DELLINK:
+			case RTM_NEWADDR: case RTM_DELADDR:
+			case RTM_NEWROUTE: case RTM_DELROUTE:
+				n++;
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+int atlas_rtnl_hash_load(const char *filename, uint64_t *hashp)
+{
+	FILE *file;
+	unsigned long long hash;
+
+	file= fopen(filename, "r");
+	if (file == NULL)
+		return -1;
+	if (fscanf(file, "%llx", &hash) != 1)
+	{
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	*hashp= hash;
+	return 0;
+}
+
+int atlas_rtnl_hash_save(const char *filename, uint64_t hash)
+{
+	FILE *file;
+
+	file= fopen(filename, "w");
+	if (file == NULL)
+		return -1;
+	fprintf(file, "%016llx\n", (unsigned long long)hash);
+	if (fclose(file) == -1)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_rtnl.h -- rtnetlink snapshots of links, addresses and routes
+ */
+
+struct nlmsghdr;
+
+typedef void (*atlas_rtnl_cb_t)(struct nlmsghdr *nlh, void *ref);
+
+/* Open a rtnetlink socket. 'groups' is a mask of RTMGRP_* multicast
+ * groups to subscribe to, or 0 for a socket that is only used for dumps.
+ * Returns -1 on failure.
+ */
+int atlas_rtnl_open(unsigned groups);
+
+/* Dump all objects of 'type' (RTM_GETLINK, RTM_GETADDR or RTM_GETROUTE)
+ * for 'family' and call 'cb' for each message. Returns -1 (with errno set)
+ * on failure.
+ */
+int atlas_rtnl_dump(int fd, int type, int family, atlas_rtnl_cb_t cb,
+	void *ref);
+
+/* Compute a hash over links, addresses and routes (of 'family', or all
+ * families for AF_UNSPEC). Only fields that show up in reports are
+ * included, counters, lifetimes and timers are not. The hash does not
+ * depend on the order in which the kernel returns objects.
+ */
+int atlas_rtnl_snapshot_hash(int fd, int family, uint64_t *hashp);
+
+/* Read and discard pending notifications on a socket opened with groups.
+ * Returns the number of link, address or route changes, -1 on error.
+ */
+int atlas_rtnl_drain(int fd);
+
+/* Helpers for keeping a hash next to a cache file */
+uint64_t atlas_rtnl_hash_mem(uint64_t hash, const void *data, size_t len);
+int atlas_rtnl_hash_load(const char *filename, uint64_t *hashp);
+int atlas_rtnl_hash_save(const char *filename, uint64_t hash);
@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_store.c -- append-only, segmented result store
+ */
+
+#include "libbb.h"
+#include <sys/file.h>
+#include <libgen.h>
+
+#include "atlas_store.h"
+
+#define LOCK_NAME	"lock"
+#define CURSOR_NAME	"cursor"
+#define SEG_PREFIX	"seg."
+#define MOVE_SUFFIX	".store"	/* For atlas_store_move_file */
+
+struct atlas_store
+{
+	char *dir;
+	int lock_fd;
+	size_t seg_size;
+	unsigned max_segs;
+	unsigned head;		/* Newest segment, the one that gets appended */
+	unsigned tail;		/* Oldest segment */
+};
+
+static void seg_path(struct atlas_store *store, unsigned seg, char *buf,
+	size_t size)
+{
+	snprintf(buf, size, "%s/" SEG_PREFIX "%010u", store->dir, seg);
+}
+
+/* Size of a segment, -1 if it does not exist */
+static off_t seg_size(struct atlas_store *store, unsigned seg)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+
+	seg_path(store, seg, path, sizeof(path));
+	if (stat(path, &sb) == -1)
+		return -1;
+	return sb.st_size;
+}
+
+static void store_lock(struct atlas_store *store)
+{
+	while (flock(store->lock_fd, LOCK_EX) == -1 && errno == EINTR)
+		;
+}
+
+static void store_unlock(struct atlas_store *store)
+{
+	flock(store->lock_fd, LOCK_UN);
+}
+
+/* Find the oldest and newest segment */
+static int store_scan(struct atlas_store *store)
+{
+	int found;
+	unsigned seg;
+	char *check;
+	DIR *dir;
+	struct dirent *de;
+
+	dir= opendir(store->dir);
+	if (dir == NULL)
+		return -1;
+
+	found= 0;
+	while (de= readdir(dir), de != NULL)
+	{
+		if (strncmp(de->d_name, SEG_PREFIX, strlen(SEG_PREFIX)) != 0)
+			continue;
+		seg= strtoul(de->d_name+strlen(SEG_PREFIX), &check, 10);
+		if (check[0] != '\0')
+			continue;
+		if (!found || seg > store->head)
+			store->head= seg;
+		if (!found || seg < store->tail)
+			store->tail= seg;
+		found= 1;
+	}
+	closedir(dir);
+
+	if (!found)
+		store->head= store->tail= 0;
+	return 0;
+}
+
+/* Other processes may have added or removed segments. Called with the
+ * lock held.
+ */
+static void store_refresh(struct atlas_store *store)
+{
+	while (seg_size(store, store->head+1) != -1)
+		store->head++;
+	if (store->tail > store->head)
+		store->tail= store->head;
+	while (store->tail < store->head && seg_size(store, store->tail) == -1)
+		store->tail++;
+}
+
+/* Drop the oldest segments, whether they have been posted or not */
+static void store_evict(struct atlas_store *store)
+{
+	char path[PATH_MAX];
+
+	while (store->head - store->tail + 1 > store->max_segs)
+	{
+		seg_path(store, store->tail, path, sizeof(path));
+		if (unlink(path) == 0)
+		{
+			bb_error_msg("store %s: dropping unposted segment %u",
+				store->dir, store->tail);
+		}
+		store->tail++;
+	}
+}
+
+static void read_cursor(struct atlas_store *store, unsigned *segp,
+	off_t *offp)
+{
+	unsigned seg;
+	long long off;
+	char path[PATH_MAX];
+	FILE *file;
+
+	*segp= store->tail;
+	*offp= 0;
+
+	snprintf(path, sizeof(path), "%s/" CURSOR_NAME, store->dir);
+	file= fopen(path, "r");
+	if (file == NULL)
+		return;
+	if (fscanf(file, "%u %lld", &seg, &off) == 2 && off >= 0 &&
+		seg >= store->tail && seg <= store->head)
+	{
+		*segp= seg;
+		*offp= off;
+	}
+	fclose(file);
+}
+
+static int write_cursor(struct atlas_store *store, unsigned seg, off_t off)
+{
+	char path[PATH_MAX], path_new[PATH_MAX];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/" CURSOR_NAME, store->dir);
+	snprintf(path_new, sizeof(path_new), "%s/" CURSOR_NAME ".new",
+		store->dir);
+	file= fopen(path_new, "w");
+	if (file == NULL)
+		return -1;
+	fprintf(file, "%u %lld\n", seg, (long long)off);
+	if (fclose(file) != 0)
+		return -1;
+	return rename(path_new, path);
+}
+
+struct atlas_store *atlas_store_open(const char *dir, size_t seg_size,
+	unsigned max_segs)
+{
+	int t_errno;
+	char path[PATH_MAX];
+	struct stat sb;
+	struct atlas_store *store;
+
+	if (mkdir(dir, 0755) == -1 && errno == ENOENT)
+	{
+		/* Stores live in a common directory, which may not exist
+		 * yet.
+		 */
+		strlcpy(path, dir, sizeof(path));
+		mkdir(dirname(path), 0755);
+		mkdir(dir, 0755);
+	}
+	if (stat(dir, &sb) == -1)
+		return NULL;
+	if (!S_ISDIR(sb.st_mode))
+	{
+		errno= ENOTDIR;
+		return NULL;
+	}
+
+	store= xzalloc(sizeof(*store));
+	store->dir= xstrdup(dir);
+	store->seg_size= seg_size ? seg_size : ATLAS_STORE_SEG_SIZE;
+	store->max_segs= max_segs ? max_segs : ATLAS_STORE_MAX_SEGS;
+
+	snprintf(path, sizeof(path), "%s/" LOCK_NAME, dir);
+	store->lock_fd= open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (store->lock_fd == -1 || store_scan(store) == -1)
+	{
+		t_errno= errno;
+		if (store->lock_fd != -1)
+			close(store->lock_fd);
+		free(store->dir);
+		free(store);
+		errno= t_errno;
+		return NULL;
+	}
+	return store;
+}
+
+void atlas_store_close(struct atlas_store *store)
+{
+	close(store->lock_fd);
+	free(store->dir);
+	free(store);
+}
+
+int atlas_store_append(struct atlas_store *store, const void *data,
+	size_t len)
+{
+	int fd, r;
+	char path[PATH_MAX];
+	struct stat sb;
+
+	r= -1;
+	store_lock(store);
+	store_refresh(store);
+
+	seg_path(store, store->head, path, sizeof(path));
+	fd= open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1 || fstat(fd, &sb) == -1)
+		goto out;
+	if (sb.st_size > 0 && sb.st_size + len > store->seg_size)
+	{
+		/* Does not fit, start a new segment. A record that is
+		 * bigger than a segment gets one of its own.
+		 */
+		close(fd);
+		store->head++;
+		store_evict(store);
+		seg_path(store, store->head, path, sizeof(path));
+		fd= open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			0644);
+		if (fd == -1)
+			goto out;
+	}
+	if (full_write(fd, data, len) == (ssize_t)len)
+		r= 0;
+
+out:
+	if (fd != -1)
+		close(fd);
+	store_unlock(store);
+	return r;
+}
+
+int atlas_store_append_file(struct atlas_store *store, const char *filename)
+{
+	int fd, r;
+	char *buf;
+	struct stat sb;
+
+	fd= open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &sb) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	if (sb.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	buf= xmalloc(sb.st_size);
+	r= -1;
+	if (full_read(fd, buf, sb.st_size) == sb.st_size)
+		r= atlas_store_append(store, buf, sb.st_size);
+	free(buf);
+	close(fd);
+	return r;
+}
+
+int atlas_store_move_file(struct atlas_store *store, const char *filename)
+{
+	int r;
+	char *work;
+
+	work= xasprintf("%s" MOVE_SUFFIX, filename);
+
+	/* Left behind when storing failed last time */
+	if (atlas_store_append_file(store, work) == -1)
+	{
+		free(work);
+		return -1;
+	}
+	unlink(work);
+
+	/* Others append to 'filename', after the rename they start a new
+	 * file.
+	 */
+	if (rename(filename, work) == -1)
+	{
+		r= (errno == ENOENT) ? 0 : -1;
+		free(work);
+		return r;
+	}
+	r= atlas_store_append_file(store, work);
+	if (r == 0)
+		unlink(work);
+	free(work);
+	return r;
+}
+
+int atlas_store_peek(struct atlas_store *store, off_t maxlen,
+	struct atlas_store_range *range)
+{
+	unsigned seg;
+	off_t off, size;
+
+	store_lock(store);
+	store_refresh(store);
+
+	read_cursor(store, &seg, &off);
+	range->seg= range->end_seg= seg;
+	range->off= range->end_off= off;
+	range->len= 0;
+	range->fd= -1;
+
+	/* Segments before the head are complete, the head is taken up to
+	 * its current size. Appends hold the lock, so that is always the
+	 * end of a record.
+	 */
+	for (; seg <= store->head; seg++)
+	{
+		size= seg_size(store, seg);
+		if (size == -1)
+			size= 0;
+		if (seg == range->seg)
+		{
+			if (range->off > size)
+				range->off= size;
+			off= range->off;
+		}
+		else
+			off= 0;
+		if (range->len > 0 && range->len + size - off > maxlen)
+			break;
+		range->len += size - off;
+		range->end_seg= seg;
+		range->end_off= size;
+	}
+
+	store_unlock(store);
+	return 0;
+}
+
+ssize_t atlas_store_read(struct atlas_store *store,
+	struct atlas_store_range *range, void *buf, size_t size)
+{
+	ssize_t n;
+	off_t left;
+	char path[PATH_MAX];
+
+	while (range->len > 0)
+	{
+		if (range->fd == -1)
+		{
+			seg_path(store, range->seg, path, sizeof(path));
+			range->fd= open(path, O_RDONLY | O_CLOEXEC);
+			if (range->fd == -1)
+			{
+				/* Nothing to read from a missing segment */
+				if (errno == ENOENT &&
+					range->seg < range->end_seg)
+				{
+					range->seg++;
+					range->off= 0;
+					continue;
+				}
+				return -1;
+			}
+			if (lseek(range->fd, range->off, SEEK_SET) == -1)
+				return -1;
+		}
+
+		left= range->len;
+		if (range->seg == range->end_seg &&
+			range->end_off - range->off < left)
+		{
+			left= range->end_off - range->off;
+		}
+		n= 0;
+		if (left > 0)
+		{
+			n= read(range->fd, buf, (off_t)size < left ? size :
+				(size_t)left);
+			if (n == -1)
+				return -1;
+		}
+		if (n == 0)
+		{
+			/* End of this segment */
+			close(range->fd);
+			range->fd= -1;
+			if (range->seg >= range->end_seg)
+			{
+				/* Shorter than expected */
+				errno= EIO;
+				return -1;
+			}
+			range->seg++;
+			range->off= 0;
+			continue;
+		}
+		range->off += n;
+		range->len -= n;
+		return n;
+	}
+	return 0;
+}
+
+int atlas_store_commit(struct atlas_store *store,
+	const struct atlas_store_range *range)
+{
+	int r;
+	char path[PATH_MAX];
+
+	store_lock(store);
+	store_refresh(store);
+
+	r= write_cursor(store, range->end_seg, range->end_off);
+	if (r == 0)
+	{
+		/* Everything before the cursor is posted. Keep the head,
+		 * it is still being appended.
+		 */
+		while (store->tail < range->end_seg &&
+			store->tail < store->head)
+		{
+			seg_path(store, store->tail, path, sizeof(path));
+			unlink(path);
+			store->tail++;
+		}
+	}
+
+	store_unlock(store);
+	return r;
+}
+
+void atlas_store_range_cleanup(struct atlas_store_range *range)
+{
+	if (range->fd != -1)
+		close(range->fd);
+	range->fd= -1;
+}
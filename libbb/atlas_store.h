@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_store.h -- append-only, segmented result store
+ */
+
+struct atlas_store;
+
+/* Results are appended to the newest of a ring of segment files in one
+ * directory. A segment is closed when the next record does not fit, so
+ * the file system only sees a new file every seg_size bytes. When there
+ * are more than max_segs segments the oldest one is dropped. The poster
+ * keeps a read cursor, segments before the cursor are deleted.
+ *
+ * Several processes can use the same store, a lock file serializes them.
+ */
+#define ATLAS_STORE_SEG_SIZE	(64*1024)
+#define ATLAS_STORE_MAX_SEGS	64
+
+/* Part of the store that is handed to the poster */
+struct atlas_store_range
+{
+	unsigned seg;		/* Read position */
+	off_t off;
+	off_t len;		/* Bytes left to read */
+	unsigned end_seg;	/* Where the cursor goes on commit */
+	off_t end_off;
+	int fd;			/* Open segment, -1 if none */
+};
+
+/* A seg_size or max_segs of 0 selects the default. Creates 'dir' (and
+ * its parent) if needed. Returns NULL with errno set on failure.
+ */
+struct atlas_store *atlas_store_open(const char *dir, size_t seg_size,
+	unsigned max_segs);
+void atlas_store_close(struct atlas_store *store);
+
+/* A record is never split across segments. Returns 0 or -1 */
+int atlas_store_append(struct atlas_store *store, const void *data,
+	size_t len);
+
+/* Append the contents of a file as one record. Returns 0 or -1. An
+ * empty or missing file is not an error.
+ */
+int atlas_store_append_file(struct atlas_store *store, const char *filename);
+
+/* Store a file that other processes append to and delete it. The file is
+ * renamed first, so results that are appended while it is being stored
+ * end up in a new file. If storing fails the renamed copy is kept and
+ * stored by the next call. Returns 0 or -1, a missing file is not an
+ * error.
+ */
+int atlas_store_move_file(struct atlas_store *store, const char *filename);
+
+/* Get up to 'maxlen' bytes after the cursor (at least one segment if there
+ * is anything at all). Returns 0 or -1.
+ */
+int atlas_store_peek(struct atlas_store *store, off_t maxlen,
+	struct atlas_store_range *range);
+
+/* Read from a range, returns 0 at the end of the range */
+ssize_t atlas_store_read(struct atlas_store *store,
+	struct atlas_store_range *range, void *buf, size_t size);
+
+/* Move the cursor to the end of the range and delete segments that
+ * are completely read. Returns 0 or -1.
+ */
+int atlas_store_commit(struct atlas_store *store,
+	const struct atlas_store_range *range);
+
+void atlas_store_range_cleanup(struct atlas_store_range *range);
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_watch.c -- inotify based notification of changes to files
+ */
+
+#include "libbb.h"
+#include <sys/inotify.h>
+#include <event2/event.h>
+
+#include "atlas_watch.h"
+
+#define WATCH_MASK	(IN_CLOSE_WRITE | IN_MOVED_TO)
+
+struct watch_entry
+{
+	int wd;
+	char *name;		/* Last path component */
+	atlas_watch_cb_t cb;
+	void *ref;
+	int fired;
+};
+
+struct atlas_watch
+{
+	int fd;
+	unsigned count;
+	struct watch_entry *entries;
+	struct event *event;
+};
+
+struct atlas_watch *atlas_watch_new(void)
+{
+	int fd;
+	struct atlas_watch *watch;
+
+	fd= inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	watch= xzalloc(sizeof(*watch));
+	watch->fd= fd;
+	return watch;
+}
+
+void atlas_watch_free(struct atlas_watch *watch)
+{
+	unsigned i;
+
+	if (watch->event)
+		event_free(watch->event);
+	close(watch->fd);
+	for (i= 0; i<watch->count; i++)
+		free(watch->entries[i].name);
+	free(watch->entries);
+	free(watch);
+}
+
+int atlas_watch_add(struct atlas_watch *watch, const char *path,
+	atlas_watch_cb_t cb, void *ref)
+{
+	int wd;
+	char *dir, *cp;
+	const char *name;
+	struct watch_entry *entry;
+
+	dir= xstrdup(path);
+	cp= strrchr(dir, '/');
+	if (cp == NULL)
+	{
+		name= path;
+		strcpy(dir, ".");
+	}
+	else
+	{
+		name= path + (cp-dir) + 1;
+		if (cp == dir)
+			cp++;	/* File in the root directory */
+		*cp= '\0';
+	}
+
+	wd= inotify_add_watch(watch->fd, dir, WATCH_MASK);
+	free(dir);
+	if (wd == -1)
+		return -1;
+
+	watch->entries= xrealloc(watch->entries,
+		(watch->count+1) * sizeof(*watch->entries));
+	entry= &watch->entries[watch->count++];
+	entry->wd= wd;
+	entry->name= xstrdup(name);
+	entry->cb= cb;
+	entry->ref= ref;
+	entry->fired= 0;
+
+	return 0;
+}
+
+int atlas_watch_fd(struct atlas_watch *watch)
+{
+	return watch->fd;
+}
+
+int atlas_watch_dispatch(struct atlas_watch *watch)
+{
+	int n;
+	unsigned i;
+	ssize_t r;
+	char *cp;
+	struct inotify_event *ev;
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	for (;;)
+	{
+		r= read(watch->fd, buf, sizeof(buf));
+		if (r <= 0)
+			break;
+
+		for (cp= buf; cp < buf+r; cp += sizeof(*ev) + ev->len)
+		{
+			ev= (struct inotify_event *)cp;
+			for (i= 0; i<watch->count; i++)
+			{
+				if (ev->mask & IN_Q_OVERFLOW)
+				{
+					/* Lost events, assume everything
+					 * changed.
+					 */
+					watch->entries[i].fired= 1;
+					continue;
+				}
+				if (watch->entries[i].wd != ev->wd)
+					continue;
+				if (ev->len == 0 ||
+					strcmp(watch->entries[i].name,
+					ev->name) != 0)
+				{
+					continue;
+				}
+				watch->entries[i].fired= 1;
+			}
+		}
+	}
+
+	/* Callbacks may add or change watches, so first collect and then
+	 * call.
+	 */
+	n= 0;
+	for (i= 0; i<watch->count; i++)
+	{
+		if (!watch->entries[i].fired)
+			continue;
+		watch->entries[i].fired= 0;
+		watch->entries[i].cb(watch->entries[i].ref);
+		n++;
+	}
+	return n;
+}
+
+static void watch_event_cb(evutil_socket_t fd UNUSED_PARAM,
+	short what UNUSED_PARAM, void *arg)
+{
+	atlas_watch_dispatch(arg);
+}
+
+struct event *atlas_watch_event_new(struct atlas_watch *watch,
+	struct event_base *base)
+{
+	if (watch->event)
+		return watch->event;
+
+	watch->event= event_new(base, watch->fd, EV_READ|EV_PERSIST,
+		watch_event_cb, watch);
+	if (!watch->event)
+		return NULL;
+	if (event_add(watch->event, NULL) == -1)
+	{
+		event_free(watch->event);
+		watch->event= NULL;
+	}
+	return watch->event;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2020 RIPE NCC <atlas@ripe.net>
+ * Licensed under GPLv2 or later, see file LICENSE in this tarball for details.
+ * atlas_watch.h -- inotify based notification of changes to files
+ */
+
+struct event;
+struct event_base;
+struct atlas_watch;
+
+typedef void (*atlas_watch_cb_t)(void *ref);
+
+/* Returns NULL if inotify is not available. Callers should keep their
+ * polling timers in that case.
+ */
+struct atlas_watch *atlas_watch_new(void);
+void atlas_watch_free(struct atlas_watch *watch);
+
+/* Watch 'path' (which need not exist) for being written or renamed into
+ * place. The directory that contains 'path' has to exist. Returns -1 on
+ * failure.
+ */
+int atlas_watch_add(struct atlas_watch *watch, const char *path,
+	atlas_watch_cb_t cb, void *ref);
+
+/* For use with poll/select. Call atlas_watch_dispatch when readable */
+int atlas_watch_fd(struct atlas_watch *watch);
+
+/* Read pending notifications and call the callbacks. Each callback is
+ * called at most once per dispatch. Returns the number of callbacks called.
+ */
+int atlas_watch_dispatch(struct atlas_watch *watch);
+
+/* Create (and add) a persistent libevent read event that calls
+ * atlas_watch_dispatch.
+ */
+struct event *atlas_watch_event_new(struct atlas_watch *watch,
+	struct event_base *base);
@@ -32,7 +32,7 @@
 //kbuild:lib-$(CONFIG_PERD) += perd.o
 
 //usage:#define perd_trivial_usage
-//usage:       "-fbSAD -P pidfile -l N -d N -L LOGFILE -c DIR"
+//usage:       "-fbSAD -P pidfile -l N -d N -L LOGFILE -c DIR -j N"
 //usage:#define perd_full_usage "\n\n"
 //usage:       "       -f      Foreground"
 //usage:     "\n       -b      Background (default)"
@@ -44,9 +44,13 @@
 //usage:     "\n       -A      Atlas specific processing"
 //usage:     "\n       -D      Periodically kick watchdog"
 //usage:     "\n       -P      pidfile to use"
+//usage:     "\n       -j      Max builtins running in the background (default 4)"
 
 #include "libbb.h"
 #include <syslog.h>
+#include <poll.h>
+
+#include "atlas_watch.h"
 
 #define ATLAS 1
 
@@ -84,6 +88,21 @@
 
 #define URANDOM_DEV	"/dev/urandom"
 
+#define DEFAULT_MAX_JOBS	4	/* Builtins running in worker processes */
+#define MAX_JOB_OUTPUT	(1024*1024)	/* Drop output beyond this */
+#define LATE_SLACK	2	/* Not late if started within this many seconds */
+
+/* A builtin that runs in a worker process. Its output is collected in
+ * memory and written out in one go when it is done.
+ */
+struct job {
+	int out_fd;		/* Read end of pipe to the worker's stdout */
+	int dest_fd;		/* Output file, -1 for our stdout */
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
 typedef struct CronFile {
 	struct CronFile *cf_Next;
 	struct CronLine *cf_LineBase;
@@ -100,6 +119,7 @@ typedef struct CronLine {
 	struct CronLine *cl_Next;
 	char *cl_Shell;         /* shell command                        */
 	pid_t cl_Pid;           /* running pid, 0, or armed (-1)        */
+	struct job *cl_Job;     /* output of a running worker, or NULL  */
 	unsigned interval;
 	time_t nextcycle;
 	time_t start_time;
@@ -107,6 +127,7 @@ typedef struct CronLine {
 	enum distribution { DISTR_NONE, DISTR_UNIFORM } distribution;
 	int distr_param;	/* Parameter for distribution, if any */
 	int distr_offset;	/* Current offset to randomize the interval */
+	time_t due;		/* When the job should have started */
 
 	/* For debugging */
 	time_t lasttime;
@@ -126,6 +147,7 @@ enum {
 	OPT_A = (1 << 6),
 	OPT_D = (1 << 7),
 	OPT_d = (1 << 8) * ENABLE_FEATURE_CROND_D,
+	OPT_j = (1 << 11),
 };
 #if ENABLE_FEATURE_CROND_D
 #define DebugOpt (option_mask32 & OPT_d)
@@ -169,16 +191,41 @@ static int do_kick_watchdog;
 static char *atlas_id= NULL;
 static char *out_filename= NULL;
 
-static int atlas_run(char *cmdline);
+static unsigned max_jobs= DEFAULT_MAX_JOBS;
+static unsigned running_jobs;
+static int jobs_deferred;
+
+/* How late jobs start, reported once an hour */
+static struct
+{
+	unsigned jobs;
+	unsigned late;
+	time_t max;
+	time_t total;
+} lateness;
+
+#define ATLAS_RUN_DONE	1	/* Ran (or failed) synchronously */
+#define ATLAS_RUN_BG	2	/* Running in a worker process */
+#define ATLAS_RUN_BUSY	3	/* No worker available, try again later */
+
+static int atlas_run(char *cmdline, CronLine *line);
+static void report_lateness(void);
 #endif
 
+static struct atlas_watch *update_watch;
+static int update_pending;
+
 static void CheckUpdates(void);
+static void watch_updates(void);
+static void wait_for_update(int seconds);
 static void SynchronizeDir(void);
 static int TestJobs(time_t *nextp);
 static void RunJobs(void);
+static void wait_for_jobs(void);
+static int is_async(const char *cmdline);
 static int CheckJobs(void);
 static void RunJob(const char *user, CronLine *line);
-#define EndJob(user, line)  ((line)->cl_Pid = 0)
+static void EndJob(const char *user, CronLine *line);
 static void DeleteFile(CronFile *tfile);
 static void SetOld(const char *userName);
 static void CopyFromOld(CronLine *line);
@@ -232,19 +279,28 @@ int perd_main(int argc UNUSED_PARAM, char **argv)
 	unsigned opt;
 	int fd;
 	unsigned seed;
+	char *check;
 
 	const char *PidFileName = NULL;
+	const char *max_jobs_str = NULL;
 
 	INIT_G();
 
 	/* "-b after -f is ignored", and so on for every pair a-b */
 	opt_complementary = "f-b:b-f:S-L:L-S:d-l"
 			":l+:d+"; /* -l and -d have numeric param */
-	opt = getopt32(argv, "l:L:fbSc:A:DP:d:O:",
+	opt = getopt32(argv, "l:L:fbSc:A:DP:d:O:j:",
 			&LogLevel, &LogFile, &CDir, &atlas_id,
-			&PidFileName, &LogLevel, &out_filename);
+			&PidFileName, &LogLevel, &out_filename, &max_jobs_str);
 	/* both -d N and -l N set the same variable: LogLevel */
 
+	if (opt & OPT_j) {
+		max_jobs = strtoul(max_jobs_str, &check, 10);
+		if (check[0] != '\0')
+			bb_error_msg_and_die("bad value for -j '%s'",
+				max_jobs_str);
+	}
+
 	if (!(opt & OPT_f)) {
 		/* close stdin, stdout, stderr.
 		 * close unused descriptors - don't need them. */
@@ -277,6 +333,11 @@ int perd_main(int argc UNUSED_PARAM, char **argv)
 
 	SynchronizeDir();
 
+	/* Wake up as soon as CRONUPDATE is written. Otherwise it is picked
+	 * up once a minute.
+	 */
+	watch_updates();
+
 	/* main loop - synchronize to 1 second after the minute, minimum sleep
 	 * of 1 second. */
 	{
@@ -295,10 +356,15 @@ int perd_main(int argc UNUSED_PARAM, char **argv)
 		}
 		for (;;) {
 			kick_watchdog();
-			sleep(sleep_time);
+			wait_for_update(sleep_time);
 
 			kick_watchdog();
 
+			if (update_pending)
+			{
+				update_pending= 0;
+				CheckUpdates();
+			}
 			if (t1 >= last_minutely + 60)
 			{
 				last_minutely= t1;
@@ -313,6 +379,7 @@ int perd_main(int argc UNUSED_PARAM, char **argv)
 			{
 				last_hourly= t1;
 				SynchronizeDir();
+				report_lateness();
 			}
 			if (t1 < last_hourly)
 			{
@@ -336,9 +403,15 @@ int perd_main(int argc UNUSED_PARAM, char **argv)
 					sleep_time= 1;
 				} else if (next > t1 && next < t1+sleep_time)
 					sleep_time= next-t1;
-				if (CheckJobs() > 0) {
+				if (CheckJobs() > 0 && sleep_time > 10) {
 					sleep_time = 10;
 				}
+				if (jobs_deferred &&
+					running_jobs < max_jobs)
+				{
+					/* A worker is available again */
+					RunJobs();
+				}
 				crondlog(
 				LVL7 "t1 = %d, next = %d, sleep_time = %d",
 					t1, next, sleep_time);
@@ -568,6 +641,131 @@ static void CheckUpdates(void)
 	}
 }
 
+static void cron_update_changed(void *ref UNUSED_PARAM)
+{
+	update_pending= 1;
+}
+
+static void watch_updates(void)
+{
+	update_watch= atlas_watch_new();
+	if (!update_watch)
+	{
+		crondlog(LVL8 "inotify not available, polling for updates");
+		return;
+	}
+	if (atlas_watch_add(update_watch, CRONUPDATE, cron_update_changed,
+		NULL) == -1)
+	{
+		crondlog(LVL8 "unable to watch for updates: %s",
+			strerror(errno));
+		atlas_watch_free(update_watch);
+		update_watch= NULL;
+	}
+}
+
+/* Read what a worker has written so far. Returns 1 at end of file */
+static int read_job_output(struct job *job)
+{
+	ssize_t r;
+	char buf[4096];
+
+	for (;;)
+	{
+		r= read(job->out_fd, buf, sizeof(buf));
+		if (r == 0)
+			return 1;
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			crondlog(LVL8 "error reading job output: %s",
+				strerror(errno));
+			return 1;
+		}
+		if (job->len + r > MAX_JOB_OUTPUT)
+		{
+			crondlog(LVL8 "job output too big, dropping %d bytes",
+				(int)r);
+			continue;
+		}
+		if (job->len + r > job->size)
+		{
+			job->size= job->size ? 2*job->size : sizeof(buf);
+			if (job->size < job->len + r)
+				job->size= job->len + r;
+			job->buf= xrealloc(job->buf, job->size);
+		}
+		memcpy(job->buf+job->len, buf, r);
+		job->len += r;
+	}
+}
+
+/* Sleep for at most 'seconds', return early if CRONUPDATE is written or
+ * when a worker is done. Output of workers is collected while waiting.
+ */
+static void wait_for_update(int seconds)
+{
+	int i, n, r, status;
+	CronFile *file;
+	CronLine *line;
+	CronLine **lines;
+	struct pollfd *pfd;
+
+	if (!update_watch && running_jobs == 0)
+	{
+		sleep(seconds);
+		return;
+	}
+
+	pfd= xmalloc((1+running_jobs)*sizeof(*pfd));
+	lines= xmalloc((1+running_jobs)*sizeof(*lines));
+	n= 0;
+	if (update_watch)
+	{
+		pfd[n].fd= atlas_watch_fd(update_watch);
+		pfd[n].events= POLLIN;
+		lines[n]= NULL;
+		n++;
+	}
+	for (file = FileBase; file; file = file->cf_Next) {
+		for (line = file->cf_LineBase; line; line = line->cl_Next) {
+			if (!line->cl_Job || n >= 1+(int)running_jobs)
+				continue;
+			pfd[n].fd= line->cl_Job->out_fd;
+			pfd[n].events= POLLIN;
+			lines[n]= line;
+			n++;
+		}
+	}
+	for (i= 0; i<n; i++)
+		pfd[i].revents= 0;
+
+	r= poll(pfd, n, seconds*1000);
+	for (i= 0; r > 0 && i<n; i++)
+	{
+		if (!pfd[i].revents)
+			continue;
+		if (!lines[i])
+		{
+			atlas_watch_dispatch(update_watch);
+			continue;
+		}
+		line= lines[i];
+		if (!read_job_output(line->cl_Job))
+			continue;
+
+		/* The worker closed stdout, it is about to exit */
+		waitpid(line->cl_Pid, &status, 0);
+		EndJob(NULL, line);
+	}
+
+	free(pfd);
+	free(lines);
+}
+
 static void SynchronizeDir(void)
 {
 	CronFile *file;
@@ -824,6 +1022,10 @@ LVL7 "(TestJobs) job is late. Now %d, lasttime %d, max %d, nextcycle %d, should
 							file->cf_User, line->cl_Shell);
 					} else if (line->cl_Pid == 0) {
 						line->cl_Pid = -1;
+						line->due = line->start_time +
+							line->nextcycle*
+							line->interval +
+							line->distr_offset;
 						file->cf_Ready = 1;
 						++nJobs;
 						*nextp= 0;
@@ -862,6 +1064,7 @@ static void RunJobs(void)
 	CronFile *file;
 	CronLine *line;
 
+	jobs_deferred = 0;
 	for (file = FileBase; file; file = file->cf_Next) {
 		if (!file->cf_Ready)
 			continue;
@@ -873,23 +1076,56 @@ static void RunJobs(void)
 
 			kick_watchdog();
 
+			/* Only async builtins run next to other jobs */
+			if (max_jobs > 0 && !is_async(line->cl_Shell))
+				wait_for_jobs();
+
 			RunJob(file->cf_User, line);
 			crondlog(LVL8 "USER %s pid %3d cmd %s",
 				file->cf_User, (int)line->cl_Pid, line->cl_Shell);
 			if (line->cl_Pid < 0) {
 				file->cf_Ready = 1;
+				jobs_deferred = 1;
 			} else if (line->cl_Pid > 0) {
 				file->cf_Running = 1;
 			}
+
 			// AA make it wait till the job is finished
-			while (CheckJobs() > 0)                        
-			{
-                         	// crondlog(LVL9 "waiting for job %s ", line->cl_Shell);
-                                sleep(5);
-                        }
+			if (max_jobs == 0)
+				wait_for_jobs();
+		}
+	}
+}
+
+/* Wait until no job is running. Output of workers is collected while
+ * waiting, a worker with a full pipe would never finish otherwise.
+ */
+static void wait_for_jobs(void)
+{
+	while (CheckJobs() > 0)
+	{
+		if (running_jobs)
+			wait_for_update(5);
+		else
+			sleep(5);
+	}
+}
 
+static int is_async(const char *cmdline)
+{
+	size_t len;
+	struct builtin *bp;
+
+	for (bp= builtin_cmds; bp->cmd != NULL; bp++)
+	{
+		len= strlen(bp->cmd);
+		if (strncmp(cmdline, bp->cmd, len) == 0 &&
+			cmdline[len] == ' ')
+		{
+			return bp->async;
 		}
 	}
+	return 0;
 }
 
 /*
@@ -929,6 +1165,39 @@ static int CheckJobs(void)
 	return nStillRunning;
 }
 
+/*
+ * EndJob() - a worker is gone, write out what it produced
+ */
+static void EndJob(const char *user UNUSED_PARAM, CronLine *line)
+{
+	int fd;
+	struct job *job;
+
+	job = line->cl_Job;
+	line->cl_Pid = 0;
+	if (!job)
+		return;
+	line->cl_Job = NULL;
+	running_jobs--;
+
+	/* The worker is gone, so this ends */
+	ndelay_off(job->out_fd);
+	read_job_output(job);
+	close(job->out_fd);
+
+	fd = job->dest_fd != -1 ? job->dest_fd : STDOUT_FILENO;
+	if (job->len && full_write(fd, job->buf, job->len) !=
+		(ssize_t)job->len)
+	{
+		crondlog(LVL8 "unable to write output of '%s': %s",
+			line->cl_Shell, strerror(errno));
+	}
+	if (job->dest_fd != -1)
+		close(job->dest_fd);
+	free(job->buf);
+	free(job);
+}
+
 static void skip_space(char *cp, char **ncpp)
 {
 	while (cp[0] != '\0' && isspace(*(unsigned char *)cp))
@@ -954,17 +1223,99 @@ static void find_eos(char *cp, char **ncpp, char quote_char)
 #define ATLAS_NARGS	40	/* Max arguments to a built-in command */
 #define ATLAS_ARGSIZE	4096	/* Max size of the command line */
 
-static int atlas_run(char *cmdline)
+static void report_run_error(const char *cmdline, const char *reason, int r)
 {
 	char c;
+	const char *cp;
+	FILE *fn;
+
+	fn= fopen(out_filename, "a");
+	if (!fn)
+		crondlog(DIE9 "unable to append to '%s'", out_filename);
+	fprintf(fn, "RESULT { ");
+	if (atlas_id)
+		fprintf(fn, DBQ(id) ":" DBQ(%s) ", ", atlas_id);
+	fprintf(fn, "%s, " DBQ(time) ":%ld, ",
+		atlas_get_version_json_str(), (long)time(NULL));
+	if (reason != NULL)
+		fprintf(fn, DBQ(reason) ":" DBQ(%s) ", ", reason);
+	fprintf(fn, DBQ(err) ":%d, " DBQ(cmd) ": \"", r);
+	for (cp= cmdline; *cp; cp++)
+	{
+		c= *cp;
+		if (c == '"' || c == '\\')
+			fprintf(fn, "\\%c", c);
+		else if (isprint_asciionly((unsigned char)c))
+			fputc(c, fn);
+		else
+			fprintf(fn, "\\u%04x", (unsigned char)c);
+	}
+	fprintf(fn, "\"");
+	fprintf(fn, " }\n");
+	fclose(fn);
+}
+
+/* Run a builtin in a worker process with stdout going to a pipe. Returns
+ * 0 or -1.
+ */
+static int start_job(CronLine *line, struct builtin *bp, int argc,
+	char *argv[], int atlas_fd)
+{
+	int r, fds[2];
+	pid_t pid;
+	struct job *job;
+
+	if (pipe(fds) == -1)
+		return -1;
+
+	fflush(stdout);
+	fflush(stderr);
+	pid= fork();
+	if (pid == -1)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0)
+	{
+		/* Worker */
+		close(fds[0]);
+		if (atlas_fd != -1)
+			close(atlas_fd);
+		dup2(fds[1], 1);
+		close(fds[1]);
+
+		r= bp->func(argc, argv);
+		alarm(0);
+		fflush(stdout);
+		if (r != 0 && out_filename)
+			report_run_error(line->cl_Shell, NULL, r);
+		_exit(r != 0);
+	}
+
+	close(fds[1]);
+	ndelay_on(fds[0]);
+	close_on_exec_on(fds[0]);
+
+	job= xzalloc(sizeof(*job));
+	job->out_fd= fds[0];
+	job->dest_fd= atlas_fd;
+	line->cl_Job= job;
+	line->cl_Pid= pid;
+	running_jobs++;
+	return 0;
+}
+
+static int atlas_run(char *cmdline, CronLine *line)
+{
 	int i, r, argc, atlas_fd, saved_fd, do_append, flags;
 	size_t len;
 	char *cp, *ncp;
 	struct builtin *bp;
 	char *outfile;
 	char *validated_fn= NULL;
-	FILE *fn;
-	char *reason;
+	const char *reason;
 	char *argv[ATLAS_NARGS];
 	char args[ATLAS_ARGSIZE];
 
@@ -990,6 +1341,12 @@ static int atlas_run(char *cmdline)
 	
 	crondlog(LVL7 "found cmd '%s' for '%s'", bp->cmd, cmdline);
 
+	if (bp->async && max_jobs > 0 && running_jobs >= max_jobs)
+	{
+		crondlog(LVL7 "no worker available for '%s'", cmdline);
+		return ATLAS_RUN_BUSY;
+	}
+
 	outfile= NULL;
 	do_append= 0;
 
@@ -1133,6 +1490,7 @@ static int atlas_run(char *cmdline)
 		crondlog(LVL7 "atlas_run: argv[%d] = '%s'", i, argv[i]);
 
 	saved_fd= -1;	/* lint */
+	atlas_fd= -1;
 	if (outfile)
 	{
 		/* Redirect I/O */
@@ -1162,6 +1520,23 @@ static int atlas_run(char *cmdline)
 			goto error;
 		}
 		free(validated_fn); validated_fn= NULL;
+	}
+
+	if (bp->async && max_jobs > 0)
+	{
+		if (start_job(line, bp, argc, argv, atlas_fd) == 0)
+			return ATLAS_RUN_BG;
+		crondlog(LVL8 "atlas_run: unable to start worker: %s",
+			strerror(errno));
+		if (atlas_fd != -1)
+			close(atlas_fd);
+		r= -1;
+		reason="unable to start worker";
+		goto error;
+	}
+
+	if (outfile)
+	{
 		fflush(stdout);
 		saved_fd= dup(1);
 		if (saved_fd == -1)
@@ -1190,58 +1565,70 @@ static int atlas_run(char *cmdline)
 error:
 	if (validated_fn) free(validated_fn);
 	if (r != 0 && out_filename)
-	{
-		fn= fopen(out_filename, "a");
-		if (!fn)
-			crondlog(DIE9 "unable to append to '%s'", out_filename);
-		fprintf(fn, "RESULT { ");
-		if (atlas_id)
-			fprintf(fn, DBQ(id) ":" DBQ(%s) ", ", atlas_id);
-		fprintf(fn, "%s, " DBQ(time) ":%d, ",
-			atlas_get_version_json_str(), time(NULL));
-		if (reason != NULL)
-			fprintf(fn, DBQ(reason) ":" DBQ(%s) ", ", reason);
-		fprintf(fn, DBQ(err) ":%d, " DBQ(cmd) ": \"", r);
-		for (cp= cmdline; *cp; cp++)
-		{
-			c= *cp;
-			if (c == '"' || c == '\\')
-				fprintf(fn, "\\%c", c);
-			else if (isprint_asciionly((unsigned char)c))
-				fputc(c, fn);
-			else
-				fprintf(fn, "\\u%04x", (unsigned char)c);
-		}
-		fprintf(fn, "\"");
-		fprintf(fn, " }\n");
-		fclose(fn);
-	}
+		report_run_error(cmdline, reason, r);
+
+	return ATLAS_RUN_DONE;
+}
+
+static void report_lateness(void)
+{
+	FILE *fn;
 
-	return 1;
+	if (lateness.jobs == 0 || !out_filename)
+		return;
+
+	fn= fopen(out_filename, "a");
+	if (!fn)
+		crondlog(DIE9 "unable to append to '%s'", out_filename);
+	fprintf(fn, "RESULT { ");
+	if (atlas_id)
+		fprintf(fn, DBQ(id) ":" DBQ(%s) ", ", atlas_id);
+	fprintf(fn, "%s, " DBQ(time) ":%ld, ",
+		atlas_get_version_json_str(), (long)time(NULL));
+	fprintf(fn, DBQ(event) ": " DBQ(lateness) ", " DBQ(jobs) ":%u, "
+		DBQ(late) ":%u, " DBQ(max) ":%ld, " DBQ(avg) ":%.1f",
+		lateness.jobs, lateness.late, (long)lateness.max,
+		(double)lateness.total/lateness.jobs);
+	fprintf(fn, " }\n");
+	fclose(fn);
+
+	memset(&lateness, '\0', sizeof(lateness));
 }
 
 static void RunJob(const char *user, CronLine *line)
 {
 	struct passwd *pas;
 	pid_t pid;
+	int r;
+	time_t now, late;
 
-	if (line->lasttime != 0)
+	now= time(NULL);
+	r= atlas_run(line->cl_Shell, line);
+	if (r == ATLAS_RUN_BUSY)
 	{
-		time_t now= time(NULL);
-		if (now > line->lasttime+line->interval+line->distr_param)
-		{
-			crondlog(LVL7 "job is late. Now %d, lasttime %d, max %d, should %d: %s",
-				now, line->lasttime,
-				line->lasttime+line->interval+line->distr_param,
-				line->start_time +
-				line->nextcycle*line->interval+
-				line->distr_offset,
-				line->cl_Shell);
-		}
+		/* Stay armed, RunJobs tries again when a worker is done */
+		return;
+	}
+
+	late= now - line->due;
+	if (late < 0)
+		late= 0;
+	lateness.jobs++;
+	lateness.total += late;
+	if (late > lateness.max)
+		lateness.max= late;
+	if (late > LATE_SLACK)
+	{
+		lateness.late++;
+		crondlog(LVL7 "job is late. Now %d, lasttime %d, late %d, should %d: %s",
+			now, line->lasttime, (int)late, line->due,
+			line->cl_Shell);
 	}
-	line->lasttime= time(NULL);
+	line->lasttime= now;
 
-	if (atlas_run(line->cl_Shell))
+	if (r == ATLAS_RUN_BG)
+		return;		/* Internal command, still running */
+	if (r == ATLAS_RUN_DONE)
 	{
 		/* Internal command */
 		line->cl_Pid = 0;
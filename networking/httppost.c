@@ -8,6 +8,15 @@
 //config:       default n
 //config:       help
 //config:         httppost post files using http
+//config:
+//config:config FEATURE_HTTPPOST_GZIP
+//config:       bool "Support gzip compressed uploads"
+//config:       default y
+//config:       depends on HTTPPOST
+//config:       help
+//config:         Add the --gzip option to httppost to send the request body
+//config:         with Content-Encoding gzip. Falls back to an uncompressed
+//config:         upload if the server does not accept it.
 
 //applet:IF_HTTPPOST(APPLET(httppost, BB_DIR_BIN, BB_SUID_DROP))
 
@@ -29,6 +38,8 @@
 #include <string.h>
 #include <sys/stat.h>
 #include "libbb.h"
+#include "bb_archive.h"
+#include "atlas_store.h"
 
 //#define SAFE_PREFIX_DATA_OUT ATLAS_DATA_OUT
 #define SAFE_PREFIX_DATA_OUT_REL ATLAS_DATA_OUT_REL
@@ -37,6 +48,7 @@
 #define SAFE_PREFIX_DATA_NEW_REL ATLAS_DATA_NEW_REL
 #define SAFE_PREFIX_DATA_STORAGE ATLAS_DATA_STORAGE
 #define SAFE_PREFIX_DATA_STORAGE_REL ATLAS_DATA_STORAGE_REL
+#define SAFE_PREFIX_DATA_STORE_REL ATLAS_DATA_STORE_REL
 #define SAFE_PREFIX_STATUS_REL ATLAS_STATUS_REL
 
 /* Maximum number of files to post in one go with post-dir */
@@ -45,9 +57,13 @@
 struct option longopts[]=
 {
 	{ "delete-file", no_argument, NULL, 'd' },
+#if ENABLE_FEATURE_HTTPPOST_GZIP
+	{ "gzip", no_argument, NULL, 'z' },
+#endif
 	{ "maxpostsize", required_argument, NULL, 'm' },
 	{ "post-file", required_argument, NULL, 'p' },
 	{ "post-dir", required_argument, NULL, 'D' },
+	{ "post-store", required_argument, NULL, 'S' },
 	{ "post-header", required_argument, NULL, 'h' },
 	{ "post-footer", required_argument, NULL, 'f' },
 	{ "set-time", required_argument, NULL, 's' },
@@ -62,9 +78,28 @@ static time_t timeout = 300;
 /* Result sent by controller when input is acceptable. */
 #define OK_STR	"OK\n"
 
+/* Status code for a server that does not accept a Content-Encoding */
+#define HTTP_UNSUPPORTED_MEDIA_TYPE	415
+
+#if ENABLE_FEATURE_HTTPPOST_GZIP
+/* Sources of the request body, in the order they are posted */
+struct post_input
+{
+	int fdH;		/* header */
+	int fdS;		/* post-file */
+	char *next;		/* next file in post-dir list */
+	int fd;			/* current post-dir file */
+	struct atlas_store *store;	/* post-store */
+	struct atlas_store_range *range;
+	int fdF;		/* footer */
+	int stage;
+	FILE *tcp_file;
+};
+#endif
+
 static int parse_url(char *url, char **hostp, char **portp, char **hostportp,
 	char **pathp);
-static int check_result(FILE *tcp_file);
+static int check_result(FILE *tcp_file, int *statusp);
 static int eat_headers(FILE *tcp_file, int *chunked, int *content_length, time_t *timep);
 static int connect_to_name(char *host, char *port);
 char *do_dir(char *dir_name, off_t curr_size, off_t max_size, off_t *lenp);
@@ -77,6 +112,12 @@ static void fatal(const char *fmt, ...);
 static void report(const char *fmt, ...);
 static void report_err(const char *fmt, ...);
 static int write_to_tcp_fd (int fd, FILE *tcp_file);
+static int open_post_dir_file(const char *p);
+static int write_store_to_tcp(struct atlas_store *store,
+	struct atlas_store_range *range, FILE *tcp_file);
+#if ENABLE_FEATURE_HTTPPOST_GZIP
+static int write_gzip_body(struct post_input *inp);
+#endif
 static void skip_spaces(const char *cp, char **ncp);
 static void got_alarm(int sig);
 static void kick_watchdog(void);
@@ -85,9 +126,9 @@ int httppost_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int httppost_main(int argc, char *argv[])
 {
 	int c,  r, fd, fdF, fdH, fdS, chunked, content_length, result;
-	int opt_delete_file, found_ok;
+	int opt_delete_file, found_ok, use_gzip, body_ok, status;
 	char *url, *host, *port, *hostport, *path, *filelist, *p, *check;
-	char *post_dir, *post_file, *atlas_id, *output_file,
+	char *post_dir, *post_store, *post_file, *atlas_id, *output_file,
 		*post_footer, *post_header, *maxpostsizestr, *timeoutstr;
 	char *time_tolerance, *rebased_fn= NULL;
 	char *fn_new, *fn;
@@ -95,16 +136,20 @@ int httppost_main(int argc, char *argv[])
 	time_t server_time, tolerance;
 	struct stat sbF, sbH, sbS;
 	off_t cLength, dir_length, maxpostsize;
+	struct atlas_store *store;
+	struct atlas_store_range store_range, store_start;
 	struct sigaction sa;
 	struct timespec ts;
 
 	post_dir= NULL; 
+	post_store= NULL;
 	post_file= NULL; 
 	post_footer=NULL;
 	post_header=NULL;
 	atlas_id= NULL;
 	output_file= NULL;
 	opt_delete_file = 0;
+	use_gzip= 0;
 	time_tolerance = NULL;
 	maxpostsizestr= NULL;
 	timeoutstr= NULL;
@@ -121,6 +166,9 @@ int httppost_main(int argc, char *argv[])
 	hostport= NULL;
 	path= NULL;
 	filelist= NULL;
+	store= NULL;
+	store_range.len= 0;
+	store_range.fd= -1;
 	maxpostsize= 1000000;
 
 	/* Allow us to be called directly by another program in busybox */
@@ -141,6 +189,9 @@ int httppost_main(int argc, char *argv[])
 		case 'D':
 			post_dir = optarg;		/* --post-dir */
 			break;
+		case 'S':				/* --post-store */
+			post_store= optarg;
+			break;
 		case 'h':				/* --post-header */
 			post_header= optarg;
 			break;
@@ -159,6 +210,11 @@ int httppost_main(int argc, char *argv[])
 		case 't':				/* --timeout */
 			timeoutstr= optarg;
 			break;
+#if ENABLE_FEATURE_HTTPPOST_GZIP
+		case 'z':				/* --gzip */
+			use_gzip= 1;
+			break;
+#endif
 		case '?':
 			fprintf(stderr, "bad option\n");
 			return 1;
@@ -362,6 +418,34 @@ int httppost_main(int argc, char *argv[])
 		cLength += dir_length;
 	}
 
+	if (post_store)
+	{
+		rebased_fn= rebased_validated_filename(post_store,
+			SAFE_PREFIX_DATA_STORE_REL);
+		if (rebased_fn == NULL)
+		{
+			report("protected store (post) '%s'", post_store);
+			goto err;
+		}
+		store= atlas_store_open(rebased_fn, 0, 0);
+		if (store == NULL)
+		{
+			report_err("unable to open store '%s'", rebased_fn);
+			goto err;
+		}
+		free(rebased_fn); rebased_fn= NULL;
+		if (atlas_store_peek(store, maxpostsize-cLength,
+			&store_range) == -1)
+		{
+			report_err("unable to read store '%s'", post_store);
+			goto err;
+		}
+		store_start= store_range;
+		fprintf(stderr, "total size in store: %ld\n",
+			(long)store_range.len);
+		cLength += store_range.len;
+	}
+
 	gettimeofday(&start_time, NULL);
 
 	sa.sa_flags= 0;
@@ -371,6 +455,7 @@ int httppost_main(int argc, char *argv[])
 	alarm(10);
 	signal(SIGPIPE, SIG_IGN);
 
+again:
 	tcp_fd= connect_to_name(host, port);
 	if (tcp_fd == -1)
 	{
@@ -395,6 +480,36 @@ int httppost_main(int argc, char *argv[])
 	fprintf(tcp_file,
 			"Content-Type: application/x-www-form-urlencoded\r\n");
 
+#if ENABLE_FEATURE_HTTPPOST_GZIP
+	if (use_gzip)
+	{
+		struct post_input inp;
+
+		/* The compressed size is not known in advance */
+		fprintf(tcp_file, "Content-Encoding: gzip\r\n");
+		fprintf(tcp_file, "Transfer-Encoding: chunked\r\n");
+		fprintf(tcp_file, "\r\n");
+
+		inp.fdH= fdH;
+		inp.fdS= fdS;
+		inp.next= post_dir ? filelist : NULL;
+		inp.fd= -1;
+		inp.store= store;
+		inp.range= &store_range;
+		inp.fdF= fdF;
+		inp.stage= 0;
+		inp.tcp_file= tcp_file;
+		body_ok= write_gzip_body(&inp);
+		if (inp.fd != -1)
+			close(inp.fd);
+
+		/* The server may have rejected the request before reading
+		 * the body, so always look at the result.
+		 */
+		goto get_result;
+	}
+#endif
+
 	cLength= 0;
 	if( post_header != NULL )
 		cLength  +=  sbH.st_size;
@@ -405,6 +520,9 @@ int httppost_main(int argc, char *argv[])
 	if (post_dir)
 		cLength += dir_length;
 
+	if (store)
+		cLength += store_range.len;
+
 	if( post_footer != NULL )
 		cLength  +=  sbF.st_size;
 
@@ -428,31 +546,9 @@ int httppost_main(int argc, char *argv[])
 		for (p= filelist; p[0] != 0; p += strlen(p)+1)
 		{
 			fprintf(stderr, "posting file '%s'\n", p);
-			rebased_fn= rebased_validated_filename(p,
-				SAFE_PREFIX_DATA_OUT_REL);
-			if (rebased_fn == NULL)
-			{
-				rebased_fn= rebased_validated_filename(p,
-					SAFE_PREFIX_DATA_OOQ_OUT_REL);
-			}
-			if (rebased_fn == NULL)
-			{
-				rebased_fn= rebased_validated_filename(p,
-					SAFE_PREFIX_DATA_STORAGE_REL);
-			}
-			if (rebased_fn == NULL)
-			{
-				report("protected file (post dir) '%s'", p);
-				goto err;
-			}
-			fd= open(p, O_RDONLY);
+			fd= open_post_dir_file(p);
 			if (fd == -1)
-			{
-				report_err("unable to open '%s'",
-					rebased_fn);
 				goto err;
-			}
-			free(rebased_fn); rebased_fn= NULL;
 			r= write_to_tcp_fd(fd, tcp_file);
 			close(fd);
 			fd= -1;
@@ -461,14 +557,48 @@ int httppost_main(int argc, char *argv[])
 		}
 	}
 
+	if (store)
+	{
+		if (!write_store_to_tcp(store, &store_range, tcp_file))
+			goto err;
+	}
+
 	if( post_footer != NULL)
 	{
 		if (!write_to_tcp_fd(fdF, tcp_file))
 			goto err;
 	}
 
+	body_ok= 1;
+
+#if ENABLE_FEATURE_HTTPPOST_GZIP
+get_result:
+#endif
 	fprintf(stderr, "httppost: getting result\n");
-	if (!check_result(tcp_file))
+	if (!check_result(tcp_file, &status))
+	{
+		if (use_gzip && status == HTTP_UNSUPPORTED_MEDIA_TYPE)
+		{
+			report("gzip not accepted, posting uncompressed");
+			fclose(tcp_file);
+			tcp_file= NULL;
+			tcp_fd= -1;
+			use_gzip= 0;
+
+			/* Start again from the beginning of each file */
+			if (fdH != -1) lseek(fdH, 0, SEEK_SET);
+			if (fdS != -1) lseek(fdS, 0, SEEK_SET);
+			if (fdF != -1) lseek(fdF, 0, SEEK_SET);
+			if (store)
+			{
+				atlas_store_range_cleanup(&store_range);
+				store_range= store_start;
+			}
+			goto again;
+		}
+		goto err;
+	}
+	if (!body_ok)
 		goto err;
 	fprintf(stderr, "httppost: getting reply headers \n");
 	server_time= 0;
@@ -608,6 +738,8 @@ int httppost_main(int argc, char *argv[])
 					report_err("unable to unlink '%s'", p);
 			}
 		}
+		if (store && atlas_store_commit(store, &store_range) == -1)
+			report_err("unable to commit store '%s'", post_store);
 	}
 	fprintf(stderr, "httppost: done\n");
 
@@ -631,6 +763,11 @@ leave:
 	if (path) free(path);
 	if (filelist) free(filelist);
 	if (rebased_fn) free(rebased_fn);
+	if (store)
+	{
+		atlas_store_range_cleanup(&store_range);
+		atlas_store_close(store);
+	}
 
 	alarm(0);
 	signal(SIGPIPE, SIG_DFL);
@@ -667,6 +804,173 @@ static int write_to_tcp_fd (int fd, FILE *tcp_file)
 }
 
 
+static int write_store_to_tcp(struct atlas_store *store,
+	struct atlas_store_range *range, FILE *tcp_file)
+{
+	ssize_t r;
+	char buffer[1024];
+
+	for (;;)
+	{
+		r= atlas_store_read(store, range, buffer, sizeof(buffer));
+		if (r == 0)
+			break;
+		if (r == -1)
+		{
+			report_err("error reading from store");
+			return 0;
+		}
+		if (fwrite(buffer, r, 1, tcp_file) != 1)
+		{
+			report_err("error writing to tcp connection");
+			return 0;
+		}
+		alarm(10);
+	}
+	return 1;
+}
+
+static int open_post_dir_file(const char *p)
+{
+	int fd;
+	char *rebased_fn;
+
+	rebased_fn= rebased_validated_filename(p, SAFE_PREFIX_DATA_OUT_REL);
+	if (rebased_fn == NULL)
+	{
+		rebased_fn= rebased_validated_filename(p,
+			SAFE_PREFIX_DATA_OOQ_OUT_REL);
+	}
+	if (rebased_fn == NULL)
+	{
+		rebased_fn= rebased_validated_filename(p,
+			SAFE_PREFIX_DATA_STORAGE_REL);
+	}
+	if (rebased_fn == NULL)
+	{
+		report("protected file (post dir) '%s'", p);
+		return -1;
+	}
+	fd= open(p, O_RDONLY);
+	if (fd == -1)
+		report_err("unable to open '%s'", rebased_fn);
+	free(rebased_fn);
+	return fd;
+}
+
+#if ENABLE_FEATURE_HTTPPOST_GZIP
+/* Concatenation of header, post-file, post-dir files, post-store and
+ * footer
+ */
+static ssize_t read_post_input(void *ctx, void *buf, size_t size)
+{
+	int fd;
+	ssize_t r;
+	struct post_input *inp;
+
+	inp= ctx;
+	for (;;)
+	{
+		switch(inp->stage)
+		{
+		case 0: fd= inp->fdH; break;
+		case 1: fd= inp->fdS; break;
+		case 2:
+			if (inp->fd == -1)
+			{
+				if (inp->next == NULL || inp->next[0] == '\0')
+				{
+					inp->stage++;
+					continue;
+				}
+				fprintf(stderr, "posting file '%s'\n",
+					inp->next);
+				inp->fd= open_post_dir_file(inp->next);
+				if (inp->fd == -1)
+					return -1;
+				inp->next += strlen(inp->next)+1;
+			}
+			fd= inp->fd;
+			break;
+		case 3:
+			if (inp->store == NULL)
+			{
+				inp->stage++;
+				continue;
+			}
+			r= atlas_store_read(inp->store, inp->range, buf, size);
+			if (r > 0)
+				return r;
+			if (r == -1)
+			{
+				report_err("error reading from store");
+				return -1;
+			}
+			inp->stage++;
+			continue;
+		case 4: fd= inp->fdF; break;
+		default:
+			return 0;	/* EOF */
+		}
+		if (fd == -1)
+		{
+			inp->stage++;
+			continue;
+		}
+
+		r= read(fd, buf, size);
+		if (r > 0)
+			return r;
+		if (r == -1)
+		{
+			report_err("error reading from file");
+			return -1;
+		}
+
+		/* End of this file */
+		if (inp->stage == 2)
+		{
+			close(inp->fd);
+			inp->fd= -1;
+			continue;
+		}
+		inp->stage++;
+	}
+}
+
+/* Send compressed data as one HTTP chunk */
+static int write_chunk(void *ctx, const void *buf, size_t size)
+{
+	FILE *tcp_file;
+
+	tcp_file= ((struct post_input *)ctx)->tcp_file;
+	if (fprintf(tcp_file, "%lx\r\n", (unsigned long)size) < 0 ||
+		fwrite(buf, size, 1, tcp_file) != 1 ||
+		fputs("\r\n", tcp_file) == EOF)
+	{
+		report_err("error writing to tcp connection");
+		return -1;
+	}
+	alarm(10);
+	return 0;
+}
+
+static int write_gzip_body(struct post_input *inp)
+{
+	if (gzip_stream(read_post_input, write_chunk, inp) != 0)
+		return 0;
+
+	/* Last chunk */
+	if (fputs("0\r\n\r\n", inp->tcp_file) == EOF ||
+		fflush(inp->tcp_file) == EOF)
+	{
+		report_err("error writing to tcp connection");
+		return 0;
+	}
+	return 1;
+}
+#endif
+
 static int parse_url(char *url, char **hostp, char **portp, char **hostportp,
 	char **pathp)
 {
@@ -788,14 +1092,15 @@ error:
 	return -1;
 }
 
-static int check_result(FILE *tcp_file)
+static int check_result(FILE *tcp_file, int *statusp)
 {
 	int major, minor;
 	size_t len;
 	char *cp, *check, *line;
 	const char *prefix;
 	char buffer[1024];
-	
+
+	*statusp= 0;
 	while (fgets(buffer, sizeof(buffer), tcp_file) == NULL)
 	{
 		if (feof(tcp_file))
@@ -858,6 +1163,7 @@ static int check_result(FILE *tcp_file)
 		return 0;
 	}
 
+	*statusp= strtoul(cp, NULL, 10);
 	if (cp[0] != '2')
 	{
 		report("POST command failed: '%s'", cp);
@@ -17,16 +17,20 @@
 //usage:#define rptaddrs_full_usage "\n\n"
 
 #include <errno.h>
+#include <poll.h>
 #include <resolv.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <net/route.h>
 #include <net/if.h>
+#include <linux/rtnetlink.h>
 #include "../eperd/eperd.h"
 #include "../eperd/readresolv.h"
 
 #include "libbb.h"
+#include "atlas_proc.h"
+#include "atlas_rtnl.h"
 
 #include <inet_common.h>
 
@@ -34,6 +38,10 @@
 #define IF_INET6_FILE	"/proc/net/if_inet6"
 #define IPV6_ROUTE_FILE	"/proc/net/ipv6_route"
 #define SUFFIX		".new"
+#define HASH_SUFFIX	".hash"
+
+#define EVENT_SETTLE	2	/* Seconds without changes before reporting */
+#define EVENT_RECHECK	60	/* For changes that rtnetlink doesn't see */
 
 #define IPV4_STATIC_REL	ATLAS_STATUS_REL "/network_v4_static_info.json"
 #define IPV6_STATIC_REL	ATLAS_STATUS_REL "/network_v6_static_info.json"
@@ -42,7 +50,7 @@
 
 #define SAFE_PREFIX_NEW_REL ATLAS_DATA_NEW_REL
 
-#define OPT_STRING      "A:O:c:"
+#define OPT_STRING      "A:O:c:e"
 
 #define DBQ(str) "\"" #str "\""
 #define JS(key, val) fprintf(fh, "\"" #key"\" : \"%s\" , ",  val);
@@ -62,25 +70,34 @@
 
 enum { 
 	OPT_a =  (1 << 0),
+	OPT_e =  (1 << 3),	/* Event mode, report when something changes */
 };
 
+static int rpt_addrs(char *cache_name, char *out_name, char *opt_atlas,
+	int opt_append, int nl_fd);
+static int snapshot_hash(int nl_fd, uint64_t *hashp);
+static int cache_expired(char *cache_name);
+static void wait_for_change(int ev_fd);
 static FILE *setup_cache(char *cache_name);
-static int setup_ipv4_rpt(FILE *of);
-static int setup_dhcpv4(FILE *of);
-static int setup_ipv6_rpt(FILE *of, char *filename);
-static int setup_dns(FILE *of);
-static int setup_static_rpt(FILE *of);
-static int report_line(FILE *of, const char *fn);
+static int setup_ipv4_rpt(struct atlas_obuf *ob);
+static int setup_dhcpv4(struct atlas_obuf *ob);
+static int setup_ipv6_rpt(struct atlas_obuf *ob);
+static int setup_dns(struct atlas_obuf *ob);
+static int setup_static_rpt(struct atlas_obuf *ob);
+static int report_line(struct atlas_obuf *ob, const char *fn);
 static int check_cache(char *cache_name);
 static int rpt_ipv6(char *cache_name, char *out_name, char *opt_atlas, int opt_append);
 static void report(const char *fmt, ...);
 static void report_err(const char *fmt, ...); 
 
+/* Reused for all /proc files that are read */
+static struct atlas_proc proc_buf;
+
 int rptaddrs_main(int argc, char *argv[]);
 
 int rptaddrs_main(int argc UNUSED_PARAM, char *argv[])
 {
-	int r, need_report;
+	int r, nl_fd, ev_fd;
 	unsigned opt;
 	char *opt_atlas;
        	char *cache_name;	/* temp file in an intermediate format */
@@ -88,7 +105,6 @@ int rptaddrs_main(int argc UNUSED_PARAM, char *argv[])
 	char *rebased_out_name= NULL;
 	char *rebased_cache_name= NULL;
 	int opt_append;
-	FILE *cf;
 
 	opt_atlas= NULL;
 	out_name = NULL;
@@ -96,6 +112,8 @@ int rptaddrs_main(int argc UNUSED_PARAM, char *argv[])
 	opt_atlas = NULL;
 	opt_complementary= NULL;
 	opt_append = FALSE;
+	nl_fd= -1;
+	ev_fd= -1;
 
 	opt= getopt32(argv, OPT_STRING, &opt_atlas, &out_name, &cache_name);
 
@@ -130,66 +148,201 @@ int rptaddrs_main(int argc UNUSED_PARAM, char *argv[])
 	if (opt & OPT_a) 
 		opt_append = TRUE;
 
-	cf= setup_cache(rebased_cache_name);
-	if (cf == NULL)
+	/* Without rtnetlink we just do a full scan every time */
+	nl_fd= atlas_rtnl_open(0);
+
+	if (opt & OPT_e)
+	{
+		ev_fd= atlas_rtnl_open(RTMGRP_LINK | RTMGRP_IPV4_IFADDR |
+			RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_IFADDR |
+			RTMGRP_IPV6_ROUTE);
+		if (ev_fd == -1)
+		{
+			report_err("unable to subscribe to rtnetlink");
+			goto err;
+		}
+	}
+
+	for (;;)
+	{
+		r= rpt_addrs(rebased_cache_name, rebased_out_name,
+			opt_atlas, opt_append, nl_fd);
+		if (r != 0)
+			goto err;
+		if (ev_fd == -1)
+			break;
+		wait_for_change(ev_fd);
+	}
+
+	if (rebased_out_name) free(rebased_out_name);
+	if (rebased_cache_name) free(rebased_cache_name);
+	if (nl_fd != -1) close(nl_fd);
+	atlas_proc_free(&proc_buf);
+
+	return 0;
+
+err:
+	if (rebased_out_name) free(rebased_out_name);
+	if (rebased_cache_name) free(rebased_cache_name);
+	if (nl_fd != -1) close(nl_fd);
+	if (ev_fd != -1) close(ev_fd);
+	atlas_proc_free(&proc_buf);
+	return 1;
+}
+
+static int rpt_addrs(char *cache_name, char *out_name, char *opt_atlas,
+	int opt_append, int nl_fd)
+{
+	int r, need_report, have_hash;
+	uint64_t hash, cached_hash;
+	char *hash_name;
+	FILE *cf;
+	struct atlas_obuf ob;
+
+	memset(&ob, '\0', sizeof(ob));
+	hash_name= NULL;
+	hash= 0;
+
+	/* Quick check: if nothing changed according to the kernel and
+	 * the files we report on, there is no need to scan and render
+	 * everything.
+	 */
+	have_hash= (nl_fd != -1 && snapshot_hash(nl_fd, &hash) == 0);
+	if (have_hash)
+	{
+		hash_name= xasprintf("%s%s", cache_name, HASH_SUFFIX);
+		if (!cache_expired(cache_name) &&
+			atlas_rtnl_hash_load(hash_name, &cached_hash) == 0 &&
+			cached_hash == hash)
+		{
+			free(hash_name);
+			return 0;
+		}
+	}
+
+	r= setup_ipv4_rpt(&ob);
+	if (r == -1)
 		goto err;
 
-	r= setup_ipv4_rpt(cf);
+	r= setup_dhcpv4(&ob);
 	if (r == -1)
-	{
-		fclose(cf);
 		goto err;
-	}
 
-	r= setup_dhcpv4(cf);
+	r= setup_ipv6_rpt(&ob);
 	if (r == -1)
-	{
-		fclose(cf);
 		goto err;
-	}
 
-	r= setup_ipv6_rpt(cf, rebased_cache_name);
+	r= setup_dns(&ob);
 	if (r == -1)
-	{
-		fclose(cf);
 		goto err;
-	}
 
-	r= setup_dns(cf);
+	r= setup_static_rpt(&ob);
 	if (r == -1)
-	{
-		fclose(cf);
 		goto err;
-	}
 
-	r= setup_static_rpt(cf);
+	cf= setup_cache(cache_name);
+	if (cf == NULL)
+		goto err;
+	r= atlas_obuf_write(&ob, cf);
+	if (fclose(cf) == -1)
+		r= -1;
 	if (r == -1)
 	{
-		fclose(cf);
+		report_err("error writing cache file for '%s'", cache_name);
 		goto err;
 	}
-	fclose(cf);
 
-	need_report= check_cache(rebased_cache_name);
+	need_report= check_cache(cache_name);
 	if (need_report)
 	{
-		r = rpt_ipv6(rebased_cache_name, rebased_out_name,
-			opt_atlas, opt_append);
+		r = rpt_ipv6(cache_name, out_name, opt_atlas, opt_append);
 		if (r != 0)
 			goto err;
 	}
 
-	if (rebased_out_name) free(rebased_out_name);
-	if (rebased_cache_name) free(rebased_cache_name);
+	if (have_hash && atlas_rtnl_hash_save(hash_name, hash) == -1)
+		report_err("unable to write '%s'", hash_name);
 
+	free(hash_name);
+	atlas_obuf_free(&ob);
 	return 0;
 
 err:
-	if (rebased_out_name) free(rebased_out_name);
-	if (rebased_cache_name) free(rebased_cache_name);
+	free(hash_name);
+	atlas_obuf_free(&ob);
 	return 1;
 }
 
+static int snapshot_hash(int nl_fd, uint64_t *hashp)
+{
+	int r;
+	uint64_t hash;
+	struct atlas_obuf ob;
+
+	if (atlas_rtnl_snapshot_hash(nl_fd, AF_UNSPEC, &hash) == -1)
+		return -1;
+
+	/* DHCP, DNS and the static configuration come from files. They
+	 * are small, just include them as rendered.
+	 */
+	memset(&ob, '\0', sizeof(ob));
+	r= setup_dhcpv4(&ob);
+	if (r != -1)
+		r= setup_dns(&ob);
+	if (r != -1)
+		r= setup_static_rpt(&ob);
+	if (r != -1)
+		*hashp= atlas_rtnl_hash_mem(hash, ob.buf, ob.len);
+	atlas_obuf_free(&ob);
+	return r;
+}
+
+static int cache_expired(char *cache_name)
+{
+	struct stat sb;
+
+	/* Same rule as in check_cache */
+	if (stat(cache_name, &sb) == -1)
+		return 1;
+	return sb.st_mtime < time(NULL) - 3600;
+}
+
+static void wait_for_change(int ev_fd)
+{
+	int r, timeout;
+	struct pollfd pfd;
+
+	pfd.fd= ev_fd;
+	pfd.events= POLLIN;
+
+	/* Changes come in bursts, an interface coming up brings addresses
+	 * and routes. Wait until things settle down.
+	 */
+	timeout= EVENT_RECHECK*1000;
+	for (;;)
+	{
+		r= poll(&pfd, 1, timeout);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			report_err("poll failed");
+			sleep(EVENT_SETTLE);
+			return;
+		}
+		if (r == 0)
+			return;
+		r= atlas_rtnl_drain(ev_fd);
+		if (r == -1)
+		{
+			report_err("error reading from rtnetlink");
+			return;
+		}
+		if (r > 0)
+			timeout= EVENT_SETTLE*1000;
+	}
+}
+
 static FILE *setup_cache(char *cache_name)
 {
 	FILE *out_file;
@@ -216,17 +369,15 @@ static FILE *setup_cache(char *cache_name)
 
 #define MAX_INF	10
 
-static int setup_ipv4_rpt(FILE *of)
+static int setup_ipv4_rpt(struct atlas_obuf *ob)
 {
 	int i, r, s, first;
-	unsigned dest, gateway, flags, refcnt, use, metric, mask;
-	FILE *in_file;
+	unsigned long long dest, gateway, mask;
+	char *cp, *line, *infname;
 	struct in_addr in_addr;
 	struct ifconf ifconf;
 	struct ifreq ifreq1;
 	struct ifreq ifreq[MAX_INF];
-	char infname[20];
-	char line[256];
 
 	s= socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
 	if (s == -1)
@@ -244,7 +395,7 @@ static int setup_ipv4_rpt(FILE *of)
 		return -1;
 	}
 
-	fprintf(of, DBQ(inet-addresses) ": [ ");
+	atlas_obuf_str(ob, DBQ(inet-addresses) ": [ ");
 	for (i= 0; i<ifconf.ifc_len/sizeof(ifreq[0]); i++)
 	{
 		memcpy(ifreq1.ifr_name, ifreq[i].ifr_name,
@@ -256,11 +407,11 @@ static int setup_ipv4_rpt(FILE *of)
 			close(s);
 			return -1;
 		}
-		fprintf(of, "%s{ " DBQ(inet-addr) ": " DBQ(%s) ", ",
+		atlas_obuf_printf(ob, "%s{ " DBQ(inet-addr) ": " DBQ(%s) ", ",
 			i == 0 ? "" : ", ",
 			inet_ntoa(((struct sockaddr_in *)(&ifreq[i].ifr_addr))
 				->sin_addr));
-		fprintf(of, DBQ(netmask) ": " DBQ(%s) ", " 
+		atlas_obuf_printf(ob, DBQ(netmask) ": " DBQ(%s) ", " 
 			DBQ(interface) ": " DBQ(%s) " }",
 			inet_ntoa(((struct sockaddr_in *)(&ifreq1.ifr_addr))->
 				sin_addr),
@@ -269,47 +420,58 @@ static int setup_ipv4_rpt(FILE *of)
 
 	close(s);
 
-	fprintf(of, " ]");
+	atlas_obuf_str(ob, " ]");
 
-	in_file= fopen(IPV4_ROUTE_FILE, "r");
-	if (in_file == NULL)
+	if (atlas_proc_read(&proc_buf, IPV4_ROUTE_FILE) == -1)
 	{
-		report_err("unable to open '%s'", IPV4_ROUTE_FILE);
+		report_err("unable to read from '%s'", IPV4_ROUTE_FILE);
 		return -1;
 	}
 	
 	/* Skip first line */
-	fgets(line, sizeof(line), in_file);
+	atlas_proc_line(&proc_buf);
 	
-	fprintf(of, ", " DBQ(inet-routes) ": [ ");
+	atlas_obuf_str(ob, ", " DBQ(inet-routes) ": [ ");
 	first= 1;
 
-	while (fgets(line, sizeof(line), in_file) != NULL)
+	while (line= atlas_proc_line(&proc_buf), line != NULL)
 	{
-		sscanf(line, "%16s %x %x %x %d %d %d %x",
-			infname, &dest, &gateway, &flags, &refcnt, &use, 
-			&metric, &mask);
+		/* Iface Destination Gateway Flags RefCnt Use Metric Mask */
+		cp= line;
+		infname= atlas_proc_word(&cp);
+		if (infname[0] == '\0')
+			continue;
+		if (atlas_proc_hex(&cp, &dest) == -1 ||
+			atlas_proc_hex(&cp, &gateway) == -1)
+		{
+			report("bad data in '%s'", IPV4_ROUTE_FILE);
+			return -1;
+		}
+		atlas_proc_skip(&cp, 4);
+		if (atlas_proc_hex(&cp, &mask) == -1)
+		{
+			report("bad data in '%s'", IPV4_ROUTE_FILE);
+			return -1;
+		}
 		in_addr.s_addr= dest;
-		fprintf(of, "%s{ " DBQ(destination) ": " DBQ(%s) ", ",
+		atlas_obuf_printf(ob, "%s{ " DBQ(destination) ": " DBQ(%s) ", ",
 			first ? "" : ", ", inet_ntoa(in_addr));
 		in_addr.s_addr= mask;
-		fprintf(of, DBQ(netmask) ": " DBQ(%s) ", ",
+		atlas_obuf_printf(ob, DBQ(netmask) ": " DBQ(%s) ", ",
 			inet_ntoa(in_addr));
 		in_addr.s_addr= gateway;
-		fprintf(of, DBQ(next-hop) ": " DBQ(%s) ", "
+		atlas_obuf_printf(ob, DBQ(next-hop) ": " DBQ(%s) ", "
 			DBQ(interface) ": " DBQ(%s) " }",
 			inet_ntoa(in_addr), infname);
 		first= 0;
 	}
 
-	fprintf(of, " ]");
-
-	fclose(in_file);
+	atlas_obuf_str(ob, " ]");
 
 	return 0;
 }
 
-static int setup_dhcpv4(FILE *of)
+static int setup_dhcpv4(struct atlas_obuf *ob)
 {
 	int found;
 	FILE *in_file;
@@ -326,7 +488,7 @@ static int setup_dhcpv4(FILE *of)
 			/* Probe is configured for DHCP but didn't get a 
 			 * DHCP lease.
 			 */
-			fprintf(of, ", " DBQ(inet-dhcp) ": true");
+			atlas_obuf_str(ob, ", " DBQ(inet-dhcp) ": true");
 			free(fn); fn= NULL;
 			return 0;
 		}
@@ -347,7 +509,7 @@ static int setup_dhcpv4(FILE *of)
 				value= "false";
 			if (value)
 			{
-				fprintf(of, ", " DBQ(inet-dhcp) ": %s",
+				atlas_obuf_printf(ob, ", " DBQ(inet-dhcp) ": %s",
 					value);
 				found= 1; 
 				break;
@@ -362,129 +524,103 @@ static int setup_dhcpv4(FILE *of)
 	return -1;
 }
 
-static int setup_ipv6_rpt(FILE *of, char *filename)
+static const char *ipv6_scope(unsigned scope, char *buf, size_t size)
 {
-	int r, n;
-	char dst6in[INET6_ADDRSTRLEN];
-	char nh6in[INET6_ADDRSTRLEN]; /* next hop */
-	char *dst6out = NULL;
-	char *nh6out = NULL;
-	char dst6p[8][5];
-	char nh6p[8][5];
-	char iface[16], flags[16];
-	char Scope[32];
-	int scope, dad_status, if_idx;
-	int iflags, metric, refcnt, use, prefix_len, slen;
-	struct sockaddr_in6 sdst6, snh6;
-	char buf2[1024];
+	switch (scope & IPV6_ADDR_SCOPE_MASK) {
+		case 0:
+			return "Global";
+		case IPV6_ADDR_LINKLOCAL:
+			return "Link";
+		case IPV6_ADDR_SITELOCAL:
+			return "Site";
+		case IPV6_ADDR_COMPATv4:
+			return "Compat";
+		case IPV6_ADDR_LOOPBACK:
+			return "Host";
+		default:
+			snprintf(buf, size, "Unknown %d", scope);
+			return buf;
+	}
+}
 
-	FILE *in_file;
+static int setup_ipv6_rpt(struct atlas_obuf *ob)
+{
+	int n;
+	unsigned long long if_idx, prefix_len, scope, dad_status;
+	unsigned long long slen, metric, refcnt, use, iflags;
+	char *cp, *line, *iface;
+	struct in6_addr dst6, src6, nh6;
+	char dst6out[INET6_ADDRSTRLEN];
+	char nh6out[INET6_ADDRSTRLEN]; /* next hop */
+	char flags[16];
+	char Scope[32];
 
-	/* Copy IF_INET6_FILE */
-	in_file= fopen(IF_INET6_FILE, "r");
-	if (in_file == NULL)
+	if (atlas_proc_read(&proc_buf, IF_INET6_FILE) == -1)
 	{
-		report_err("unable to open '%s'", IF_INET6_FILE);
+		report_err("unable to read from '%s'", IF_INET6_FILE);
 		return -1;
 	}
 	n = 0;
-	while ((r = fscanf(in_file, "%4s%4s%4s%4s%4s%4s%4s%4s %08x %02x %02x %02x %20s\n",
-					dst6p[0], dst6p[1], dst6p[2]
-					, dst6p[3], dst6p[4], dst6p[5]
-					, dst6p[6], dst6p[7], &if_idx, &prefix_len
-					, &scope, &dad_status, iface)) != EOF) {
-
-		snprintf(dst6in, sizeof(dst6in), "%s:%s:%s:%s:%s:%s:%s:%s",
-				dst6p[0], dst6p[1], dst6p[2], dst6p[3],
-				dst6p[4], dst6p[5], dst6p[6], dst6p[7]);
-
-		memset(&sdst6, '\0', sizeof(sdst6));
-		inet_pton(AF_INET6, dst6in, (struct sockaddr *) &sdst6.sin6_addr);
-		sdst6.sin6_family = AF_INET6;
-		dst6out = INET6_rresolve((struct sockaddr_in6 *) &sdst6, 0x0fff);
-
-		switch (scope & IPV6_ADDR_SCOPE_MASK) {
-			case 0:
-				snprintf(Scope, sizeof(Scope), "Global");
-				break;
-			case IPV6_ADDR_LINKLOCAL:
-				snprintf(Scope, sizeof(Scope), "Link");
-				break;
-			case IPV6_ADDR_SITELOCAL:
-				snprintf(Scope, sizeof(Scope), "Site");
-				break;
-			case IPV6_ADDR_COMPATv4:
-				snprintf(Scope, sizeof(Scope), "Compat");
-				break;
-			case IPV6_ADDR_LOOPBACK:
-				snprintf(Scope, sizeof(Scope), "Host");
-				break;
-			default:
-				snprintf(Scope, sizeof(Scope), "Unknown %d", scope);
+	while (line= atlas_proc_line(&proc_buf), line != NULL)
+	{
+		/* address if_idx prefix_len scope dad_status iface */
+		cp= line;
+		if (atlas_proc_hexbytes(&cp, dst6.s6_addr,
+				sizeof(dst6.s6_addr)) == -1 ||
+			atlas_proc_hex(&cp, &if_idx) == -1 ||
+			atlas_proc_hex(&cp, &prefix_len) == -1 ||
+			atlas_proc_hex(&cp, &scope) == -1 ||
+			atlas_proc_hex(&cp, &dad_status) == -1)
+		{
+			report("bad data in '%s'", IF_INET6_FILE);
+			return -1;
 		}
-		r = snprintf(buf2, sizeof(buf2), "%s %s{" DBQ(inet6-addr) " : "
+		iface= atlas_proc_word(&cp);
+
+		inet_ntop(AF_INET6, &dst6, dst6out, sizeof(dst6out));
+
+		atlas_obuf_printf(ob, "%s %s{" DBQ(inet6-addr) " : "
 				DBQ(%s) ", " DBQ(prefix-length) " : %d,"
 				DBQ(scope) " : " DBQ(%s) ", " DBQ(interface) 
 				" : " DBQ(%s) "}",  
 				n ? "" : ", \"inet6-addresses\" : [", n ? ", " : ""
-				, dst6out, prefix_len, Scope, iface);
-
-		/* printf("%s\n", buf2); */
-
-		if(dst6out) {
-			free(dst6out);
-			dst6out=NULL;
-		}
+				, dst6out, (int)prefix_len,
+				ipv6_scope(scope, Scope, sizeof(Scope)), iface);
 		n++;
-		if (fwrite(buf2, 1, r, of) != r)
-		{
-			report_err("error writing to '%s'", filename);
-			fclose(in_file);
-			return -1;
-		}
-
-		if (ferror(in_file))
-		{
-			report_err("error reading from '%s'", IF_INET6_FILE);
-			fclose(in_file);
-			return -1;
-		}
 	}	
-	if ( n > 0 ) {
-		r = snprintf(buf2, 2, "]");
-		if (fwrite(buf2, 1, r, of) != r)
-		{
-			report_err("error writing to '%s'", filename);
-			fclose(in_file);
-			return -1;
-		}
-	}		
+	if ( n > 0 )
+		atlas_obuf_str(ob, "]");
 
-	fclose(in_file);
-
-	/* Copy IPV6_ROUTE_FILE */
-	in_file= fopen(IPV6_ROUTE_FILE, "r");
-	if (in_file == NULL)
+	if (atlas_proc_read(&proc_buf, IPV6_ROUTE_FILE) == -1)
 	{
-		report_err("unable to open '%s'", IPV6_ROUTE_FILE);
+		report_err("unable to read from '%s'", IPV6_ROUTE_FILE);
 		return -1;
 	}
 
 	n = 0;
-	while ((r = fscanf (in_file, "%4s%4s%4s%4s%4s%4s%4s%4s%x%*s%x%4s%4s%4s%4s%4s%4s%4s%4s%x%x%x%x%s\n",
-				dst6p[0], dst6p[1], dst6p[2], dst6p[3], dst6p[4],
-				dst6p[5], dst6p[6], dst6p[7], &prefix_len, &slen, 
-				nh6p[0], nh6p[1], nh6p[2], nh6p[3], nh6p[4],
-				nh6p[5], nh6p[6], nh6p[7], &metric, &use, &refcnt, &iflags, iface)) != EOF) {
-
-		if (r != 23) {
-			if ((r < 0) && feof(in_file)) { /* EOF with no (nonspace) chars read. */
-				break;
-			}
-			report_err("reading '%s'", IF_INET6_FILE);
-			fclose(in_file);
+	while (line= atlas_proc_line(&proc_buf), line != NULL)
+	{
+		/* dst dst_len src src_len next_hop metric refcnt use flags
+		 * iface
+		 */
+		cp= line;
+		if (atlas_proc_hexbytes(&cp, dst6.s6_addr,
+				sizeof(dst6.s6_addr)) == -1 ||
+			atlas_proc_hex(&cp, &prefix_len) == -1 ||
+			atlas_proc_hexbytes(&cp, src6.s6_addr,
+				sizeof(src6.s6_addr)) == -1 ||
+			atlas_proc_hex(&cp, &slen) == -1 ||
+			atlas_proc_hexbytes(&cp, nh6.s6_addr,
+				sizeof(nh6.s6_addr)) == -1 ||
+			atlas_proc_hex(&cp, &metric) == -1 ||
+			atlas_proc_hex(&cp, &refcnt) == -1 ||
+			atlas_proc_hex(&cp, &use) == -1 ||
+			atlas_proc_hex(&cp, &iflags) == -1)
+		{
+			report("bad data in '%s'", IPV6_ROUTE_FILE);
 			return -1;
 		}
+		iface= atlas_proc_word(&cp);
 
 		/* skip some the stuff we don't want to report */
 		if (!(iflags & RTF_UP)) { /* Skip interfaces that are down. */
@@ -494,99 +630,37 @@ static int setup_ipv6_rpt(FILE *of, char *filename)
 			continue;
 		}
 
-		if ( strncmp (dst6p[0], "ff02", strlen("ff02")) == 0 ) {
-			continue;
-		}
-		if ( strncmp (dst6p[0], "ff00", strlen("ff00")) == 0 ) {
+		/* ff02::/16 and ff00::/16 */
+		if (dst6.s6_addr[0] == 0xff &&
+			(dst6.s6_addr[1] == 0x02 || dst6.s6_addr[1] == 0x00))
+		{
 			continue;
 		}
 
 		if (prefix_len == 128)
 			continue;	/* Skip host routes */
 
-		 snprintf(dst6in, sizeof(dst6in), "%s:%s:%s:%s:%s:%s:%s:%s",
-                                                dst6p[0], dst6p[1], dst6p[2], dst6p[3],
-                                                dst6p[4], dst6p[5], dst6p[6], dst6p[7]);
-
-		 snprintf(nh6in, sizeof(nh6in), "%s:%s:%s:%s:%s:%s:%s:%s",
-				 nh6p[0], nh6p[1], nh6p[2], nh6p[3],
-				 nh6p[4], nh6p[5], nh6p[6], nh6p[7]);
-
-		
 		route_set_flags(flags, (iflags & IPV6_MASK));
-		memset(&sdst6, '\0', sizeof(sdst6));
-		inet_pton(AF_INET6, dst6in, (struct sockaddr *) &sdst6.sin6_addr);
-		sdst6.sin6_family = AF_INET6;
-		dst6out = INET6_rresolve((struct sockaddr_in6 *) &sdst6, 0x0fff);
-
-		memset(&snh6, '\0', sizeof(snh6));
-		inet_pton(AF_INET6, nh6in, (struct sockaddr *) &snh6.sin6_addr);
-		snh6.sin6_family = AF_INET6;
-		nh6out = INET6_rresolve((struct sockaddr_in6 *) &snh6, 0x0fff);
-	
-			
-		r = snprintf(buf2, sizeof(buf2), "%s %s{" DBQ(destination) " : "
+		inet_ntop(AF_INET6, &dst6, dst6out, sizeof(dst6out));
+		inet_ntop(AF_INET6, &nh6, nh6out, sizeof(nh6out));
+
+		atlas_obuf_printf(ob, "%s %s{" DBQ(destination) " : "
 				DBQ(%s) ", " DBQ(prefix-length) " : %d,"
 				DBQ(next-hop) " : " DBQ(%s) ", " DBQ(flags)
 				" : " DBQ(%s) ", " DBQ(metric) " : %d , "
 				DBQ(interface) " : " DBQ(%s) "}",
 				n ? "" : ", \"inet6-routes\" : [", n ? ", " : ""
-				, dst6out, prefix_len, nh6out, flags, metric
-				, iface);
-
-		/*
-		r = snprintf(buf2, sizeof(buf2), "%s %s{" DBQ(destination) " : "
-				DBQ(%s) ", " DBQ(prefix-length) " : %d," 
-				DBQ(next-hop) " : " DBQ(%s) ", " DBQ(flags) 
-				" : " DBQ(%s) ", " DBQ(metric) " : %d , "
-				DBQ(interface) " : " DBQ(%s) "}",
-				n ? " " : '"inet6-routes" ['
-				, n ? ", " : ""
-				, dst6out, prefix_len, nh6out, flags, metric
-				, iface); 
-				*/
-
-		/* printf("%s\n", buf2); */
-		
-		if(dst6out) {
-			free(dst6out);
-			dst6out=NULL;
-		}
-		if(nh6out) {
-			free(nh6out);
-			nh6out=NULL;
-		}
-
-		if (fwrite(buf2, 1, r, of) != r)
-		{
-			report_err("error writing to '%s'", filename);
-			fclose(in_file);
-			return -1;
-		}
+				, dst6out, (int)prefix_len, nh6out, flags,
+				(int)metric, iface);
 		n++;
 	}
-	if ( n > 0 ) {
-		r = snprintf(buf2, 2, "]");
-		if (fwrite(buf2, 1, r, of) != r)
-		{
-			report_err("error writing to '%s'", filename);
-			fclose(in_file);
-			return -1;
-		}
-	}		
-
-	if (ferror(in_file))
-	{
-		report_err("error reading from '%s'", IPV6_ROUTE_FILE);
-		fclose(in_file);
-		return -1;
-	}
-	fclose(in_file);
+	if ( n > 0 )
+		atlas_obuf_str(ob, "]");
 
 	return 0;
 }
 
-static int setup_dns(FILE *of)
+static int setup_dns(struct atlas_obuf *ob)
 {
 	int i, resolv_max;
 	char *nslist[MAXNS];
@@ -595,44 +669,44 @@ static int setup_dns(FILE *of)
 
 	get_local_resolvers(nslist, &resolv_max, NULL);
 
-	fprintf(of, ", " DBQ(dns) ": [ ");
+	atlas_obuf_str(ob, ", " DBQ(dns) ": [ ");
 	for (i= 0; i<resolv_max; i++)
 	{
-		fprintf(of, "%s{ " DBQ(nameserver) ": " DBQ(%s) " }",
+		atlas_obuf_printf(ob, "%s{ " DBQ(nameserver) ": " DBQ(%s) " }",
 			i == 0 ? "" : ", ", 
 			nslist[i]);
 		free(nslist[i]); nslist[i]= NULL;
 	}
 	
-	fprintf(of, " ]");
+	atlas_obuf_str(ob, " ]");
 	
 	return 0;
 }
 
-static int setup_static_rpt(FILE *of)
+static int setup_static_rpt(struct atlas_obuf *ob)
 {
 	int r;
 	char *fn;
 
 	fn= atlas_path(IPV4_STATIC_REL);
-	r= report_line(of, fn);
+	r= report_line(ob, fn);
 	free(fn); fn= NULL;
 	if (r == -1)
 		return -1;
 	fn= atlas_path(IPV6_STATIC_REL);
-	r= report_line(of, fn);
+	r= report_line(ob, fn);
 	free(fn); fn= NULL;
 	if (r == -1)
 		return -1;
 	fn= atlas_path(DNS_STATIC_REL);
-	r= report_line(of, fn);
+	r= report_line(ob, fn);
 	free(fn); fn= NULL;
 	if (r == -1)
 		return -1;
 	return 0;
 }
 
-static int report_line(FILE *of, const char *fn)
+static int report_line(struct atlas_obuf *ob, const char *fn)
 {
 	FILE *f;
 	char *nl;
@@ -668,7 +742,7 @@ static int report_line(FILE *of, const char *fn)
 			return -1;
 		}
 		*nl= '\0';
-		fprintf(of, ", %s", line);
+		atlas_obuf_printf(ob, ", %s", line);
 	}
 
 	return 0;
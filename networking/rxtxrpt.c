@@ -27,6 +27,8 @@ table if it has changed.
 #include <string.h>
 
 #include "libbb.h"
+#include "atlas_proc.h"
+#include "atlas_rtnl.h"
 
 #define NEW_FORMAT
 
@@ -34,12 +36,18 @@ table if it has changed.
 #define IF_INET6_FILE	"/proc/net/if_inet6"
 #define IPV6_ROUTE_FILE	"/proc/net/ipv6_route"
 #define SUFFIX		".new"
+#define HASH_SUFFIX	".hash"
 
 #define DBQ(str) "\"" #str "\""
 
 int do_atlas= 0;
 
+/* Reused for all files that are read and written */
+static struct atlas_proc proc_buf;
+static struct atlas_obuf out_buf;
+
 static int rpt_rxtx(void);
+static int ipv6_hash(uint64_t *hashp);
 static int setup_ipv6_rpt(char *cache_name, int *need_report);
 static int rpt_ipv6(char *cache_name);
 static void report(const char *fmt, ...);
@@ -47,8 +55,9 @@ static void report_err(const char *fmt, ...);
 
 int rxtxrpt_main(int argc, char *argv[])
 {
-	int r, need_report;
-	char *opt_atlas, *cache_name;
+	int r, need_report, have_hash;
+	uint64_t hash, cached_hash;
+	char *opt_atlas, *cache_name, *hash_name;
 
 	opt_atlas= NULL;
 	opt_complementary= NULL;
@@ -66,11 +75,11 @@ int rxtxrpt_main(int argc, char *argv[])
 	if (do_atlas)
 	{
 #ifdef NEW_FORMAT
-		printf("RESULT { " DBQ(id) ": " DBQ(%s) ", ", opt_atlas);
-		printf("%s, ", atlas_get_version_json_str());
-		printf(DBQ(time) ": %lld, ", (long long)time(NULL));
-		printf(DBQ(lts) ": %d, ", get_timesync());
-		printf(DBQ(interfaces) ": [");
+		atlas_obuf_printf(&out_buf, "RESULT { " DBQ(id) ": " DBQ(%s)
+			", %s, " DBQ(time) ": %lld, " DBQ(lts) ": %d, "
+			DBQ(interfaces) ": [", opt_atlas,
+			atlas_get_version_json_str(), (long long)time(NULL),
+			get_timesync());
 #else /* !NEW_FORMWAT */
 		printf("%s %lu ", opt_atlas, time(NULL));
 #endif /* NEW_FORMWAT */
@@ -83,120 +92,124 @@ int rxtxrpt_main(int argc, char *argv[])
 	if (do_atlas)
 	{
 #ifdef NEW_FORMAT
-		printf(" ] }\n");
+		atlas_obuf_str(&out_buf, " ] }\n");
 #else /* !NEW_FORMAT */
 		printf("\n");
 
 #endif /* NEW_FORMAT */
 	}
 
+#ifdef NEW_FORMAT
+	if (atlas_obuf_write(&out_buf, stdout) == -1)
+	{
+		report_err("error writing output");
+		return 1;
+	}
+#endif /* NEW_FORMAT */
+
 	if (cache_name)
 	{
-		r= setup_ipv6_rpt(cache_name, &need_report);
-		if (r != 0)
-			return r;
-		if (need_report)
+		/* Only scan /proc and compare with the cache if the kernel
+		 * has IPv6 addresses or routes that differ from last time.
+		 */
+		hash_name= xasprintf("%s%s", cache_name, HASH_SUFFIX);
+		have_hash= (ipv6_hash(&hash) == 0);
+		if (have_hash && access(cache_name, F_OK) == 0 &&
+			atlas_rtnl_hash_load(hash_name, &cached_hash) == 0 &&
+			cached_hash == hash)
 		{
+			free(hash_name);
+			return 0;
+		}
+
+		r= setup_ipv6_rpt(cache_name, &need_report);
+		if (r == 0 && need_report)
 			r= rpt_ipv6(cache_name);
-			if (r != 0)
-				return r;
+		if (r == 0 && have_hash &&
+			atlas_rtnl_hash_save(hash_name, hash) == -1)
+		{
+			report_err("unable to write '%s'", hash_name);
 		}
+		free(hash_name);
+		if (r != 0)
+			return r;
 	}
 
 	return 0;
 }
 
 #ifdef NEW_FORMAT
+static const char *const rxtx_names[]=
+{
+	"bytes_recv", "pkt_recv", "errors_recv", "dropped_recv",
+	"fifo_recv", "framing_recv", "compressed_recv", "multicast_recv",
+	"bytes_sent", "pkt_sent", "errors_sent", "dropped_sent",
+	"fifo_sent", "collisions_sent", "carr_lost_sent", "compressed_sent",
+};
+#define N_RXTX	(sizeof(rxtx_names)/sizeof(rxtx_names[0]))
+
 static int rpt_rxtx(void)
 {
-	int i;
-	unsigned long long bytes_recv, pkt_recv, errors_recv, dropped_recv,
-		fifo_recv, framing_recv, compressed_recv, multicast_recv,
-		bytes_sent, pkt_sent, errors_sent, dropped_sent,
-		fifo_sent, collisions_sent, carr_lost_sent, compressed_sent;
-	char *cp, *infname;
-	FILE *file;
-	char buf[256];
+	int i, j;
+	unsigned long long value[N_RXTX];
+	char *cp, *line, *infname;
 
-	file= fopen(DEV_FILE, "r");
-	if (!file)
+	if (atlas_proc_read(&proc_buf, DEV_FILE) == -1)
 	{
-		report_err("unable to open '%s'", DEV_FILE);
+		report_err("unable to read from '%s'", DEV_FILE);
 		return 1;
 	}
 
 	/* Skip two lines */
-	if (fgets(buf, sizeof(buf), file) == NULL ||
-		fgets(buf, sizeof(buf), file) == NULL)
+	if (atlas_proc_line(&proc_buf) == NULL ||
+		atlas_proc_line(&proc_buf) == NULL)
 	{
-		report_err("unable to read from '%s'", DEV_FILE);
-		fclose(file);
+		report("unable to read from '%s'", DEV_FILE);
 		return 1;
 	}
 
 	for (i= 0; i<100; i++)
 	{
-		if (fgets(buf, sizeof(buf), file) == NULL)
-		{
-			if (feof(file))
-				break;
-			report_err("unable to read from '%s'", DEV_FILE);
-			fclose(file);
-			return 1;
-		}
-
-		cp= buf;
+		line= atlas_proc_line(&proc_buf);
+		if (line == NULL)
+			break;
 
 		/* Skip leading white space */
+		cp= line;
 		while (*cp == ' ')
 			cp++;
 		infname= cp;
 		cp= strchr(cp, ':');
 		if (cp == NULL)
 		{
-			report_err("format error in '%s'", DEV_FILE);
-			fclose(file);
+			report("format error in '%s'", DEV_FILE);
 			return 1;
 		}
+		*cp++= '\0';
 
 		/* Get all the values */
-		if (sscanf(cp+1, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
-			&bytes_recv, &pkt_recv, &errors_recv, &dropped_recv,
-			&fifo_recv, &framing_recv, &compressed_recv,
-			&multicast_recv,
-			&bytes_sent, &pkt_sent, &errors_sent, &dropped_sent,
-			&fifo_sent, &collisions_sent, &carr_lost_sent,
-			&compressed_sent) != 16)
+		for (j= 0; j<N_RXTX; j++)
 		{
-			report_err("format error in '%s'", DEV_FILE);
-			fclose(file);
-			return 1;
+			if (atlas_proc_dec(&cp, &value[j]) == -1)
+			{
+				report("format error in '%s'", DEV_FILE);
+				return 1;
+			}
 		}
 
-		*cp= '\0';
-
-		printf("%s { " DBQ(name) ": " DBQ(%s) ", ",
-			i == 0 ? "" : ",", infname);
-	
-		printf(DBQ(bytes_recv) ": %llu, ", bytes_recv);
-		printf(DBQ(pkt_recv) ": %llu, ", pkt_recv);
-		printf(DBQ(errors_recv) ": %llu, ", errors_recv);
-		printf(DBQ(dropped_recv) ": %llu, ", dropped_recv);
-		printf(DBQ(fifo_recv) ": %llu, ", fifo_recv);
-		printf(DBQ(framing_recv) ": %llu, ", framing_recv);
-		printf(DBQ(compressed_recv) ": %llu, ", compressed_recv);
-		printf(DBQ(multicast_recv) ": %llu, ", multicast_recv);
-		printf(DBQ(bytes_sent) ": %llu, ", bytes_sent);
-		printf(DBQ(pkt_sent) ": %llu, ", pkt_sent);
-		printf(DBQ(errors_sent) ": %llu, ", errors_sent);
-		printf(DBQ(dropped_sent) ": %llu, ", dropped_sent);
-		printf(DBQ(fifo_sent) ": %llu, ", fifo_sent);
-		printf(DBQ(collisions_sent) ": %llu, ", collisions_sent);
-		printf(DBQ(carr_lost_sent) ": %llu, ", carr_lost_sent);
-		printf(DBQ(compressed_sent) ": %llu", compressed_sent);
-		printf(" }");
+		atlas_obuf_str(&out_buf, i == 0 ? " { " : ", { ");
+		atlas_obuf_str(&out_buf, DBQ(name) ": \"");
+		atlas_obuf_str(&out_buf, infname);
+		atlas_obuf_str(&out_buf, "\"");
+		for (j= 0; j<N_RXTX; j++)
+		{
+			atlas_obuf_str(&out_buf, ", \"");
+			atlas_obuf_str(&out_buf, rxtx_names[j]);
+			atlas_obuf_str(&out_buf, "\": ");
+			atlas_obuf_ull(&out_buf, value[j]);
+		}
+		atlas_obuf_str(&out_buf, " }");
 	}
-	fclose(file);
 
 	return 0;
 }
@@ -251,10 +264,22 @@ static int rpt_rxtx(void)
 }
 #endif /* NEW_FORMAT */
 
+static int ipv6_hash(uint64_t *hashp)
+{
+	int r, fd;
+
+	fd= atlas_rtnl_open(0);
+	if (fd == -1)
+		return -1;
+	r= atlas_rtnl_snapshot_hash(fd, AF_INET6, hashp);
+	close(fd);
+	return r;
+}
+
 static int setup_ipv6_rpt(char *cache_name, int *need_report)
 {
-	int i, r;
-	char *cp, *cp1;
+	int r;
+	char *cp, *cp1, *line;
 	char filename[80];
 	char buf1[1024];
 	char buf2[1024];
@@ -279,96 +304,50 @@ static int setup_ipv6_rpt(char *cache_name, int *need_report)
 	}
 
 	/* Copy IF_INET6_FILE */
-	in_file= fopen(IF_INET6_FILE, "r");
-	if (in_file == NULL)
-	{
-		report_err("unable to open '%s'", IF_INET6_FILE);
-		fclose(out_file);
-		return 1;
-	}
-
-	while (r= fread(buf1, 1, sizeof(buf1), in_file), r > 0)
-	{
-		if (fwrite(buf1, 1, r, out_file) != r)
-		{
-			report_err("error writing to '%s'", filename);
-			fclose(in_file);
-			fclose(out_file);
-			return 1;
-		}
-	}
-	if (ferror(in_file))
+	if (atlas_proc_read(&proc_buf, IF_INET6_FILE) == -1)
 	{
-		report_err("error reading from '%s'", IF_INET6_FILE);
-		fclose(in_file);
+		report_err("unable to read from '%s'", IF_INET6_FILE);
 		fclose(out_file);
 		return 1;
 	}
-	fclose(in_file);
+	atlas_obuf_mem(&out_buf, proc_buf.buf, proc_buf.len);
 
 	/* Copy IPV6_ROUTE_FILE */
-	in_file= fopen(IPV6_ROUTE_FILE, "r");
-	if (in_file == NULL)
+	if (atlas_proc_read(&proc_buf, IPV6_ROUTE_FILE) == -1)
 	{
-		report_err("unable to open '%s'", IPV6_ROUTE_FILE);
+		report_err("unable to read from '%s'", IPV6_ROUTE_FILE);
 		fclose(out_file);
 		return 1;
 	}
 
-	while (fgets(buf1, sizeof(buf1), in_file) != NULL)
+	while (line= atlas_proc_line(&proc_buf), line != NULL)
 	{
 		/* Cut out Ref and Use fields */
-		cp= buf1;
-		for (i= 0; i<6; i++)
-		{
-			if (cp && cp[0] != '\0')
-				cp= strchr(cp+1, ' ');
-		}
-		if (!cp && cp[0] == '\0')
-		{
-			report("bad data in '%s'", IPV6_ROUTE_FILE);
-			fclose(in_file);
-			fclose(out_file);
-			return 1;
-		}
-		cp++;
-		/* Find the end of the two fields */
+		cp= line;
+		atlas_proc_skip(&cp, 6);
 		cp1= cp;
-		for (i= 0; i<2; i++)
-		{
-			if (cp1 && cp1[0] != '\0')
-				cp1= strchr(cp1+1, ' ');
-		}
-		if (!cp1 && cp1[0] == '\0')
+		atlas_proc_skip(&cp1, 2);
+		if (*cp1 == '\0')
 		{
 			report("bad data in '%s'", IPV6_ROUTE_FILE);
-			fclose(in_file);
-			fclose(out_file);
-			return 1;
-		}
-		cp1++;
-		/* And delete the two fields */
-		memmove(cp, cp1, strlen(cp1)+1);
-
-		if (fputs(buf1, out_file) == -1)
-		{
-			report_err("error writing to '%s'", filename);
-			fclose(in_file);
 			fclose(out_file);
 			return 1;
 		}
+		atlas_obuf_mem(&out_buf, line, cp-line);
+		atlas_obuf_str(&out_buf, cp1);
+		atlas_obuf_str(&out_buf, "\n");
 	}
-	if (ferror(in_file))
+
+	r= atlas_obuf_write(&out_buf, out_file);
+	if (fclose(out_file) == -1)
+		r= -1;
+	if (r == -1)
 	{
-		report_err("error reading from '%s'", IPV6_ROUTE_FILE);
-		fclose(in_file);
-		fclose(out_file);
+		report_err("error writing to '%s'", filename);
 		return 1;
 	}
-	fclose(in_file);
 
 	/* Now check if the new file is different from the cache one */
-	fclose(out_file);
 	cache_file= fopen(cache_name, "r");
 	if (cache_file == NULL)
 	{
@@ -134,6 +134,8 @@
 #include <unistd.h>
 #include <linux/reboot.h>
 
+#include "atlas_ctl.h"
+
 #define LOGIN_PREFIX	"Atlas probe, see http://atlas.ripe.net/\r\n\r\n"
 #define LOGIN_PROMPT	" login: "
 #define PASSWORD_PROMPT	"\r\nPassword: "
@@ -217,6 +219,7 @@ static int start_crontab(struct tsession *ts, char *line);
 static void add_to_crontab(struct tsession *ts, char *line);
 static void end_crontab(struct tsession *ts);
 static void do_oneoff(struct tsession *ts, char *line);
+static void close_crontab(void);
 int validate_filename(const char *path, const char *prefix);
 #endif
 
@@ -238,6 +241,7 @@ struct globals {
 /* Place to store the file handle and directory name for a new crontab */
 static FILE *atlas_crontab;
 static char atlas_dirname[256];
+static int atlas_ctl_fd= -1;	/* Control socket of eperd, if any */
 static struct tsession *atlas_ts;	/* Allow only one 'atlas' connection
 					 * at a time. The old one
 					 * self-destructs when a new one is
@@ -1105,11 +1109,7 @@ int telnetd_main(int argc UNUSED_PARAM, char **argv)
 					/* There is an old session still
 					 * around. Take over.
 					 */
-					if (atlas_crontab)
-					{
-						fclose(atlas_crontab);
-						atlas_crontab= NULL;
-					}
+					close_crontab();
 				}
 				atlas_ts= ts;
  
@@ -1293,11 +1293,7 @@ skip3a:
 #ifdef ATLAS
 		if (ts == atlas_ts)
 		{
-			if (atlas_crontab)
-			{
-				fclose(atlas_crontab);
-				atlas_crontab= NULL;
-			}
+			close_crontab();
 			atlas_ts= NULL;
 		}
 #endif /* ATLAS */
@@ -1504,9 +1500,42 @@ static int start_crontab(struct tsession *ts, char *line)
 		return -1;
 	}
 
+	/* Also stream the crontab to eperd, if it listens. Any failure
+	 * just means falling back to cron.update.
+	 */
+	if (strlen(atlas_dirname) + strlen(CRONTAB_SUFFIX ATLAS_CTL_SUFFIX) +
+		1 <= sizeof(filename))
+	{
+		strlcpy(filename, atlas_dirname, sizeof(filename));
+		strlcat(filename, CRONTAB_SUFFIX ATLAS_CTL_SUFFIX,
+			sizeof(filename));
+		atlas_ctl_fd= atlas_ctl_connect(filename);
+		if (atlas_ctl_fd != -1 && atlas_ctl_send(atlas_ctl_fd,
+			ATLAS_CTL_BEGIN, "", 0) == -1)
+		{
+			close(atlas_ctl_fd);
+			atlas_ctl_fd= -1;
+		}
+	}
+
 	return 0;
 }
 
+static void close_crontab(void)
+{
+	if (atlas_crontab)
+	{
+		fclose(atlas_crontab);
+		atlas_crontab= NULL;
+	}
+	if (atlas_ctl_fd != -1)
+	{
+		/* Without END, eperd does not delete anything */
+		close(atlas_ctl_fd);
+		atlas_ctl_fd= -1;
+	}
+}
+
 static void add_to_crontab(struct tsession *ts, char *line)
 {
 	if (!atlas_crontab)
@@ -1516,15 +1545,20 @@ static void add_to_crontab(struct tsession *ts, char *line)
 		fputc('\n', atlas_crontab) == -1)
 	{
 		add_2sock(ts, IO_ERROR);
-		fclose(atlas_crontab);
-		atlas_crontab= NULL;
+		close_crontab();
 		return;
 	}
+	if (atlas_ctl_fd != -1 && atlas_ctl_send(atlas_ctl_fd,
+		ATLAS_CTL_ADD, line, strlen(line)) == -1)
+	{
+		close(atlas_ctl_fd);
+		atlas_ctl_fd= -1;
+	}
 }
 
 static void end_crontab(struct tsession *ts)
 {
-	int fd;
+	int fd, r;
 	size_t len;
 	struct stat st;
 	char filename1[256];
@@ -1532,18 +1566,20 @@ static void end_crontab(struct tsession *ts)
 
 	if (!atlas_crontab)
 		return;		/* Some error occured earlier */
-	if (fclose(atlas_crontab) == -1)
+	r= fclose(atlas_crontab);
+	atlas_crontab= NULL;
+	if (r == -1)
 	{
-		atlas_crontab= NULL;
+		close_crontab();
 		add_2sock(ts, IO_ERROR);
 		return;
 	}
-	atlas_crontab= NULL;
 
 	/* Rename */
 	len= strlen(atlas_dirname);
 	if (len + strlen(CRONTAB_NEW_SUF) + 1 > sizeof(filename1))
 	{
+		close_crontab();
 		add_2sock(ts, NAME_TOO_LONG);
 		return;
 	}
@@ -1551,6 +1587,7 @@ static void end_crontab(struct tsession *ts)
 	strlcat(filename1, CRONTAB_NEW_SUF, sizeof(filename1));
 	if (len + strlen(CRONTAB_SUFFIX) + 1 > sizeof(filename2))
 	{
+		close_crontab();
 		add_2sock(ts, NAME_TOO_LONG);
 		return;
 	}
@@ -1558,10 +1595,24 @@ static void end_crontab(struct tsession *ts)
 	strlcat(filename2, CRONTAB_SUFFIX, sizeof(filename2));
 	if (rename(filename1, filename2) == -1)
 	{
+		close_crontab();
 		add_2sock(ts, IO_ERROR);
 		return;
 	}
 
+	/* If eperd got the crontab over the control socket, the file is
+	 * only needed when eperd restarts.
+	 */
+	if (atlas_ctl_fd != -1)
+	{
+		r= atlas_ctl_send(atlas_ctl_fd, ATLAS_CTL_END, "", 0);
+		if (r == 0)
+			r= atlas_ctl_wait_ack(atlas_ctl_fd);
+		close_crontab();
+		if (r == 0)
+			return;
+	}
+
 	/* Inspired by the crontab command, tell cron to load the new
 	 * crontab.
 	 */
@@ -1605,6 +1656,7 @@ static void end_crontab(struct tsession *ts)
 
 static void do_oneoff(struct tsession *ts, char *line)
 {
+	int fd, r;
 	size_t len;
 	char *cp, *ncp, *rebased_fn, *rebased_fn_new;
 	FILE *file;
@@ -1650,6 +1702,35 @@ static void do_oneoff(struct tsession *ts, char *line)
 		return;
 	}
 
+	/* Find start of command */
+	cp= ncp;
+	while (cp[0] != '\0' && isspace((unsigned char)cp[0]))
+		cp++;
+
+	/* Hand the command directly to eooqd if it listens next to the
+	 * queue file.
+	 */
+	if (strlen(rebased_fn) + strlen(ATLAS_CTL_SUFFIX) + 1 <=
+		sizeof(filename))
+	{
+		strlcpy(filename, rebased_fn, sizeof(filename));
+		strlcat(filename, ATLAS_CTL_SUFFIX, sizeof(filename));
+		fd= atlas_ctl_connect(filename);
+		if (fd != -1)
+		{
+			r= atlas_ctl_send(fd, ATLAS_CTL_ONEOFF, cp, strlen(cp));
+			if (r == 0)
+				r= atlas_ctl_wait_ack(fd);
+			close(fd);
+			if (r == 0)
+			{
+				free(rebased_fn); rebased_fn= NULL;
+				free(rebased_fn_new); rebased_fn_new= NULL;
+				return;
+			}
+		}
+	}
+
 	/* Try to grab 'filename', if there is any. It doesn't matter if this
 	 * fails.
 	 */
@@ -1663,11 +1744,6 @@ static void do_oneoff(struct tsession *ts, char *line)
 		return;
 	}
 
-	/* Find start of command */
-	cp= ncp;
-	while (cp[0] != '\0' && isspace((unsigned char)cp[0]))
-		cp++;
-
 	if (fprintf(file, "%s\n", cp) == -1)
 	{
 		free(rebased_fn); rebased_fn= NULL;